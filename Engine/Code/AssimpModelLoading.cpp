@@ -1,4 +1,12 @@
 ﻿#include "AssimpModelLoading.h"
+#include "MeshCache.h"
+#include "JobSystem.h"
+#include "ObjLoader.h"
+#include "VertexPacking.h"
+#include "Meshlets.h"
+#include "MeshLod.h"
+#include "MeshOptimizer.h"
+#include <chrono>
 
 
 void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices)
@@ -87,7 +95,7 @@ void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 bas
     myMesh->submeshes.push_back(submesh);
 }
 
-void ProcessAssimpMaterial(App* app, aiMaterial* material, Material& myMaterial, String directory)
+void ProcessAssimpMaterial(aiMaterial* material, MaterialDesc& myMaterial, const std::string& directory)
 {
     aiString name;
     aiColor3D diffuseColor;
@@ -105,27 +113,22 @@ void ProcessAssimpMaterial(App* app, aiMaterial* material, Material& myMaterial,
     myMaterial.emissive = vec3(emissiveColor.r, emissiveColor.g, emissiveColor.b);
     myMaterial.smoothness = shininess / 256.0f;
 
+    // Only the paths here, the textures are loaded by the upload stage
     aiString aiFilename;
     if (material->GetTextureCount(aiTextureType_DIFFUSE) > 0)
     {
         material->GetTexture(aiTextureType_DIFFUSE, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.albedoTextureIdx = LoadTexture2D(app, filepath.str, TextureType::Albedo);
+        myMaterial.albedoTexture = directory + "/" + aiFilename.C_Str();
     }
     if (material->GetTextureCount(aiTextureType_NORMALS) > 0)
     {
         material->GetTexture(aiTextureType_NORMALS, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.normalsTextureIdx = LoadTexture2D(app, filepath.str, TextureType::Normal);
+        myMaterial.normalsTexture = directory + "/" + aiFilename.C_Str();
     }
     if (material->GetTextureCount(aiTextureType_HEIGHT) > 0)
     {
         material->GetTexture(aiTextureType_HEIGHT, 0, &aiFilename);
-        String filename = MakeString(aiFilename.C_Str());
-        String filepath = MakePath(directory, filename);
-        myMaterial.heighTextureIdx = LoadTexture2D(app, filepath.str, TextureType::Height);
+        myMaterial.heightTexture = directory + "/" + aiFilename.C_Str();
     }
 }
 
@@ -144,31 +147,163 @@ void ProcessAssimpNode(const aiScene* scene, aiNode* node, Mesh* myMesh, u32 bas
     }
 }
 
-u32 LoadModel(App* app, const char* filename)
+static bool ImportAssimpModel(const char* filename, ImportedModel& imported)
 {
-    const aiScene* scene = aiImportFile(filename,
-        aiProcess_Triangulate |
-        aiProcess_GenSmoothNormals |
-        aiProcess_CalcTangentSpace |
-        aiProcess_JoinIdenticalVertices |
-        aiProcess_PreTransformVertices |
-        aiProcess_ImproveCacheLocality |
-        aiProcess_OptimizeMeshes |
-        aiProcess_SortByPType);
+    const aiScene* scene = aiImportFile(filename, MODEL_IMPORT_FLAGS);
 
     if (!scene)
     {
-        if (!scene)
-        {
-            char errorMessage[256];
-            sprintf_s(errorMessage, "Error loading mesh %s: %s", filename, aiGetErrorString());
+        ELOG("Error loading mesh %s: %s", filename, aiGetErrorString());
+        return false;
+    }
 
-            //ELOG("Error loading mesh");
-            return UINT32_MAX;
-        }
+    // Same as GetDirectoryPart, without the frame arena
+    const std::string path = filename;
+    const size_t slash = path.find_last_of("/\\");
+    const std::string directory = slash == std::string::npos ? std::string() : path.substr(0, slash);
+
+    // Create a list of materials
+    imported.materials.resize(scene->mNumMaterials);
+    for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+    {
+        ProcessAssimpMaterial(scene->mMaterials[i], imported.materials[i], directory);
+    }
+
+    ProcessAssimpNode(scene, scene->mRootNode, &imported.mesh, 0, imported.submeshMaterials);
+
+    aiReleaseImport(scene);
+    return true;
+}
+
+// Triangles weight the ACMR, vertices the per vertex ratios
+static void AccumulateVertexCacheStats(VertexCacheStats& total, f64 weights[2], const VertexCacheStats& stats, u32 triangleCount, u32 vertexCount)
+{
+    total.acmr += stats.acmr * triangleCount;
+    total.atvr += stats.atvr * vertexCount;
+    total.overfetch += stats.overfetch * vertexCount;
+    weights[0] += triangleCount;
+    weights[1] += vertexCount;
+}
+
+static void ResolveVertexCacheStats(VertexCacheStats& total, const f64 weights[2])
+{
+    if (weights[0] > 0.0) total.acmr = (f32)(total.acmr / weights[0]);
+    if (weights[1] > 0.0) total.atvr = (f32)(total.atvr / weights[1]);
+    if (weights[1] > 0.0) total.overfetch = (f32)(total.overfetch / weights[1]);
+}
+
+bool ImportModel(JobSystem& jobs, const char* filename, ImportedModel& imported, bool useCache)
+{
+    imported = ImportedModel{};
+    imported.filename = filename;
+
+    // Unchanged sources skip Assimp entirely
+    imported.sourceHash = ComputeModelSourceHash(filename);
+    if (useCache && ReadMeshCache(imported, MODEL_IMPORT_FLAGS))
+    {
+        imported.valid = true;
+        return true;
+    }
+
+    // Wavefront files take the native loader, it does the same processing as
+    // MODEL_IMPORT_FLAGS without Assimp's generic scene building
+    bool loaded = IsObjFile(filename) && LoadObjModel(jobs, filename, imported);
+    if (!loaded)
+    {
+        loaded = ImportAssimpModel(filename, imported);
+    }
+    if (!loaded)
+    {
+        return false;
+    }
+
+    Mesh& mesh = imported.mesh;
+
+    // The source order is kept to report what the reordering gained
+    std::vector<std::vector<u32>> sourceIndices(mesh.submeshes.size());
+    std::vector<u32> sourceVertexCounts(mesh.submeshes.size());
+
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    {
+        Submesh& submesh = mesh.submeshes[i];
+        ComputeSubmeshBounds(submesh);
+        submesh.indexCount = submesh.indices.size();
+
+        const u32 floatStride = submesh.vertexBufferLayout.stride / sizeof(float);
+        sourceIndices[i] = submesh.indices;
+        sourceVertexCounts[i] = floatStride > 0 ? (u32)(submesh.vertices.size() / floatStride) : 0;
+
+        // Triangle order: cache friendly fans, clusters sorted against
+        // overdraw, then meshlets grown from that order. Each meshlet and LOD
+        // level is fanned again, and the vertices follow the final order.
+        OptimizeVertexCache(submesh.indices.data(), submesh.indexCount);
+        OptimizeOverdraw(submesh, MODEL_OVERDRAW_THRESHOLD);
+        BuildMeshlets(submesh);
+        for (const Meshlet& meshlet : submesh.meshlets)
+            OptimizeVertexCache(&submesh.indices[meshlet.firstIndex], meshlet.indexCount);
+        BuildLodChain(submesh);
+        for (const SubmeshLod& lod : submesh.lods)
+            OptimizeVertexCache(&submesh.indices[lod.firstIndex], lod.indexCount);
+        OptimizeVertexFetch(submesh);
+    }
+    ComputeMeshBounds(mesh);
+    PackMeshVertices(mesh);
+
+    // Both orders are measured with the packed vertex size
+    f64 sourceWeights[2] = {};
+    f64 optimizedWeights[2] = {};
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    {
+        const Submesh& submesh = mesh.submeshes[i];
+        const u32 stride = submesh.vertexBufferLayout.stride;
+        const u32 triangleCount = submesh.indexCount / 3;
+        const u32 vertexCount = stride > 0 ? (u32)(submesh.vertexData.size() / stride) : 0;
+
+        const VertexCacheStats before = AnalyzeVertexCache(sourceIndices[i].data(), (u32)sourceIndices[i].size(), sourceVertexCounts[i], stride);
+        const VertexCacheStats after = AnalyzeVertexCache(submesh.indices.data(), submesh.indexCount, vertexCount, stride);
+        AccumulateVertexCacheStats(imported.sourceStats, sourceWeights, before, triangleCount, vertexCount);
+        AccumulateVertexCacheStats(imported.optimizedStats, optimizedWeights, after, triangleCount, vertexCount);
+    }
+    ResolveVertexCacheStats(imported.sourceStats, sourceWeights);
+    ResolveVertexCacheStats(imported.optimizedStats, optimizedWeights);
+    ILOG("%s: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f, overfetch %.2f -> %.2f", filename,
+        imported.sourceStats.acmr, imported.optimizedStats.acmr,
+        imported.sourceStats.atvr, imported.optimizedStats.atvr,
+        imported.sourceStats.overfetch, imported.optimizedStats.overfetch);
+
+    // Submeshes go back to back in the vertex and index buffers, each with its
+    // full detail indices followed by those of the lower levels
+    u32 indicesOffset = 0;
+    u32 verticesOffset = 0;
+    for (Submesh& submesh : mesh.submeshes)
+    {
+        submesh.vertexOffset = verticesOffset;
+        verticesOffset += submesh.vertexData.size();
+
+        submesh.indexOffset = indicesOffset;
+        indicesOffset += submesh.indices.size() * sizeof(u32);
+    }
+
+    WriteMeshCache(imported, MODEL_IMPORT_FLAGS);
+
+    imported.valid = true;
+    return true;
+}
+
+static u32 LoadMaterialTexture(App* app, const std::string& filepath, TextureType type)
+{
+    // Materials without a texture keep the index a value initialized Material has
+    return filepath.empty() ? 0 : LoadTexture2D(app, filepath.c_str(), type);
+}
+
+u32 UploadImportedModel(App* app, ImportedModel& imported)
+{
+    if (!imported.valid)
+    {
+        return UINT32_MAX;
     }
 
-    app->meshes.push_back(Mesh{});
+    app->meshes.push_back(std::move(imported.mesh));
     Mesh& mesh = app->meshes.back();
     u32 meshIdx = (u32)app->meshes.size() - 1u;
 
@@ -177,54 +312,82 @@ u32 LoadModel(App* app, const char* filename)
     model.meshIdx = meshIdx;
     u32 modelIdx = (u32)app->models.size() - 1u;
 
-    String directory = GetDirectoryPart(MakeString(filename));
-
-    // Create a list of materials
+    // Textures are loaded in material order, so their indices do not depend
+    // on which thread imported the model
     u32 baseMeshMaterialIndex = (u32)app->materials.size();
-    for (unsigned int i = 0; i < scene->mNumMaterials; ++i)
+    for (const MaterialDesc& desc : imported.materials)
     {
-        app->materials.push_back(Material{});
-        Material& material = app->materials.back();
-        ProcessAssimpMaterial(app, scene->mMaterials[i], material, directory);
+        Material material = {};
+        material.name = desc.name;
+        material.albedo = desc.albedo;
+        material.emissive = desc.emissive;
+        material.smoothness = desc.smoothness;
+        material.albedoTextureIdx = LoadMaterialTexture(app, desc.albedoTexture, TextureType::Albedo);
+        material.normalsTextureIdx = LoadMaterialTexture(app, desc.normalsTexture, TextureType::Normal);
+        material.heighTextureIdx = LoadMaterialTexture(app, desc.heightTexture, TextureType::Height);
+        material.coneStepTextureIdx = LoadMaterialTexture(app, desc.heightTexture, TextureType::ConeStep);
+        app->materials.push_back(material);
     }
 
-    ProcessAssimpNode(scene, scene->mRootNode, &mesh, baseMeshMaterialIndex, model.materialIdx);
-
-    aiReleaseImport(scene);
-
-    u32 vertexBufferSize = 0;
-    u32 indexBufferSize = 0;
+    for (u32 submeshMaterial : imported.submeshMaterials)
+    {
+        model.materialIdx.push_back(baseMeshMaterialIndex + submeshMaterial);
+    }
 
+    // Positions alone, deinterleaved for the depth pre-pass. Submeshes are
+    // back to back, so a cached one ends where the next one starts.
+    std::vector<u8> positions;
     for (u32 i = 0; i < mesh.submeshes.size(); ++i)
     {
-        vertexBufferSize += mesh.submeshes[i].vertices.size() * sizeof(float);
-        indexBufferSize += mesh.submeshes[i].indices.size() * sizeof(u32);
+        Submesh& submesh = mesh.submeshes[i];
+        submesh.positionStreamOffset = (u32)positions.size();
+        if (imported.cacheFile.data)
+        {
+            const u64 vertexEnd = i + 1 < mesh.submeshes.size() ? mesh.submeshes[i + 1].vertexOffset : imported.cachedVertexBytes;
+            AppendPackedPositions(submesh.vertexBufferLayout, imported.cachedVertices + submesh.vertexOffset, vertexEnd - submesh.vertexOffset, positions);
+        }
+        else
+        {
+            AppendPackedPositions(submesh.vertexBufferLayout, submesh.vertexData.data(), submesh.vertexData.size(), positions);
+        }
     }
 
+    glGenBuffers(1, &mesh.positionBufferHandle);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.positionBufferHandle);
+    glBufferData(GL_ARRAY_BUFFER, positions.size(), positions.data(), GL_STATIC_DRAW);
+
     glGenBuffers(1, &mesh.vertexBufferHandle);
     glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
 
     glGenBuffers(1, &mesh.indexBufferHandle);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
-
-    u32 indicesOffset = 0;
-    u32 verticesOffset = 0;
 
-    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    if (imported.cacheFile.data)
     {
-        const void* verticesData = mesh.submeshes[i].vertices.data();
-        const u32   verticesSize = mesh.submeshes[i].vertices.size() * sizeof(float);
-        glBufferSubData(GL_ARRAY_BUFFER, verticesOffset, verticesSize, verticesData);
-        mesh.submeshes[i].vertexOffset = verticesOffset;
-        verticesOffset += verticesSize;
-
-        const void* indicesData = mesh.submeshes[i].indices.data();
-        const u32   indicesSize = mesh.submeshes[i].indices.size() * sizeof(u32);
-        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indicesOffset, indicesSize, indicesData);
-        mesh.submeshes[i].indexOffset = indicesOffset;
-        indicesOffset += indicesSize;
+        glBufferData(GL_ARRAY_BUFFER, imported.cachedVertexBytes, imported.cachedVertices, GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, imported.cachedIndexBytes, imported.cachedIndices, GL_STATIC_DRAW);
+        UnmapFile(imported.cacheFile);
+    }
+    else
+    {
+        u32 vertexBufferSize = 0;
+        u32 indexBufferSize = 0;
+
+        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+        {
+            vertexBufferSize += mesh.submeshes[i].vertexData.size();
+            indexBufferSize += mesh.submeshes[i].indices.size() * sizeof(u32);
+        }
+
+        glBufferData(GL_ARRAY_BUFFER, vertexBufferSize, NULL, GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBufferSize, NULL, GL_STATIC_DRAW);
+
+        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+        {
+            const Submesh& submesh = mesh.submeshes[i];
+            glBufferSubData(GL_ARRAY_BUFFER, submesh.vertexOffset, submesh.vertexData.size(), submesh.vertexData.data());
+            glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, submesh.indexOffset, submesh.indices.size() * sizeof(u32), submesh.indices.data());
+        }
     }
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
@@ -232,6 +395,39 @@ u32 LoadModel(App* app, const char* filename)
 
     return modelIdx;
 }
+
+u32 LoadModel(App* app, const char* filename)
+{
+    ImportedModel imported;
+    ImportModel(app->jobs, filename, imported);
+    return UploadImportedModel(app, imported);
+}
+
+void LoadModels(App* app, const char* const* filenames, u32 count, u32* modelIndices)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    std::vector<ImportedModel> imported(count);
+    ParallelFor(app->jobs, count, [&](u32 i)
+    {
+        ImportModel(app->jobs, filenames[i], imported[i]);
+    });
+
+    const auto uploadStart = std::chrono::high_resolution_clock::now();
+
+    for (u32 i = 0; i < count; ++i)
+    {
+        modelIndices[i] = UploadImportedModel(app, imported[i]);
+    }
+
+    const auto end = std::chrono::high_resolution_clock::now();
+    ILOG("Loaded %u models in %.2f ms (import %.2f ms on %u threads, upload %.2f ms)", count,
+        std::chrono::duration<f64, std::milli>(end - start).count(),
+        std::chrono::duration<f64, std::milli>(uploadStart - start).count(),
+        (u32)app->jobs.workers.size() + 1u,
+        std::chrono::duration<f64, std::milli>(end - uploadStart).count());
+}
+
 void ActivateModel(App* app, u32 modelIndex)
 {
     for (auto& entity : app->entities)
@@ -14,6 +14,19 @@
 #include <glad/glad.h>
 #include <unordered_map>
 
+// Post-processing applied to every imported model, part of the mesh cache key
+#define MODEL_IMPORT_FLAGS                  \
+    (aiProcess_Triangulate |                \
+     aiProcess_GenSmoothNormals |           \
+     aiProcess_CalcTangentSpace |           \
+     aiProcess_JoinIdenticalVertices |      \
+     aiProcess_PreTransformVertices |       \
+     aiProcess_OptimizeMeshes |             \
+     aiProcess_SortByPType)
+
+// Overdraw clusters may cost up to this factor of the vertex cache ACMR
+#define MODEL_OVERDRAW_THRESHOLD 1.05f
+
 struct App;
 struct Mesh;
 struct Material;
@@ -25,10 +38,26 @@ struct Model;
 struct Texture; 
 
 void ProcessAssimpMesh(const aiScene* scene, aiMesh* mesh, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices);
-void ProcessAssimpMaterial(App* app, aiMaterial* material, Material& myMaterial, String directory);
+void ProcessAssimpMaterial(aiMaterial* material, MaterialDesc& myMaterial, const std::string& directory);
 void ProcessAssimpNode(const aiScene* scene, aiNode* node, Mesh* myMesh, u32 baseMeshMaterialIndex, std::vector<u32>& submeshMaterialIndices);
+
+// CPU stage of LoadModel: mesh cache lookup, then the native OBJ loader for
+// .obj files or Assimp for anything else, bounds, index and vertex reordering,
+// meshlets, LOD chains, vertex packing and buffer offsets. A fresh import logs
+// and returns the vertex cache stats before and after the reordering, useCache
+// false forces one. Thread safe, it touches neither GL nor the frame arena.
+bool ImportModel(JobSystem& jobs, const char* filename, ImportedModel& imported, bool useCache = true);
+
+// GL stage of LoadModel, main thread only. Creates the mesh, model and
+// materials (loading their textures) and returns the model index.
+u32 UploadImportedModel(App* app, ImportedModel& imported);
+
 u32 LoadModel(App* app, const char* filename);
 
+// Imports all files on the job system and uploads them in the given order,
+// so modelIndices[i] is the same as a serial LoadModel(filenames[i]) would return
+void LoadModels(App* app, const char* const* filenames, u32 count, u32* modelIndices);
+
 String MakeString(const char* str);
 String MakePath(String directory, String filename);
 u32 LoadTexture2D(App* app, const char* filepath, TextureType type); 
@@ -0,0 +1,277 @@
+#include "BlockCompression.h"
+#include "JobSystem.h"
+#include <float.h>
+#include <string.h>
+
+// Least squares passes over the BC1 endpoints after the principal axis fit
+#define BC1_REFINE_ITERATIONS 2
+
+u32 GetBlockBytes(BlockFormat format)
+{
+    return format == BlockFormat_BC1 || format == BlockFormat_BC4 ? 8 : 16;
+}
+
+u32 GetCompressedImageBytes(BlockFormat format, u32 width, u32 height)
+{
+    return ((width + 3) / 4) * ((height + 3) / 4) * GetBlockBytes(format);
+}
+
+static u16 PackRgb565(const vec3& color)
+{
+    const u32 r = (u32)glm::clamp(color.r * (31.0f / 255.0f) + 0.5f, 0.0f, 31.0f);
+    const u32 g = (u32)glm::clamp(color.g * (63.0f / 255.0f) + 0.5f, 0.0f, 63.0f);
+    const u32 b = (u32)glm::clamp(color.b * (31.0f / 255.0f) + 0.5f, 0.0f, 31.0f);
+    return (u16)((r << 11) | (g << 5) | b);
+}
+
+// Bit replication, what the hardware expands 565 to
+static vec3 UnpackRgb565(u16 color)
+{
+    const u32 r = color >> 11;
+    const u32 g = (color >> 5) & 63;
+    const u32 b = color & 31;
+    return vec3((f32)((r << 3) | (r >> 2)), (f32)((g << 2) | (g >> 4)), (f32)((b << 3) | (b >> 2)));
+}
+
+// Nearest four color palette entry of every pixel, returns the squared error
+static f32 FitBC1Indices(const vec3* pixels, u16 color0, u16 color1, u32& indices)
+{
+    const vec3 endpoint0 = UnpackRgb565(color0);
+    const vec3 endpoint1 = UnpackRgb565(color1);
+    const vec3 palette[4] = {
+        endpoint0,
+        endpoint1,
+        (endpoint0 * 2.0f + endpoint1) * (1.0f / 3.0f),
+        (endpoint0 + endpoint1 * 2.0f) * (1.0f / 3.0f),
+    };
+
+    f32 error = 0.0f;
+    indices = 0;
+    for (u32 i = 0; i < 16; ++i)
+    {
+        u32 best = 0;
+        f32 bestDistance = FLT_MAX;
+        for (u32 p = 0; p < 4; ++p)
+        {
+            const vec3 delta = pixels[i] - palette[p];
+            const f32 distance = glm::dot(delta, delta);
+            if (distance < bestDistance)
+            {
+                best = p;
+                bestDistance = distance;
+            }
+        }
+        indices |= best << (i * 2);
+        error += bestDistance;
+    }
+    return error;
+}
+
+static void WriteBC1Block(u8* output, u16 color0, u16 color1, u32 indices)
+{
+    // color0 > color1 selects the four color mode, equal endpoints only use index 0
+    if (color0 < color1)
+    {
+        const u16 swap = color0;
+        color0 = color1;
+        color1 = swap;
+        indices ^= 0x55555555;
+    }
+    else if (color0 == color1)
+    {
+        indices = 0;
+    }
+
+    memcpy(output + 0, &color0, 2);
+    memcpy(output + 2, &color1, 2);
+    memcpy(output + 4, &indices, 4);
+}
+
+// Endpoints on the principal axis of the colors, inset a little as the ends
+// are rarely hit exactly, then refined by least squares against the indices
+static void EncodeBC1Block(const u8* rgba, u8* output)
+{
+    vec3 pixels[16];
+    vec3 mean(0.0f);
+    vec3 minColor(255.0f);
+    vec3 maxColor(0.0f);
+    for (u32 i = 0; i < 16; ++i)
+    {
+        pixels[i] = vec3(rgba[i * 4 + 0], rgba[i * 4 + 1], rgba[i * 4 + 2]);
+        mean += pixels[i];
+        minColor = glm::min(minColor, pixels[i]);
+        maxColor = glm::max(maxColor, pixels[i]);
+    }
+    mean *= 1.0f / 16.0f;
+
+    if (minColor == maxColor)
+    {
+        const u16 color = PackRgb565(mean);
+        WriteBC1Block(output, color, color, 0);
+        return;
+    }
+
+    f32 covariance[6] = {};
+    for (u32 i = 0; i < 16; ++i)
+    {
+        const vec3 d = pixels[i] - mean;
+        covariance[0] += d.r * d.r; covariance[1] += d.r * d.g; covariance[2] += d.r * d.b;
+        covariance[3] += d.g * d.g; covariance[4] += d.g * d.b; covariance[5] += d.b * d.b;
+    }
+
+    vec3 axis = maxColor - minColor;
+    for (u32 iteration = 0; iteration < 4; ++iteration)
+    {
+        const vec3 next(covariance[0] * axis.r + covariance[1] * axis.g + covariance[2] * axis.b,
+                        covariance[1] * axis.r + covariance[3] * axis.g + covariance[4] * axis.b,
+                        covariance[2] * axis.r + covariance[4] * axis.g + covariance[5] * axis.b);
+        const f32 length = glm::length(next);
+        if (length <= 0.0f)
+            break;
+        axis = next / length;
+    }
+    if (glm::dot(axis, axis) <= 0.0f)
+        axis = glm::normalize(maxColor - minColor);
+    axis = glm::normalize(axis);
+
+    f32 minProjection = FLT_MAX;
+    f32 maxProjection = -FLT_MAX;
+    for (u32 i = 0; i < 16; ++i)
+    {
+        const f32 projection = glm::dot(pixels[i] - mean, axis);
+        minProjection = glm::min(minProjection, projection);
+        maxProjection = glm::max(maxProjection, projection);
+    }
+    const f32 inset = (maxProjection - minProjection) / 16.0f;
+    vec3 endpoint0 = mean + axis * (maxProjection - inset);
+    vec3 endpoint1 = mean + axis * (minProjection + inset);
+
+    u16 bestColor0 = PackRgb565(endpoint0);
+    u16 bestColor1 = PackRgb565(endpoint1);
+    u32 bestIndices = 0;
+    f32 bestError = FitBC1Indices(pixels, bestColor0, bestColor1, bestIndices);
+
+    // Weight of endpoint0 for each palette index
+    static const f32 weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+    u32 indices = bestIndices;
+    for (u32 iteration = 0; iteration < BC1_REFINE_ITERATIONS; ++iteration)
+    {
+        f32 aa = 0.0f, ab = 0.0f, bb = 0.0f;
+        vec3 ax(0.0f), bx(0.0f);
+        for (u32 i = 0; i < 16; ++i)
+        {
+            const f32 a = weights[(indices >> (i * 2)) & 3];
+            const f32 b = 1.0f - a;
+            aa += a * a; ab += a * b; bb += b * b;
+            ax += pixels[i] * a;
+            bx += pixels[i] * b;
+        }
+        const f32 determinant = aa * bb - ab * ab;
+        if (glm::abs(determinant) < 1e-6f)
+            break;
+
+        endpoint0 = (ax * bb - bx * ab) / determinant;
+        endpoint1 = (bx * aa - ax * ab) / determinant;
+
+        const u16 color0 = PackRgb565(endpoint0);
+        const u16 color1 = PackRgb565(endpoint1);
+        const f32 error = FitBC1Indices(pixels, color0, color1, indices);
+        if (error >= bestError)
+            break;
+        bestError = error;
+        bestColor0 = color0;
+        bestColor1 = color1;
+        bestIndices = indices;
+    }
+
+    WriteBC1Block(output, bestColor0, bestColor1, bestIndices);
+}
+
+// Eight value mode between the block's min and max, 3 bit indices
+static void EncodeBC4Block(const u8* values, u32 stride, u8* output)
+{
+    u8 minValue = 255;
+    u8 maxValue = 0;
+    for (u32 i = 0; i < 16; ++i)
+    {
+        minValue = glm::min(minValue, values[i * stride]);
+        maxValue = glm::max(maxValue, values[i * stride]);
+    }
+
+    output[0] = maxValue;
+    output[1] = minValue;
+
+    u64 indices = 0;
+    if (maxValue > minValue)
+    {
+        f32 palette[8];
+        palette[0] = maxValue;
+        palette[1] = minValue;
+        for (u32 p = 2; p < 8; ++p)
+            palette[p] = ((8 - p) * (f32)maxValue + (p - 1) * (f32)minValue) / 7.0f;
+
+        for (u32 i = 0; i < 16; ++i)
+        {
+            u64 best = 0;
+            f32 bestDistance = FLT_MAX;
+            for (u32 p = 0; p < 8; ++p)
+            {
+                const f32 distance = glm::abs(values[i * stride] - palette[p]);
+                if (distance < bestDistance)
+                {
+                    best = p;
+                    bestDistance = distance;
+                }
+            }
+            indices |= best << (i * 3);
+        }
+    }
+
+    for (u32 i = 0; i < 6; ++i)
+        output[2 + i] = (u8)(indices >> (i * 8));
+}
+
+void CompressImage(JobSystem& jobs, BlockFormat format, const u8* rgba, u32 width, u32 height, u8* output)
+{
+    const u32 blocksX = (width + 3) / 4;
+    const u32 blocksY = (height + 3) / 4;
+    const u32 blockBytes = GetBlockBytes(format);
+
+    ParallelFor(jobs, blocksY, [&](u32 blockY)
+    {
+        u8 block[16 * 4];
+        for (u32 blockX = 0; blockX < blocksX; ++blockX)
+        {
+            for (u32 y = 0; y < 4; ++y)
+            {
+                const u32 row = glm::min(blockY * 4 + y, height - 1);
+                for (u32 x = 0; x < 4; ++x)
+                {
+                    const u32 column = glm::min(blockX * 4 + x, width - 1);
+                    memcpy(&block[(y * 4 + x) * 4], &rgba[((size_t)row * width + column) * 4], 4);
+                }
+            }
+
+            u8* out = output + ((size_t)blockY * blocksX + blockX) * blockBytes;
+            switch (format)
+            {
+            case BlockFormat_BC1:
+                EncodeBC1Block(block, out);
+                break;
+            case BlockFormat_BC3:
+                EncodeBC4Block(block + 3, 4, out);
+                EncodeBC1Block(block, out + 8);
+                break;
+            case BlockFormat_BC4:
+                EncodeBC4Block(block, 4, out);
+                break;
+            case BlockFormat_BC5:
+                EncodeBC4Block(block, 4, out);
+                EncodeBC4Block(block + 1, 4, out + 8);
+                break;
+            default:
+                ASSERT(false, "Unknown block format");
+            }
+        }
+    });
+}
@@ -0,0 +1,16 @@
+#ifndef BLOCK_COMPRESSION_H
+#define BLOCK_COMPRESSION_H
+
+#include "Structs.hpp"
+
+// BC1 and BC4 take 8 bytes per 4x4 block, BC3 and BC5 16
+u32 GetBlockBytes(BlockFormat format);
+
+// Bytes of a width x height image, partial blocks included
+u32 GetCompressedImageBytes(BlockFormat format, u32 width, u32 height);
+
+// Encodes an RGBA8 image, rows of blocks in parallel on the job system. Edge
+// blocks of sizes that are not a multiple of 4 repeat the last row/column.
+void CompressImage(JobSystem& jobs, BlockFormat format, const u8* rgba, u32 width, u32 height, u8* output);
+
+#endif // BLOCK_COMPRESSION_H
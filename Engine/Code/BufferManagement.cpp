@@ -1,6 +1,8 @@
 ﻿#include "BufferManagement.h"
 #include "platform.h"
 
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
 bool IsPowerOf2(u32 value)
 {
     return value && !(value & (value - 1));
@@ -57,3 +59,147 @@ void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment)
     buffer.head += size;
 }
 
+
+// glBufferStorage is core in 4.4, the loaded GL functions stop at 4.3
+static PFNGLBUFFERSTORAGEPROC LoadBufferStorage()
+{
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    bool supported = major > 4 || (major == 4 && minor >= 4);
+
+    GLint extensionCount = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+    for (GLint i = 0; i < extensionCount && !supported; ++i)
+    {
+        supported = strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_buffer_storage") == 0;
+    }
+
+    return supported ? (PFNGLBUFFERSTORAGEPROC)GetGLProcAddress("glBufferStorage") : NULL;
+}
+
+RingBuffer CreateRingBuffer(u32 regionSize, GLenum type)
+{
+    static PFNGLBUFFERSTORAGEPROC bufferStorage = LoadBufferStorage();
+
+    // Regions start at offsets that are valid for glBindBufferRange
+    GLint offsetAlignment = 256;
+    if (type == GL_UNIFORM_BUFFER)
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &offsetAlignment);
+
+    RingBuffer buffer = {};
+    buffer.regionSize = Align(regionSize, (u32)offsetAlignment);
+    buffer.size = buffer.regionSize * RING_BUFFER_FRAMES;
+    buffer.type = type;
+    buffer.regionIdx = RING_BUFFER_FRAMES - 1;
+
+    glGenBuffers(1, &buffer.handle);
+    glBindBuffer(type, buffer.handle);
+    if (bufferStorage)
+    {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        bufferStorage(type, buffer.size, NULL, flags);
+        buffer.mapping = (u8*)glMapBufferRange(type, 0, buffer.size, flags);
+    }
+    else
+    {
+        glBufferData(type, buffer.size, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(type, 0);
+
+    return buffer;
+}
+
+void DestroyRingBuffer(RingBuffer& buffer)
+{
+    for (u32 i = 0; i < RING_BUFFER_FRAMES; ++i)
+    {
+        if (buffer.fences[i])
+            glDeleteSync(buffer.fences[i]);
+        buffer.fences[i] = 0;
+    }
+    if (buffer.mapping)
+    {
+        glBindBuffer(buffer.type, buffer.handle);
+        glUnmapBuffer(buffer.type);
+        glBindBuffer(buffer.type, 0);
+    }
+    glDeleteBuffers(1, &buffer.handle);
+    buffer = {};
+}
+
+void MapRingBufferFrame(RingBuffer& buffer)
+{
+    buffer.regionIdx = (buffer.regionIdx + 1) % RING_BUFFER_FRAMES;
+    buffer.head = 0;
+
+    // Wait until the GPU is done with the last frame that used this region.
+    // With RING_BUFFER_FRAMES frames in flight this normally returns at once.
+    GLsync& fence = buffer.fences[buffer.regionIdx];
+    if (fence)
+    {
+        GLenum result = glClientWaitSync(fence, 0, 0);
+        if (result == GL_TIMEOUT_EXPIRED)
+        {
+            buffer.stalls++;
+            do
+            {
+                result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+            } while (result == GL_TIMEOUT_EXPIRED);
+        }
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    const u32 regionStart = buffer.regionIdx * buffer.regionSize;
+    if (buffer.mapping)
+    {
+        buffer.data = buffer.mapping + regionStart;
+    }
+    else
+    {
+        // The fence already guarantees the region is free, don't let the driver sync again
+        glBindBuffer(buffer.type, buffer.handle);
+        buffer.data = (u8*)glMapBufferRange(buffer.type, regionStart, buffer.regionSize,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    }
+}
+
+void UnmapRingBufferFrame(RingBuffer& buffer)
+{
+    if (!buffer.mapping)
+    {
+        glBindBuffer(buffer.type, buffer.handle);
+        glUnmapBuffer(buffer.type);
+        glBindBuffer(buffer.type, 0);
+        buffer.data = NULL;
+    }
+}
+
+void FenceRingBufferFrame(RingBuffer& buffer)
+{
+    GLsync& fence = buffer.fences[buffer.regionIdx];
+    if (fence)
+        glDeleteSync(fence);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+u32 GetRingBufferOffset(const RingBuffer& buffer)
+{
+    return buffer.regionIdx * buffer.regionSize + buffer.head;
+}
+
+void AlignHead(RingBuffer& buffer, u32 alignment)
+{
+    ASSERT(IsPowerOf2(alignment), "The alignment must be a power of 2");
+    buffer.head = Align(buffer.head, alignment);
+}
+
+void PushAlignedData(RingBuffer& buffer, const void* data, u32 size, u32 alignment)
+{
+    ASSERT(buffer.data != NULL, "The ring buffer frame must be mapped first");
+    AlignHead(buffer, alignment);
+    ASSERT(buffer.head + size <= buffer.regionSize, "Ring buffer region overflow");
+    memcpy(buffer.data + buffer.head, data, size);
+    buffer.head += size;
+}
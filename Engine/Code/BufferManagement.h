@@ -26,10 +26,34 @@ void UnmapBuffer(Buffer& buffer);
 void AlignHead(Buffer& buffer, u32 alignment);
 void PushAlignedData(Buffer& buffer, const void* data, u32 size, u32 alignment);
 
+// GL 4.4 / ARB_buffer_storage bits, the glad loader in the tree stops at 4.3
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+// Ring buffer management. The storage is immutable and persistently mapped
+// when the driver supports glBufferStorage, otherwise each region is mapped
+// unsynchronized for the frame.
+// Per frame: MapRingBufferFrame, Push*, UnmapRingBufferFrame, draws, FenceRingBufferFrame.
+RingBuffer CreateRingBuffer(u32 regionSize, GLenum type);
+void DestroyRingBuffer(RingBuffer& buffer);
+void MapRingBufferFrame(RingBuffer& buffer);
+void UnmapRingBufferFrame(RingBuffer& buffer);
+void FenceRingBufferFrame(RingBuffer& buffer);
+// Offset of the head from the start of the GL buffer, for glBindBufferRange
+u32 GetRingBufferOffset(const RingBuffer& buffer);
+
+void AlignHead(RingBuffer& buffer, u32 alignment);
+void PushAlignedData(RingBuffer& buffer, const void* data, u32 size, u32 alignment);
+
 // Macros for buffer creation
 #define CreateConstantBuffer(size) CreateBuffer(size, GL_UNIFORM_BUFFER, GL_STREAM_DRAW)
 #define CreateStaticVertexBuffer(size) CreateBuffer(size, GL_ARRAY_BUFFER, GL_STATIC_DRAW)
 #define CreateStaticIndexBuffer(size) CreateBuffer(size, GL_ELEMENT_ARRAY_BUFFER, GL_STATIC_DRAW)
+#define CreateConstantRingBuffer(regionSize) CreateRingBuffer(regionSize, GL_UNIFORM_BUFFER)
 
 // Macros for pushing data
 #define PushData(buffer, data, size) PushAlignedData(buffer, data, size, 1)
@@ -0,0 +1,236 @@
+#include "ConeStepMap.h"
+#include "JobSystem.h"
+#include <stb_image.h>
+#include <algorithm>
+#include <string.h>
+
+#define CONE_STEP_CACHE_MAGIC 0x454E4F43u // "CONE"
+
+struct ConeStepCacheHeader
+{
+    u32 magic;
+    u32 version;
+    u32 sourceTimestamp[2]; // low, high
+    u32 width;
+    u32 height;
+};
+
+// Level 0 is the depth map, every other level keeps the smallest depth (the
+// highest point) of the 2x2 texels below it
+struct DepthPyramid
+{
+    std::vector<ivec2> sizes;
+    std::vector<std::vector<u8>> levels;
+};
+
+// Pending pyramid node of the search, ordered by the smallest ratio it may hold
+struct ConeSearchNode
+{
+    f32 bound;
+    u32 level;
+    i32 x;
+    i32 y;
+
+    bool operator>(const ConeSearchNode& other) const { return bound > other.bound; }
+};
+
+static std::string GetCachePath(const char* filepath)
+{
+    return std::string(filepath) + CONE_STEP_CACHE_EXTENSION;
+}
+
+bool ReadConeStepCache(const char* filepath, ConeStepMap& map)
+{
+    const u64 sourceTimestamp = GetFileLastWriteTimestamp(filepath);
+    if (sourceTimestamp == 0)
+        return false;
+
+    const std::string cachePath = GetCachePath(filepath);
+    MappedFile file = MapFileReadOnly(cachePath.c_str());
+    if (!file.data)
+        return false;
+
+    const ConeStepCacheHeader* header = (const ConeStepCacheHeader*)file.data;
+    const bool valid = file.size >= sizeof(ConeStepCacheHeader) &&
+        header->magic == CONE_STEP_CACHE_MAGIC && header->version == CONE_STEP_CACHE_VERSION &&
+        header->sourceTimestamp[0] == (u32)sourceTimestamp && header->sourceTimestamp[1] == (u32)(sourceTimestamp >> 32) &&
+        header->width > 0 && header->height > 0 &&
+        file.size == sizeof(ConeStepCacheHeader) + (u64)header->width * header->height * 2;
+    if (!valid)
+    {
+        ILOG("Cone step cache %s is stale, building it again", cachePath.c_str());
+        UnmapFile(file);
+        return false;
+    }
+
+    map.size = ivec2(header->width, header->height);
+    const u8* texels = file.data + sizeof(ConeStepCacheHeader);
+    map.texels.assign(texels, texels + (size_t)map.size.x * map.size.y * 2);
+    UnmapFile(file);
+    return true;
+}
+
+static void WriteConeStepCache(const char* filepath, const ConeStepMap& map)
+{
+    ConeStepCacheHeader header = {};
+    header.magic = CONE_STEP_CACHE_MAGIC;
+    header.version = CONE_STEP_CACHE_VERSION;
+    const u64 sourceTimestamp = GetFileLastWriteTimestamp(filepath);
+    header.sourceTimestamp[0] = (u32)sourceTimestamp;
+    header.sourceTimestamp[1] = (u32)(sourceTimestamp >> 32);
+    header.width = map.size.x;
+    header.height = map.size.y;
+
+    const std::string cachePath = GetCachePath(filepath);
+    FILE* file = fopen(cachePath.c_str(), "wb");
+    if (!file)
+    {
+        ELOG("fopen() failed writing cone step cache %s", cachePath.c_str());
+        return;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(map.texels.data(), 1, map.texels.size(), file);
+
+    const bool failed = ferror(file) != 0;
+    fclose(file);
+    if (failed)
+    {
+        ELOG("Error writing cone step cache %s", cachePath.c_str());
+        remove(cachePath.c_str());
+    }
+}
+
+static void BuildDepthPyramid(const u8* depths, ivec2 size, DepthPyramid& pyramid)
+{
+    pyramid.sizes.push_back(size);
+    pyramid.levels.emplace_back(depths, depths + (size_t)size.x * size.y);
+    while (size.x > 1 || size.y > 1)
+    {
+        const ivec2 sourceSize = size;
+        const std::vector<u8>& source = pyramid.levels.back();
+        size = (size + 1) / 2;
+
+        std::vector<u8> level((size_t)size.x * size.y);
+        for (i32 y = 0; y < size.y; ++y)
+        {
+            const i32 y0 = y * 2;
+            const i32 y1 = glm::min(y0 + 1, sourceSize.y - 1);
+            for (i32 x = 0; x < size.x; ++x)
+            {
+                const i32 x0 = x * 2;
+                const i32 x1 = glm::min(x0 + 1, sourceSize.x - 1);
+                level[(size_t)y * size.x + x] = glm::min(
+                    glm::min(source[(size_t)y0 * sourceSize.x + x0], source[(size_t)y0 * sourceSize.x + x1]),
+                    glm::min(source[(size_t)y1 * sourceSize.x + x0], source[(size_t)y1 * sourceSize.x + x1]));
+            }
+        }
+        pyramid.sizes.push_back(size);
+        pyramid.levels.push_back(std::move(level));
+    }
+}
+
+// Smallest squared UV distance from texel p to the texels under a node
+static f32 GetNodeDistance2(ivec2 p, u32 level, i32 x, i32 y, ivec2 size, vec2 texelSize)
+{
+    const ivec2 first = ivec2(x, y) << (i32)level;
+    const ivec2 last = glm::min(first + (1 << level) - 1, size - 1);
+    const vec2 gap = vec2(glm::max(glm::max(first - p, p - last), ivec2(0))) * texelSize;
+    return glm::dot(gap, gap);
+}
+
+// Best first search of the pyramid: a node can only lower the ratio when its
+// highest texel is above p and its bound, distance over that height
+// difference, is below the best ratio found so far. Ratios are compared
+// squared. occluder is the texel that set the previous texel's cone, its
+// ratio for p starts the search with a tight bound.
+static f32 FindConeRatio(const DepthPyramid& pyramid, ivec2 p, vec2 texelSize, ivec2& occluder, std::vector<ConeSearchNode>& heap)
+{
+    const ivec2 size = pyramid.sizes[0];
+    const std::vector<u8>& depths = pyramid.levels[0];
+    const i32 depth = depths[(size_t)p.y * size.x + p.x];
+    f32 best = 1.0f;
+
+    const i32 occluderAbove = depth - depths[(size_t)occluder.y * size.x + occluder.x];
+    if (occluderAbove > 0)
+        best = glm::min(best, GetNodeDistance2(p, 0, occluder.x, occluder.y, size, texelSize) * (255.0f * 255.0f) / (f32)(occluderAbove * occluderAbove));
+
+    heap.clear();
+    const u32 top = (u32)pyramid.levels.size() - 1;
+    heap.push_back({ 0.0f, top, 0, 0 });
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<ConeSearchNode>());
+        const ConeSearchNode node = heap.back();
+        heap.pop_back();
+        if (node.bound >= best)
+            break;
+
+        if (node.level == 0)
+        {
+            // Leaves are pushed with their exact ratio
+            best = node.bound;
+            occluder = ivec2(node.x, node.y);
+            continue;
+        }
+
+        const u32 level = node.level - 1;
+        const ivec2 levelSize = pyramid.sizes[level];
+        for (i32 y = node.y * 2; y < glm::min(node.y * 2 + 2, levelSize.y); ++y)
+        {
+            for (i32 x = node.x * 2; x < glm::min(node.x * 2 + 2, levelSize.x); ++x)
+            {
+                const i32 above = depth - pyramid.levels[level][(size_t)y * levelSize.x + x];
+                if (above <= 0)
+                    continue;
+
+                const f32 bound = GetNodeDistance2(p, level, x, y, size, texelSize) * (255.0f * 255.0f) / (f32)(above * above);
+                if (bound < best)
+                {
+                    heap.push_back({ bound, level, x, y });
+                    std::push_heap(heap.begin(), heap.end(), std::greater<ConeSearchNode>());
+                }
+            }
+        }
+    }
+    return sqrtf(best);
+}
+
+bool BuildConeStepMap(JobSystem& jobs, const char* filepath, ConeStepMap& map)
+{
+    ivec2 size;
+    i32 channels = 0;
+    // Same orientation as the height texture the cook produces
+    stbi_set_flip_vertically_on_load_thread(true);
+    u8* depths = stbi_load(filepath, &size.x, &size.y, &channels, 1);
+    if (!depths)
+    {
+        ELOG("Could not open file %s", filepath);
+        return false;
+    }
+
+    DepthPyramid pyramid;
+    BuildDepthPyramid(depths, size, pyramid);
+    stbi_image_free(depths);
+
+    map.size = size;
+    map.texels.resize((size_t)size.x * size.y * 2);
+    const vec2 texelSize = 1.0f / vec2(size);
+    ParallelFor(jobs, size.y, [&](u32 y)
+    {
+        std::vector<ConeSearchNode> heap;
+        ivec2 occluder(0, y);
+        u8* out = &map.texels[(size_t)y * size.x * 2];
+        for (i32 x = 0; x < size.x; ++x)
+        {
+            // The square root spends the 8 bits on the narrow cones that matter
+            const f32 ratio = FindConeRatio(pyramid, ivec2(x, y), texelSize, occluder, heap);
+            out[x * 2 + 0] = pyramid.levels[0][(size_t)y * size.x + x];
+            out[x * 2 + 1] = (u8)(sqrtf(ratio) * 255.0f);
+        }
+    });
+
+    ILOG("Built cone step map for %s: %dx%d", filepath, size.x, size.y);
+    WriteConeStepCache(filepath, map);
+    return true;
+}
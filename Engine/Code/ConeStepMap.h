@@ -0,0 +1,23 @@
+#ifndef CONE_STEP_MAP_H
+#define CONE_STEP_MAP_H
+
+#include "Structs.hpp"
+
+// Bump whenever the file layout or the cone search changes
+#define CONE_STEP_CACHE_VERSION   1
+#define CONE_STEP_CACHE_EXTENSION ".cone"
+
+// Maps <height>.cone when it was built by this version from a source with the
+// same write time. Thread safe, does not touch GL.
+bool ReadConeStepCache(const char* filepath, ConeStepMap& map);
+
+// Decodes the height map (flipped like every streamed texture) and stores, per
+// texel, its depth in R and in G the square root of the widest cone ratio
+// (UV distance per unit of depth, at most 1) whose apex is the texel and that
+// holds no texel above it. A ray inside the cone cannot hit the surface, so the
+// relief shader can advance to the cone's edge with one fetch. The search runs
+// on the job system over a min depth pyramid and the result is written to the
+// cache. Thread safe, does not touch GL.
+bool BuildConeStepMap(JobSystem& jobs, const char* filepath, ConeStepMap& map);
+
+#endif // CONE_STEP_MAP_H
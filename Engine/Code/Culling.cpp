@@ -0,0 +1,265 @@
+#include "Culling.h"
+#include "platform.h"
+#include <float.h>
+#include <string.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define CULLING_AVX 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CULLING_SSE 1
+#endif
+
+void ComputeSubmeshBounds(Submesh& submesh)
+{
+    const u32 floatStride = submesh.vertexBufferLayout.stride / sizeof(float);
+    const u32 vertexCount = floatStride > 0 ? (u32)submesh.vertices.size() / floatStride : 0;
+
+    if (vertexCount == 0)
+    {
+        submesh.aabb = { vec3(0.0f), vec3(0.0f) };
+        submesh.sphere = { vec3(0.0f), 0.0f };
+        return;
+    }
+
+    vec3 minPos(FLT_MAX);
+    vec3 maxPos(-FLT_MAX);
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        const float* v = &submesh.vertices[i * floatStride];
+        vec3 position(v[0], v[1], v[2]);
+        minPos = glm::min(minPos, position);
+        maxPos = glm::max(maxPos, position);
+    }
+
+    // Centered on the box, but the radius comes from the vertices so it is
+    // tighter than half the diagonal
+    vec3 center = (minPos + maxPos) * 0.5f;
+    f32 radiusSq = 0.0f;
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        const float* v = &submesh.vertices[i * floatStride];
+        vec3 offset = vec3(v[0], v[1], v[2]) - center;
+        radiusSq = glm::max(radiusSq, glm::dot(offset, offset));
+    }
+
+    submesh.aabb = { minPos, maxPos };
+    submesh.sphere = { center, sqrtf(radiusSq) };
+}
+
+void ComputeMeshBounds(Mesh& mesh)
+{
+    if (mesh.submeshes.empty())
+    {
+        mesh.aabb = { vec3(0.0f), vec3(0.0f) };
+        mesh.sphere = { vec3(0.0f), 0.0f };
+        return;
+    }
+
+    vec3 minPos(FLT_MAX);
+    vec3 maxPos(-FLT_MAX);
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        minPos = glm::min(minPos, submesh.aabb.min);
+        maxPos = glm::max(maxPos, submesh.aabb.max);
+    }
+
+    vec3 center = (minPos + maxPos) * 0.5f;
+    f32 radius = 0.0f;
+    for (const Submesh& submesh : mesh.submeshes)
+    {
+        radius = glm::max(radius, glm::length(submesh.sphere.center - center) + submesh.sphere.radius);
+    }
+
+    mesh.aabb = { minPos, maxPos };
+    mesh.sphere = { center, radius };
+}
+
+Frustum ExtractFrustum(const glm::mat4& viewProjection)
+{
+    // Gribb/Hartmann: each plane is the 4th row of the matrix +/- one of the others
+    const glm::mat4 m = glm::transpose(viewProjection);
+
+    Frustum frustum;
+    frustum.planes[0] = m[3] + m[0]; // left
+    frustum.planes[1] = m[3] - m[0]; // right
+    frustum.planes[2] = m[3] + m[1]; // bottom
+    frustum.planes[3] = m[3] - m[1]; // top
+    frustum.planes[4] = m[3] + m[2]; // near
+    frustum.planes[5] = m[3] - m[2]; // far
+
+    for (u32 i = 0; i < 6; ++i)
+    {
+        frustum.planes[i] /= glm::length(vec3(frustum.planes[i]));
+    }
+    return frustum;
+}
+
+bool IsSphereInFrustum(const Frustum& frustum, const vec3& center, f32 radius)
+{
+    for (u32 i = 0; i < 6; ++i)
+    {
+        const vec4& plane = frustum.planes[i];
+        if (glm::dot(vec3(plane), center) + plane.w < -radius)
+            return false;
+    }
+    return true;
+}
+
+// A box is outside when it is fully behind any plane. For each plane the
+// signed distance of the center plus the projected extent |n| . e must be >= 0.
+void CullBoundsBatch(CullingBounds& bounds, const Frustum& frustum)
+{
+    const f32* cx = bounds.centerX.data();
+    const f32* cy = bounds.centerY.data();
+    const f32* cz = bounds.centerZ.data();
+    const f32* ex = bounds.extentX.data();
+    const f32* ey = bounds.extentY.data();
+    const f32* ez = bounds.extentZ.data();
+    u8* visible = bounds.visible.data();
+
+#if defined(CULLING_AVX)
+    for (u32 i = 0; i < bounds.count; i += 8)
+    {
+        const __m256 centerX = _mm256_loadu_ps(cx + i);
+        const __m256 centerY = _mm256_loadu_ps(cy + i);
+        const __m256 centerZ = _mm256_loadu_ps(cz + i);
+        const __m256 extentX = _mm256_loadu_ps(ex + i);
+        const __m256 extentY = _mm256_loadu_ps(ey + i);
+        const __m256 extentZ = _mm256_loadu_ps(ez + i);
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+        for (u32 p = 0; p < 6; ++p)
+        {
+            const vec4& plane = frustum.planes[p];
+            __m256 distance = _mm256_set1_ps(plane.w);
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(_mm256_set1_ps(plane.x), centerX));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(_mm256_set1_ps(plane.y), centerY));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(_mm256_set1_ps(plane.z), centerZ));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(_mm256_set1_ps(fabsf(plane.x)), extentX));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(_mm256_set1_ps(fabsf(plane.y)), extentY));
+            distance = _mm256_add_ps(distance, _mm256_mul_ps(_mm256_set1_ps(fabsf(plane.z)), extentZ));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_GE_OQ));
+        }
+
+        const int mask = _mm256_movemask_ps(inside);
+        for (u32 lane = 0; lane < 8; ++lane)
+            visible[i + lane] = (u8)((mask >> lane) & 1);
+    }
+#elif defined(CULLING_SSE)
+    for (u32 i = 0; i < bounds.count; i += 4)
+    {
+        const __m128 centerX = _mm_loadu_ps(cx + i);
+        const __m128 centerY = _mm_loadu_ps(cy + i);
+        const __m128 centerZ = _mm_loadu_ps(cz + i);
+        const __m128 extentX = _mm_loadu_ps(ex + i);
+        const __m128 extentY = _mm_loadu_ps(ey + i);
+        const __m128 extentZ = _mm_loadu_ps(ez + i);
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+        for (u32 p = 0; p < 6; ++p)
+        {
+            const vec4& plane = frustum.planes[p];
+            __m128 distance = _mm_set1_ps(plane.w);
+            distance = _mm_add_ps(distance, _mm_mul_ps(_mm_set1_ps(plane.x), centerX));
+            distance = _mm_add_ps(distance, _mm_mul_ps(_mm_set1_ps(plane.y), centerY));
+            distance = _mm_add_ps(distance, _mm_mul_ps(_mm_set1_ps(plane.z), centerZ));
+            distance = _mm_add_ps(distance, _mm_mul_ps(_mm_set1_ps(fabsf(plane.x)), extentX));
+            distance = _mm_add_ps(distance, _mm_mul_ps(_mm_set1_ps(fabsf(plane.y)), extentY));
+            distance = _mm_add_ps(distance, _mm_mul_ps(_mm_set1_ps(fabsf(plane.z)), extentZ));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, _mm_setzero_ps()));
+        }
+
+        const int mask = _mm_movemask_ps(inside);
+        for (u32 lane = 0; lane < 4; ++lane)
+            visible[i + lane] = (u8)((mask >> lane) & 1);
+    }
+#else
+    for (u32 i = 0; i < bounds.count; ++i)
+    {
+        bool inside = true;
+        for (u32 p = 0; p < 6 && inside; ++p)
+        {
+            const vec4& plane = frustum.planes[p];
+            f32 distance = plane.w + plane.x * cx[i] + plane.y * cy[i] + plane.z * cz[i] +
+                fabsf(plane.x) * ex[i] + fabsf(plane.y) * ey[i] + fabsf(plane.z) * ez[i];
+            inside = distance >= 0.0f;
+        }
+        visible[i] = inside ? 1 : 0;
+    }
+#endif
+}
+
+void CullEntities(App* app, const Frustum& frustum)
+{
+    CullingBounds& bounds = app->cullingBounds;
+    const u32 entityCount = (u32)app->entities.size();
+    const u32 paddedCount = (entityCount + CULLING_BATCH_SIZE - 1) / CULLING_BATCH_SIZE * CULLING_BATCH_SIZE;
+
+    // Padding rows are zero sized boxes at the origin, their results are ignored
+    bounds.count = paddedCount;
+    bounds.centerX.assign(paddedCount, 0.0f);
+    bounds.centerY.assign(paddedCount, 0.0f);
+    bounds.centerZ.assign(paddedCount, 0.0f);
+    bounds.extentX.assign(paddedCount, 0.0f);
+    bounds.extentY.assign(paddedCount, 0.0f);
+    bounds.extentZ.assign(paddedCount, 0.0f);
+    bounds.visible.resize(paddedCount);
+
+    for (u32 i = 0; i < entityCount; ++i)
+    {
+        const Entity& entity = app->entities[i];
+
+        // Inactive entities and models that failed to load keep the zero box, they are never drawn
+        if (!entity.active || entity.modelIndex >= app->models.size())
+            continue;
+        const Mesh& mesh = app->meshes[app->models[entity.modelIndex].meshIdx];
+
+        // Transformed box: the center moves with the matrix, the extents are
+        // projected on the world axes through the absolute rotation/scale part
+        const vec3 localCenter = (mesh.aabb.min + mesh.aabb.max) * 0.5f;
+        const vec3 localExtent = (mesh.aabb.max - mesh.aabb.min) * 0.5f;
+        const vec3 worldCenter = vec3(entity.worldMatrix * vec4(localCenter, 1.0f));
+        const glm::mat3 absolute = glm::mat3(
+            glm::abs(vec3(entity.worldMatrix[0])),
+            glm::abs(vec3(entity.worldMatrix[1])),
+            glm::abs(vec3(entity.worldMatrix[2])));
+        const vec3 worldExtent = absolute * localExtent;
+
+        bounds.centerX[i] = worldCenter.x;
+        bounds.centerY[i] = worldCenter.y;
+        bounds.centerZ[i] = worldCenter.z;
+        bounds.extentX[i] = worldExtent.x;
+        bounds.extentY[i] = worldExtent.y;
+        bounds.extentZ[i] = worldExtent.z;
+    }
+
+    if (app->frustumCulling)
+    {
+        CullBoundsBatch(bounds, frustum);
+    }
+    else
+    {
+        memset(bounds.visible.data(), 1, paddedCount);
+    }
+
+    bounds.visibleEntities = 0;
+    bounds.culledEntities = 0;
+    for (u32 i = 0; i < entityCount; ++i)
+    {
+        const Entity& entity = app->entities[i];
+        if (!entity.active || entity.modelIndex >= app->models.size())
+        {
+            bounds.visible[i] = 0;
+            continue;
+        }
+        if (entity.pass == RenderPass_Background)
+        {
+            bounds.visible[i] = 1;
+        }
+
+        if (bounds.visible[i]) bounds.visibleEntities++;
+        else                   bounds.culledEntities++;
+    }
+}
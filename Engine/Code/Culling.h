@@ -0,0 +1,25 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include "Structs.hpp"
+
+// Bounds of the positions of a submesh (attribute at offset 0 of its layout)
+void ComputeSubmeshBounds(Submesh& submesh);
+// Union of the submesh bounds, call it after ComputeSubmeshBounds on every submesh
+void ComputeMeshBounds(Mesh& mesh);
+
+Frustum ExtractFrustum(const glm::mat4& viewProjection);
+
+bool IsSphereInFrustum(const Frustum& frustum, const vec3& center, f32 radius);
+
+// Tests bounds.count rows of the SoA table against the frustum and writes
+// 1 (intersecting) or 0 (outside) into bounds.visible. Uses AVX when the
+// build enables it, SSE otherwise.
+void CullBoundsBatch(CullingBounds& bounds, const Frustum& frustum);
+
+// Refreshes the world space bounds of every entity from its world matrix and
+// runs the batch test. Inactive entities and the background pass are never
+// tested: the former are hidden, the latter is always visible.
+void CullEntities(App* app, const Frustum& frustum);
+
+#endif // CULLING_H
@@ -0,0 +1,188 @@
+#include "DepthPrePass.h"
+#include "ProgramReflection.h"
+#include "RenderQueue.h"
+#include "RenderState.h"
+#include "VertexPacking.h"
+#include "platform.h"
+
+void InitDepthPrePass(DepthPrePass& prePass)
+{
+    prePass.mode = DepthPrePass_Auto;
+    prePass.enabled = false;
+    prePass.frameEnabled = false;
+    prePass.drawCount = 0;
+    for (DepthPrePassQuery& query : prePass.queries)
+    {
+        glGenQueries(2, query.timestamps);
+        query.enabled = -1;
+        query.probe = false;
+    }
+    prePass.frame = 0;
+    prePass.nextProbe = 0;
+    prePass.probeFrames = 0;
+    prePass.settleFrames = 0;
+    prePass.lastProbeTime[0] = 0.0f;
+    prePass.lastProbeTime[1] = 0.0f;
+}
+
+void DestroyDepthPrePass(DepthPrePass& prePass)
+{
+    for (DepthPrePassQuery& query : prePass.queries)
+    {
+        glDeleteQueries(2, query.timestamps);
+        query.timestamps[0] = 0;
+        query.timestamps[1] = 0;
+    }
+}
+
+// Adds the frame of a slot about to be reused to the probe, results that are
+// still not available are dropped rather than waited on
+static void ReadDepthPrePassQuery(DepthPrePass& prePass, DepthPrePassQuery& query)
+{
+    if (query.enabled < 0)
+        return;
+
+    GLint available = 0;
+    glGetQueryObjectiv(query.timestamps[1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available && query.probe)
+    {
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(query.timestamps[0], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(query.timestamps[1], GL_QUERY_RESULT, &end);
+        const u32 enabled = (u32)query.enabled;
+        prePass.probeTime[enabled] += (f64)(end - begin) / 1.0e6;
+        prePass.probeSamples[enabled]++;
+    }
+    query.enabled = -1;
+}
+
+static void FinishDepthPrePassProbe(DepthPrePass& prePass)
+{
+    prePass.nextProbe = DEPTH_PREPASS_PROBE_INTERVAL;
+    if (prePass.probeSamples[0] == 0 || prePass.probeSamples[1] == 0)
+        return;
+
+    const f64 without = prePass.probeTime[0] / prePass.probeSamples[0];
+    const f64 with = prePass.probeTime[1] / prePass.probeSamples[1];
+    const bool enabled = with < without * (1.0 - DEPTH_PREPASS_MIN_GAIN);
+    if (enabled != prePass.enabled)
+    {
+        ILOG("Depth pre-pass %s: %.3f ms with it, %.3f ms without", enabled ? "on" : "off", with, without);
+    }
+    prePass.enabled = enabled;
+    prePass.lastProbeTime[0] = (f32)without;
+    prePass.lastProbeTime[1] = (f32)with;
+}
+
+bool BeginDepthPrePassFrame(DepthPrePass& prePass)
+{
+    DepthPrePassQuery& query = prePass.queries[prePass.frame % DEPTH_PREPASS_QUERY_FRAMES];
+    ReadDepthPrePassQuery(prePass, query);
+
+    bool probe = false;
+    if (prePass.mode == DepthPrePass_Auto)
+    {
+        if (prePass.probeFrames == 0 && prePass.settleFrames == 0)
+        {
+            if (prePass.nextProbe == 0)
+            {
+                prePass.probeFrames = DEPTH_PREPASS_PROBE_FRAMES;
+                prePass.probeTime[0] = prePass.probeTime[1] = 0.0;
+                prePass.probeSamples[0] = prePass.probeSamples[1] = 0;
+            }
+            else
+            {
+                prePass.nextProbe--;
+            }
+        }
+
+        if (prePass.probeFrames > 0)
+        {
+            // Alternating every frame keeps camera motion out of the comparison
+            probe = true;
+            prePass.frameEnabled = (prePass.probeFrames & 1) != 0;
+            if (--prePass.probeFrames == 0)
+                prePass.settleFrames = DEPTH_PREPASS_QUERY_FRAMES;
+        }
+        else
+        {
+            if (prePass.settleFrames > 0 && --prePass.settleFrames == 0)
+                FinishDepthPrePassProbe(prePass);
+            prePass.frameEnabled = prePass.enabled;
+        }
+    }
+    else
+    {
+        prePass.frameEnabled = prePass.mode == DepthPrePass_On;
+    }
+
+    query.enabled = prePass.frameEnabled ? 1 : 0;
+    query.probe = probe;
+    glQueryCounter(query.timestamps[0], GL_TIMESTAMP);
+    prePass.drawCount = 0;
+    return prePass.frameEnabled;
+}
+
+void EndDepthPrePassFrame(DepthPrePass& prePass)
+{
+    glQueryCounter(prePass.queries[prePass.frame % DEPTH_PREPASS_QUERY_FRAMES].timestamps[1], GL_TIMESTAMP);
+    prePass.frame++;
+}
+
+bool IsInDepthPrePass(const App* app, const RenderItem& item)
+{
+    return app->entities[item.entityIdx].pass == RenderPass_Opaque && item.programIdx != app->reliefMappingIdx;
+}
+
+static GLuint FindPositionVao(const Mesh& mesh, Submesh& submesh)
+{
+    if (submesh.positionVao != 0)
+        return submesh.positionVao;
+
+    glGenVertexArrays(1, &submesh.positionVao);
+    glBindVertexArray(submesh.positionVao);
+
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.positionBufferHandle);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
+    glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, PACKED_POSITION_BYTES, (void*)(u64)submesh.positionStreamOffset);
+    glEnableVertexAttribArray(0);
+
+    glBindVertexArray(0);
+    return submesh.positionVao;
+}
+
+void RenderDepthPrePass(App* app, const RenderQueue& queue)
+{
+    RenderState& state = app->renderState;
+    const Program& program = app->programs[app->depthPrePassIdx];
+    SetProgram(state, program.handle);
+    SetDepthFunc(state, GL_LESS);
+    SetDepthWrite(state, true);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+    u32 lastEntity = UINT32_MAX;
+    for (const RenderQueueEntry& queueEntry : queue.entries)
+    {
+        const RenderItem& item = queue.items[queueEntry.itemIdx];
+        if (!IsInDepthPrePass(app, item))
+            continue;
+
+        const Entity& entity = app->entities[item.entityIdx];
+        Mesh& mesh = app->meshes[app->models[entity.modelIndex].meshIdx];
+        if (item.entityIdx != lastEntity)
+        {
+            SetUniformBufferRange(state, 1, app->entityUBO.handle, entity.entityBufferOffset, entity.entityBufferSize);
+            SetUniformVec3(program, Uniform_PositionScale, mesh.positionScale);
+            SetUniformVec3(program, Uniform_PositionOffset, mesh.positionOffset);
+            lastEntity = item.entityIdx;
+        }
+
+        SetVertexArray(state, FindPositionVao(mesh, mesh.submeshes[item.submeshIdx]));
+        DrawRenderItem(queue, item);
+        app->depthPrePass.drawCount++;
+    }
+
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    SetDepthFunc(state, GL_EQUAL);
+    SetDepthWrite(state, false);
+}
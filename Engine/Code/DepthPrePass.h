@@ -0,0 +1,33 @@
+#ifndef DEPTH_PRE_PASS_H
+#define DEPTH_PRE_PASS_H
+
+#include "Structs.hpp"
+#include <glad/glad.h>
+
+// Optional depth only pass over the opaque render queue, drawn from the
+// position stream of each mesh (Mesh::positionBufferHandle) with
+// DEPTH_PREPASS.glsl. The main pass then shades with GL_EQUAL and no depth
+// writes, so each pixel runs its expensive fragment shader once. Every vertex
+// shader drawn against this depth computes gl_Position the same invariant way.
+void InitDepthPrePass(DepthPrePass& prePass);
+void DestroyDepthPrePass(DepthPrePass& prePass);
+
+// Picks whether this frame draws the pre-pass and writes the timestamp that
+// starts the opaque geometry. In auto mode a probe alternates both ways for
+// DEPTH_PREPASS_PROBE_FRAMES frames and keeps the pre-pass only when it
+// saves DEPTH_PREPASS_MIN_GAIN of the GPU time.
+bool BeginDepthPrePassFrame(DepthPrePass& prePass);
+
+// Timestamp after the last opaque draw, call it once per Begin
+void EndDepthPrePassFrame(DepthPrePass& prePass);
+
+// Items whose depth is the rasterized one. The relief march writes
+// gl_FragDepth, so those items keep GL_LESS and write their own depth after
+// the others, and the background pass is drawn as before.
+bool IsInDepthPrePass(const App* app, const RenderItem& item);
+
+// Draws the depth of the items above with the color writes masked, then
+// leaves the depth test at GL_EQUAL without writes for the main pass
+void RenderDepthPrePass(App* app, const RenderQueue& queue);
+
+#endif // DEPTH_PRE_PASS_H
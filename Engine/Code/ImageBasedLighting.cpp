@@ -0,0 +1,702 @@
+#include "ImageBasedLighting.h"
+#include "JobSystem.h"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define IBL_SSE 1
+#endif
+
+#define IBL_CACHE_MAGIC 0x304C4249u // "IBL0"
+
+enum IblCacheKind
+{
+    IblCache_Environment,
+    IblCache_BrdfLut,
+};
+
+struct IblCacheHeader
+{
+    u32 magic;
+    u32 version;
+    u32 kind;
+    u32 sourceTimestamp[2]; // low, high
+    u32 size;
+    u32 mipCount;
+    u32 floatCount;
+};
+
+// Texel (s, t) in [-1, 1] of a face points along origin + s * sAxis + t * tAxis,
+// the GL cube map convention
+struct CubeFaceBasis
+{
+    vec3 origin;
+    vec3 sAxis;
+    vec3 tAxis;
+};
+
+static const CubeFaceBasis FaceBases[6] = {
+    { vec3( 1.0f, 0.0f, 0.0f), vec3( 0.0f, 0.0f, -1.0f), vec3(0.0f, -1.0f,  0.0f) }, // +X
+    { vec3(-1.0f, 0.0f, 0.0f), vec3( 0.0f, 0.0f,  1.0f), vec3(0.0f, -1.0f,  0.0f) }, // -X
+    { vec3( 0.0f, 1.0f, 0.0f), vec3( 1.0f, 0.0f,  0.0f), vec3(0.0f,  0.0f,  1.0f) }, // +Y
+    { vec3( 0.0f,-1.0f, 0.0f), vec3( 1.0f, 0.0f,  0.0f), vec3(0.0f,  0.0f, -1.0f) }, // -Y
+    { vec3( 0.0f, 0.0f, 1.0f), vec3( 1.0f, 0.0f,  0.0f), vec3(0.0f, -1.0f,  0.0f) }, // +Z
+    { vec3( 0.0f, 0.0f,-1.0f), vec3(-1.0f, 0.0f,  0.0f), vec3(0.0f, -1.0f,  0.0f) }, // -Z
+};
+
+// Six faces of size x size RGB floats, one after the other
+struct CubeLevel
+{
+    i32 size;
+    std::vector<f32> texels;
+};
+
+static std::string GetCachePath(const std::vector<std::string>& faces)
+{
+    return faces[0] + IBL_CACHE_EXTENSION;
+}
+
+// Newest write time of the faces, 0 when none exists
+static u64 GetFacesTimestamp(const std::vector<std::string>& faces)
+{
+    u64 timestamp = 0;
+    for (const std::string& face : faces)
+        timestamp = glm::max(timestamp, GetFileLastWriteTimestamp(face.c_str()));
+    return timestamp;
+}
+
+static u32 GetSpecularFloatCount()
+{
+    u32 count = 0;
+    for (u32 mip = 0; mip < IBL_SPECULAR_MIPS; ++mip)
+    {
+        const u32 size = IBL_SPECULAR_SIZE >> mip;
+        count += 6 * size * size * 3;
+    }
+    return count;
+}
+
+static u32 GetSpecularLevelOffset(u32 mip)
+{
+    u32 offset = 0;
+    for (u32 level = 0; level < mip; ++level)
+    {
+        const u32 size = IBL_SPECULAR_SIZE >> level;
+        offset += 6 * size * size * 3;
+    }
+    return offset;
+}
+
+// Maps path and checks its header, the floats follow it
+static bool MapCacheFile(const char* path, const IblCacheHeader& expected, MappedFile& file)
+{
+    file = MapFileReadOnly(path);
+    if (!file.data)
+        return false;
+
+    const IblCacheHeader* header = (const IblCacheHeader*)file.data;
+    const bool valid = file.size >= sizeof(IblCacheHeader) &&
+        header->magic == IBL_CACHE_MAGIC && header->version == IBL_CACHE_VERSION && header->kind == expected.kind &&
+        header->sourceTimestamp[0] == expected.sourceTimestamp[0] && header->sourceTimestamp[1] == expected.sourceTimestamp[1] &&
+        header->size == expected.size && header->mipCount == expected.mipCount && header->floatCount == expected.floatCount &&
+        file.size == sizeof(IblCacheHeader) + (u64)header->floatCount * sizeof(f32);
+    if (!valid)
+    {
+        ILOG("Lighting cache %s is stale, baking it again", path);
+        UnmapFile(file);
+        return false;
+    }
+    return true;
+}
+
+static void WriteCacheFile(const char* path, const IblCacheHeader& header, const f32* first, u32 firstCount, const f32* second, u32 secondCount)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        ELOG("fopen() failed writing lighting cache %s", path);
+        return;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(first, sizeof(f32), firstCount, file);
+    if (secondCount > 0)
+        fwrite(second, sizeof(f32), secondCount, file);
+
+    const bool failed = ferror(file) != 0;
+    fclose(file);
+    if (failed)
+    {
+        ELOG("Error writing lighting cache %s", path);
+        remove(path);
+    }
+}
+
+static IblCacheHeader MakeEnvironmentHeader(u64 sourceTimestamp)
+{
+    IblCacheHeader header = {};
+    header.magic = IBL_CACHE_MAGIC;
+    header.version = IBL_CACHE_VERSION;
+    header.kind = IblCache_Environment;
+    header.sourceTimestamp[0] = (u32)sourceTimestamp;
+    header.sourceTimestamp[1] = (u32)(sourceTimestamp >> 32);
+    header.size = IBL_SPECULAR_SIZE;
+    header.mipCount = IBL_SPECULAR_MIPS;
+    header.floatCount = IBL_SH_COEFFICIENTS * 3 + GetSpecularFloatCount();
+    return header;
+}
+
+bool ReadEnvironmentLightingCache(const std::vector<std::string>& faces, EnvironmentLightingData& data)
+{
+    const u64 sourceTimestamp = GetFacesTimestamp(faces);
+    if (sourceTimestamp == 0)
+        return false;
+
+    const std::string cachePath = GetCachePath(faces);
+    MappedFile file;
+    if (!MapCacheFile(cachePath.c_str(), MakeEnvironmentHeader(sourceTimestamp), file))
+        return false;
+
+    const f32* floats = (const f32*)(file.data + sizeof(IblCacheHeader));
+    memcpy(data.irradianceSH, floats, sizeof(data.irradianceSH));
+    floats += IBL_SH_COEFFICIENTS * 3;
+    data.specular.assign(floats, floats + GetSpecularFloatCount());
+    UnmapFile(file);
+    return true;
+}
+
+// Area average of the RGB8 faces down to size, missing faces stay black
+static void DownsampleFaces(JobSystem& jobs, const Image images[6], i32 sourceSize, CubeLevel& level)
+{
+    level.texels.assign((size_t)6 * level.size * level.size * 3, 0.0f);
+    const i32 footprint = sourceSize / level.size;
+    ParallelFor(jobs, 6 * level.size, [&](u32 row)
+    {
+        const u32 face = row / level.size;
+        const i32 y = (i32)(row % level.size);
+        const u8* pixels = (const u8*)images[face].pixels;
+        if (!pixels)
+            return;
+
+        f32* out = &level.texels[((size_t)face * level.size + y) * level.size * 3];
+        const f32 scale = 1.0f / (255.0f * footprint * footprint);
+        for (i32 x = 0; x < level.size; ++x)
+        {
+            u32 sum[3] = {};
+            for (i32 sy = y * footprint; sy < (y + 1) * footprint; ++sy)
+            {
+                const u8* texel = &pixels[((size_t)sy * sourceSize + x * footprint) * 3];
+                for (i32 sx = 0; sx < footprint; ++sx, texel += 3)
+                {
+                    sum[0] += texel[0];
+                    sum[1] += texel[1];
+                    sum[2] += texel[2];
+                }
+            }
+            for (u32 c = 0; c < 3; ++c)
+                out[x * 3 + c] = sum[c] * scale;
+        }
+    });
+}
+
+// 2x2 box filter of every face
+static void DownsampleLevel(const CubeLevel& source, CubeLevel& level)
+{
+    level.size = glm::max(source.size / 2, 1);
+    level.texels.resize((size_t)6 * level.size * level.size * 3);
+    const i32 ratio = source.size / level.size;
+    for (u32 face = 0; face < 6; ++face)
+    {
+        const f32* in = &source.texels[(size_t)face * source.size * source.size * 3];
+        f32* out = &level.texels[(size_t)face * level.size * level.size * 3];
+        for (i32 y = 0; y < level.size; ++y)
+        {
+            for (i32 x = 0; x < level.size; ++x)
+            {
+                for (u32 c = 0; c < 3; ++c)
+                {
+                    f32 sum = 0.0f;
+                    for (i32 sy = 0; sy < ratio; ++sy)
+                        for (i32 sx = 0; sx < ratio; ++sx)
+                            sum += in[(((size_t)y * ratio + sy) * source.size + x * ratio + sx) * 3 + c];
+                    out[((size_t)y * level.size + x) * 3 + c] = sum / (f32)(ratio * ratio);
+                }
+            }
+        }
+    }
+}
+
+// Face and (s, t) in [0, 1] that direction points to, the inverse of FaceBases
+static u32 DirectionToFace(const vec3& direction, vec2& st)
+{
+    const vec3 a = glm::abs(direction);
+    u32 face;
+    f32 major;
+    if (a.x >= a.y && a.x >= a.z)
+    {
+        face = direction.x > 0.0f ? 0 : 1;
+        major = a.x;
+    }
+    else if (a.y >= a.z)
+    {
+        face = direction.y > 0.0f ? 2 : 3;
+        major = a.y;
+    }
+    else
+    {
+        face = direction.z > 0.0f ? 4 : 5;
+        major = a.z;
+    }
+
+    const CubeFaceBasis& basis = FaceBases[face];
+    st.x = glm::dot(direction, basis.sAxis) / major * 0.5f + 0.5f;
+    st.y = glm::dot(direction, basis.tAxis) / major * 0.5f + 0.5f;
+    return face;
+}
+
+// Bilinear inside the face, clamped at its edges
+static vec3 SampleFace(const CubeLevel& level, u32 face, vec2 st)
+{
+    const f32 x = glm::clamp(st.x * level.size - 0.5f, 0.0f, (f32)(level.size - 1));
+    const f32 y = glm::clamp(st.y * level.size - 0.5f, 0.0f, (f32)(level.size - 1));
+    const i32 x0 = (i32)x;
+    const i32 y0 = (i32)y;
+    const i32 x1 = glm::min(x0 + 1, level.size - 1);
+    const i32 y1 = glm::min(y0 + 1, level.size - 1);
+    const f32 fx = x - x0;
+    const f32 fy = y - y0;
+
+    const f32* texels = &level.texels[(size_t)face * level.size * level.size * 3];
+    const f32* t00 = &texels[((size_t)y0 * level.size + x0) * 3];
+    const f32* t10 = &texels[((size_t)y0 * level.size + x1) * 3];
+    const f32* t01 = &texels[((size_t)y1 * level.size + x0) * 3];
+    const f32* t11 = &texels[((size_t)y1 * level.size + x1) * 3];
+
+    vec3 color;
+    for (u32 c = 0; c < 3; ++c)
+    {
+        const f32 top = t00[c] + (t10[c] - t00[c]) * fx;
+        const f32 bottom = t01[c] + (t11[c] - t01[c]) * fx;
+        color[c] = top + (bottom - top) * fy;
+    }
+    return color;
+}
+
+static vec3 SampleCube(const std::vector<CubeLevel>& chain, const vec3& direction, f32 lod)
+{
+    vec2 st;
+    const u32 face = DirectionToFace(direction, st);
+    lod = glm::clamp(lod, 0.0f, (f32)(chain.size() - 1));
+    const u32 level = (u32)lod;
+    const vec3 color = SampleFace(chain[level], face, st);
+    if (level + 1 == chain.size())
+        return color;
+    return glm::mix(color, SampleFace(chain[level + 1], face, st), lod - level);
+}
+
+// Real SH basis up to band 2, evaluated at a unit direction
+static void EvaluateSH9(const vec3& d, f32 basis[IBL_SH_COEFFICIENTS])
+{
+    basis[0] = 0.282095f;
+    basis[1] = 0.488603f * d.y;
+    basis[2] = 0.488603f * d.z;
+    basis[3] = 0.488603f * d.x;
+    basis[4] = 1.092548f * d.x * d.y;
+    basis[5] = 1.092548f * d.y * d.z;
+    basis[6] = 0.315392f * (3.0f * d.z * d.z - 1.0f);
+    basis[7] = 1.092548f * d.x * d.z;
+    basis[8] = 0.546274f * (d.x * d.x - d.y * d.y);
+}
+
+// Per row sums: 27 weighted radiance coefficients and the total solid angle
+#define SH_ROW_SUMS (IBL_SH_COEFFICIENTS * 3 + 1)
+
+static void AccumulateTexelSH(const vec3& direction, f32 weight, const f32* rgb, f32* sums)
+{
+    f32 basis[IBL_SH_COEFFICIENTS];
+    EvaluateSH9(direction, basis);
+    for (u32 i = 0; i < IBL_SH_COEFFICIENTS; ++i)
+    {
+        const f32 w = weight * basis[i];
+        sums[i * 3 + 0] += w * rgb[0];
+        sums[i * 3 + 1] += w * rgb[1];
+        sums[i * 3 + 2] += w * rgb[2];
+    }
+    sums[IBL_SH_COEFFICIENTS * 3] += weight;
+}
+
+// Projects one row of a face. The solid angle of texel (s, t) is
+// (2 / size)^2 / (1 + s^2 + t^2)^1.5, the same distance normalizes its direction.
+static void ProjectRowSH(const CubeLevel& level, u32 face, i32 y, f32* sums)
+{
+    const CubeFaceBasis& basis = FaceBases[face];
+    const f32 texelSize = 2.0f / level.size;
+    const f32 texelArea = texelSize * texelSize;
+    const f32 t = (y + 0.5f) * texelSize - 1.0f;
+    const f32* rgb = &level.texels[((size_t)face * level.size + y) * level.size * 3];
+    const vec3 rowOrigin = basis.origin + t * basis.tAxis;
+
+    i32 x = 0;
+#if defined(IBL_SSE)
+    __m128 acc[SH_ROW_SUMS];
+    for (u32 i = 0; i < SH_ROW_SUMS; ++i)
+        acc[i] = _mm_setzero_ps();
+
+    const __m128 one = _mm_set1_ps(1.0f);
+    for (; x + 4 <= level.size; x += 4, rgb += 12)
+    {
+        const __m128 s = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_set1_ps((f32)x + 0.5f), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f)), _mm_set1_ps(texelSize)), one);
+        const __m128 invLength = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_set1_ps(1.0f + t * t), _mm_mul_ps(s, s))));
+        const __m128 weight = _mm_mul_ps(_mm_set1_ps(texelArea), _mm_mul_ps(invLength, _mm_mul_ps(invLength, invLength)));
+
+        const __m128 dx = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(rowOrigin.x), _mm_mul_ps(s, _mm_set1_ps(basis.sAxis.x))), invLength);
+        const __m128 dy = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(rowOrigin.y), _mm_mul_ps(s, _mm_set1_ps(basis.sAxis.y))), invLength);
+        const __m128 dz = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(rowOrigin.z), _mm_mul_ps(s, _mm_set1_ps(basis.sAxis.z))), invLength);
+
+        const __m128 shBasis[IBL_SH_COEFFICIENTS] = {
+            _mm_set1_ps(0.282095f),
+            _mm_mul_ps(_mm_set1_ps(0.488603f), dy),
+            _mm_mul_ps(_mm_set1_ps(0.488603f), dz),
+            _mm_mul_ps(_mm_set1_ps(0.488603f), dx),
+            _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(dx, dy)),
+            _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(dy, dz)),
+            _mm_mul_ps(_mm_set1_ps(0.315392f), _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(3.0f), _mm_mul_ps(dz, dz)), one)),
+            _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(dx, dz)),
+            _mm_mul_ps(_mm_set1_ps(0.546274f), _mm_sub_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy))),
+        };
+        const __m128 color[3] = {
+            _mm_setr_ps(rgb[0], rgb[3], rgb[6], rgb[9]),
+            _mm_setr_ps(rgb[1], rgb[4], rgb[7], rgb[10]),
+            _mm_setr_ps(rgb[2], rgb[5], rgb[8], rgb[11]),
+        };
+
+        for (u32 i = 0; i < IBL_SH_COEFFICIENTS; ++i)
+        {
+            const __m128 w = _mm_mul_ps(weight, shBasis[i]);
+            for (u32 c = 0; c < 3; ++c)
+                acc[i * 3 + c] = _mm_add_ps(acc[i * 3 + c], _mm_mul_ps(w, color[c]));
+        }
+        acc[IBL_SH_COEFFICIENTS * 3] = _mm_add_ps(acc[IBL_SH_COEFFICIENTS * 3], weight);
+    }
+
+    for (u32 i = 0; i < SH_ROW_SUMS; ++i)
+    {
+        alignas(16) f32 lanes[4];
+        _mm_store_ps(lanes, acc[i]);
+        sums[i] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+    for (; x < level.size; ++x, rgb += 3)
+    {
+        const f32 s = (x + 0.5f) * texelSize - 1.0f;
+        const f32 invLength = 1.0f / sqrtf(1.0f + s * s + t * t);
+        AccumulateTexelSH((rowOrigin + s * basis.sAxis) * invLength, texelArea * invLength * invLength * invLength, rgb, sums);
+    }
+}
+
+// Irradiance from radiance: the cosine lobe scales band l by A_l (PI, 2PI/3,
+// PI/4), the division by PI leaves 1, 2/3 and 1/4
+static void ProjectIrradianceSH(JobSystem& jobs, const CubeLevel& level, vec3 irradianceSH[IBL_SH_COEFFICIENTS])
+{
+    const u32 rowCount = 6 * level.size;
+    std::vector<f32> rowSums((size_t)rowCount * SH_ROW_SUMS, 0.0f);
+    ParallelFor(jobs, rowCount, [&](u32 row)
+    {
+        ProjectRowSH(level, row / level.size, (i32)(row % level.size), &rowSums[(size_t)row * SH_ROW_SUMS]);
+    });
+
+    f32 sums[SH_ROW_SUMS] = {};
+    for (u32 row = 0; row < rowCount; ++row)
+        for (u32 i = 0; i < SH_ROW_SUMS; ++i)
+            sums[i] += rowSums[(size_t)row * SH_ROW_SUMS + i];
+
+    // The texel solid angles add up to 4PI only approximately
+    const f32 normalization = 4.0f * PI / sums[IBL_SH_COEFFICIENTS * 3];
+    static const f32 BandScales[IBL_SH_COEFFICIENTS] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+    for (u32 i = 0; i < IBL_SH_COEFFICIENTS; ++i)
+        irradianceSH[i] = vec3(sums[i * 3], sums[i * 3 + 1], sums[i * 3 + 2]) * normalization * BandScales[i];
+}
+
+static vec2 Hammersley(u32 i, u32 count)
+{
+    u32 bits = i;
+    bits = (bits << 16u) | (bits >> 16u);
+    bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+    bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+    bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+    bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+    return vec2((f32)i / count, bits * 2.3283064365386963e-10f);
+}
+
+// GGX half vector around +Z for alpha = roughness^2
+static vec3 ImportanceSampleGGX(vec2 xi, f32 alpha)
+{
+    const f32 phi = 2.0f * PI * xi.x;
+    const f32 cosTheta = sqrtf((1.0f - xi.y) / (1.0f + (alpha * alpha - 1.0f) * xi.y));
+    const f32 sinTheta = sqrtf(1.0f - cosTheta * cosTheta);
+    return vec3(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta);
+}
+
+// With N = V = R every texel of a level uses the same samples around its own
+// normal. Stored SoA, padded to a multiple of 4 with zero weights.
+struct PrefilterSamples
+{
+    std::vector<f32> x, y, z;
+    std::vector<f32> weight; // NdotL
+    std::vector<f32> lod;    // source level covering the sample's solid angle
+    f32 totalWeight;
+};
+
+static void BuildPrefilterSamples(f32 roughness, i32 sourceSize, PrefilterSamples& samples)
+{
+    const f32 alpha = roughness * roughness;
+    const f32 texelSolidAngle = 4.0f * PI / (6.0f * sourceSize * sourceSize);
+    samples.totalWeight = 0.0f;
+
+    for (u32 i = 0; i < IBL_PREFILTER_SAMPLES; ++i)
+    {
+        const vec3 h = ImportanceSampleGGX(Hammersley(i, IBL_PREFILTER_SAMPLES), alpha);
+        const vec3 l = vec3(2.0f * h.z * h.x, 2.0f * h.z * h.y, 2.0f * h.z * h.z - 1.0f);
+        if (l.z <= 0.0f)
+            continue;
+
+        // Filtered importance sampling: pdf = D(NdotH) / 4 when N = V
+        const f32 a2 = alpha * alpha;
+        const f32 denominator = h.z * h.z * (a2 - 1.0f) + 1.0f;
+        const f32 pdf = a2 / (PI * denominator * denominator) * 0.25f;
+        const f32 sampleSolidAngle = 1.0f / (IBL_PREFILTER_SAMPLES * pdf + 1e-4f);
+
+        samples.x.push_back(l.x);
+        samples.y.push_back(l.y);
+        samples.z.push_back(l.z);
+        samples.weight.push_back(l.z);
+        samples.lod.push_back(glm::max(0.5f * glm::log2(sampleSolidAngle / texelSolidAngle) + 1.0f, 0.0f));
+        samples.totalWeight += l.z;
+    }
+
+    while (samples.x.size() % 4 != 0)
+    {
+        samples.x.push_back(0.0f);
+        samples.y.push_back(0.0f);
+        samples.z.push_back(1.0f);
+        samples.weight.push_back(0.0f);
+        samples.lod.push_back(0.0f);
+    }
+}
+
+static vec3 PrefilterTexel(const std::vector<CubeLevel>& chain, const PrefilterSamples& samples, const vec3& normal)
+{
+    const vec3 up = fabsf(normal.z) < 0.999f ? vec3(0.0f, 0.0f, 1.0f) : vec3(1.0f, 0.0f, 0.0f);
+    const vec3 tangent = glm::normalize(glm::cross(up, normal));
+    const vec3 bitangent = glm::cross(normal, tangent);
+
+    vec3 color(0.0f);
+    const u32 count = (u32)samples.x.size();
+    for (u32 i = 0; i < count; i += 4)
+    {
+        // Tangent to world for four samples at once
+        alignas(16) f32 wx[4], wy[4], wz[4];
+#if defined(IBL_SSE)
+        const __m128 lx = _mm_loadu_ps(&samples.x[i]);
+        const __m128 ly = _mm_loadu_ps(&samples.y[i]);
+        const __m128 lz = _mm_loadu_ps(&samples.z[i]);
+        _mm_store_ps(wx, _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, _mm_set1_ps(tangent.x)), _mm_mul_ps(ly, _mm_set1_ps(bitangent.x))), _mm_mul_ps(lz, _mm_set1_ps(normal.x))));
+        _mm_store_ps(wy, _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, _mm_set1_ps(tangent.y)), _mm_mul_ps(ly, _mm_set1_ps(bitangent.y))), _mm_mul_ps(lz, _mm_set1_ps(normal.y))));
+        _mm_store_ps(wz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, _mm_set1_ps(tangent.z)), _mm_mul_ps(ly, _mm_set1_ps(bitangent.z))), _mm_mul_ps(lz, _mm_set1_ps(normal.z))));
+#else
+        for (u32 lane = 0; lane < 4; ++lane)
+        {
+            const vec3 world = tangent * samples.x[i + lane] + bitangent * samples.y[i + lane] + normal * samples.z[i + lane];
+            wx[lane] = world.x;
+            wy[lane] = world.y;
+            wz[lane] = world.z;
+        }
+#endif
+        for (u32 lane = 0; lane < 4; ++lane)
+        {
+            const f32 weight = samples.weight[i + lane];
+            if (weight > 0.0f)
+                color += SampleCube(chain, vec3(wx[lane], wy[lane], wz[lane]), samples.lod[i + lane]) * weight;
+        }
+    }
+    return color / samples.totalWeight;
+}
+
+static void PrefilterSpecular(JobSystem& jobs, const std::vector<CubeLevel>& chain, std::vector<f32>& specular)
+{
+    specular.resize(GetSpecularFloatCount());
+    for (u32 mip = 0; mip < IBL_SPECULAR_MIPS; ++mip)
+    {
+        const i32 size = IBL_SPECULAR_SIZE >> mip;
+        const f32 roughness = (f32)mip / (IBL_SPECULAR_MIPS - 1);
+        f32* level = &specular[GetSpecularLevelOffset(mip)];
+
+        // A mirror only needs the source level of the same resolution
+        PrefilterSamples samples;
+        if (mip > 0)
+            BuildPrefilterSamples(roughness, chain[0].size, samples);
+        const f32 mirrorLod = glm::max(glm::log2((f32)chain[0].size / size), 0.0f);
+
+        ParallelFor(jobs, 6 * size, [&](u32 row)
+        {
+            const u32 face = row / size;
+            const i32 y = (i32)(row % size);
+            const CubeFaceBasis& basis = FaceBases[face];
+            const f32 t = (y + 0.5f) * 2.0f / size - 1.0f;
+            f32* out = &level[((size_t)face * size + y) * size * 3];
+            for (i32 x = 0; x < size; ++x)
+            {
+                const f32 s = (x + 0.5f) * 2.0f / size - 1.0f;
+                const vec3 normal = glm::normalize(basis.origin + s * basis.sAxis + t * basis.tAxis);
+                const vec3 color = mip == 0 ? SampleCube(chain, normal, mirrorLod) : PrefilterTexel(chain, samples, normal);
+                out[x * 3 + 0] = color.r;
+                out[x * 3 + 1] = color.g;
+                out[x * 3 + 2] = color.b;
+            }
+        });
+    }
+}
+
+void BakeEnvironmentLighting(JobSystem& jobs, const std::vector<std::string>& faces, const Image images[6], EnvironmentLightingData& data)
+{
+    i32 sourceSize = 0;
+    for (u32 face = 0; face < 6; ++face)
+    {
+        if (images[face].pixels)
+            sourceSize = images[face].size.x;
+    }
+
+    // Box filtered to the largest power of two the faces divide into, then halved down to 1x1
+    i32 baseSize = 1;
+    while (baseSize * 2 <= glm::min(sourceSize, IBL_SOURCE_SIZE) && sourceSize % (baseSize * 2) == 0)
+        baseSize *= 2;
+
+    std::vector<CubeLevel> chain(1);
+    chain[0].size = baseSize;
+    DownsampleFaces(jobs, images, sourceSize, chain[0]);
+    while (chain.back().size > 1)
+    {
+        CubeLevel level;
+        DownsampleLevel(chain.back(), level);
+        chain.push_back(std::move(level));
+    }
+
+    // SH9 cannot hold more than a 32x32 face's worth of detail
+    u32 shLevel = 0;
+    while (chain[shLevel].size > 32)
+        shLevel++;
+    ProjectIrradianceSH(jobs, chain[shLevel], data.irradianceSH);
+    PrefilterSpecular(jobs, chain, data.specular);
+
+    ILOG("Baked environment lighting for %s: %dx%d source, SH9 from %dx%d, %u specular mips of %dx%d",
+        faces[0].c_str(), sourceSize, sourceSize, chain[shLevel].size, chain[shLevel].size,
+        IBL_SPECULAR_MIPS, IBL_SPECULAR_SIZE, IBL_SPECULAR_SIZE);
+
+    const IblCacheHeader header = MakeEnvironmentHeader(GetFacesTimestamp(faces));
+    const std::string cachePath = GetCachePath(faces);
+    WriteCacheFile(cachePath.c_str(), header, &data.irradianceSH[0].x, IBL_SH_COEFFICIENTS * 3, data.specular.data(), (u32)data.specular.size());
+}
+
+void UploadEnvironmentLighting(const EnvironmentLightingData& data, EnvironmentLighting& lighting)
+{
+    memcpy(lighting.irradianceSH, data.irradianceSH, sizeof(lighting.irradianceSH));
+
+    glGenTextures(1, &lighting.specularTexture);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, lighting.specularTexture);
+    glTexStorage2D(GL_TEXTURE_CUBE_MAP, IBL_SPECULAR_MIPS, GL_RGB16F, IBL_SPECULAR_SIZE, IBL_SPECULAR_SIZE);
+    for (u32 mip = 0; mip < IBL_SPECULAR_MIPS; ++mip)
+    {
+        const i32 size = IBL_SPECULAR_SIZE >> mip;
+        const f32* level = &data.specular[GetSpecularLevelOffset(mip)];
+        for (u32 face = 0; face < 6; ++face)
+        {
+            glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, mip, 0, 0, size, size,
+                GL_RGB, GL_FLOAT, &level[(size_t)face * size * size * 3]);
+        }
+    }
+
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+}
+
+// Smith G for IBL, k = alpha / 2
+static f32 GeometrySmithIBL(f32 NdotV, f32 NdotL, f32 roughness)
+{
+    const f32 k = roughness * roughness * 0.5f;
+    return (NdotV / (NdotV * (1.0f - k) + k)) * (NdotL / (NdotL * (1.0f - k) + k));
+}
+
+static void BakeBrdfLut(JobSystem& jobs, std::vector<f32>& lut)
+{
+    const u32 size = IBL_BRDF_LUT_SIZE;
+    lut.resize((size_t)size * size * 2);
+    ParallelFor(jobs, size, [&](u32 y)
+    {
+        const f32 roughness = (y + 0.5f) / size;
+        const f32 alpha = roughness * roughness;
+        for (u32 x = 0; x < size; ++x)
+        {
+            const f32 NdotV = (x + 0.5f) / size;
+            const vec3 v(sqrtf(1.0f - NdotV * NdotV), 0.0f, NdotV);
+
+            f32 scale = 0.0f;
+            f32 bias = 0.0f;
+            for (u32 i = 0; i < IBL_BRDF_SAMPLES; ++i)
+            {
+                const vec3 h = ImportanceSampleGGX(Hammersley(i, IBL_BRDF_SAMPLES), alpha);
+                const f32 VdotH = glm::dot(v, h);
+                const vec3 l = 2.0f * VdotH * h - v;
+                if (l.z <= 0.0f)
+                    continue;
+
+                const f32 visibility = GeometrySmithIBL(NdotV, l.z, roughness) * glm::max(VdotH, 0.0f) / (h.z * NdotV);
+                const f32 fresnel = powf(1.0f - glm::max(VdotH, 0.0f), 5.0f);
+                scale += (1.0f - fresnel) * visibility;
+                bias += fresnel * visibility;
+            }
+            lut[((size_t)y * size + x) * 2 + 0] = scale / IBL_BRDF_SAMPLES;
+            lut[((size_t)y * size + x) * 2 + 1] = bias / IBL_BRDF_SAMPLES;
+        }
+    });
+}
+
+GLuint LoadBrdfLut(JobSystem& jobs)
+{
+    IblCacheHeader header = {};
+    header.magic = IBL_CACHE_MAGIC;
+    header.version = IBL_CACHE_VERSION;
+    header.kind = IblCache_BrdfLut;
+    header.size = IBL_BRDF_LUT_SIZE;
+    header.mipCount = 1;
+    header.floatCount = IBL_BRDF_LUT_SIZE * IBL_BRDF_LUT_SIZE * 2;
+
+    std::vector<f32> lut;
+    MappedFile file;
+    if (MapCacheFile(IBL_BRDF_LUT_PATH, header, file))
+    {
+        const f32* floats = (const f32*)(file.data + sizeof(IblCacheHeader));
+        lut.assign(floats, floats + header.floatCount);
+        UnmapFile(file);
+    }
+    else
+    {
+        BakeBrdfLut(jobs, lut);
+        WriteCacheFile(IBL_BRDF_LUT_PATH, header, lut.data(), (u32)lut.size(), nullptr, 0);
+    }
+
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RG16F, IBL_BRDF_LUT_SIZE, IBL_BRDF_LUT_SIZE);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, IBL_BRDF_LUT_SIZE, IBL_BRDF_LUT_SIZE, GL_RG, GL_FLOAT, lut.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return texture;
+}
@@ -0,0 +1,33 @@
+#ifndef IMAGE_BASED_LIGHTING_H
+#define IMAGE_BASED_LIGHTING_H
+
+#include "Structs.hpp"
+
+// Bump whenever the file layout or the filtering changes
+#define IBL_CACHE_VERSION   1
+#define IBL_CACHE_EXTENSION ".ibl"
+#define IBL_BRDF_LUT_PATH   "BrdfLut" IBL_CACHE_EXTENSION
+
+// Faces are box filtered down to this size before the projection and the
+// prefilter, bigger skyboxes add nothing to a GGX lobe
+#define IBL_SOURCE_SIZE      256
+#define IBL_PREFILTER_SAMPLES 256
+#define IBL_BRDF_SAMPLES      512
+
+// Reads <faces[0]>.ibl when it was written by this version from faces with
+// the same newest write time. Thread safe, does not touch GL.
+bool ReadEnvironmentLightingCache(const std::vector<std::string>& faces, EnvironmentLightingData& data);
+
+// Projects the irradiance on SH9 and prefilters the GGX specular chain from the
+// six decoded RGB8 faces in GL order, faces that failed to load count as
+// black. Runs on the job system and writes the cache. Does not touch GL.
+void BakeEnvironmentLighting(JobSystem& jobs, const std::vector<std::string>& faces, const Image images[6], EnvironmentLightingData& data);
+
+// Immutable RGB16F cube with IBL_SPECULAR_MIPS levels, trilinear filtered
+void UploadEnvironmentLighting(const EnvironmentLightingData& data, EnvironmentLighting& lighting);
+
+// Split sum scale (R) and bias (G) of the GGX BRDF by NdotV (s) and roughness
+// (t) as an RG16F texture. Read from IBL_BRDF_LUT_PATH or baked and written.
+GLuint LoadBrdfLut(JobSystem& jobs);
+
+#endif // IMAGE_BASED_LIGHTING_H
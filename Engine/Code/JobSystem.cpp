@@ -0,0 +1,130 @@
+#include "JobSystem.h"
+#include <atomic>
+
+static void WorkerLoop(JobSystem* jobs)
+{
+    for (;;)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(jobs->mutex);
+            jobs->wake.wait(lock, [jobs] { return jobs->quit || !jobs->jobs.empty(); });
+            if (jobs->jobs.empty())
+                return;
+            job = std::move(jobs->jobs.front());
+            jobs->jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void InitJobSystem(JobSystem& jobs, u32 workerCount)
+{
+    if (workerCount == 0)
+    {
+        const u32 hardwareThreads = std::thread::hardware_concurrency();
+        workerCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+    }
+
+    jobs.quit = false;
+    for (u32 i = 0; i < workerCount; ++i)
+        jobs.workers.emplace_back(WorkerLoop, &jobs);
+}
+
+void ShutdownJobSystem(JobSystem& jobs)
+{
+    {
+        std::lock_guard<std::mutex> lock(jobs.mutex);
+        jobs.quit = true;
+    }
+    jobs.wake.notify_all();
+
+    // Workers drain the queue before leaving
+    for (std::thread& worker : jobs.workers)
+        worker.join();
+    jobs.workers.clear();
+}
+
+static bool TryPopJob(JobSystem& jobs, std::function<void()>& job)
+{
+    std::lock_guard<std::mutex> lock(jobs.mutex);
+    if (jobs.jobs.empty())
+        return false;
+    job = std::move(jobs.jobs.front());
+    jobs.jobs.pop_front();
+    return true;
+}
+
+void SubmitJob(JobSystem& jobs, std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(jobs.mutex);
+        jobs.jobs.push_back(std::move(job));
+    }
+    jobs.wake.notify_one();
+}
+
+// Shared by the caller and the helper jobs of one ParallelFor. It lives on the
+// caller's stack, so the caller waits for every helper to leave it.
+struct ParallelForState
+{
+    std::atomic<u32> next;
+    u32 count;
+    const std::function<void(u32)>* function;
+    std::mutex mutex;
+    std::condition_variable done;
+    u32 activeHelpers;
+};
+
+static void RunParallelFor(ParallelForState& state)
+{
+    for (u32 i = state.next++; i < state.count; i = state.next++)
+        (*state.function)(i);
+}
+
+void ParallelFor(JobSystem& jobs, u32 count, const std::function<void(u32)>& function)
+{
+    if (count == 0)
+        return;
+
+    ParallelForState state;
+    state.next = 0;
+    state.count = count;
+    state.function = &function;
+
+    // The caller takes a share too, so it never needs more helpers than count - 1
+    const u32 helpers = glm::min((u32)jobs.workers.size(), count - 1);
+    state.activeHelpers = helpers;
+    for (u32 i = 0; i < helpers; ++i)
+    {
+        SubmitJob(jobs, [&state]
+        {
+            RunParallelFor(state);
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (--state.activeHelpers == 0)
+                state.done.notify_one();
+        });
+    }
+
+    RunParallelFor(state);
+
+    // ParallelFor may be nested inside a job. Waiting threads run queued jobs
+    // so helpers stuck behind them in the queue still get a thread. Once the
+    // queue is empty every helper has been picked up and blocking is safe.
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.activeHelpers == 0)
+                return;
+        }
+
+        std::function<void()> job;
+        if (!TryPopJob(jobs, job))
+            break;
+        job();
+    }
+
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.done.wait(lock, [&state] { return state.activeHelpers == 0; });
+}
@@ -0,0 +1,17 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include "Structs.hpp"
+
+// workerCount 0 uses one worker per hardware thread minus the main thread
+void InitJobSystem(JobSystem& jobs, u32 workerCount = 0);
+void ShutdownJobSystem(JobSystem& jobs);
+
+// Queues a job for any worker, it runs asynchronously
+void SubmitJob(JobSystem& jobs, std::function<void()> job);
+
+// Runs function(i) for i in [0, count) on the workers and the calling
+// thread, and returns when every call has finished. Can be called from jobs.
+void ParallelFor(JobSystem& jobs, u32 count, const std::function<void(u32)>& function);
+
+#endif // JOB_SYSTEM_H
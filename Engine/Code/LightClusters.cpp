@@ -0,0 +1,204 @@
+#include "LightClusters.h"
+#include "platform.h"
+
+// Upper bound of the ambient + diffuse + specular terms of CalcPointLight
+// before attenuation, relative to the light color
+#define LIGHT_PEAK_RESPONSE 5.0f
+
+// Header of the ClusterGrid buffer in Render_Quad.glsl and FORWARD.glsl (std430)
+struct ClusterGridHeader
+{
+    glm::mat4  view;
+    glm::uvec4 dims;   // grid x, y, z and directional light count (first indices of the list)
+    vec4       params; // tile width, tile height (pixels), slice scale, slice bias
+};
+
+void InitLightClusters(LightClusters& clusters)
+{
+    glGenBuffers(1, &clusters.gridBuffer);
+    glGenBuffers(1, &clusters.indexBuffer);
+
+    clusters.clusterRanges.resize(CLUSTER_COUNT);
+}
+
+void DestroyLightClusters(LightClusters& clusters)
+{
+    glDeleteBuffers(1, &clusters.gridBuffer);
+    glDeleteBuffers(1, &clusters.indexBuffer);
+    clusters.gridBuffer = 0;
+    clusters.indexBuffer = 0;
+}
+
+f32 ComputeLightInfluenceRadius(const vec3& radiance)
+{
+    const f32 peak = glm::max(radiance.r, glm::max(radiance.g, radiance.b)) * LIGHT_PEAK_RESPONSE;
+    if (peak <= LIGHT_INFLUENCE_THRESHOLD)
+        return 0.0f;
+
+    // peak / (1 + l*d + q*d^2) = threshold  ->  q*d^2 + l*d + (1 - peak/threshold) = 0
+    const f32 l = LIGHT_ATTENUATION_LINEAR;
+    const f32 q = LIGHT_ATTENUATION_QUADRATIC;
+    const f32 c = 1.0f - peak / LIGHT_INFLUENCE_THRESHOLD;
+    return (-l + sqrtf(l * l - 4.0f * q * c)) / (2.0f * q);
+}
+
+static u32 GetSlice(f32 viewDepth, f32 sliceScale, f32 sliceBias)
+{
+    i32 slice = (i32)floorf(logf(viewDepth) * sliceScale + sliceBias);
+    return (u32)glm::clamp(slice, 0, CLUSTER_GRID_Z - 1);
+}
+
+static i32 GetTile(f32 ndc, i32 tileCount)
+{
+    i32 tile = (i32)floorf((ndc * 0.5f + 0.5f) * (f32)tileCount);
+    return glm::clamp(tile, 0, tileCount - 1);
+}
+
+// Closest point of the froxel box to the sphere center, both in view space
+// with depth measured as positive distance in front of the camera
+static bool SphereOverlapsCluster(const vec3& center, f32 radius,
+                                  f32 minNdcX, f32 maxNdcX, f32 minNdcY, f32 maxNdcY,
+                                  f32 nearDepth, f32 farDepth, f32 tanHalfX, f32 tanHalfY)
+{
+    const f32 minX = glm::min(minNdcX * tanHalfX * nearDepth, minNdcX * tanHalfX * farDepth);
+    const f32 maxX = glm::max(maxNdcX * tanHalfX * nearDepth, maxNdcX * tanHalfX * farDepth);
+    const f32 minY = glm::min(minNdcY * tanHalfY * nearDepth, minNdcY * tanHalfY * farDepth);
+    const f32 maxY = glm::max(maxNdcY * tanHalfY * nearDepth, maxNdcY * tanHalfY * farDepth);
+
+    const vec3 closest = glm::clamp(center, vec3(minX, minY, nearDepth), vec3(maxX, maxY, farDepth));
+    const vec3 offset = closest - center;
+    return glm::dot(offset, offset) <= radius * radius;
+}
+
+void BuildLightClusters(App* app)
+{
+    LightClusters& clusters = app->lightClusters;
+    const Camera& camera = app->worldCamera;
+    const glm::mat4& proj = camera.projectionMatrix;
+
+    // Recover the frustum parameters from the projection so the grid always
+    // matches whatever near/far the camera is using
+    const f32 nearPlane = proj[3][2] / (proj[2][2] - 1.0f);
+    const f32 farPlane = proj[3][2] / (proj[2][2] + 1.0f);
+    const f32 tanHalfX = 1.0f / proj[0][0];
+    const f32 tanHalfY = 1.0f / proj[1][1];
+    const f32 logDepthRange = logf(farPlane / nearPlane);
+    const f32 sliceScale = (f32)CLUSTER_GRID_Z / logDepthRange;
+    const f32 sliceBias = -(f32)CLUSTER_GRID_Z * logf(nearPlane) / logDepthRange;
+
+    const std::vector<GpuLight>& lights = app->lightStorage.mirror;
+    const u32 mode = (u32)app->pgaType;
+
+    // Directional lights of the current mode lead the index list
+    clusters.lightIndices.clear();
+    clusters.pointLights = 0;
+    for (u32 lightIdx = 0; lightIdx < lights.size(); ++lightIdx)
+    {
+        if (lights[lightIdx].mode == mode && lights[lightIdx].type == (u32)LightType::Light_Directional)
+            clusters.lightIndices.push_back(lightIdx);
+    }
+    clusters.directionalLights = (u32)clusters.lightIndices.size();
+
+    // Find the clusters overlapped by each point light
+    clusters.refs.clear();
+    for (u32 lightIdx = 0; lightIdx < lights.size(); ++lightIdx)
+    {
+        const GpuLight& light = lights[lightIdx];
+        if (light.mode != mode || light.type != (u32)LightType::Light_Point)
+            continue;
+
+        clusters.pointLights++;
+        if (light.radius <= 0.0f)
+            continue;
+
+        vec3 center = vec3(camera.viewMatrix * vec4(light.position, 1.0f));
+        center.z = -center.z;
+        const f32 radius = light.radius;
+
+        if (center.z + radius < nearPlane || center.z - radius > farPlane)
+            continue;
+
+        const f32 minDepth = glm::max(center.z - radius, nearPlane);
+        const f32 maxDepth = glm::min(center.z + radius, farPlane);
+
+        // x / z over the box [x - r, x + r] x [minDepth, maxDepth] has its extremes at the corners
+        const f32 minNdcX = glm::min((center.x - radius) / minDepth, (center.x - radius) / maxDepth) / tanHalfX;
+        const f32 maxNdcX = glm::max((center.x + radius) / minDepth, (center.x + radius) / maxDepth) / tanHalfX;
+        const f32 minNdcY = glm::min((center.y - radius) / minDepth, (center.y - radius) / maxDepth) / tanHalfY;
+        const f32 maxNdcY = glm::max((center.y + radius) / minDepth, (center.y + radius) / maxDepth) / tanHalfY;
+        if (minNdcX > 1.0f || maxNdcX < -1.0f || minNdcY > 1.0f || maxNdcY < -1.0f)
+            continue;
+
+        const i32 x0 = GetTile(minNdcX, CLUSTER_GRID_X), x1 = GetTile(maxNdcX, CLUSTER_GRID_X);
+        const i32 y0 = GetTile(minNdcY, CLUSTER_GRID_Y), y1 = GetTile(maxNdcY, CLUSTER_GRID_Y);
+        const u32 z0 = GetSlice(minDepth, sliceScale, sliceBias), z1 = GetSlice(maxDepth, sliceScale, sliceBias);
+
+        for (u32 z = z0; z <= z1; ++z)
+        {
+            const f32 sliceNear = nearPlane * powf(farPlane / nearPlane, (f32)z / CLUSTER_GRID_Z);
+            const f32 sliceFar = nearPlane * powf(farPlane / nearPlane, (f32)(z + 1) / CLUSTER_GRID_Z);
+            for (i32 y = y0; y <= y1; ++y)
+            {
+                const f32 tileMinY = -1.0f + 2.0f * y / CLUSTER_GRID_Y;
+                const f32 tileMaxY = -1.0f + 2.0f * (y + 1) / CLUSTER_GRID_Y;
+                for (i32 x = x0; x <= x1; ++x)
+                {
+                    const f32 tileMinX = -1.0f + 2.0f * x / CLUSTER_GRID_X;
+                    const f32 tileMaxX = -1.0f + 2.0f * (x + 1) / CLUSTER_GRID_X;
+                    if (!SphereOverlapsCluster(center, radius, tileMinX, tileMaxX, tileMinY, tileMaxY,
+                                               sliceNear, sliceFar, tanHalfX, tanHalfY))
+                        continue;
+
+                    const u32 cluster = x + y * CLUSTER_GRID_X + z * CLUSTER_GRID_X * CLUSTER_GRID_Y;
+                    clusters.refs.push_back({ cluster, lightIdx });
+                }
+            }
+        }
+    }
+
+    // Counting sort of the references into per-cluster (offset, count) ranges
+    clusters.clusterRanges.assign(CLUSTER_COUNT, glm::uvec2(0));
+    for (const ClusterLightRef& ref : clusters.refs)
+        clusters.clusterRanges[ref.cluster].y++;
+
+    u32 offset = clusters.directionalLights;
+    clusters.maxLightsPerCluster = 0;
+    for (glm::uvec2& range : clusters.clusterRanges)
+    {
+        clusters.maxLightsPerCluster = glm::max(clusters.maxLightsPerCluster, range.y);
+        range.x = offset;
+        offset += range.y;
+        range.y = 0;
+    }
+
+    clusters.lightIndices.resize(clusters.directionalLights + clusters.refs.size());
+    for (const ClusterLightRef& ref : clusters.refs)
+    {
+        glm::uvec2& range = clusters.clusterRanges[ref.cluster];
+        clusters.lightIndices[range.x + range.y++] = ref.light;
+    }
+
+    // Upload. Buffers are orphaned every frame and never empty so the bindings stay valid.
+    ClusterGridHeader header;
+    header.view = camera.viewMatrix;
+    header.dims = glm::uvec4(CLUSTER_GRID_X, CLUSTER_GRID_Y, CLUSTER_GRID_Z, clusters.directionalLights);
+    header.params = vec4((f32)app->displaySize.x / CLUSTER_GRID_X, (f32)app->displaySize.y / CLUSTER_GRID_Y, sliceScale, sliceBias);
+
+    const GLsizeiptr rangesSize = CLUSTER_COUNT * sizeof(glm::uvec2);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.gridBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(header) + rangesSize, NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(header), &header);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(header), rangesSize, clusters.clusterRanges.data());
+
+    const u32 emptyIndex = 0;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusters.indexBuffer);
+    if (clusters.lightIndices.empty())
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32), &emptyIndex, GL_STREAM_DRAW);
+    else
+        glBufferData(GL_SHADER_STORAGE_BUFFER, clusters.lightIndices.size() * sizeof(u32), clusters.lightIndices.data(), GL_STREAM_DRAW);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_GRID_SSBO_BINDING, clusters.gridBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_INDICES_SSBO_BINDING, clusters.indexBuffer);
+}
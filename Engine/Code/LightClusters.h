@@ -0,0 +1,26 @@
+#ifndef LIGHT_CLUSTERS_H
+#define LIGHT_CLUSTERS_H
+
+#include "Structs.hpp"
+#include <glad/glad.h>
+
+// Attenuation used by the lighting shaders: 1 / (1 + LINEAR * d + QUADRATIC * d^2)
+#define LIGHT_ATTENUATION_LINEAR    0.09f
+#define LIGHT_ATTENUATION_QUADRATIC 0.032f
+// A light stops being binned where its contribution falls below this value
+#define LIGHT_INFLUENCE_THRESHOLD   (1.0f / 256.0f)
+
+void InitLightClusters(LightClusters& clusters);
+void DestroyLightClusters(LightClusters& clusters);
+
+// Distance at which a light of the given color * intensity drops below
+// LIGHT_INFLUENCE_THRESHOLD. Returns 0 for lights too dim to matter.
+f32 ComputeLightInfluenceRadius(const vec3& radiance);
+
+// Bins the point lights of the current mode into the froxel grid of the
+// current camera and uploads the grid and index buffers to their shader
+// storage bindings. Indices refer to the light buffer (see Lights.h), the
+// directional lights of the mode are listed first.
+void BuildLightClusters(App* app);
+
+#endif // LIGHT_CLUSTERS_H
@@ -0,0 +1,134 @@
+#include "Lights.h"
+#include "LightClusters.h"
+#include "platform.h"
+#include <algorithm>
+
+static GpuLight PackLight(const Light& light)
+{
+    GpuLight gpuLight;
+    gpuLight.color = light.color * light.intensity;
+    gpuLight.type = (u32)light.type;
+    gpuLight.direction = light.direction;
+    gpuLight.radius = light.type == LightType::Light_Point ? ComputeLightInfluenceRadius(gpuLight.color) : 0.0f;
+    gpuLight.position = light.position;
+    gpuLight.mode = (u32)light.mode;
+    return gpuLight;
+}
+
+void InitLightStorage(LightStorage& storage)
+{
+    storage.capacity = LIGHT_STORAGE_MIN_CAPACITY;
+    glGenBuffers(1, &storage.buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, storage.buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, storage.capacity * sizeof(GpuLight), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void DestroyLightStorage(LightStorage& storage)
+{
+    glDeleteBuffers(1, &storage.buffer);
+    storage.buffer = 0;
+    storage.capacity = 0;
+}
+
+void MarkLightDirty(App* app, u32 lightIndex)
+{
+    LightStorage& storage = app->lightStorage;
+    ASSERT(lightIndex < storage.mirror.size(), "Light index out of range");
+
+    storage.mirror[lightIndex] = PackLight(app->lights[lightIndex]);
+    if (!storage.dirtyFlags[lightIndex])
+    {
+        storage.dirtyFlags[lightIndex] = 1;
+        storage.dirtyLights.push_back(lightIndex);
+    }
+}
+
+void AddLight(App* app, const Light& light)
+{
+    LightStorage& storage = app->lightStorage;
+    app->lights.push_back(light);
+    storage.mirror.push_back(GpuLight{});
+    storage.dirtyFlags.push_back(0);
+    MarkLightDirty(app, (u32)app->lights.size() - 1u);
+}
+
+void RemoveLights(App* app, u32 first, u32 count)
+{
+    LightStorage& storage = app->lightStorage;
+    ASSERT(first + count <= app->lights.size(), "Removing lights out of range");
+
+    app->lights.erase(app->lights.begin() + first, app->lights.begin() + first + count);
+    storage.mirror.erase(storage.mirror.begin() + first, storage.mirror.begin() + first + count);
+    storage.dirtyFlags.erase(storage.dirtyFlags.begin() + first, storage.dirtyFlags.begin() + first + count);
+
+    // The dirty list holds indices from before the erase. Rebuild it from the
+    // flags in front of the gap, everything after the gap moved down and has
+    // to be uploaded again.
+    storage.dirtyLights.clear();
+    for (u32 i = 0; i < first; ++i)
+    {
+        if (storage.dirtyFlags[i])
+            storage.dirtyLights.push_back(i);
+    }
+    for (u32 i = first; i < storage.mirror.size(); ++i)
+    {
+        storage.dirtyFlags[i] = 1;
+        storage.dirtyLights.push_back(i);
+    }
+}
+
+void UploadDirtyLights(App* app)
+{
+    LightStorage& storage = app->lightStorage;
+    const u32 lightCount = (u32)storage.mirror.size();
+
+    storage.lastUploadLights = 0;
+    storage.lastUploadRanges = 0;
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, storage.buffer);
+
+    if (lightCount > storage.capacity)
+    {
+        // Grow geometrically and upload everything in one go
+        while (storage.capacity < lightCount)
+            storage.capacity *= 2;
+        glBufferData(GL_SHADER_STORAGE_BUFFER, storage.capacity * sizeof(GpuLight), NULL, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, lightCount * sizeof(GpuLight), storage.mirror.data());
+        storage.lastUploadLights = lightCount;
+        storage.lastUploadRanges = 1;
+    }
+    else if (!storage.dirtyLights.empty())
+    {
+        std::sort(storage.dirtyLights.begin(), storage.dirtyLights.end());
+
+        u32 i = 0;
+        const u32 dirtyCount = (u32)storage.dirtyLights.size();
+        while (i < dirtyCount && storage.dirtyLights[i] < lightCount)
+        {
+            const u32 first = storage.dirtyLights[i];
+            u32 last = first;
+            while (i + 1 < dirtyCount && storage.dirtyLights[i + 1] == last + 1 && storage.dirtyLights[i + 1] < lightCount)
+            {
+                ++i;
+                ++last;
+            }
+            ++i;
+
+            const u32 count = last - first + 1;
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(GpuLight), count * sizeof(GpuLight), &storage.mirror[first]);
+            storage.lastUploadLights += count;
+            storage.lastUploadRanges++;
+        }
+    }
+
+    for (u32 index : storage.dirtyLights)
+    {
+        if (index < lightCount)
+            storage.dirtyFlags[index] = 0;
+    }
+    storage.dirtyLights.clear();
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHTS_SSBO_BINDING, storage.buffer);
+}
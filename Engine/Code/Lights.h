@@ -0,0 +1,22 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "Structs.hpp"
+#include <glad/glad.h>
+
+#define LIGHT_STORAGE_MIN_CAPACITY 64
+
+void InitLightStorage(LightStorage& storage);
+void DestroyLightStorage(LightStorage& storage);
+
+// app->lights must only grow, shrink or change through these so the mirror
+// stays in sync. Editing a light is O(1): it repacks one entry and flags it.
+void AddLight(App* app, const Light& light);
+void RemoveLights(App* app, u32 first, u32 count);
+void MarkLightDirty(App* app, u32 lightIndex);
+
+// Uploads the dirty entries as contiguous ranges and binds the buffer to
+// LIGHTS_SSBO_BINDING. Call it once per frame.
+void UploadDirtyLights(App* app);
+
+#endif // LIGHTS_H
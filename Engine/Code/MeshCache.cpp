@@ -0,0 +1,422 @@
+#include "MeshCache.h"
+#include "platform.h"
+#include <string.h>
+
+#define MESH_CACHE_MAGIC          0x4853454Du // "MESH"
+#define MESH_CACHE_MAX_ATTRIBUTES 8
+#define MESH_CACHE_NO_STRING      UINT32_MAX
+#define MESH_CACHE_DATA_ALIGNMENT 16
+
+// File layout: header | submeshes | materials | meshlets | string table | vertex data | index data.
+// The vertex and index blocks are exact copies of the mesh's GL buffers.
+struct MeshCacheHeader
+{
+    u32 magic;
+    u32 version;
+    u64 sourceHash;
+    u32 importFlags;
+    u32 submeshCount;
+    u32 materialCount;
+    u32 meshletCount;
+    u32 stringBytes;
+    u64 vertexDataOffset;
+    u64 vertexBytes;
+    u64 indexDataOffset;
+    u64 indexBytes;
+    Aabb aabb;
+    BoundingSphere sphere;
+    vec3 positionScale;
+    vec3 positionOffset;
+};
+
+struct MeshCacheSubmesh
+{
+    VertexBufferAttribute attributes[MESH_CACHE_MAX_ATTRIBUTES];
+    u32 attributeCount;
+    u32 stride;
+    u32 materialIdx; // relative to the first material of the model
+    u32 vertexOffset;
+    u32 vertexBytes;
+    u32 indexOffset;
+    u32 indexCount;  // full detail level
+    u32 indexBytes;  // every level
+    u32 firstMeshlet;
+    u32 meshletCount;
+    u32 lodCount;
+    SubmeshLod lods[MESH_MAX_LODS];
+    Aabb aabb;
+    BoundingSphere sphere;
+};
+
+// Texture slots are stored by path and resolved by the upload stage, so
+// their indices come out the same as after an import
+struct MeshCacheMaterial
+{
+    vec3 albedo;
+    vec3 emissive;
+    f32 smoothness;
+    u32 name;
+    u32 albedoTexture;
+    u32 normalsTexture;
+    u32 heightTexture;
+};
+
+static u64 HashBytes(u64 hash, const u8* data, u64 size)
+{
+    for (u64 i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+static bool HashFile(const char* filepath, u64& hash)
+{
+    MappedFile file = MapFileReadOnly(filepath);
+    if (!file.data)
+        return false;
+
+    hash = HashBytes(hash, file.data, file.size);
+    UnmapFile(file);
+    return true;
+}
+
+static bool EndsWith(const std::string& str, const char* suffix)
+{
+    const size_t suffixLen = strlen(suffix);
+    return str.size() >= suffixLen && str.compare(str.size() - suffixLen, suffixLen, suffix) == 0;
+}
+
+u64 ComputeModelSourceHash(const char* filename)
+{
+    MappedFile source = MapFileReadOnly(filename);
+    if (!source.data)
+        return 0;
+
+    u64 hash = HashBytes(0xCBF29CE484222325ull, source.data, source.size);
+
+    // Materials are part of the cache, so the .mtl files count as source too
+    if (EndsWith(filename, ".obj"))
+    {
+        const std::string path = filename;
+        const size_t slash = path.find_last_of("/\\");
+        const std::string directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+        const char* text = (const char*)source.data;
+        const char* end = text + source.size;
+        for (const char* line = text; line < end; )
+        {
+            const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+            if (!lineEnd)
+                lineEnd = end;
+
+            if (lineEnd - line > 7 && strncmp(line, "mtllib", 6) == 0 && (line[6] == ' ' || line[6] == '\t'))
+            {
+                const char* nameBegin = line + 7;
+                const char* nameEnd = lineEnd;
+                while (nameBegin < nameEnd && (*nameBegin == ' ' || *nameBegin == '\t'))
+                    nameBegin++;
+                while (nameEnd > nameBegin && (nameEnd[-1] == '\r' || nameEnd[-1] == ' ' || nameEnd[-1] == '\t'))
+                    nameEnd--;
+
+                // A missing library still changes the hash, so adding it later invalidates the cache
+                const std::string library = directory + std::string(nameBegin, nameEnd);
+                if (!HashFile(library.c_str(), hash))
+                    hash = HashBytes(hash, (const u8*)library.c_str(), library.size());
+            }
+            line = lineEnd + 1;
+        }
+    }
+
+    UnmapFile(source);
+    return hash;
+}
+
+static std::string GetCachePath(const char* filename)
+{
+    return std::string(filename) + MESH_CACHE_EXTENSION;
+}
+
+static u64 AlignOffset(u64 offset)
+{
+    return (offset + MESH_CACHE_DATA_ALIGNMENT - 1) & ~(u64)(MESH_CACHE_DATA_ALIGNMENT - 1);
+}
+
+static bool IsValidString(u32 offset, u32 stringBytes)
+{
+    return offset == MESH_CACHE_NO_STRING || offset < stringBytes;
+}
+
+static bool ValidateMeshCache(const MappedFile& file, u64 sourceHash, u32 importFlags)
+{
+    if (file.size < sizeof(MeshCacheHeader))
+        return false;
+
+    const MeshCacheHeader* header = (const MeshCacheHeader*)file.data;
+    if (header->magic != MESH_CACHE_MAGIC || header->version != MESH_CACHE_VERSION ||
+        header->sourceHash != sourceHash || header->importFlags != importFlags)
+        return false;
+
+    const u64 tablesEnd = sizeof(MeshCacheHeader) +
+        (u64)header->submeshCount * sizeof(MeshCacheSubmesh) +
+        (u64)header->materialCount * sizeof(MeshCacheMaterial) +
+        (u64)header->meshletCount * sizeof(Meshlet) +
+        header->stringBytes;
+    if (header->vertexDataOffset < tablesEnd ||
+        header->indexDataOffset < header->vertexDataOffset + header->vertexBytes ||
+        header->indexDataOffset + header->indexBytes != file.size)
+        return false;
+
+    const MeshCacheSubmesh* submeshes = (const MeshCacheSubmesh*)(header + 1);
+    const MeshCacheMaterial* materials = (const MeshCacheMaterial*)(submeshes + header->submeshCount);
+    const Meshlet* meshlets = (const Meshlet*)(materials + header->materialCount);
+    const char* strings = (const char*)(meshlets + header->meshletCount);
+    if (header->stringBytes > 0 && strings[header->stringBytes - 1] != '\0')
+        return false;
+
+    for (u32 i = 0; i < header->submeshCount; ++i)
+    {
+        const MeshCacheSubmesh& submesh = submeshes[i];
+        if (submesh.attributeCount > MESH_CACHE_MAX_ATTRIBUTES ||
+            submesh.materialIdx >= header->materialCount ||
+            (u64)submesh.vertexOffset + submesh.vertexBytes > header->vertexBytes ||
+            (u64)submesh.indexOffset + submesh.indexBytes > header->indexBytes ||
+            (u64)submesh.indexCount * sizeof(u32) > submesh.indexBytes ||
+            (u64)submesh.firstMeshlet + submesh.meshletCount > header->meshletCount ||
+            submesh.lodCount > MESH_MAX_LODS)
+            return false;
+
+        for (u32 j = 0; j < submesh.lodCount; ++j)
+        {
+            const SubmeshLod& lod = submesh.lods[j];
+            if (((u64)lod.firstIndex + lod.indexCount) * sizeof(u32) > submesh.indexBytes)
+                return false;
+        }
+
+        for (u32 j = 0; j < submesh.meshletCount; ++j)
+        {
+            const Meshlet& meshlet = meshlets[submesh.firstMeshlet + j];
+            if ((u64)meshlet.firstIndex + meshlet.indexCount > submesh.indexCount)
+                return false;
+        }
+    }
+
+    for (u32 i = 0; i < header->materialCount; ++i)
+    {
+        const MeshCacheMaterial& material = materials[i];
+        if (!IsValidString(material.name, header->stringBytes) ||
+            !IsValidString(material.albedoTexture, header->stringBytes) ||
+            !IsValidString(material.normalsTexture, header->stringBytes) ||
+            !IsValidString(material.heightTexture, header->stringBytes))
+            return false;
+    }
+
+    return true;
+}
+
+static std::string GetCachedString(const char* strings, u32 offset)
+{
+    return offset == MESH_CACHE_NO_STRING ? std::string() : std::string(strings + offset);
+}
+
+bool ReadMeshCache(ImportedModel& imported, u32 importFlags)
+{
+    if (imported.sourceHash == 0)
+        return false;
+
+    const std::string cachePath = GetCachePath(imported.filename.c_str());
+    MappedFile file = MapFileReadOnly(cachePath.c_str());
+    if (!file.data)
+        return false;
+
+    if (!ValidateMeshCache(file, imported.sourceHash, importFlags))
+    {
+        ILOG("Mesh cache %s is stale, importing %s", cachePath.c_str(), imported.filename.c_str());
+        UnmapFile(file);
+        return false;
+    }
+
+    const MeshCacheHeader* header = (const MeshCacheHeader*)file.data;
+    const MeshCacheSubmesh* cachedSubmeshes = (const MeshCacheSubmesh*)(header + 1);
+    const MeshCacheMaterial* cachedMaterials = (const MeshCacheMaterial*)(cachedSubmeshes + header->submeshCount);
+    const Meshlet* cachedMeshlets = (const Meshlet*)(cachedMaterials + header->materialCount);
+    const char* strings = (const char*)(cachedMeshlets + header->meshletCount);
+
+    imported.materials.resize(header->materialCount);
+    for (u32 i = 0; i < header->materialCount; ++i)
+    {
+        const MeshCacheMaterial& cached = cachedMaterials[i];
+        MaterialDesc& material = imported.materials[i];
+        material.name = GetCachedString(strings, cached.name);
+        material.albedo = cached.albedo;
+        material.emissive = cached.emissive;
+        material.smoothness = cached.smoothness;
+        material.albedoTexture = GetCachedString(strings, cached.albedoTexture);
+        material.normalsTexture = GetCachedString(strings, cached.normalsTexture);
+        material.heightTexture = GetCachedString(strings, cached.heightTexture);
+    }
+
+    Mesh& mesh = imported.mesh;
+    mesh.submeshes.resize(header->submeshCount);
+    imported.submeshMaterials.resize(header->submeshCount);
+    for (u32 i = 0; i < header->submeshCount; ++i)
+    {
+        const MeshCacheSubmesh& cached = cachedSubmeshes[i];
+        Submesh& submesh = mesh.submeshes[i];
+        submesh.vertexBufferLayout.attributes.assign(cached.attributes, cached.attributes + cached.attributeCount);
+        submesh.vertexBufferLayout.stride = (u8)cached.stride;
+        submesh.aabb = cached.aabb;
+        submesh.sphere = cached.sphere;
+        submesh.vertexOffset = cached.vertexOffset;
+        submesh.indexOffset = cached.indexOffset;
+        submesh.indexCount = cached.indexCount;
+        submesh.meshlets.assign(cachedMeshlets + cached.firstMeshlet, cachedMeshlets + cached.firstMeshlet + cached.meshletCount);
+        submesh.lods.assign(cached.lods, cached.lods + cached.lodCount);
+        imported.submeshMaterials[i] = cached.materialIdx;
+    }
+    mesh.aabb = header->aabb;
+    mesh.sphere = header->sphere;
+    mesh.positionScale = header->positionScale;
+    mesh.positionOffset = header->positionOffset;
+
+    // The pages are only touched when the upload copies them into the buffers
+    imported.cacheFile = file;
+    imported.cachedVertices = file.data + header->vertexDataOffset;
+    imported.cachedVertexBytes = header->vertexBytes;
+    imported.cachedIndices = file.data + header->indexDataOffset;
+    imported.cachedIndexBytes = header->indexBytes;
+    return true;
+}
+
+static u32 AddString(std::vector<char>& strings, const std::string& str)
+{
+    if (str.empty())
+        return MESH_CACHE_NO_STRING;
+
+    u32 offset = (u32)strings.size();
+    strings.insert(strings.end(), str.begin(), str.end());
+    strings.push_back('\0');
+    return offset;
+}
+
+static void WritePadding(FILE* file, u64 from, u64 to)
+{
+    static const u8 zeros[MESH_CACHE_DATA_ALIGNMENT] = {};
+    if (to > from)
+        fwrite(zeros, 1, (size_t)(to - from), file);
+}
+
+void WriteMeshCache(const ImportedModel& imported, u32 importFlags)
+{
+    if (imported.sourceHash == 0)
+        return;
+
+    const Mesh& mesh = imported.mesh;
+    const char* filename = imported.filename.c_str();
+
+    std::vector<MeshCacheSubmesh> submeshes(mesh.submeshes.size());
+    std::vector<Meshlet> meshlets;
+    u64 vertexBytes = 0;
+    u64 indexBytes = 0;
+    for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+    {
+        const Submesh& submesh = mesh.submeshes[i];
+        const VertexBufferLayout& layout = submesh.vertexBufferLayout;
+        if (layout.attributes.size() > MESH_CACHE_MAX_ATTRIBUTES)
+        {
+            ELOG("Mesh cache not written for %s: too many vertex attributes", filename);
+            return;
+        }
+
+        MeshCacheSubmesh& cached = submeshes[i];
+        memset((void*)&cached, 0, sizeof(cached));
+        memcpy(cached.attributes, layout.attributes.data(), layout.attributes.size() * sizeof(VertexBufferAttribute));
+        cached.attributeCount = (u32)layout.attributes.size();
+        cached.stride = layout.stride;
+        cached.materialIdx = imported.submeshMaterials[i];
+        cached.vertexOffset = submesh.vertexOffset;
+        cached.vertexBytes = (u32)submesh.vertexData.size();
+        cached.indexOffset = submesh.indexOffset;
+        cached.indexCount = submesh.indexCount;
+        cached.indexBytes = (u32)(submesh.indices.size() * sizeof(u32));
+        cached.firstMeshlet = (u32)meshlets.size();
+        cached.meshletCount = (u32)submesh.meshlets.size();
+        meshlets.insert(meshlets.end(), submesh.meshlets.begin(), submesh.meshlets.end());
+        cached.lodCount = (u32)glm::min(submesh.lods.size(), (size_t)MESH_MAX_LODS);
+        memcpy(cached.lods, submesh.lods.data(), cached.lodCount * sizeof(SubmeshLod));
+        cached.aabb = submesh.aabb;
+        cached.sphere = submesh.sphere;
+
+        vertexBytes += cached.vertexBytes;
+        indexBytes += cached.indexBytes;
+    }
+
+    std::vector<char> strings;
+    std::vector<MeshCacheMaterial> materials;
+    for (const MaterialDesc& material : imported.materials)
+    {
+        MeshCacheMaterial cached = {};
+        cached.albedo = material.albedo;
+        cached.emissive = material.emissive;
+        cached.smoothness = material.smoothness;
+        cached.name = AddString(strings, material.name);
+        cached.albedoTexture = AddString(strings, material.albedoTexture);
+        cached.normalsTexture = AddString(strings, material.normalsTexture);
+        cached.heightTexture = AddString(strings, material.heightTexture);
+        materials.push_back(cached);
+    }
+    MeshCacheHeader header = {};
+    header.magic = MESH_CACHE_MAGIC;
+    header.version = MESH_CACHE_VERSION;
+    header.sourceHash = imported.sourceHash;
+    header.importFlags = importFlags;
+    header.submeshCount = (u32)submeshes.size();
+    header.materialCount = (u32)materials.size();
+    header.meshletCount = (u32)meshlets.size();
+    header.stringBytes = (u32)strings.size();
+    header.vertexBytes = vertexBytes;
+    header.indexBytes = indexBytes;
+    header.aabb = mesh.aabb;
+    header.sphere = mesh.sphere;
+    header.positionScale = mesh.positionScale;
+    header.positionOffset = mesh.positionOffset;
+
+    const u64 tablesEnd = sizeof(header) +
+        submeshes.size() * sizeof(MeshCacheSubmesh) +
+        materials.size() * sizeof(MeshCacheMaterial) +
+        meshlets.size() * sizeof(Meshlet) +
+        strings.size();
+    header.vertexDataOffset = AlignOffset(tablesEnd);
+    header.indexDataOffset = AlignOffset(header.vertexDataOffset + vertexBytes);
+
+    const std::string cachePath = GetCachePath(filename);
+    FILE* file = fopen(cachePath.c_str(), "wb");
+    if (!file)
+    {
+        ELOG("fopen() failed writing mesh cache %s", cachePath.c_str());
+        return;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(submeshes.data(), sizeof(MeshCacheSubmesh), submeshes.size(), file);
+    fwrite(materials.data(), sizeof(MeshCacheMaterial), materials.size(), file);
+    fwrite(meshlets.data(), sizeof(Meshlet), meshlets.size(), file);
+    fwrite(strings.data(), 1, strings.size(), file);
+    WritePadding(file, tablesEnd, header.vertexDataOffset);
+
+    // Submeshes were laid out back to back in the vertex and index buffers
+    for (const Submesh& submesh : mesh.submeshes)
+        fwrite(submesh.vertexData.data(), 1, submesh.vertexData.size(), file);
+    WritePadding(file, header.vertexDataOffset + vertexBytes, header.indexDataOffset);
+    for (const Submesh& submesh : mesh.submeshes)
+        fwrite(submesh.indices.data(), sizeof(u32), submesh.indices.size(), file);
+
+    const bool failed = ferror(file) != 0;
+    fclose(file);
+    if (failed)
+    {
+        ELOG("Error writing mesh cache %s", cachePath.c_str());
+        remove(cachePath.c_str());
+    }
+}
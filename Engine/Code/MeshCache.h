@@ -0,0 +1,23 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "Structs.hpp"
+
+// Bump whenever the file layout or the processing done before writing changes
+#define MESH_CACHE_VERSION    7
+#define MESH_CACHE_EXTENSION  ".meshcache"
+
+// 64-bit FNV-1a of the source file and, for .obj files, of the material
+// libraries it references. Returns 0 if the source cannot be read.
+u64 ComputeModelSourceHash(const char* filename);
+
+// Fills imported from its cache file when the cache was written for the same
+// source hash, import flags and version. The cache stays mapped in
+// imported.cacheFile so the upload can copy the vertex and index blocks
+// straight from it. Thread safe, does not touch GL.
+bool ReadMeshCache(ImportedModel& imported, u32 importFlags);
+
+// Writes the cache of a model that was just imported. Thread safe.
+void WriteMeshCache(const ImportedModel& imported, u32 importFlags);
+
+#endif // MESH_CACHE_H
@@ -0,0 +1,432 @@
+#include "MeshLod.h"
+#include <algorithm>
+#include <float.h>
+#include <unordered_map>
+#include <string.h>
+
+// Each level aims for this fraction of the triangles of the previous one
+#define LOD_REDUCTION     0.5f
+// The chain stops when a level gets this small or saves less than 20%
+#define LOD_MIN_TRIANGLES 16
+#define LOD_MIN_SAVING    0.8f
+
+// Border edges get a plane perpendicular to the surface so their vertices
+// only slide along the border
+#define LOD_BORDER_WEIGHT 10.0
+
+// Collapses that turn a triangle more than about 85 degrees are rejected
+#define LOD_MIN_NORMAL_DOT 0.1
+
+// Area weighted sum of squared distances to planes, stored as the symmetric
+// matrix A, vector b and constant c of x'Ax + 2b'x + c. Double precision,
+// the terms cancel out near the minimum.
+struct Quadric
+{
+    f64 a00, a01, a02, a11, a12, a22;
+    f64 b0, b1, b2;
+    f64 c;
+    f64 weight;
+};
+
+static void AddPlane(Quadric& q, const glm::dvec3& n, f64 d, f64 weight)
+{
+    q.a00 += weight * n.x * n.x; q.a01 += weight * n.x * n.y; q.a02 += weight * n.x * n.z;
+    q.a11 += weight * n.y * n.y; q.a12 += weight * n.y * n.z; q.a22 += weight * n.z * n.z;
+    q.b0 += weight * n.x * d; q.b1 += weight * n.y * d; q.b2 += weight * n.z * d;
+    q.c += weight * d * d;
+    q.weight += weight;
+}
+
+static void AddQuadric(Quadric& q, const Quadric& other)
+{
+    q.a00 += other.a00; q.a01 += other.a01; q.a02 += other.a02;
+    q.a11 += other.a11; q.a12 += other.a12; q.a22 += other.a22;
+    q.b0 += other.b0; q.b1 += other.b1; q.b2 += other.b2;
+    q.c += other.c;
+    q.weight += other.weight;
+}
+
+// Mean squared distance of p to the planes of q
+static f64 EvaluateQuadric(const Quadric& q, const vec3& p)
+{
+    const f64 x = p.x, y = p.y, z = p.z;
+    const f64 value =
+        q.a00 * x * x + q.a11 * y * y + q.a22 * z * z +
+        2.0 * (q.a01 * x * y + q.a02 * x * z + q.a12 * y * z) +
+        2.0 * (q.b0 * x + q.b1 * y + q.b2 * z) + q.c;
+    return q.weight > 0.0 ? glm::max(value, 0.0) / q.weight : 0.0;
+}
+
+struct Collapse
+{
+    u32 from;   // position ids
+    u32 to;
+    f64 cost;
+};
+
+// Simplification state shared by every level of a submesh. Vertices that only
+// differ in normal or texture coordinates share a position id, collapses work
+// on those and map each vertex of the removed position to one on the kept side.
+struct Simplifier
+{
+    std::vector<u32> positionIds;   // per vertex
+    std::vector<vec3> positions;    // per position id
+    std::vector<Quadric> quadrics;  // per position id
+    std::vector<u8> border;         // per position id
+
+    // Position id to triangles, rebuilt every pass
+    std::vector<u32> triangleOffsets;
+    std::vector<u32> triangles;
+};
+
+struct PositionKey
+{
+    u32 bits[3];
+    bool operator==(const PositionKey& other) const { return memcmp(bits, other.bits, sizeof(bits)) == 0; }
+};
+
+struct PositionKeyHash
+{
+    size_t operator()(const PositionKey& key) const
+    {
+        return (size_t)(key.bits[0] * 73856093u ^ key.bits[1] * 19349663u ^ key.bits[2] * 83492791u);
+    }
+};
+
+static void BuildPositionIds(Simplifier& simplifier, const Submesh& submesh, u32 floatStride, u32 vertexCount)
+{
+    std::unordered_map<PositionKey, u32, PositionKeyHash> ids;
+    ids.reserve(vertexCount);
+
+    simplifier.positionIds.resize(vertexCount);
+    simplifier.positions.clear();
+    for (u32 v = 0; v < vertexCount; ++v)
+    {
+        const float* p = &submesh.vertices[(size_t)v * floatStride];
+        PositionKey key;
+        memcpy(key.bits, p, sizeof(key.bits));
+
+        auto inserted = ids.insert({ key, (u32)simplifier.positions.size() });
+        if (inserted.second)
+            simplifier.positions.push_back(vec3(p[0], p[1], p[2]));
+        simplifier.positionIds[v] = inserted.first->second;
+    }
+}
+
+static u64 EdgeKey(u32 a, u32 b)
+{
+    return a < b ? ((u64)a << 32) | b : ((u64)b << 32) | a;
+}
+
+// Triangle planes, area weighted, plus the border planes of the full mesh.
+// A border edge is one used by a single triangle.
+static void BuildQuadrics(Simplifier& simplifier, const std::vector<u32>& indices)
+{
+    const u32 positionCount = (u32)simplifier.positions.size();
+    simplifier.quadrics.assign(positionCount, Quadric{});
+    simplifier.border.assign(positionCount, 0);
+
+    // Edges with the triangle using them, for the border planes
+    std::vector<std::pair<u64, u32>> edges;
+    edges.reserve(indices.size());
+    for (size_t t = 0; t + 2 < indices.size(); t += 3)
+    {
+        const u32 p[3] = { simplifier.positionIds[indices[t]], simplifier.positionIds[indices[t + 1]], simplifier.positionIds[indices[t + 2]] };
+        const glm::dvec3 p0(simplifier.positions[p[0]]);
+        const glm::dvec3 cross = glm::cross(glm::dvec3(simplifier.positions[p[1]]) - p0, glm::dvec3(simplifier.positions[p[2]]) - p0);
+        const f64 length = glm::length(cross);
+        if (length <= 0.0)
+            continue;
+
+        const glm::dvec3 n = cross / length;
+        const f64 area = length * 0.5;
+        for (u32 k = 0; k < 3; ++k)
+        {
+            AddPlane(simplifier.quadrics[p[k]], n, -glm::dot(n, p0), area);
+            edges.push_back({ EdgeKey(p[k], p[(k + 1) % 3]), (u32)(t / 3) });
+        }
+    }
+
+    std::sort(edges.begin(), edges.end());
+    for (size_t i = 0; i < edges.size();)
+    {
+        size_t j = i + 1;
+        while (j < edges.size() && edges[j].first == edges[i].first)
+            ++j;
+
+        if (j - i == 1)
+        {
+            const u32 a = (u32)(edges[i].first >> 32);
+            const u32 b = (u32)edges[i].first;
+            simplifier.border[a] = 1;
+            simplifier.border[b] = 1;
+
+            // Plane through the edge, perpendicular to its triangle
+            const u32* triangle = &indices[edges[i].second * 3];
+            const glm::dvec3 p0(simplifier.positions[simplifier.positionIds[triangle[0]]]);
+            const glm::dvec3 p1(simplifier.positions[simplifier.positionIds[triangle[1]]]);
+            const glm::dvec3 p2(simplifier.positions[simplifier.positionIds[triangle[2]]]);
+            const glm::dvec3 pa(simplifier.positions[a]);
+            const glm::dvec3 edge = glm::dvec3(simplifier.positions[b]) - pa;
+            const glm::dvec3 planeNormal = glm::cross(edge, glm::cross(p1 - p0, p2 - p0));
+            const f64 length = glm::length(planeNormal);
+            if (length > 0.0)
+            {
+                const glm::dvec3 n = planeNormal / length;
+                const f64 weight = glm::dot(edge, edge) * LOD_BORDER_WEIGHT;
+                AddPlane(simplifier.quadrics[a], n, -glm::dot(n, pa), weight);
+                AddPlane(simplifier.quadrics[b], n, -glm::dot(n, pa), weight);
+            }
+        }
+        i = j;
+    }
+}
+
+static void BuildPositionAdjacency(Simplifier& simplifier, const std::vector<u32>& indices)
+{
+    const u32 positionCount = (u32)simplifier.positions.size();
+    simplifier.triangleOffsets.assign(positionCount + 1, 0);
+    for (u32 index : indices)
+        simplifier.triangleOffsets[simplifier.positionIds[index] + 1]++;
+    for (u32 p = 0; p < positionCount; ++p)
+        simplifier.triangleOffsets[p + 1] += simplifier.triangleOffsets[p];
+
+    std::vector<u32> cursor(simplifier.triangleOffsets.begin(), simplifier.triangleOffsets.end() - 1);
+    simplifier.triangles.resize(indices.size());
+    for (u32 i = 0; i < (u32)indices.size(); ++i)
+        simplifier.triangles[cursor[simplifier.positionIds[indices[i]]]++] = i / 3;
+}
+
+// Maps every vertex of position collapse.from used by the current triangles to
+// a vertex of position collapse.to sharing a triangle with it, so seams move
+// along themselves. Fails when a vertex has no such partner or when a
+// remaining triangle would flip.
+static bool PrepareCollapse(const Simplifier& simplifier, const std::vector<u32>& indices, const Collapse& collapse,
+                            std::vector<std::pair<u32, u32>>& wedges)
+{
+    wedges.clear();
+    const u32 begin = simplifier.triangleOffsets[collapse.from];
+    const u32 end = simplifier.triangleOffsets[collapse.from + 1];
+
+    for (u32 a = begin; a < end; ++a)
+    {
+        const u32* triangle = &indices[simplifier.triangles[a] * 3];
+        u32 fromVertex = UINT32_MAX;
+        u32 toVertex = UINT32_MAX;
+        for (u32 k = 0; k < 3; ++k)
+        {
+            const u32 positionId = simplifier.positionIds[triangle[k]];
+            if (positionId == collapse.from) fromVertex = triangle[k];
+            if (positionId == collapse.to) toVertex = triangle[k];
+        }
+        if (toVertex == UINT32_MAX)
+            continue;
+
+        bool known = false;
+        for (const auto& wedge : wedges)
+            known |= wedge.first == fromVertex;
+        if (!known)
+            wedges.push_back({ fromVertex, toVertex });
+    }
+
+    const vec3& target = simplifier.positions[collapse.to];
+    for (u32 a = begin; a < end; ++a)
+    {
+        const u32* triangle = &indices[simplifier.triangles[a] * 3];
+        vec3 before[3];
+        vec3 after[3];
+        bool collapsing = false;
+        for (u32 k = 0; k < 3; ++k)
+        {
+            const u32 positionId = simplifier.positionIds[triangle[k]];
+            collapsing |= positionId == collapse.to;
+            before[k] = simplifier.positions[positionId];
+            after[k] = positionId == collapse.from ? target : before[k];
+
+            if (positionId == collapse.from)
+            {
+                bool mapped = false;
+                for (const auto& wedge : wedges)
+                    mapped |= wedge.first == triangle[k];
+                if (!mapped)
+                    return false;
+            }
+        }
+
+        // Triangles on the edge disappear, the others must keep their facing
+        if (collapsing)
+            continue;
+
+        const glm::dvec3 oldNormal = glm::cross(glm::dvec3(before[1] - before[0]), glm::dvec3(before[2] - before[0]));
+        const glm::dvec3 newNormal = glm::cross(glm::dvec3(after[1] - after[0]), glm::dvec3(after[2] - after[0]));
+        const f64 scale = glm::length(oldNormal) * glm::length(newNormal);
+        if (scale <= 0.0 || glm::dot(oldNormal, newNormal) < LOD_MIN_NORMAL_DOT * scale)
+            return false;
+    }
+    return true;
+}
+
+// One level: passes of independent collapses, cheapest first, until the
+// target is reached or nothing can collapse. Returns the error of the level.
+static f32 Simplify(Simplifier& simplifier, std::vector<u32>& indices, u32 targetTriangles)
+{
+    const u32 positionCount = (u32)simplifier.positions.size();
+    std::vector<u32> remap(simplifier.positionIds.size());
+    std::vector<u8> locked(positionCount);
+    std::vector<u64> edges;
+    std::vector<Collapse> collapses;
+    std::vector<std::pair<u32, u32>> wedges;
+    f64 maxError = 0.0;
+
+    while (indices.size() / 3 > targetTriangles)
+    {
+        edges.clear();
+        for (size_t t = 0; t + 2 < indices.size(); t += 3)
+        {
+            for (u32 k = 0; k < 3; ++k)
+                edges.push_back(EdgeKey(simplifier.positionIds[indices[t + k]], simplifier.positionIds[indices[t + (k + 1) % 3]]));
+        }
+        std::sort(edges.begin(), edges.end());
+
+        // Border vertices may only move along a border edge, onto another border vertex
+        collapses.clear();
+        for (size_t i = 0; i < edges.size();)
+        {
+            size_t j = i + 1;
+            while (j < edges.size() && edges[j] == edges[i])
+                ++j;
+            const bool borderEdge = j - i == 1;
+            const u32 a = (u32)(edges[i] >> 32);
+            const u32 b = (u32)edges[i];
+            i = j;
+
+            Collapse best = { UINT32_MAX, UINT32_MAX, DBL_MAX };
+            const u32 ends[2][2] = { { a, b }, { b, a } };
+            for (const auto& end : ends)
+            {
+                const u32 from = end[0];
+                const u32 to = end[1];
+                if (simplifier.border[from] && !(borderEdge && simplifier.border[to]))
+                    continue;
+
+                const f64 cost = EvaluateQuadric(simplifier.quadrics[from], simplifier.positions[to]);
+                if (cost < best.cost)
+                    best = { from, to, cost };
+            }
+            if (best.from != UINT32_MAX)
+                collapses.push_back(best);
+        }
+
+        // Every collapse removes about two triangles. Locks and rejections
+        // skip some, only a few times the needed count has to be in order.
+        const u32 triangleCount = (u32)indices.size() / 3;
+        const u32 collapsesNeeded = (triangleCount - targetTriangles + 1) / 2;
+        const auto cheaper = [](const Collapse& x, const Collapse& y) { return x.cost < y.cost; };
+        if (collapses.size() > (size_t)collapsesNeeded * 4)
+        {
+            std::nth_element(collapses.begin(), collapses.begin() + collapsesNeeded * 4, collapses.end(), cheaper);
+            collapses.resize((size_t)collapsesNeeded * 4);
+        }
+        std::sort(collapses.begin(), collapses.end(), cheaper);
+
+        BuildPositionAdjacency(simplifier, indices);
+        for (u32 v = 0; v < (u32)remap.size(); ++v)
+            remap[v] = v;
+        std::fill(locked.begin(), locked.end(), 0);
+
+        u32 applied = 0;
+        for (const Collapse& collapse : collapses)
+        {
+            if (applied >= collapsesNeeded)
+                break;
+            if (locked[collapse.from] || locked[collapse.to])
+                continue;
+            if (!PrepareCollapse(simplifier, indices, collapse, wedges))
+                continue;
+
+            for (const auto& wedge : wedges)
+                remap[wedge.first] = wedge.second;
+            AddQuadric(simplifier.quadrics[collapse.to], simplifier.quadrics[collapse.from]);
+            locked[collapse.from] = 1;
+            locked[collapse.to] = 1;
+            maxError = glm::max(maxError, collapse.cost);
+            applied++;
+        }
+
+        if (applied == 0)
+            break;
+
+        // Triangles that lost an edge are dropped
+        size_t write = 0;
+        for (size_t t = 0; t + 2 < indices.size(); t += 3)
+        {
+            const u32 i0 = remap[indices[t]];
+            const u32 i1 = remap[indices[t + 1]];
+            const u32 i2 = remap[indices[t + 2]];
+            const u32 p0 = simplifier.positionIds[i0];
+            const u32 p1 = simplifier.positionIds[i1];
+            const u32 p2 = simplifier.positionIds[i2];
+            if (p0 == p1 || p1 == p2 || p0 == p2)
+                continue;
+            indices[write++] = i0;
+            indices[write++] = i1;
+            indices[write++] = i2;
+        }
+        indices.resize(write);
+    }
+
+    return (f32)sqrt(maxError);
+}
+
+void BuildLodChain(Submesh& submesh)
+{
+    submesh.lods.clear();
+
+    const u32 floatStride = submesh.vertexBufferLayout.stride / sizeof(float);
+    const u32 vertexCount = floatStride > 0 ? (u32)submesh.vertices.size() / floatStride : 0;
+    if (vertexCount == 0 || submesh.indexCount / 3 < LOD_MIN_TRIANGLES * 2)
+        return;
+
+    Simplifier simplifier;
+    BuildPositionIds(simplifier, submesh, floatStride, vertexCount);
+
+    std::vector<u32> level(submesh.indices.begin(), submesh.indices.begin() + submesh.indexCount);
+    BuildQuadrics(simplifier, level);
+
+    f32 error = 0.0f;
+    u32 previousTriangles = (u32)level.size() / 3;
+    while (submesh.lods.size() < MESH_MAX_LODS && previousTriangles >= LOD_MIN_TRIANGLES * 2)
+    {
+        const u32 target = (u32)(previousTriangles * LOD_REDUCTION);
+        error += Simplify(simplifier, level, target);
+
+        const u32 triangles = (u32)level.size() / 3;
+        if (triangles == 0 || triangles > previousTriangles * LOD_MIN_SAVING)
+            break;
+
+        SubmeshLod lod;
+        lod.firstIndex = (u32)submesh.indices.size();
+        lod.indexCount = (u32)level.size();
+        lod.error = error;
+        submesh.indices.insert(submesh.indices.end(), level.begin(), level.end());
+        submesh.lods.push_back(lod);
+        previousTriangles = triangles;
+    }
+}
+
+f32 ComputeScreenSize(const Camera& camera, const vec3& center, f32 radius)
+{
+    // projectionMatrix[1][1] is 1 / tan(fovy / 2)
+    const f32 distance = glm::length(center - camera.position);
+    if (distance <= radius)
+        return FLT_MAX;
+    return radius * camera.projectionMatrix[1][1] / distance;
+}
+
+u32 SelectLod(const f32* thresholds, f32 screenSize)
+{
+    u32 lod = 0;
+    while (lod < MESH_MAX_LODS && screenSize < thresholds[lod])
+        lod++;
+    return lod;
+}
@@ -0,0 +1,21 @@
+#ifndef MESH_LOD_H
+#define MESH_LOD_H
+
+#include "Structs.hpp"
+
+// Appends up to MESH_MAX_LODS simplified index lists to submesh.indices, each
+// with about half the triangles of the previous one, and describes them in
+// submesh.lods. The levels reuse the submesh vertices: quadric error half-edge
+// collapses move a vertex onto a neighbor, borders and UV/normal seams are
+// preserved. submesh.indexCount must hold the full detail count. Needs the
+// float vertices, call it before PackMeshVertices. Thread safe.
+void BuildLodChain(Submesh& submesh);
+
+// Projected diameter of a sphere over the viewport height
+f32 ComputeScreenSize(const Camera& camera, const vec3& center, f32 radius);
+
+// Level whose screen size threshold the entity is still above: 0 when
+// screenSize >= thresholds[0], 1 when it is between thresholds[0] and [1]...
+u32 SelectLod(const f32* thresholds, f32 screenSize);
+
+#endif // MESH_LOD_H
@@ -0,0 +1,356 @@
+#include "MeshOptimizer.h"
+#include <algorithm>
+#include <string.h>
+
+// Direct mapped 16 KB cache in front of the vertex buffer
+#define VERTEX_FETCH_LINE_BYTES 64
+#define VERTEX_FETCH_LINE_COUNT 256
+
+// Overdraw clusters shorter than this are not worth a cache restart
+#define OVERDRAW_MIN_CLUSTER_TRIANGLES 16
+
+// FIFO cache: a vertex is cached while fewer than VERTEX_CACHE_SIZE misses
+// happened since its own one. Stamps start at 0, which is never cached.
+struct FifoCache
+{
+    std::vector<u32> stamps;
+    u32 time;
+};
+
+static void ResetFifoCache(FifoCache& cache, u32 vertexCount)
+{
+    cache.stamps.assign(vertexCount, 0);
+    cache.time = VERTEX_CACHE_SIZE + 1;
+}
+
+// Ages every entry out without touching the stamps
+static void FlushFifoCache(FifoCache& cache)
+{
+    cache.time += VERTEX_CACHE_SIZE;
+}
+
+// Returns true on a miss
+static bool TouchFifoCache(FifoCache& cache, u32 vertex)
+{
+    if (cache.time - cache.stamps[vertex] < VERTEX_CACHE_SIZE)
+        return false;
+    cache.stamps[vertex] = ++cache.time;
+    return true;
+}
+
+VertexCacheStats AnalyzeVertexCache(const u32* indices, u32 indexCount, u32 vertexCount, u32 vertexStride)
+{
+    VertexCacheStats stats = {};
+    const u32 triangleCount = indexCount / 3;
+    if (triangleCount == 0 || vertexCount == 0)
+        return stats;
+
+    FifoCache cache;
+    ResetFifoCache(cache, vertexCount);
+
+    std::vector<u8> referenced(vertexCount, 0);
+    u32 lines[VERTEX_FETCH_LINE_COUNT];
+    memset(lines, 0xFF, sizeof(lines));
+
+    u32 misses = 0;
+    u32 uniqueVertices = 0;
+    u64 bytesFetched = 0;
+    for (u32 i = 0; i < triangleCount * 3; ++i)
+    {
+        const u32 vertex = indices[i];
+        if (!referenced[vertex])
+        {
+            referenced[vertex] = 1;
+            uniqueVertices++;
+        }
+
+        if (!TouchFifoCache(cache, vertex))
+            continue;
+        misses++;
+
+        // Every miss reads the vertex, through the line cache
+        const u64 firstByte = (u64)vertex * vertexStride;
+        const u64 lastByte = firstByte + vertexStride - 1;
+        for (u64 line = firstByte / VERTEX_FETCH_LINE_BYTES; line <= lastByte / VERTEX_FETCH_LINE_BYTES; ++line)
+        {
+            u32& slot = lines[line % VERTEX_FETCH_LINE_COUNT];
+            if (slot != (u32)line)
+            {
+                slot = (u32)line;
+                bytesFetched += VERTEX_FETCH_LINE_BYTES;
+            }
+        }
+    }
+
+    stats.acmr = (f32)misses / (f32)triangleCount;
+    stats.atvr = (f32)misses / (f32)uniqueVertices;
+    stats.overfetch = (f32)((f64)bytesFetched / ((f64)uniqueVertices * vertexStride));
+    return stats;
+}
+
+// Triangles around each vertex, as offsets into a flat list
+static void BuildTriangleAdjacency(std::vector<u32>& offsets, std::vector<u32>& triangles, const u32* indices, u32 indexCount, u32 vertexCount)
+{
+    offsets.assign(vertexCount + 1, 0);
+    for (u32 i = 0; i < indexCount; ++i)
+        offsets[indices[i] + 1]++;
+    for (u32 v = 0; v < vertexCount; ++v)
+        offsets[v + 1] += offsets[v];
+
+    std::vector<u32> cursor(offsets.begin(), offsets.end() - 1);
+    triangles.resize(indexCount);
+    for (u32 i = 0; i < indexCount; ++i)
+        triangles[cursor[indices[i]]++] = i / 3;
+}
+
+// Cached candidate that stays cached after its remaining triangles are fanned,
+// preferring the oldest. A dead end falls back to the most recently used
+// vertex that still has triangles, then to the next one in order.
+static u32 NextFanVertex(const std::vector<u32>& candidates, std::vector<u32>& deadEnd, const FifoCache& cache,
+                         const std::vector<u32>& liveTriangles, u32& cursor)
+{
+    u32 best = UINT32_MAX;
+    i32 bestPriority = -1;
+    for (u32 vertex : candidates)
+    {
+        if (liveTriangles[vertex] == 0)
+            continue;
+
+        i32 priority = 0;
+        const u32 age = cache.time - cache.stamps[vertex];
+        if (age + 2 * liveTriangles[vertex] <= VERTEX_CACHE_SIZE)
+            priority = (i32)age;
+        if (priority > bestPriority)
+        {
+            best = vertex;
+            bestPriority = priority;
+        }
+    }
+    if (best != UINT32_MAX)
+        return best;
+
+    while (!deadEnd.empty())
+    {
+        const u32 vertex = deadEnd.back();
+        deadEnd.pop_back();
+        if (liveTriangles[vertex] > 0)
+            return vertex;
+    }
+
+    for (; cursor < (u32)liveTriangles.size(); ++cursor)
+    {
+        if (liveTriangles[cursor] > 0)
+            return cursor;
+    }
+    return UINT32_MAX;
+}
+
+void OptimizeVertexCache(u32* indices, u32 indexCount)
+{
+    const u32 triangleCount = indexCount / 3;
+    if (triangleCount < 2)
+        return;
+    indexCount = triangleCount * 3;
+
+    // Local vertex ids keep the work proportional to the range
+    std::vector<u32> vertices(indices, indices + indexCount);
+    std::sort(vertices.begin(), vertices.end());
+    vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+    const u32 vertexCount = (u32)vertices.size();
+
+    std::vector<u32> local(indexCount);
+    for (u32 i = 0; i < indexCount; ++i)
+        local[i] = (u32)(std::lower_bound(vertices.begin(), vertices.end(), indices[i]) - vertices.begin());
+
+    std::vector<u32> adjacencyOffsets;
+    std::vector<u32> adjacency;
+    BuildTriangleAdjacency(adjacencyOffsets, adjacency, local.data(), indexCount, vertexCount);
+
+    std::vector<u32> liveTriangles(vertexCount);
+    for (u32 v = 0; v < vertexCount; ++v)
+        liveTriangles[v] = adjacencyOffsets[v + 1] - adjacencyOffsets[v];
+
+    FifoCache cache;
+    ResetFifoCache(cache, vertexCount);
+
+    std::vector<u8> emitted(triangleCount, 0);
+    std::vector<u32> deadEnd;
+    std::vector<u32> candidates;
+    deadEnd.reserve(indexCount);
+
+    u32 written = 0;
+    u32 cursor = 0;
+    u32 fan = local[0];
+    while (fan != UINT32_MAX)
+    {
+        candidates.clear();
+        for (u32 a = adjacencyOffsets[fan]; a < adjacencyOffsets[fan + 1]; ++a)
+        {
+            const u32 triangle = adjacency[a];
+            if (emitted[triangle])
+                continue;
+            emitted[triangle] = 1;
+
+            for (u32 k = 0; k < 3; ++k)
+            {
+                const u32 vertex = local[triangle * 3 + k];
+                indices[written++] = vertices[vertex];
+                deadEnd.push_back(vertex);
+                candidates.push_back(vertex);
+                liveTriangles[vertex]--;
+                TouchFifoCache(cache, vertex);
+            }
+        }
+        fan = NextFanVertex(candidates, deadEnd, cache, liveTriangles, cursor);
+    }
+}
+
+// Area weighted centroid and normal of a run of triangles. Normals follow the
+// vertex normals rather than the winding, like the meshlet cones do.
+static void AccumulateTriangles(const Submesh& submesh, u32 floatStride, i32 normalOffset,
+                                const u32* indices, u32 triangleCount, glm::dvec3& centroid, glm::dvec3& normal, f64& area)
+{
+    for (u32 t = 0; t < triangleCount; ++t)
+    {
+        const float* a = &submesh.vertices[(size_t)indices[t * 3 + 0] * floatStride];
+        const float* b = &submesh.vertices[(size_t)indices[t * 3 + 1] * floatStride];
+        const float* c = &submesh.vertices[(size_t)indices[t * 3 + 2] * floatStride];
+        const glm::dvec3 p0(a[0], a[1], a[2]);
+        const glm::dvec3 p1(b[0], b[1], b[2]);
+        const glm::dvec3 p2(c[0], c[1], c[2]);
+
+        glm::dvec3 cross = glm::cross(p1 - p0, p2 - p0);
+        if (normalOffset >= 0)
+        {
+            const float* na = a + normalOffset;
+            const float* nb = b + normalOffset;
+            const float* nc = c + normalOffset;
+            const glm::dvec3 vertexNormal(na[0] + nb[0] + nc[0], na[1] + nb[1] + nc[1], na[2] + nb[2] + nc[2]);
+            if (glm::dot(cross, vertexNormal) < 0.0)
+                cross = -cross;
+        }
+
+        const f64 triangleArea = glm::length(cross) * 0.5;
+        centroid += (p0 + p1 + p2) * (triangleArea / 3.0);
+        normal += cross * 0.5;
+        area += triangleArea;
+    }
+}
+
+struct OverdrawCluster
+{
+    u32 firstTriangle;
+    u32 triangleCount;
+    f64 sortKey;
+};
+
+void OptimizeOverdraw(Submesh& submesh, f32 threshold)
+{
+    const u32 floatStride = submesh.vertexBufferLayout.stride / sizeof(float);
+    const u32 vertexCount = floatStride > 0 ? (u32)submesh.vertices.size() / floatStride : 0;
+    const u32 triangleCount = submesh.indexCount / 3;
+    if (vertexCount == 0 || triangleCount < OVERDRAW_MIN_CLUSTER_TRIANGLES * 2)
+        return;
+
+    i32 normalOffset = -1;
+    for (const VertexBufferAttribute& attribute : submesh.vertexBufferLayout.attributes)
+    {
+        if (attribute.location == 1)
+            normalOffset = attribute.offset / sizeof(float);
+    }
+
+    u32* indices = submesh.indices.data();
+    const f32 maxClusterAcmr = AnalyzeVertexCache(indices, triangleCount * 3, vertexCount, 1).acmr * threshold;
+
+    // Hard boundaries are the triangles that miss on every corner, where the
+    // cache order restarted anyway. Soft ones end a cluster as soon as its
+    // own ACMR, counted from an empty cache, is good enough.
+    std::vector<OverdrawCluster> clusters;
+    FifoCache cache;
+    ResetFifoCache(cache, vertexCount);
+    OverdrawCluster current = {};
+    u32 clusterMisses = 0;
+    for (u32 t = 0; t < triangleCount; ++t)
+    {
+        u32 misses = 0;
+        for (u32 k = 0; k < 3; ++k)
+            misses += TouchFifoCache(cache, indices[t * 3 + k]) ? 1 : 0;
+
+        if (misses == 3 && current.triangleCount >= OVERDRAW_MIN_CLUSTER_TRIANGLES)
+        {
+            clusters.push_back(current);
+            current = { t, 0, 0.0 };
+            clusterMisses = 0;
+        }
+        current.triangleCount++;
+        clusterMisses += misses;
+
+        if (current.triangleCount >= OVERDRAW_MIN_CLUSTER_TRIANGLES &&
+            (f32)clusterMisses <= maxClusterAcmr * (f32)current.triangleCount)
+        {
+            clusters.push_back(current);
+            current = { t + 1, 0, 0.0 };
+            clusterMisses = 0;
+            FlushFifoCache(cache);
+        }
+    }
+    if (current.triangleCount > 0)
+        clusters.push_back(current);
+    if (clusters.size() < 2)
+        return;
+
+    glm::dvec3 meshCentroid(0.0);
+    glm::dvec3 meshNormal(0.0);
+    f64 meshArea = 0.0;
+    AccumulateTriangles(submesh, floatStride, normalOffset, indices, triangleCount, meshCentroid, meshNormal, meshArea);
+    if (meshArea <= 0.0)
+        return;
+    meshCentroid /= meshArea;
+
+    // Clusters facing away from the mesh center, far from it, occlude the rest
+    for (OverdrawCluster& cluster : clusters)
+    {
+        glm::dvec3 centroid(0.0);
+        glm::dvec3 normal(0.0);
+        f64 area = 0.0;
+        AccumulateTriangles(submesh, floatStride, normalOffset, &indices[cluster.firstTriangle * 3], cluster.triangleCount, centroid, normal, area);
+
+        const f64 normalLength = glm::length(normal);
+        if (area > 0.0 && normalLength > 0.0)
+            cluster.sortKey = glm::dot(centroid / area - meshCentroid, normal / normalLength);
+    }
+
+    std::stable_sort(clusters.begin(), clusters.end(),
+        [](const OverdrawCluster& a, const OverdrawCluster& b) { return a.sortKey > b.sortKey; });
+
+    std::vector<u32> sorted;
+    sorted.reserve(triangleCount * 3);
+    for (const OverdrawCluster& cluster : clusters)
+        sorted.insert(sorted.end(), indices + cluster.firstTriangle * 3, indices + (cluster.firstTriangle + cluster.triangleCount) * 3);
+    memcpy(indices, sorted.data(), sorted.size() * sizeof(u32));
+}
+
+void OptimizeVertexFetch(Submesh& submesh)
+{
+    const u32 floatStride = submesh.vertexBufferLayout.stride / sizeof(float);
+    const u32 vertexCount = floatStride > 0 ? (u32)submesh.vertices.size() / floatStride : 0;
+    if (vertexCount == 0)
+        return;
+
+    std::vector<u32> remap(vertexCount, UINT32_MAX);
+    u32 usedVertices = 0;
+    for (u32& index : submesh.indices)
+    {
+        if (remap[index] == UINT32_MAX)
+            remap[index] = usedVertices++;
+        index = remap[index];
+    }
+
+    std::vector<float> vertices((size_t)usedVertices * floatStride);
+    for (u32 v = 0; v < vertexCount; ++v)
+    {
+        if (remap[v] != UINT32_MAX)
+            memcpy(&vertices[(size_t)remap[v] * floatStride], &submesh.vertices[(size_t)v * floatStride], floatStride * sizeof(float));
+    }
+    submesh.vertices.swap(vertices);
+}
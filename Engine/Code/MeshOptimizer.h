@@ -0,0 +1,31 @@
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include "Structs.hpp"
+
+// Entries of the simulated post-transform cache, a FIFO like the one most
+// GPUs use. Tipsify optimizes for the same size.
+#define VERTEX_CACHE_SIZE 16
+
+// Simulates the post-transform cache and a 64 byte line fetch cache over a
+// triangle list. vertexStride is the size of one vertex in the vertex buffer.
+VertexCacheStats AnalyzeVertexCache(const u32* indices, u32 indexCount, u32 vertexCount, u32 vertexStride);
+
+// Tipsify (Sander et al. 2007): reorders the triangles to fan around recently
+// used vertices so most of them hit the post-transform cache. Works on any
+// range of a submesh's indices, its cost only depends on the range size.
+void OptimizeVertexCache(u32* indices, u32 indexCount);
+
+// Splits the cache optimized full detail level of a submesh into clusters at
+// the points where the cache order restarts, or where a cut costs less than
+// threshold times its ACMR, and sorts the clusters outside in so the surfaces
+// that occlude the rest of the mesh tend to be drawn first. Needs the float
+// vertices.
+void OptimizeOverdraw(Submesh& submesh, f32 threshold);
+
+// Renumbers the float vertices in the order the indices first use them, so
+// the vertex fetch reads the buffer close to sequentially. Every index list
+// of the submesh (all LOD levels) is remapped, unused vertices are dropped.
+void OptimizeVertexFetch(Submesh& submesh);
+
+#endif // MESH_OPTIMIZER_H
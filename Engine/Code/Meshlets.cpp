@@ -0,0 +1,332 @@
+#include "Meshlets.h"
+#include "Culling.h"
+#include "RenderQueue.h"
+#include <float.h>
+
+// Below this spread (cos of the widest triangle to the axis) the cone can
+// almost never reject, so it is disabled rather than tested
+#define MESHLET_MIN_CONE_DOT 0.1f
+
+// Cost of a triangle facing away from the meshlet axis, in new vertices.
+// Keeps the normal cones tight enough for the backface test to reject.
+#define MESHLET_CONE_WEIGHT 1.0f
+
+// Face normals are oriented by the vertex normals rather than the winding:
+// the engine draws without face culling, so winding was never enforced.
+// Degenerate triangles get a zero normal.
+static void ComputeFaceNormals(std::vector<vec3>& faceNormals, const Submesh& submesh, u32 floatStride, i32 normalOffset)
+{
+    const u32 triangleCount = (u32)submesh.indices.size() / 3;
+    const float* vertices = submesh.vertices.data();
+
+    faceNormals.resize(triangleCount);
+    for (u32 t = 0; t < triangleCount; ++t)
+    {
+        const float* a = &vertices[(size_t)submesh.indices[t * 3 + 0] * floatStride];
+        const float* b = &vertices[(size_t)submesh.indices[t * 3 + 1] * floatStride];
+        const float* c = &vertices[(size_t)submesh.indices[t * 3 + 2] * floatStride];
+        const vec3 p0(a[0], a[1], a[2]);
+        vec3 normal = glm::cross(vec3(b[0], b[1], b[2]) - p0, vec3(c[0], c[1], c[2]) - p0);
+
+        const f32 length = glm::length(normal);
+        if (length <= 1e-12f)
+        {
+            faceNormals[t] = vec3(0.0f);
+            continue;
+        }
+        normal /= length;
+
+        if (normalOffset >= 0)
+        {
+            const float* na = a + normalOffset;
+            const float* nb = b + normalOffset;
+            const float* nc = c + normalOffset;
+            const vec3 vertexNormal(na[0] + nb[0] + nc[0], na[1] + nb[1] + nc[1], na[2] + nb[2] + nc[2]);
+            if (glm::dot(normal, vertexNormal) < 0.0f)
+                normal = -normal;
+        }
+        faceNormals[t] = normal;
+    }
+}
+
+static void ComputeMeshletBounds(Meshlet& meshlet, const Submesh& submesh, u32 floatStride, const std::vector<vec3>& faceNormals)
+{
+    const u32* indices = &submesh.indices[meshlet.firstIndex];
+    const float* vertices = submesh.vertices.data();
+
+    vec3 minPos(FLT_MAX);
+    vec3 maxPos(-FLT_MAX);
+    for (u32 i = 0; i < meshlet.indexCount; ++i)
+    {
+        const float* v = &vertices[(size_t)indices[i] * floatStride];
+        minPos = glm::min(minPos, vec3(v[0], v[1], v[2]));
+        maxPos = glm::max(maxPos, vec3(v[0], v[1], v[2]));
+    }
+
+    const vec3 center = (minPos + maxPos) * 0.5f;
+    f32 radiusSq = 0.0f;
+    for (u32 i = 0; i < meshlet.indexCount; ++i)
+    {
+        const float* v = &vertices[(size_t)indices[i] * floatStride];
+        const vec3 offset = vec3(v[0], v[1], v[2]) - center;
+        radiusSq = glm::max(radiusSq, glm::dot(offset, offset));
+    }
+    meshlet.sphere = { center, sqrtf(radiusSq) };
+
+    // faceNormals are in meshlet order like the indices
+    const u32 firstTriangle = meshlet.firstIndex / 3;
+    const u32 triangleCount = meshlet.indexCount / 3;
+    vec3 axis(0.0f);
+    for (u32 t = 0; t < triangleCount; ++t)
+        axis += faceNormals[firstTriangle + t];
+
+    meshlet.coneAxis = vec3(0.0f);
+    meshlet.coneCutoff = 1.0f;
+
+    const f32 axisLength = glm::length(axis);
+    if (axisLength <= 1e-6f)
+        return;
+    axis /= axisLength;
+
+    f32 minDot = 1.0f;
+    for (u32 t = 0; t < triangleCount; ++t)
+    {
+        const vec3& normal = faceNormals[firstTriangle + t];
+        if (normal != vec3(0.0f))
+            minDot = glm::min(minDot, glm::dot(axis, normal));
+    }
+
+    if (minDot <= MESHLET_MIN_CONE_DOT)
+        return;
+
+    meshlet.coneAxis = axis;
+    meshlet.coneCutoff = sqrtf(1.0f - minDot * minDot);
+}
+
+// Vertices of the triangle not yet used by the meshlet, degenerate corners count once
+static u32 CountNewVertices(const u32* triangle, const std::vector<u32>& vertexMeshlet, u32 meshletId)
+{
+    u32 count = 0;
+    for (u32 k = 0; k < 3; ++k)
+    {
+        const bool repeated = (k > 0 && triangle[k] == triangle[0]) || (k > 1 && triangle[k] == triangle[1]);
+        if (!repeated && vertexMeshlet[triangle[k]] != meshletId)
+            count++;
+    }
+    return count;
+}
+
+// Triangles around each vertex, as offsets into a flat list
+struct TriangleAdjacency
+{
+    std::vector<u32> offsets;
+    std::vector<u32> triangles;
+};
+
+static void BuildTriangleAdjacency(TriangleAdjacency& adjacency, const std::vector<u32>& indices, u32 vertexCount)
+{
+    adjacency.offsets.assign(vertexCount + 1, 0);
+    for (u32 index : indices)
+        adjacency.offsets[index + 1]++;
+    for (u32 v = 0; v < vertexCount; ++v)
+        adjacency.offsets[v + 1] += adjacency.offsets[v];
+
+    std::vector<u32> cursor(adjacency.offsets.begin(), adjacency.offsets.end() - 1);
+    adjacency.triangles.resize(indices.size());
+    for (u32 i = 0; i < (u32)indices.size(); ++i)
+        adjacency.triangles[cursor[indices[i]]++] = i / 3;
+}
+
+struct MeshletBuilder
+{
+    const std::vector<u32>& indices;
+    const std::vector<vec3>& faceNormals;
+    TriangleAdjacency adjacency;
+    std::vector<u32> vertexMeshlet; // id of the last meshlet that used each vertex
+    std::vector<u8> emitted;
+    u32 meshletId;
+    vec3 axis;                      // sum of the face normals of the meshlet
+};
+
+// Unemitted triangle around the given vertices with the lowest cost (new
+// vertices plus the cone penalty), UINT32_MAX if there is none
+static u32 FindNeighborTriangle(const MeshletBuilder& builder, const u32* vertices, u32 vertexCount, u32& newVertices)
+{
+    const f32 axisLength = glm::length(builder.axis);
+    const vec3 axis = axisLength > 0.0f ? builder.axis / axisLength : vec3(0.0f);
+
+    u32 best = UINT32_MAX;
+    f32 bestCost = FLT_MAX;
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        const u32 vertex = vertices[i];
+        for (u32 a = builder.adjacency.offsets[vertex]; a < builder.adjacency.offsets[vertex + 1]; ++a)
+        {
+            const u32 triangle = builder.adjacency.triangles[a];
+            if (builder.emitted[triangle])
+                continue;
+
+            const u32 count = CountNewVertices(&builder.indices[triangle * 3], builder.vertexMeshlet, builder.meshletId);
+            const f32 cost = (f32)count + MESHLET_CONE_WEIGHT * (1.0f - glm::dot(axis, builder.faceNormals[triangle]));
+            if (cost < bestCost)
+            {
+                best = triangle;
+                bestCost = cost;
+                newVertices = count;
+            }
+        }
+    }
+    return best;
+}
+
+void BuildMeshlets(Submesh& submesh)
+{
+    submesh.meshlets.clear();
+
+    const u32 floatStride = submesh.vertexBufferLayout.stride / sizeof(float);
+    const u32 vertexCount = floatStride > 0 ? (u32)submesh.vertices.size() / floatStride : 0;
+    const u32 triangleCount = (u32)submesh.indices.size() / 3;
+    if (vertexCount == 0 || triangleCount == 0)
+        return;
+    submesh.indices.resize(triangleCount * 3);
+
+    i32 normalOffset = -1;
+    for (const VertexBufferAttribute& attribute : submesh.vertexBufferLayout.attributes)
+    {
+        if (attribute.location == 1)
+            normalOffset = attribute.offset / sizeof(float);
+    }
+
+    std::vector<vec3> faceNormals;
+    ComputeFaceNormals(faceNormals, submesh, floatStride, normalOffset);
+
+    MeshletBuilder builder = {
+        submesh.indices,
+        faceNormals,
+        TriangleAdjacency(),
+        std::vector<u32>(vertexCount, UINT32_MAX),
+        std::vector<u8>(triangleCount, 0),
+        0,
+        vec3(0.0f)
+    };
+    BuildTriangleAdjacency(builder.adjacency, submesh.indices, vertexCount);
+
+    // Meshlets grow through shared vertices: the next triangle is the cheapest
+    // neighbor of the last one, then of any meshlet vertex, and only when the
+    // patch is closed the next one in index order. A triangle that would
+    // overflow a limit seeds the next meshlet.
+    std::vector<u32> meshletIndices;
+    std::vector<vec3> meshletFaceNormals;
+    meshletIndices.reserve(submesh.indices.size());
+    meshletFaceNormals.reserve(triangleCount);
+    u32 meshletVertices[MESHLET_MAX_VERTICES];
+    u32 meshletVertexCount = 0;
+    u32 scanCursor = 0;
+    u32 lastTriangle = UINT32_MAX;
+
+    Meshlet current = {};
+    for (u32 emittedCount = 0; emittedCount < triangleCount; ++emittedCount)
+    {
+        u32 newVertices = 0;
+        u32 triangle = UINT32_MAX;
+        if (lastTriangle != UINT32_MAX)
+        {
+            triangle = FindNeighborTriangle(builder, &submesh.indices[lastTriangle * 3], 3, newVertices);
+            if (triangle == UINT32_MAX)
+                triangle = FindNeighborTriangle(builder, meshletVertices, meshletVertexCount, newVertices);
+        }
+        if (triangle == UINT32_MAX)
+        {
+            while (builder.emitted[scanCursor])
+                scanCursor++;
+            triangle = scanCursor;
+            newVertices = CountNewVertices(&submesh.indices[triangle * 3], builder.vertexMeshlet, builder.meshletId);
+        }
+
+        if (current.indexCount > 0 &&
+            (meshletVertexCount + newVertices > MESHLET_MAX_VERTICES || current.indexCount / 3 + 1 > MESHLET_MAX_TRIANGLES))
+        {
+            submesh.meshlets.push_back(current);
+            current = {};
+            current.firstIndex = (u32)meshletIndices.size();
+            meshletVertexCount = 0;
+            builder.meshletId++;
+            builder.axis = vec3(0.0f);
+        }
+
+        const u32* corners = &submesh.indices[triangle * 3];
+        for (u32 k = 0; k < 3; ++k)
+        {
+            if (builder.vertexMeshlet[corners[k]] != builder.meshletId)
+            {
+                builder.vertexMeshlet[corners[k]] = builder.meshletId;
+                meshletVertices[meshletVertexCount++] = corners[k];
+            }
+            meshletIndices.push_back(corners[k]);
+        }
+        meshletFaceNormals.push_back(faceNormals[triangle]);
+        builder.emitted[triangle] = 1;
+        builder.axis += faceNormals[triangle];
+        current.indexCount += 3;
+        lastTriangle = triangle;
+    }
+    submesh.meshlets.push_back(current);
+
+    // Triangles are stored in meshlet order so each meshlet is one index range
+    submesh.indices.swap(meshletIndices);
+    submesh.indexCount = (u32)submesh.indices.size();
+
+    for (Meshlet& meshlet : submesh.meshlets)
+        ComputeMeshletBounds(meshlet, submesh, floatStride, meshletFaceNormals);
+}
+
+u32 PushVisibleMeshletRanges(RenderQueue& queue, const Submesh& submesh, const glm::mat4& worldMatrix,
+                             const Frustum& frustum, const vec3& cameraPosition, bool coneTest, u32& culledMeshlets)
+{
+    const f32 maxScale = glm::max(glm::length(vec3(worldMatrix[0])),
+                         glm::max(glm::length(vec3(worldMatrix[1])), glm::length(vec3(worldMatrix[2]))));
+    const glm::mat3 rotation = glm::mat3(worldMatrix) * (1.0f / maxScale);
+
+    u32 rangeCount = 0;
+    u32 runFirst = 0;
+    u32 runCount = 0;
+    for (const Meshlet& meshlet : submesh.meshlets)
+    {
+        const vec3 center = vec3(worldMatrix * vec4(meshlet.sphere.center, 1.0f));
+        const f32 radius = meshlet.sphere.radius * maxScale;
+
+        bool visible = IsSphereInFrustum(frustum, center, radius);
+
+        // Every triangle faces away when the view direction to the sphere is
+        // inside the cone, widened by the sphere so any point of it counts
+        if (visible && coneTest && meshlet.coneCutoff < 1.0f)
+        {
+            const vec3 toCenter = center - cameraPosition;
+            const vec3 axis = rotation * meshlet.coneAxis;
+            visible = glm::dot(toCenter, axis) < meshlet.coneCutoff * glm::length(toCenter) + radius;
+        }
+
+        if (!visible)
+        {
+            culledMeshlets++;
+            if (runCount > 0)
+            {
+                PushRenderRange(queue, runCount, submesh.indexOffset + runFirst * sizeof(u32));
+                rangeCount++;
+                runCount = 0;
+            }
+            continue;
+        }
+
+        if (runCount == 0)
+            runFirst = meshlet.firstIndex;
+        runCount += meshlet.indexCount;
+    }
+
+    if (runCount > 0)
+    {
+        PushRenderRange(queue, runCount, submesh.indexOffset + runFirst * sizeof(u32));
+        rangeCount++;
+    }
+    return rangeCount;
+}
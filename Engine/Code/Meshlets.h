@@ -0,0 +1,18 @@
+#ifndef MESHLETS_H
+#define MESHLETS_H
+
+#include "Structs.hpp"
+
+// Splits the triangles of a submesh, in index order, into meshlets and
+// computes their bounding spheres and normal cones. Needs the float vertices,
+// call it before PackMeshVertices. Thread safe.
+void BuildMeshlets(Submesh& submesh);
+
+// Appends the index ranges of the meshlets that pass the frustum test and,
+// when coneTest is set, the backface cone test against cameraPosition. Runs of
+// visible meshlets become one range. Returns the number of ranges pushed, 0
+// when every meshlet was culled. The cone test assumes a uniform scale.
+u32 PushVisibleMeshletRanges(RenderQueue& queue, const Submesh& submesh, const glm::mat4& worldMatrix,
+                             const Frustum& frustum, const vec3& cameraPosition, bool coneTest, u32& culledMeshlets);
+
+#endif // MESHLETS_H
@@ -0,0 +1,841 @@
+#include "ObjLoader.h"
+#include "JobSystem.h"
+#include <string.h>
+#include <float.h>
+#include <unordered_map>
+
+// Chunks smaller than this are not worth a thread
+#define OBJ_MIN_CHUNK_SIZE KB(256)
+
+#define OBJ_RELATIVE_POSITION 0x1
+#define OBJ_RELATIVE_TEXCOORD 0x2
+#define OBJ_RELATIVE_NORMAL   0x4
+
+// Indices are 0-based, -1 when the corner has no such attribute. Relative
+// (negative) references are stored against the chunk's own counts until the
+// chunk bases are known.
+struct ObjCorner
+{
+    i32 position;
+    i32 texCoord;
+    i32 normal;
+    u32 relative;
+};
+
+struct ObjFace
+{
+    u32 firstCorner;
+    u32 cornerCount;
+    i32 material; // slot in ObjChunk::materials, -1 while no usemtl was seen in the chunk
+};
+
+struct ObjChunk
+{
+    const char* begin;
+    const char* end;
+    std::vector<vec3> positions;
+    std::vector<vec2> texCoords;
+    std::vector<vec3> normals;
+    std::vector<ObjCorner> corners;
+    std::vector<ObjFace> faces;
+    std::vector<std::string> materials;
+    std::vector<std::string> materialLibraries;
+};
+
+// Faces of the file that use one material
+struct ObjFaceRef
+{
+    u32 chunk;
+    u32 face;
+};
+
+bool IsObjFile(const char* filename)
+{
+    const size_t len = strlen(filename);
+    if (len < 4)
+        return false;
+    const char* ext = filename + len - 4;
+    return ext[0] == '.' &&
+        (ext[1] == 'o' || ext[1] == 'O') &&
+        (ext[2] == 'b' || ext[2] == 'B') &&
+        (ext[3] == 'j' || ext[3] == 'J');
+}
+
+static bool IsSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* SkipSpaces(const char* p, const char* end)
+{
+    while (p < end && IsSpace(*p))
+        p++;
+    return p;
+}
+
+static const char* SkipLine(const char* p, const char* end)
+{
+    const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+    return lineEnd ? lineEnd + 1 : end;
+}
+
+static bool StartsWithWord(const char* p, const char* end, const char* word)
+{
+    const size_t len = strlen(word);
+    return (size_t)(end - p) > len && strncmp(p, word, len) == 0 && IsSpace(p[len]);
+}
+
+static bool StartsWithWordNoCase(const char* p, const char* end, const char* word)
+{
+    const size_t len = strlen(word);
+    if ((size_t)(end - p) <= len || !IsSpace(p[len]))
+        return false;
+    for (size_t i = 0; i < len; ++i)
+    {
+        char c = p[i];
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        if (c != word[i])
+            return false;
+    }
+    return true;
+}
+
+// Rest of the line without surrounding whitespace or a trailing comment
+static std::string ReadRestOfLine(const char* p, const char* end)
+{
+    p = SkipSpaces(p, end);
+    const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+    if (!lineEnd)
+        lineEnd = end;
+    const char* comment = (const char*)memchr(p, '#', lineEnd - p);
+    if (comment)
+        lineEnd = comment;
+    while (lineEnd > p && IsSpace(lineEnd[-1]))
+        lineEnd--;
+    return std::string(p, lineEnd);
+}
+
+// Decimal parser for the fixed point numbers exporters write. Up to 19
+// significant digits go into an integer, the power of ten is applied once.
+static const char* ParseFloat(const char* p, const char* end, f32& value)
+{
+    static const f64 powersOfTen[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    p = SkipSpaces(p, end);
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        p++;
+    }
+
+    u64 mantissa = 0;
+    i32 exponent = 0;
+    u32 digits = 0;
+    const char* start = p;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        if (digits < 19) { mantissa = mantissa * 10 + (u64)(*p - '0'); if (mantissa) digits++; }
+        else             { exponent++; }
+        p++;
+    }
+    if (p < end && *p == '.')
+    {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            if (digits < 19) { mantissa = mantissa * 10 + (u64)(*p - '0'); exponent--; if (mantissa) digits++; }
+            p++;
+        }
+    }
+    if (p == start)
+    {
+        value = 0.0f;
+        return p;
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char* q = p + 1;
+        bool negativeExponent = false;
+        if (q < end && (*q == '-' || *q == '+'))
+        {
+            negativeExponent = *q == '-';
+            q++;
+        }
+        if (q < end && *q >= '0' && *q <= '9')
+        {
+            i32 e = 0;
+            while (q < end && *q >= '0' && *q <= '9')
+            {
+                e = glm::min(e * 10 + (*q - '0'), 9999);
+                q++;
+            }
+            exponent += negativeExponent ? -e : e;
+            p = q;
+        }
+    }
+
+    f64 result = (f64)mantissa;
+    if (exponent < 0)
+        result = exponent >= -22 ? result / powersOfTen[-exponent] : result * pow(10.0, exponent);
+    else if (exponent > 0)
+        result = exponent <= 22 ? result * powersOfTen[exponent] : result * pow(10.0, exponent);
+
+    value = (f32)(negative ? -result : result);
+    return p;
+}
+
+static const char* ParseInt(const char* p, const char* end, i32& value, bool& found)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        p++;
+    }
+    i64 result = 0;
+    found = false;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        result = glm::min<i64>(result * 10 + (*p - '0'), INT32_MAX);
+        found = true;
+        p++;
+    }
+    value = (i32)(negative ? -result : result);
+    return p;
+}
+
+// OBJ indices are 1-based, negative ones count back from the last element
+static i32 ResolveIndex(i32 index, u32 localCount, u32& relative, u32 relativeBit)
+{
+    if (index > 0)
+        return index - 1;
+    if (index < 0)
+    {
+        relative |= relativeBit;
+        return (i32)localCount + index;
+    }
+    return -1;
+}
+
+static const char* ParseFace(ObjChunk& chunk, const char* p, const char* end, i32 material)
+{
+    ObjFace face = { (u32)chunk.corners.size(), 0, material };
+
+    for (;;)
+    {
+        p = SkipSpaces(p, end);
+        if (p >= end || *p == '\n' || *p == '#')
+            break;
+
+        ObjCorner corner = { -1, -1, -1, 0 };
+        i32 index = 0;
+        bool found = false;
+
+        p = ParseInt(p, end, index, found);
+        if (!found)
+            break;
+        corner.position = ResolveIndex(index, (u32)chunk.positions.size(), corner.relative, OBJ_RELATIVE_POSITION);
+
+        if (p < end && *p == '/')
+        {
+            p = ParseInt(p + 1, end, index, found);
+            if (found)
+                corner.texCoord = ResolveIndex(index, (u32)chunk.texCoords.size(), corner.relative, OBJ_RELATIVE_TEXCOORD);
+
+            if (p < end && *p == '/')
+            {
+                p = ParseInt(p + 1, end, index, found);
+                if (found)
+                    corner.normal = ResolveIndex(index, (u32)chunk.normals.size(), corner.relative, OBJ_RELATIVE_NORMAL);
+            }
+        }
+
+        chunk.corners.push_back(corner);
+        face.cornerCount++;
+
+        // Skip whatever is left of a malformed token
+        while (p < end && !IsSpace(*p) && *p != '\n')
+            p++;
+    }
+
+    // Points and lines are dropped, like SortByPType would leave them out of the triangle meshes
+    if (face.cornerCount >= 3)
+        chunk.faces.push_back(face);
+    else
+        chunk.corners.resize(face.firstCorner);
+
+    return p;
+}
+
+static void ParseObjChunk(ObjChunk& chunk)
+{
+    const char* p = chunk.begin;
+    const char* end = chunk.end;
+    i32 material = -1;
+
+    while (p < end)
+    {
+        p = SkipSpaces(p, end);
+        if (p >= end)
+            break;
+
+        if (p[0] == 'v' && p + 1 < end)
+        {
+            if (IsSpace(p[1]))
+            {
+                vec3 position;
+                p = ParseFloat(p + 1, end, position.x);
+                p = ParseFloat(p, end, position.y);
+                p = ParseFloat(p, end, position.z);
+                chunk.positions.push_back(position);
+            }
+            else if (p[1] == 't' && p + 2 < end && IsSpace(p[2]))
+            {
+                vec2 texCoord;
+                p = ParseFloat(p + 2, end, texCoord.x);
+                p = ParseFloat(p, end, texCoord.y);
+                chunk.texCoords.push_back(texCoord);
+            }
+            else if (p[1] == 'n' && p + 2 < end && IsSpace(p[2]))
+            {
+                vec3 normal;
+                p = ParseFloat(p + 2, end, normal.x);
+                p = ParseFloat(p, end, normal.y);
+                p = ParseFloat(p, end, normal.z);
+                chunk.normals.push_back(normal);
+            }
+        }
+        else if (p[0] == 'f' && p + 1 < end && IsSpace(p[1]))
+        {
+            p = ParseFace(chunk, p + 1, end, material);
+        }
+        else if (StartsWithWord(p, end, "usemtl"))
+        {
+            chunk.materials.push_back(ReadRestOfLine(p + 6, end));
+            material = (i32)chunk.materials.size() - 1;
+        }
+        else if (StartsWithWord(p, end, "mtllib"))
+        {
+            chunk.materialLibraries.push_back(ReadRestOfLine(p + 6, end));
+        }
+
+        p = SkipLine(p, end);
+    }
+}
+
+// Values Assimp's OBJ importer gives a material the .mtl does not set
+static MaterialDesc MakeDefaultMaterial(const std::string& name)
+{
+    MaterialDesc material = {};
+    material.name = name;
+    material.albedo = vec3(0.6f);
+    material.emissive = vec3(0.0f);
+    material.smoothness = 0.0f;
+    return material;
+}
+
+// Texture statements may carry options (-bm 0.05, -s 1 1 1...) before the file name
+static std::string ReadTexturePath(const char* p, const char* end, const std::string& directory)
+{
+    struct TextureOption { const char* name; u32 arguments; };
+    static const TextureOption options[] = {
+        { "-blendu", 1 }, { "-blendv", 1 }, { "-boost", 1 }, { "-mm", 2 }, { "-o", 3 }, { "-s", 3 },
+        { "-t", 3 }, { "-texres", 1 }, { "-clamp", 1 }, { "-bm", 1 }, { "-imfchan", 1 }, { "-type", 1 },
+    };
+
+    p = SkipSpaces(p, end);
+    while (p < end && *p == '-')
+    {
+        const char* nameEnd = p;
+        while (nameEnd < end && !IsSpace(*nameEnd) && *nameEnd != '\n')
+            nameEnd++;
+
+        u32 arguments = 0;
+        for (const TextureOption& option : options)
+        {
+            if (strlen(option.name) == (size_t)(nameEnd - p) && strncmp(option.name, p, nameEnd - p) == 0)
+                arguments = option.arguments;
+        }
+
+        p = SkipSpaces(nameEnd, end);
+        for (u32 i = 0; i < arguments; ++i)
+        {
+            // -o, -s and -t take up to three numbers
+            if (i > 0 && (p >= end || !((*p >= '0' && *p <= '9') || *p == '-' || *p == '.')))
+                break;
+            while (p < end && !IsSpace(*p) && *p != '\n')
+                p++;
+            p = SkipSpaces(p, end);
+        }
+    }
+
+    const std::string filename = ReadRestOfLine(p, end);
+    return filename.empty() || directory.empty() ? filename : directory + "/" + filename;
+}
+
+static void ParseMtl(const std::string& filepath, const std::string& directory,
+                     std::vector<MaterialDesc>& materials, std::unordered_map<std::string, u32>& materialMap)
+{
+    MappedFile file = MapFileReadOnly(filepath.c_str());
+    if (!file.data)
+    {
+        ELOG("Could not open material library %s", filepath.c_str());
+        return;
+    }
+
+    const char* p = (const char*)file.data;
+    const char* end = p + file.size;
+    MaterialDesc* material = NULL;
+
+    while (p < end)
+    {
+        p = SkipSpaces(p, end);
+        if (p >= end)
+            break;
+
+        if (StartsWithWord(p, end, "newmtl"))
+        {
+            const std::string name = ReadRestOfLine(p + 6, end);
+            auto it = materialMap.find(name);
+            if (it == materialMap.end())
+            {
+                it = materialMap.insert({ name, (u32)materials.size() }).first;
+                materials.push_back(MakeDefaultMaterial(name));
+            }
+            material = &materials[it->second];
+        }
+        else if (material)
+        {
+            if (StartsWithWord(p, end, "Kd"))
+            {
+                p = ParseFloat(p + 2, end, material->albedo.r);
+                p = ParseFloat(p, end, material->albedo.g);
+                p = ParseFloat(p, end, material->albedo.b);
+            }
+            else if (StartsWithWord(p, end, "Ke"))
+            {
+                p = ParseFloat(p + 2, end, material->emissive.r);
+                p = ParseFloat(p, end, material->emissive.g);
+                p = ParseFloat(p, end, material->emissive.b);
+            }
+            else if (StartsWithWord(p, end, "Ns"))
+            {
+                f32 shininess = 0.0f;
+                p = ParseFloat(p + 2, end, shininess);
+                material->smoothness = shininess / 256.0f;
+            }
+            // Same keys Assimp maps to the diffuse, normals and height slots
+            else if (StartsWithWordNoCase(p, end, "map_kd"))
+                material->albedoTexture = ReadTexturePath(p + 6, end, directory);
+            else if (StartsWithWordNoCase(p, end, "map_kn"))
+                material->normalsTexture = ReadTexturePath(p + 6, end, directory);
+            else if (StartsWithWordNoCase(p, end, "norm"))
+                material->normalsTexture = ReadTexturePath(p + 4, end, directory);
+            else if (StartsWithWordNoCase(p, end, "map_bump"))
+                material->heightTexture = ReadTexturePath(p + 8, end, directory);
+            else if (StartsWithWordNoCase(p, end, "bump"))
+                material->heightTexture = ReadTexturePath(p + 4, end, directory);
+        }
+
+        p = SkipLine(p, end);
+    }
+
+    UnmapFile(file);
+}
+
+// Open addressing table from an OBJ corner (position, texcoord, normal) to a
+// welded vertex. Kept at most half full, it doubles when it gets there.
+struct WeldTable
+{
+    explicit WeldTable(u32 expectedCount)
+    {
+        u32 capacity = 64;
+        while (capacity < expectedCount * 2)
+            capacity <<= 1;
+        Reset(capacity);
+    }
+
+    // Returns the vertex of the corner, adding it as newVertex if it was not there
+    u32 FindOrAdd(const ObjCorner& corner, u32 newVertex, bool& added)
+    {
+        if ((count + 1) * 2 > mask + 1)
+            Grow();
+
+        for (u32 slot = Hash(corner.position, corner.texCoord, corner.normal) & mask; ; slot = (slot + 1) & mask)
+        {
+            Entry& entry = entries[slot];
+            if (entry.position == EMPTY_SLOT)
+            {
+                entry = { corner.position, corner.texCoord, corner.normal, newVertex };
+                count++;
+                added = true;
+                return newVertex;
+            }
+            if (entry.position == corner.position && entry.texCoord == corner.texCoord && entry.normal == corner.normal)
+            {
+                added = false;
+                return entry.vertex;
+            }
+        }
+    }
+
+    struct Entry
+    {
+        i32 position;
+        i32 texCoord;
+        i32 normal;
+        u32 vertex;
+    };
+
+    static const i32 EMPTY_SLOT = -2;
+
+    static u32 Hash(i32 position, i32 texCoord, i32 normal)
+    {
+        u64 h = (u64)(u32)position * 0x9E3779B97F4A7C15ull;
+        h ^= (u64)(u32)texCoord * 0xC2B2AE3D27D4EB4Full;
+        h ^= (u64)(u32)normal * 0x165667B19E3779F9ull;
+        return (u32)(h ^ (h >> 32));
+    }
+
+    void Reset(u32 capacity)
+    {
+        entries.assign(capacity, Entry{ EMPTY_SLOT, 0, 0, 0 });
+        mask = capacity - 1;
+        count = 0;
+    }
+
+    void Grow()
+    {
+        std::vector<Entry> old;
+        old.swap(entries);
+        Reset((u32)old.size() * 2);
+        for (const Entry& entry : old)
+        {
+            if (entry.position == EMPTY_SLOT)
+                continue;
+            u32 slot = Hash(entry.position, entry.texCoord, entry.normal) & mask;
+            while (entries[slot].position != EMPTY_SLOT)
+                slot = (slot + 1) & mask;
+            entries[slot] = entry;
+            count++;
+        }
+    }
+
+    std::vector<Entry> entries;
+    u32 mask;
+    u32 count;
+};
+
+struct ObjGeometry
+{
+    std::vector<vec3> positions;
+    std::vector<vec2> texCoords;
+    std::vector<vec3> normals;
+};
+
+static vec3 AnyPerpendicular(const vec3& n)
+{
+    const vec3 axis = fabsf(n.x) < 0.9f ? vec3(1.0f, 0.0f, 0.0f) : vec3(0.0f, 1.0f, 0.0f);
+    return glm::normalize(glm::cross(n, axis));
+}
+
+static void BuildObjSubmesh(const ObjGeometry& geometry, const std::vector<ObjChunk>& chunks,
+                            const std::vector<ObjFaceRef>& faces, Submesh& submesh)
+{
+    u32 cornerCount = 0;
+    bool hasTexCoords = false;
+    bool hasNormals = true;
+    for (const ObjFaceRef& ref : faces)
+    {
+        const ObjChunk& chunk = chunks[ref.chunk];
+        const ObjFace& face = chunk.faces[ref.face];
+        cornerCount += face.cornerCount;
+        for (u32 i = 0; i < face.cornerCount; ++i)
+        {
+            const ObjCorner& corner = chunk.corners[face.firstCorner + i];
+            hasTexCoords |= corner.texCoord >= 0;
+            hasNormals &= corner.normal >= 0;
+        }
+    }
+
+    // Weld corners into vertices and fan triangulate the polygons. Closed
+    // meshes share each vertex between about four corners.
+    WeldTable table(cornerCount / 4);
+    std::vector<ObjCorner> vertices;
+    std::vector<u32> indices;
+    std::vector<u32> polygon;
+    for (const ObjFaceRef& ref : faces)
+    {
+        const ObjChunk& chunk = chunks[ref.chunk];
+        const ObjFace& face = chunk.faces[ref.face];
+
+        polygon.clear();
+        for (u32 i = 0; i < face.cornerCount; ++i)
+        {
+            ObjCorner corner = chunk.corners[face.firstCorner + i];
+            corner.relative = 0;
+            if (!hasNormals)
+                corner.normal = -1;
+
+            bool added = false;
+            const u32 vertex = table.FindOrAdd(corner, (u32)vertices.size(), added);
+            if (added)
+                vertices.push_back(corner);
+            polygon.push_back(vertex);
+        }
+
+        for (u32 i = 1; i + 1 < polygon.size(); ++i)
+        {
+            indices.push_back(polygon[0]);
+            indices.push_back(polygon[i]);
+            indices.push_back(polygon[i + 1]);
+        }
+    }
+
+    const u32 vertexCount = (u32)vertices.size();
+    std::vector<vec3> positions(vertexCount);
+    std::vector<vec2> texCoords(vertexCount, vec2(0.0f));
+    std::vector<vec3> normals(vertexCount, vec3(0.0f));
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        positions[i] = geometry.positions[vertices[i].position];
+        if (vertices[i].texCoord >= 0)
+            texCoords[i] = geometry.texCoords[vertices[i].texCoord];
+        if (hasNormals)
+            normals[i] = geometry.normals[vertices[i].normal];
+    }
+
+    // GenSmoothNormals: average of the unit face normals around each position
+    if (!hasNormals)
+    {
+        std::unordered_map<i32, vec3> positionNormals;
+        for (u32 t = 0; t + 2 < indices.size(); t += 3)
+        {
+            const vec3& p0 = positions[indices[t]];
+            const vec3 faceNormal = glm::cross(positions[indices[t + 1]] - p0, positions[indices[t + 2]] - p0);
+            const f32 length = glm::length(faceNormal);
+            if (length <= FLT_MIN)
+                continue;
+            for (u32 k = 0; k < 3; ++k)
+                positionNormals[vertices[indices[t + k]].position] += faceNormal / length;
+        }
+        for (u32 i = 0; i < vertexCount; ++i)
+        {
+            const vec3 sum = positionNormals[vertices[i].position];
+            const f32 length = glm::length(sum);
+            normals[i] = length > FLT_MIN ? sum / length : vec3(0.0f, 1.0f, 0.0f);
+        }
+    }
+
+    // CalcTangentSpace: per face UV gradients, projected on the vertex normal and averaged.
+    // The bitangent is the mathematical one, i.e. what the Assimp path gets after its flip.
+    std::vector<vec3> tangents;
+    std::vector<vec3> bitangents;
+    if (hasTexCoords)
+    {
+        tangents.assign(vertexCount, vec3(0.0f));
+        bitangents.assign(vertexCount, vec3(0.0f));
+        for (u32 t = 0; t + 2 < indices.size(); t += 3)
+        {
+            const u32 i0 = indices[t], i1 = indices[t + 1], i2 = indices[t + 2];
+            const vec3 v = positions[i1] - positions[i0];
+            const vec3 w = positions[i2] - positions[i0];
+            const vec2 s = texCoords[i1] - texCoords[i0];
+            const vec2 r = texCoords[i2] - texCoords[i0];
+            const f32 det = s.x * r.y - s.y * r.x;
+            if (fabsf(det) <= FLT_MIN)
+                continue;
+
+            const f32 sign = det < 0.0f ? -1.0f : 1.0f;
+            const vec3 faceTangent = (v * r.y - w * s.y) * sign;
+            const vec3 faceBitangent = (w * s.x - v * r.x) * sign;
+            for (u32 k = 0; k < 3; ++k)
+            {
+                const u32 vertex = indices[t + k];
+                const vec3& n = normals[vertex];
+                const vec3 tangent = faceTangent - n * glm::dot(faceTangent, n);
+                const vec3 bitangent = faceBitangent - n * glm::dot(faceBitangent, n);
+                if (glm::dot(tangent, tangent) > FLT_MIN) tangents[vertex] += glm::normalize(tangent);
+                if (glm::dot(bitangent, bitangent) > FLT_MIN) bitangents[vertex] += glm::normalize(bitangent);
+            }
+        }
+        for (u32 i = 0; i < vertexCount; ++i)
+        {
+            const vec3& n = normals[i];
+            tangents[i] = glm::dot(tangents[i], tangents[i]) > FLT_MIN ? glm::normalize(tangents[i]) : AnyPerpendicular(n);
+            bitangents[i] = glm::dot(bitangents[i], bitangents[i]) > FLT_MIN ? glm::normalize(bitangents[i]) : glm::cross(n, tangents[i]);
+        }
+    }
+
+    // Same layout ProcessAssimpMesh builds
+    VertexBufferLayout& layout = submesh.vertexBufferLayout;
+    layout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0 });
+    layout.attributes.push_back(VertexBufferAttribute{ 1, 3, 3 * sizeof(float) });
+    layout.stride = 6 * sizeof(float);
+    if (hasTexCoords)
+    {
+        layout.attributes.push_back(VertexBufferAttribute{ 2, 2, layout.stride });
+        layout.stride += 2 * sizeof(float);
+        layout.attributes.push_back(VertexBufferAttribute{ 3, 3, layout.stride });
+        layout.stride += 3 * sizeof(float);
+        layout.attributes.push_back(VertexBufferAttribute{ 4, 3, layout.stride });
+        layout.stride += 3 * sizeof(float);
+    }
+
+    submesh.vertices.reserve(vertexCount * (layout.stride / sizeof(float)));
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        std::vector<float>& out = submesh.vertices;
+        out.insert(out.end(), { positions[i].x, positions[i].y, positions[i].z });
+        out.insert(out.end(), { normals[i].x, normals[i].y, normals[i].z });
+        if (hasTexCoords)
+        {
+            out.insert(out.end(), { texCoords[i].x, texCoords[i].y });
+            out.insert(out.end(), { tangents[i].x, tangents[i].y, tangents[i].z });
+            out.insert(out.end(), { bitangents[i].x, bitangents[i].y, bitangents[i].z });
+        }
+    }
+    submesh.indices.swap(indices);
+}
+
+static bool IsValidIndex(i32 index, size_t count, bool optional)
+{
+    return (optional && index == -1) || (index >= 0 && (size_t)index < count);
+}
+
+bool LoadObjModel(JobSystem& jobs, const char* filename, ImportedModel& imported)
+{
+    MappedFile file = MapFileReadOnly(filename);
+    if (!file.data)
+    {
+        ELOG("Could not open file %s", filename);
+        return false;
+    }
+
+    // Split at line boundaries, one chunk per thread at most
+    const char* text = (const char*)file.data;
+    const char* textEnd = text + file.size;
+    const u32 threadCount = (u32)jobs.workers.size() + 1u;
+    const u32 chunkCount = (u32)glm::clamp<u64>(file.size / OBJ_MIN_CHUNK_SIZE, 1, threadCount);
+
+    std::vector<ObjChunk> chunks(chunkCount);
+    const char* chunkBegin = text;
+    for (u32 i = 0; i < chunkCount; ++i)
+    {
+        const char* chunkEnd = textEnd;
+        if (i + 1 < chunkCount)
+        {
+            const char* split = text + file.size * (i + 1) / chunkCount;
+            chunkEnd = SkipLine(split > chunkBegin ? split : chunkBegin, textEnd);
+        }
+        chunks[i].begin = chunkBegin;
+        chunks[i].end = chunkEnd;
+        chunkBegin = chunkEnd;
+    }
+
+    ParallelFor(jobs, chunkCount, [&chunks](u32 i) { ParseObjChunk(chunks[i]); });
+
+    // Global element ranges of each chunk, then every reference becomes absolute
+    ObjGeometry geometry;
+    std::vector<u32> positionBase(chunkCount), texCoordBase(chunkCount), normalBase(chunkCount);
+    for (u32 i = 0; i < chunkCount; ++i)
+    {
+        positionBase[i] = (u32)geometry.positions.size();
+        texCoordBase[i] = (u32)geometry.texCoords.size();
+        normalBase[i] = (u32)geometry.normals.size();
+        geometry.positions.insert(geometry.positions.end(), chunks[i].positions.begin(), chunks[i].positions.end());
+        geometry.texCoords.insert(geometry.texCoords.end(), chunks[i].texCoords.begin(), chunks[i].texCoords.end());
+        geometry.normals.insert(geometry.normals.end(), chunks[i].normals.begin(), chunks[i].normals.end());
+    }
+
+    const std::string path = filename;
+    const size_t slash = path.find_last_of("/\\");
+    const std::string directory = slash == std::string::npos ? std::string() : path.substr(0, slash);
+
+    // Assimp always creates its default material first, the libraries follow in order
+    std::vector<MaterialDesc>& materials = imported.materials;
+    std::unordered_map<std::string, u32> materialMap;
+    materials.push_back(MakeDefaultMaterial("DefaultMaterial"));
+    for (const ObjChunk& chunk : chunks)
+    {
+        for (const std::string& library : chunk.materialLibraries)
+            ParseMtl(directory.empty() ? library : directory + "/" + library, directory, materials, materialMap);
+    }
+
+    // Faces grouped by material, in file order. A chunk starts with the
+    // material the previous one ended with.
+    std::vector<std::vector<ObjFaceRef>> materialFaces(materials.size());
+    u32 currentMaterial = 0;
+    u32 skippedFaces = 0;
+    for (u32 c = 0; c < chunkCount; ++c)
+    {
+        ObjChunk& chunk = chunks[c];
+        std::vector<u32> chunkMaterials(chunk.materials.size());
+        for (u32 m = 0; m < chunk.materials.size(); ++m)
+        {
+            auto it = materialMap.find(chunk.materials[m]);
+            chunkMaterials[m] = it != materialMap.end() ? it->second : 0;
+        }
+
+        for (ObjCorner& corner : chunk.corners)
+        {
+            if (corner.relative & OBJ_RELATIVE_POSITION) corner.position += positionBase[c];
+            if (corner.relative & OBJ_RELATIVE_TEXCOORD) corner.texCoord += texCoordBase[c];
+            if (corner.relative & OBJ_RELATIVE_NORMAL)   corner.normal += normalBase[c];
+        }
+
+        for (u32 f = 0; f < chunk.faces.size(); ++f)
+        {
+            const ObjFace& face = chunk.faces[f];
+            bool valid = true;
+            for (u32 i = 0; i < face.cornerCount && valid; ++i)
+            {
+                const ObjCorner& corner = chunk.corners[face.firstCorner + i];
+                valid = IsValidIndex(corner.position, geometry.positions.size(), false) &&
+                        IsValidIndex(corner.texCoord, geometry.texCoords.size(), true) &&
+                        IsValidIndex(corner.normal, geometry.normals.size(), true);
+            }
+            if (!valid)
+            {
+                skippedFaces++;
+                continue;
+            }
+
+            const u32 material = face.material >= 0 ? chunkMaterials[face.material] : currentMaterial;
+            materialFaces[material].push_back({ c, f });
+        }
+
+        if (!chunk.materials.empty())
+            currentMaterial = chunkMaterials.back();
+    }
+
+    if (skippedFaces > 0)
+    {
+        ELOG("%s: skipped %u faces with out of range indices", filename, skippedFaces);
+    }
+
+    // One submesh per material in material order, as PreTransformVertices leaves them
+    std::vector<u32> usedMaterials;
+    for (u32 m = 0; m < materialFaces.size(); ++m)
+    {
+        if (!materialFaces[m].empty())
+            usedMaterials.push_back(m);
+    }
+
+    Mesh& mesh = imported.mesh;
+    mesh.submeshes.resize(usedMaterials.size());
+    imported.submeshMaterials = usedMaterials;
+    ParallelFor(jobs, (u32)usedMaterials.size(), [&](u32 i)
+    {
+        BuildObjSubmesh(geometry, chunks, materialFaces[usedMaterials[i]], mesh.submeshes[i]);
+    });
+
+    UnmapFile(file);
+    return true;
+}
@@ -0,0 +1,16 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include "Structs.hpp"
+
+bool IsObjFile(const char* filename);
+
+// Native Wavefront OBJ/MTL import producing the same data the Assimp path
+// does with MODEL_IMPORT_FLAGS: one submesh per material, triangulated,
+// welded, with smooth normals when the file has none and a tangent frame
+// when it has texture coordinates. The file is parsed in chunks on the job
+// system. Fills imported.materials, submeshMaterials and the submesh
+// vertices, indices and layouts. Thread safe, does not touch GL.
+bool LoadObjModel(JobSystem& jobs, const char* filename, ImportedModel& imported);
+
+#endif // OBJ_LOADER_H
@@ -0,0 +1,186 @@
+#include "ProgramReflection.h"
+#include "platform.h"
+
+static const char* UniformNames[] = {
+    "uModel",
+    "uView",
+    "uProj",
+    "uCameraPosition",
+    "uViewPos",
+    "uTexture",
+    "uDiffuse",
+    "uAlbedoTexture",
+    "uNormalMap",
+    "uHeightMap",
+    "uHeightScale",
+    "skybox",
+    "uSkybox",
+    "uReflectionIntensity",
+    "diffus_amb",
+    "cubeMapType",
+    "uDebugType",
+    "uViewMode",
+    "uNear",
+    "uFar",
+    "uColor",
+    "uNormals",
+    "uPosition",
+    "uViewDir",
+    "uDepth",
+    "uCompactGBuffer",
+    "uInverseViewProjection",
+    "uPositionScale",
+    "uPositionOffset",
+    "uIrradianceSH",
+    "uSpecularEnvironment",
+    "uSpecularMaxLod",
+    "uBrdfLut",
+    "uConeStepMap",
+    "uReliefMarch",
+    "uReliefFade",
+    "uReliefAdaptive",
+};
+static_assert(ARRAY_COUNT(UniformNames) == Uniform_Count, "UniformNames must match the UniformId enum");
+
+const char* GetUniformName(UniformId id)
+{
+    return UniformNames[id];
+}
+
+static void ReflectAttributes(Program& program)
+{
+    program.vertexInputLayout.attributes.clear();
+
+    GLint attributeCount = 0;
+    glGetProgramiv(program.handle, GL_ACTIVE_ATTRIBUTES, &attributeCount);
+    for (GLint i = 0; i < attributeCount; ++i)
+    {
+        GLchar name[248];
+        GLsizei realNameSize = 0;
+        GLint attribSize = 0;
+        GLenum attribType;
+        glGetActiveAttrib(program.handle, i, ARRAY_COUNT(name), &realNameSize, &attribSize, &attribType, name);
+        GLint attribLocation = glGetAttribLocation(program.handle, name);
+        program.vertexInputLayout.attributes.push_back({ static_cast<u8>(attribLocation), static_cast<u8>(attribSize) });
+    }
+}
+
+static void ReflectUniforms(Program& program)
+{
+    program.uniforms.clear();
+
+    GLint uniformCount = 0;
+    glGetProgramiv(program.handle, GL_ACTIVE_UNIFORMS, &uniformCount);
+    for (GLint i = 0; i < uniformCount; ++i)
+    {
+        GLchar name[248];
+        GLsizei nameLength = 0;
+        GLint size = 0;
+        GLenum type;
+        glGetActiveUniform(program.handle, i, ARRAY_COUNT(name), &nameLength, &size, &type, name);
+
+        // Members of uniform blocks have no location, they are reflected with the block
+        GLint location = glGetUniformLocation(program.handle, name);
+        if (location < 0)
+            continue;
+
+        // Arrays are reported as "name[0]", store the base name
+        std::string uniformName(name, nameLength);
+        size_t bracket = uniformName.find('[');
+        if (bracket != std::string::npos)
+            uniformName.resize(bracket);
+
+        program.uniforms.push_back({ uniformName, location, type, size });
+    }
+
+    for (u32 id = 0; id < Uniform_Count; ++id)
+    {
+        program.uniformLocations[id] = FindUniformLocation(program, UniformNames[id]);
+    }
+}
+
+static void ReflectUniformBlocks(Program& program)
+{
+    program.uniformBlocks.clear();
+
+    GLint blockCount = 0;
+    glGetProgramiv(program.handle, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+    for (GLint i = 0; i < blockCount; ++i)
+    {
+        GLchar name[248];
+        GLsizei nameLength = 0;
+        glGetActiveUniformBlockName(program.handle, i, ARRAY_COUNT(name), &nameLength, name);
+
+        ProgramUniformBlock block = {};
+        block.name.assign(name, nameLength);
+        block.index = (GLuint)i;
+        glGetActiveUniformBlockiv(program.handle, i, GL_UNIFORM_BLOCK_BINDING, &block.binding);
+        glGetActiveUniformBlockiv(program.handle, i, GL_UNIFORM_BLOCK_DATA_SIZE, &block.dataSize);
+        program.uniformBlocks.push_back(block);
+    }
+}
+
+void ReflectProgram(Program& program)
+{
+    ReflectAttributes(program);
+    ReflectUniforms(program);
+    ReflectUniformBlocks(program);
+}
+
+GLint FindUniformLocation(const Program& program, const char* name)
+{
+    for (const ProgramUniform& uniform : program.uniforms)
+        if (uniform.name == name)
+            return uniform.location;
+    return -1;
+}
+
+const ProgramUniformBlock* FindUniformBlock(const Program& program, const char* name)
+{
+    for (const ProgramUniformBlock& block : program.uniformBlocks)
+        if (block.name == name)
+            return &block;
+    return NULL;
+}
+
+void SetUniformInt(const Program& program, UniformId id, i32 value)
+{
+    GLint location = program.uniformLocations[id];
+    if (location >= 0) glUniform1i(location, value);
+}
+
+void SetUniformFloat(const Program& program, UniformId id, f32 value)
+{
+    GLint location = program.uniformLocations[id];
+    if (location >= 0) glUniform1f(location, value);
+}
+
+void SetUniformVec2(const Program& program, UniformId id, const vec2& value)
+{
+    GLint location = program.uniformLocations[id];
+    if (location >= 0) glUniform2fv(location, 1, glm::value_ptr(value));
+}
+
+void SetUniformVec3(const Program& program, UniformId id, const vec3& value)
+{
+    GLint location = program.uniformLocations[id];
+    if (location >= 0) glUniform3fv(location, 1, glm::value_ptr(value));
+}
+
+void SetUniformVec3Array(const Program& program, UniformId id, const vec3* values, u32 count)
+{
+    GLint location = program.uniformLocations[id];
+    if (location >= 0) glUniform3fv(location, count, glm::value_ptr(values[0]));
+}
+
+void SetUniformVec4(const Program& program, UniformId id, const vec4& value)
+{
+    GLint location = program.uniformLocations[id];
+    if (location >= 0) glUniform4fv(location, 1, glm::value_ptr(value));
+}
+
+void SetUniformMat4(const Program& program, UniformId id, const glm::mat4& value)
+{
+    GLint location = program.uniformLocations[id];
+    if (location >= 0) glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value));
+}
@@ -0,0 +1,28 @@
+#ifndef PROGRAM_REFLECTION_H
+#define PROGRAM_REFLECTION_H
+
+#include "Structs.hpp"
+#include <glad/glad.h>
+
+// Reflection of attributes, uniforms and uniform blocks. It runs once per link
+// (LoadProgram and shader hot reload) so the render loop never has to look up
+// uniforms by name.
+void ReflectProgram(Program& program);
+
+// Returns the location of a reflected uniform or -1 if the program doesn't use it.
+GLint FindUniformLocation(const Program& program, const char* name);
+const ProgramUniformBlock* FindUniformBlock(const Program& program, const char* name);
+
+const char* GetUniformName(UniformId id);
+
+// Typed setters acting on the currently bound program. Uniforms that were
+// optimized out by the driver are skipped.
+void SetUniformInt(const Program& program, UniformId id, i32 value);
+void SetUniformFloat(const Program& program, UniformId id, f32 value);
+void SetUniformVec2(const Program& program, UniformId id, const vec2& value);
+void SetUniformVec3(const Program& program, UniformId id, const vec3& value);
+void SetUniformVec3Array(const Program& program, UniformId id, const vec3* values, u32 count);
+void SetUniformVec4(const Program& program, UniformId id, const vec4& value);
+void SetUniformMat4(const Program& program, UniformId id, const glm::mat4& value);
+
+#endif // PROGRAM_REFLECTION_H
@@ -0,0 +1,118 @@
+#include "RenderQueue.h"
+#include "platform.h"
+#include <string.h>
+
+static u64 PackField(u64 key, u32 value, u32 bits)
+{
+    const u64 mask = (1ull << bits) - 1ull;
+    return (key << bits) | ((u64)value & mask);
+}
+
+u64 MakeDrawKey(u32 pass, u32 programRank, u32 materialIdx, u32 meshIdx, f32 viewDepth)
+{
+    const u32 maxDepth = (1u << DRAW_KEY_DEPTH_BITS) - 1u;
+    f32 normalizedDepth = glm::clamp(viewDepth / DRAW_KEY_MAX_DEPTH, 0.0f, 1.0f);
+    u32 depth = (u32)(normalizedDepth * (f32)maxDepth);
+
+    u64 key = 0;
+    key = PackField(key, pass, DRAW_KEY_PASS_BITS);
+    key = PackField(key, programRank, DRAW_KEY_PROGRAM_BITS);
+    key = PackField(key, materialIdx, DRAW_KEY_MATERIAL_BITS);
+    key = PackField(key, meshIdx, DRAW_KEY_MESH_BITS);
+    key = PackField(key, depth, DRAW_KEY_DEPTH_BITS);
+    return key;
+}
+
+void ClearRenderQueue(RenderQueue& queue)
+{
+    queue.items.clear();
+    queue.entries.clear();
+    queue.rangeCounts.clear();
+    queue.rangeOffsets.clear();
+    queue.drawCount = 0;
+    queue.triangleCount = 0;
+    queue.programChanges = 0;
+    queue.materialChanges = 0;
+    queue.vaoChanges = 0;
+}
+
+void PushRenderItem(RenderQueue& queue, u64 key, const RenderItem& item)
+{
+    RenderQueueEntry entry = { key, (u32)queue.items.size() };
+    queue.items.push_back(item);
+    queue.entries.push_back(entry);
+}
+
+void PushRenderRange(RenderQueue& queue, u32 indexCount, u32 byteOffset)
+{
+    queue.rangeCounts.push_back((GLsizei)indexCount);
+    queue.triangleCount += indexCount / 3;
+    queue.rangeOffsets.push_back((const void*)(uintptr_t)byteOffset);
+}
+
+void DrawRenderItem(const RenderQueue& queue, const RenderItem& item)
+{
+    if (item.rangeCount == 1)
+    {
+        glDrawElements(GL_TRIANGLES, queue.rangeCounts[item.firstRange], GL_UNSIGNED_INT, queue.rangeOffsets[item.firstRange]);
+    }
+    else
+    {
+        glMultiDrawElements(GL_TRIANGLES, &queue.rangeCounts[item.firstRange], GL_UNSIGNED_INT,
+                            &queue.rangeOffsets[item.firstRange], (GLsizei)item.rangeCount);
+    }
+}
+
+void SortRenderQueue(RenderQueue& queue)
+{
+    const u32 count = (u32)queue.entries.size();
+    if (count < 2)
+        return;
+
+    queue.scratch.resize(count);
+
+    u32 histograms[8][256];
+    memset(histograms, 0, sizeof(histograms));
+    for (u32 i = 0; i < count; ++i)
+    {
+        const u64 key = queue.entries[i].key;
+        for (u32 byte = 0; byte < 8; ++byte)
+            histograms[byte][(key >> (byte * 8)) & 0xff]++;
+    }
+
+    RenderQueueEntry* src = queue.entries.data();
+    RenderQueueEntry* dst = queue.scratch.data();
+
+    for (u32 byte = 0; byte < 8; ++byte)
+    {
+        u32* histogram = histograms[byte];
+        const u32 shift = byte * 8;
+
+        // Every key has the same digit here, this pass would not move anything
+        if (histogram[(src[0].key >> shift) & 0xff] == count)
+            continue;
+
+        u32 offset = 0;
+        for (u32 digit = 0; digit < 256; ++digit)
+        {
+            const u32 digitCount = histogram[digit];
+            histogram[digit] = offset;
+            offset += digitCount;
+        }
+
+        for (u32 i = 0; i < count; ++i)
+        {
+            const u32 digit = (src[i].key >> shift) & 0xff;
+            dst[histogram[digit]++] = src[i];
+        }
+
+        RenderQueueEntry* tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    if (src != queue.entries.data())
+    {
+        queue.entries.swap(queue.scratch);
+    }
+}
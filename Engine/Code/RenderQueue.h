@@ -0,0 +1,32 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include "Structs.hpp"
+
+// Draw key layout, most significant bits first:
+//   pass (4) | program rank (8) | material (16) | mesh (12) | depth (24)
+// Sorting ascending groups draws by pass, then by program and material to
+// minimize state changes, and finally front-to-back inside each group.
+#define DRAW_KEY_PASS_BITS     4
+#define DRAW_KEY_PROGRAM_BITS  8
+#define DRAW_KEY_MATERIAL_BITS 16
+#define DRAW_KEY_MESH_BITS     12
+#define DRAW_KEY_DEPTH_BITS    24
+
+#define DRAW_KEY_MAX_DEPTH 5000.0f
+
+u64 MakeDrawKey(u32 pass, u32 programRank, u32 materialIdx, u32 meshIdx, f32 viewDepth);
+
+void ClearRenderQueue(RenderQueue& queue);
+void PushRenderItem(RenderQueue& queue, u64 key, const RenderItem& item);
+
+// Index range drawn by the next items, byteOffset is into the mesh index buffer
+void PushRenderRange(RenderQueue& queue, u32 indexCount, u32 byteOffset);
+
+// Draws the ranges of an item with the mesh VAO already bound
+void DrawRenderItem(const RenderQueue& queue, const RenderItem& item);
+
+// LSD radix sort over the 8 key bytes. Bytes that are equal for every entry are skipped.
+void SortRenderQueue(RenderQueue& queue);
+
+#endif // RENDER_QUEUE_H
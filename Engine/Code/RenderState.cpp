@@ -0,0 +1,122 @@
+#include "RenderState.h"
+#include "platform.h"
+
+#define UNKNOWN_HANDLE UINT32_MAX
+#define UNKNOWN_FLAG   -1
+
+void BeginRenderStateFrame(RenderState& state)
+{
+    state.lastFrameIssuedCalls = state.issuedCalls;
+    state.lastFrameSkippedCalls = state.skippedCalls;
+    state.issuedCalls = 0;
+    state.skippedCalls = 0;
+
+    state.program = UNKNOWN_HANDLE;
+    state.vertexArray = UNKNOWN_HANDLE;
+    state.framebuffer = UNKNOWN_HANDLE;
+    state.activeTexture = GL_NONE;
+    for (u32 i = 0; i < RENDER_STATE_TEXTURE_UNITS; ++i)
+    {
+        state.textures2D[i] = UNKNOWN_HANDLE;
+        state.texturesCube[i] = UNKNOWN_HANDLE;
+    }
+    for (u32 i = 0; i < RENDER_STATE_UNIFORM_BUFFERS; ++i)
+    {
+        state.uniformBuffers[i].buffer = UNKNOWN_HANDLE;
+    }
+    state.depthTest = UNKNOWN_FLAG;
+    state.depthWrite = UNKNOWN_FLAG;
+    state.cullFace = UNKNOWN_FLAG;
+    state.depthFunc = GL_NONE;
+}
+
+void SetProgram(RenderState& state, GLuint program)
+{
+    if (state.program == program) { state.skippedCalls++; return; }
+    glUseProgram(program);
+    state.program = program;
+    state.issuedCalls++;
+}
+
+void SetVertexArray(RenderState& state, GLuint vertexArray)
+{
+    if (state.vertexArray == vertexArray) { state.skippedCalls++; return; }
+    glBindVertexArray(vertexArray);
+    state.vertexArray = vertexArray;
+    state.issuedCalls++;
+}
+
+void SetFramebuffer(RenderState& state, GLuint framebuffer)
+{
+    if (state.framebuffer == framebuffer) { state.skippedCalls++; return; }
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    state.framebuffer = framebuffer;
+    state.issuedCalls++;
+}
+
+void SetTexture(RenderState& state, u32 unit, GLenum target, GLuint texture)
+{
+    ASSERT(unit < RENDER_STATE_TEXTURE_UNITS, "Texture unit out of the tracked range");
+    ASSERT(target == GL_TEXTURE_2D || target == GL_TEXTURE_CUBE_MAP, "Untracked texture target");
+
+    GLuint& bound = target == GL_TEXTURE_2D ? state.textures2D[unit] : state.texturesCube[unit];
+    if (bound == texture) { state.skippedCalls++; return; }
+
+    if (state.activeTexture != GL_TEXTURE0 + unit)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        state.activeTexture = GL_TEXTURE0 + unit;
+        state.issuedCalls++;
+    }
+    glBindTexture(target, texture);
+    bound = texture;
+    state.issuedCalls++;
+}
+
+void SetUniformBufferRange(RenderState& state, u32 index, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    ASSERT(index < RENDER_STATE_UNIFORM_BUFFERS, "Uniform buffer binding out of the tracked range");
+
+    UniformBufferBinding& binding = state.uniformBuffers[index];
+    if (binding.buffer == buffer && binding.offset == offset && binding.size == size) { state.skippedCalls++; return; }
+    glBindBufferRange(GL_UNIFORM_BUFFER, index, buffer, offset, size);
+    binding.buffer = buffer;
+    binding.offset = offset;
+    binding.size = size;
+    state.issuedCalls++;
+}
+
+static void SetCapability(RenderState& state, i8& cached, GLenum capability, bool enabled)
+{
+    if (cached == (i8)enabled) { state.skippedCalls++; return; }
+    if (enabled) glEnable(capability);
+    else         glDisable(capability);
+    cached = (i8)enabled;
+    state.issuedCalls++;
+}
+
+void SetDepthTest(RenderState& state, bool enabled)
+{
+    SetCapability(state, state.depthTest, GL_DEPTH_TEST, enabled);
+}
+
+void SetCullFace(RenderState& state, bool enabled)
+{
+    SetCapability(state, state.cullFace, GL_CULL_FACE, enabled);
+}
+
+void SetDepthWrite(RenderState& state, bool enabled)
+{
+    if (state.depthWrite == (i8)enabled) { state.skippedCalls++; return; }
+    glDepthMask(enabled ? GL_TRUE : GL_FALSE);
+    state.depthWrite = (i8)enabled;
+    state.issuedCalls++;
+}
+
+void SetDepthFunc(RenderState& state, GLenum func)
+{
+    if (state.depthFunc == func) { state.skippedCalls++; return; }
+    glDepthFunc(func);
+    state.depthFunc = func;
+    state.issuedCalls++;
+}
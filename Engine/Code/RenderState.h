@@ -0,0 +1,23 @@
+#ifndef RENDER_STATE_H
+#define RENDER_STATE_H
+
+#include "Structs.hpp"
+#include <glad/glad.h>
+
+// Invalidates the cached state and publishes last frame's counters. Call it
+// before the first draw of every frame.
+void BeginRenderStateFrame(RenderState& state);
+
+// Each setter issues the GL call only when the value differs from the cached
+// one, otherwise it counts the call as skipped.
+void SetProgram(RenderState& state, GLuint program);
+void SetVertexArray(RenderState& state, GLuint vertexArray);
+void SetFramebuffer(RenderState& state, GLuint framebuffer);
+void SetTexture(RenderState& state, u32 unit, GLenum target, GLuint texture);
+void SetUniformBufferRange(RenderState& state, u32 index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+void SetDepthTest(RenderState& state, bool enabled);
+void SetDepthWrite(RenderState& state, bool enabled);
+void SetDepthFunc(RenderState& state, GLenum func);
+void SetCullFace(RenderState& state, bool enabled);
+
+#endif // RENDER_STATE_H
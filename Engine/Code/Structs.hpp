@@ -4,6 +4,12 @@
 #include"platform.h"
 #include <glad/glad.h> 
 #include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <unordered_map>
 
 typedef glm::vec2  vec2;
 typedef glm::vec3  vec3;
@@ -42,6 +48,34 @@ struct Buffer {
     u8* data;
 };
 
+// Per-frame streaming buffer split in RING_BUFFER_FRAMES regions. Each frame
+// writes into the next region once the fence of its previous use has been
+// signaled, so the CPU never writes memory the GPU is still reading.
+#define RING_BUFFER_FRAMES 3
+
+struct RingBuffer {
+    u32 size;           // whole allocation
+    u32 regionSize;
+    GLenum type;
+    GLuint handle;
+    u32 head;           // relative to the current region
+    u8* data;           // start of the current region
+    u8* mapping;        // persistent mapping of the whole buffer, NULL when not available
+    u32 regionIdx;
+    GLsync fences[RING_BUFFER_FRAMES];
+    u32 stalls;         // waits that found the GPU still busy with the region
+};
+
+// Worker threads for CPU-only work (imports, decoding). Jobs must not touch
+// GL or the frame arena (MakeString, MakePath...), both belong to the main thread.
+struct JobSystem {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool quit;
+};
+
 struct Image
 {
     void* pixels;
@@ -54,14 +88,121 @@ enum TextureType
 {
     Albedo,
     Normal,
-    Height
+    Height,
+    ConeStep,   // built from a height map, see ConeStepMap.h
+    TextureType_Count
+};
+
+// Depth and cone ratio of a height map, RG8 rows bottom to top like the GL texture
+struct ConeStepMap
+{
+    ivec2 size;
+    std::vector<u8> texels;
+};
+
+// Block compressed formats the texture cooker produces, on 4x4 pixel blocks
+enum BlockFormat
+{
+    BlockFormat_BC1, // RGB, albedo without alpha
+    BlockFormat_BC3, // RGB + separate alpha, albedo with alpha
+    BlockFormat_BC4, // R, height maps
+    BlockFormat_BC5, // RG, tangent space normals with Z rebuilt in the shader
+    BlockFormat_Count
+};
+
+#define TEXTURE_MAX_MIPS 16
+
+// Block compressed texture with its full mip chain, either mapped from the
+// texture cache or owned after cooking. Rows go bottom up, as GL takes them.
+struct CookedTexture
+{
+    BlockFormat format;
+    ivec2       size;
+    u32         mipCount;
+    u32         mipOffsets[TEXTURE_MAX_MIPS]; // from data
+    u32         mipBytes[TEXTURE_MAX_MIPS];
+    const u8*   data;
+    std::vector<u8> ownedData;
+    MappedFile  file;
 };
 
 struct Texture
 {
-    GLuint      handle;
+    GLuint      handle;     // the type's placeholder until the streamer made it resident
     std::string filepath;
     TextureType type;
+    bool        resident;
+
+    // Residency, valid once resident. The GL texture only holds the levels
+    // from baseMip on, level 0 of handle is baseMip of the full chain.
+    GLenum      internalFormat;
+    ivec2       size;       // of the full chain's level 0
+    u32         mipCount;   // of the full chain
+    u32         baseMip;
+    u64         bytes;      // VRAM of the resident levels
+    bool        streaming;  // a request for finer levels is in flight
+    u32         wantedMip;  // finest level the render loop asked for since the last update
+    u32         lastUsedFrame;
+    u32         lastFullUseFrame; // last frame baseMip itself was wanted
+};
+
+// Keeps the textures' VRAM under a budget: levels nobody needs are dropped,
+// least recently used textures lose their finest levels first, and the
+// streamer brings levels back when the render loop asks for them.
+struct TextureResidency
+{
+    u64 budget;
+    f32 mipBias;            // added to the level the screen size asks for
+    u32 frame;
+
+    u64 usedBytes;
+    u32 promotions;         // finer levels requested from the streamer
+    u32 evictions;          // levels dropped to stay under the budget
+    u32 trims;              // levels dropped because nothing needed them
+};
+
+// Upper bound of the bytes the streamer copies into its pixel unpack buffers
+// per frame, the size of each ring buffer region
+#define TEXTURE_STREAM_MAX_FRAME_BYTES (4u * 1024u * 1024u)
+
+// One texture on its way to the GPU. A worker fills the cooked mips (or the
+// plain image when the driver has no S3TC), then the main thread uploads it
+// a few rows at a time and swaps it in for the placeholder.
+struct TextureStreamRequest
+{
+    u32           textureIdx;
+    std::string   filepath;
+    TextureType   type;
+    u32           firstMip;     // coarser levels only, when the budget or the screen size asks for less
+    u64           reservedBytes; // counted in the residency's usedBytes while in flight
+    bool          compressed;
+    bool          decoded;      // false when the source could not be read
+    CookedTexture cooked;
+    Image         image;
+    ConeStepMap   coneStep;     // owns image.pixels for TextureType::ConeStep
+
+    // Upload progress, main thread only
+    GLuint        handle;
+    u32           mip;
+    u32           row;          // next block row (compressed) or pixel row of the mip
+};
+
+struct TextureStreamer
+{
+    // Requests the workers are done with, guarded by the mutex
+    std::mutex mutex;
+    std::vector<TextureStreamRequest*> decoded;
+
+    // Main thread only
+    std::deque<TextureStreamRequest*> uploads;
+    u32 decoding;               // submitted and not picked up from decoded yet
+    RingBuffer pixelBuffer;     // GL_PIXEL_UNPACK_BUFFER, one region per frame in flight
+    GLuint placeholders[TextureType_Count]; // 1x1 per TextureType
+
+    u32 frameBudget;            // bytes per frame, at most TEXTURE_STREAM_MAX_FRAME_BYTES
+    u32 frameBytes;             // uploaded last frame
+    u32 completed;
+    u64 totalBytes;
 };
 
 struct VertexShaderAttribute {
@@ -73,6 +214,66 @@ struct VertexShaderLayout {
     std::vector<VertexShaderAttribute> attributes;
 };
 
+// Uniforms the engine sets from C++. Their locations are resolved once per link
+// into Program::uniformLocations so draws can index them directly.
+enum UniformId
+{
+    Uniform_Model,
+    Uniform_View,
+    Uniform_Proj,
+    Uniform_CameraPosition,
+    Uniform_ViewPos,
+    Uniform_Texture,
+    Uniform_Diffuse,
+    Uniform_AlbedoTexture,
+    Uniform_NormalMap,
+    Uniform_HeightMap,
+    Uniform_HeightScale,
+    Uniform_Skybox,
+    Uniform_ForwardSkybox,
+    Uniform_ReflectionIntensity,
+    Uniform_DiffuseAmbient,
+    Uniform_CubeMapType,
+    Uniform_DebugType,
+    Uniform_ViewMode,
+    Uniform_Near,
+    Uniform_Far,
+    Uniform_Color,
+    Uniform_Normals,
+    Uniform_Position,
+    Uniform_ViewDir,
+    Uniform_Depth,
+    Uniform_CompactGBuffer,
+    Uniform_InverseViewProjection,
+    Uniform_PositionScale,
+    Uniform_PositionOffset,
+    Uniform_IrradianceSH,
+    Uniform_SpecularEnvironment,
+    Uniform_SpecularMaxLod,
+    Uniform_BrdfLut,
+    Uniform_ConeStepMap,
+    Uniform_ReliefMarch,
+    Uniform_ReliefFade,
+    Uniform_ReliefAdaptive,
+    Uniform_Count
+};
+
+struct ProgramUniform
+{
+    std::string name;
+    GLint location;
+    GLenum type;
+    GLint size;
+};
+
+struct ProgramUniformBlock
+{
+    std::string name;
+    GLuint index;
+    GLint binding;
+    GLint dataSize;
+};
+
 struct Program
 {
     GLuint handle;
@@ -80,6 +281,34 @@ struct Program
     std::string programName;
     u64 lastWriteTimestamp;
     VertexShaderLayout vertexInputLayout;
+    std::vector<ProgramUniform> uniforms;
+    std::vector<ProgramUniformBlock> uniformBlocks;
+    GLint uniformLocations[Uniform_Count];
+    u32 features; // ShaderFeature mask the program was compiled with
+};
+
+// Compile time features of a program. Each set bit is injected as a #define in
+// front of the source (see CreateProgramFromSource), so a permutation carries
+// no branches or texture fetches for features it doesn't use.
+enum ShaderFeature
+{
+    ShaderFeature_NormalMap   = 1 << 0, // NORMAL_MAP
+    ShaderFeature_HeightMap   = 1 << 1, // HEIGHT_MAP
+    ShaderFeature_Environment = 1 << 2, // ENVIRONMENT
+    ShaderFeature_ShowDepth   = 1 << 3, // SHOW_DEPTH
+};
+
+// DEBUG_VIEW_n lives in its own bits of the mask, 0 means no debug view
+#define SHADER_FEATURE_DEBUG_VIEW_SHIFT 8
+#define SHADER_FEATURE_DEBUG_VIEW_MASK  (0xFu << SHADER_FEATURE_DEBUG_VIEW_SHIFT)
+
+// Every permutation of one source file and program name that was asked for so
+// far, compiled on demand by GetProgramPermutation
+struct ProgramPermutations
+{
+    std::string filepath;
+    std::string programName;
+    std::unordered_map<u32, u32> programs; // feature mask -> index into App::programs
 };
 
 enum Mode
@@ -114,6 +343,8 @@ struct VertexBufferAttribute {
     u8 location;
     u8 componentCount;
     u8 offset;
+    GLenum componentType = GL_FLOAT;
+    bool normalized = false; // integer components are mapped to [0, 1] or [-1, 1]
 };
 
 struct VertexV3V2N3T3 {
@@ -135,6 +366,14 @@ enum EntityType
     Enviroment_Map,
 };
 
+// Passes are the most significant field of the draw key, so they are drawn in this order
+enum RenderPass
+{
+    RenderPass_Opaque,
+    RenderPass_Background,
+    RenderPass_Count
+};
+
 struct Entity {
 
     glm::mat4 worldMatrix;
@@ -144,6 +383,9 @@ struct Entity {
     std::string name;
     bool active;
     EntityType type;
+    RenderPass pass;
+    u32 lod; // level drawn last frame
+    f32 reliefFade; // relief strength drawn last frame, 0 = normal mapping only
 };
 
 
@@ -158,20 +400,67 @@ struct Vao
     GLuint programHandle;
 };
 
+// Local space bounds, computed once when the geometry is loaded
+struct Aabb {
+    vec3 min;
+    vec3 max;
+};
+
+struct BoundingSphere {
+    vec3 center;
+    f32 radius;
+};
+
+// Cluster of at most MESHLET_MAX_VERTICES / MESHLET_MAX_TRIANGLES triangles
+// that is culled as a unit. The triangles are contiguous in the submesh indices.
+#define MESHLET_MAX_VERTICES  64
+#define MESHLET_MAX_TRIANGLES 124
+
+struct Meshlet {
+    BoundingSphere sphere;
+    vec3 coneAxis;   // average facing of the triangles
+    f32 coneCutoff;  // sin of the cone spread, 1 disables the backface test
+    u32 firstIndex;  // relative to the submesh
+    u32 indexCount;
+};
+
+// Simplified level of a submesh. Its indices follow the full detail ones in
+// the same index buffer and reference the same vertices.
+#define MESH_MAX_LODS 4
+
+struct SubmeshLod {
+    u32 firstIndex; // relative to the submesh
+    u32 indexCount;
+    f32 error;      // largest distance the simplification moved the surface, in model units
+};
+
 struct Submesh {
     VertexBufferLayout vertexBufferLayout;
-    std::vector<float> vertices;
+    Aabb aabb;
+    BoundingSphere sphere;
+    std::vector<Meshlet> meshlets;   // full detail level only
+    std::vector<SubmeshLod> lods;    // levels 1..n, coarser each time
+    std::vector<float> vertices; // float vertices as imported, dropped by PackMeshVertices
+    std::vector<u8> vertexData;  // quantized vertices uploaded to the GPU
     std::vector<u32> indices;
     u32 vertexOffset;
     u32 indexOffset;
+    u32 indexCount; // full detail level; indices may be empty when the geometry came from the mesh cache
+    u32 positionStreamOffset; // bytes into Mesh::positionBufferHandle
     std::vector<Vao> vaos;
+    GLuint positionVao;       // position stream only, created by the first depth pre-pass
 
 };
 
 struct Mesh {
     std::vector<Submesh> submeshes;
+    Aabb aabb;
+    BoundingSphere sphere;
+    vec3 positionScale;  // packed positions decode to positionOffset + positionScale * unorm16
+    vec3 positionOffset;
     GLuint vertexBufferHandle;
     GLuint indexBufferHandle;
+    GLuint positionBufferHandle; // packed positions alone, see DepthPrePass.h
 };
 
 struct Material {
@@ -182,6 +471,47 @@ struct Material {
     u32 albedoTextureIdx;
     u32 normalsTextureIdx;
     u32 heighTextureIdx;
+    u32 coneStepTextureIdx;     // built from the height map, 0 without one
+};
+
+// Material as read by the import stage, textures are resolved into indices
+// by the upload stage. Empty paths mean no texture.
+struct MaterialDesc {
+    std::string name;
+    vec3 albedo;
+    vec3 emissive;
+    f32 smoothness;
+    std::string albedoTexture;
+    std::string normalsTexture;
+    std::string heightTexture;
+};
+
+// Result of the CPU stage of LoadModel. The mesh has no GL objects yet and,
+// when it came from the mesh cache, no CPU vertex/index copies either: the
+// upload reads them from the still mapped cache file.
+// Vertex stage efficiency of a triangle list
+struct VertexCacheStats {
+    f32 acmr;      // post-transform cache misses per triangle, 0.5 at best and 3 at worst
+    f32 atvr;      // misses per vertex referenced, 1 is optimal
+    f32 overfetch; // vertex buffer bytes read per byte referenced, 1 is optimal
+};
+
+struct ImportedModel {
+    std::string filename;
+    u64 sourceHash;
+    bool valid;
+    Mesh mesh;
+    std::vector<u32> submeshMaterials; // relative to materials
+    std::vector<MaterialDesc> materials;
+    // Full detail level of all submeshes before and after the index and vertex
+    // reordering, zero when the model came from the mesh cache
+    VertexCacheStats sourceStats;
+    VertexCacheStats optimizedStats;
+    MappedFile cacheFile;
+    const u8* cachedVertices;
+    u64 cachedVertexBytes;
+    const u8* cachedIndices;
+    u64 cachedIndexBytes;
 };
 
 enum class LightType {
@@ -200,6 +530,66 @@ struct Light
     int mode;
 };
 
+// Light as laid out in the std430 light buffer (48 bytes), the Light struct
+// of the shaders must match it field by field
+struct GpuLight
+{
+    vec3 color;     // color * intensity
+    u32  type;
+    vec3 direction;
+    f32  radius;    // influence radius, see ComputeLightInfluenceRadius
+    vec3 position;
+    u32  mode;
+};
+
+// GPU copy of app->lights. The CPU mirror keeps the same order as app->lights;
+// edited lights are flagged dirty and only their ranges are uploaded, once
+// per frame, by UploadDirtyLights.
+struct LightStorage
+{
+    GLuint buffer;
+    u32 capacity;
+
+    std::vector<GpuLight> mirror;
+    std::vector<u8> dirtyFlags;
+    std::vector<u32> dirtyLights;
+
+    u32 lastUploadLights;
+    u32 lastUploadRanges;
+};
+
+// View space froxel grid used by the deferred lighting pass. Slices are
+// distributed exponentially between the near and far planes.
+#define CLUSTER_GRID_X 16
+#define CLUSTER_GRID_Y 9
+#define CLUSTER_GRID_Z 24
+#define CLUSTER_COUNT (CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z)
+
+// Shader storage bindings shared with Render_Quad.glsl
+#define LIGHTS_SSBO_BINDING 0
+#define CLUSTER_GRID_SSBO_BINDING 1
+#define CLUSTER_INDICES_SSBO_BINDING 2
+
+struct ClusterLightRef
+{
+    u32 cluster;
+    u32 light;
+};
+
+struct LightClusters
+{
+    GLuint gridBuffer;
+    GLuint indexBuffer;
+
+    std::vector<ClusterLightRef> refs;
+    std::vector<glm::uvec2> clusterRanges;
+    std::vector<u32> lightIndices;
+
+    u32 directionalLights;
+    u32 pointLights;
+    u32 maxLightsPerCluster;
+};
+
 struct FrameBuffer
 {
     u32 handle;
@@ -210,10 +600,15 @@ struct FrameBuffer
     uint64_t _width;
     uint64_t _height;
 
-    bool CreateFBO(const uint64_t aAttachments, const uint64_t aWidth, const uint64_t aHeight)
+    // Compact layout: RGBA8 albedo and RG16 octahedral normals only, position
+    // and view direction are rebuilt from depth by the lighting pass
+    bool compact;
+
+    bool CreateFBO(const uint64_t aAttachments, const uint64_t aWidth, const uint64_t aHeight, bool aCompact = false)
     {
         _width = aWidth;
         _height = aHeight;
+        compact = aCompact;
 
         if (aAttachments > GL_MAX_COLOR_ATTACHMENTS)
         {
@@ -226,7 +621,16 @@ struct FrameBuffer
             GLuint colorAttachment;
             glGenTextures(1, &colorAttachment);
             glBindTexture(GL_TEXTURE_2D, colorAttachment);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, aWidth, aHeight, 0, GL_RGBA, GL_FLOAT, NULL);
+            if (compact)
+            {
+                const GLenum internalFormat = i == 0 ? GL_RGBA8 : GL_RG16;
+                const GLenum format = i == 0 ? GL_RGBA : GL_RG;
+                glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, aWidth, aHeight, 0, format, GL_UNSIGNED_BYTE, NULL);
+            }
+            else
+            {
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, aWidth, aHeight, 0, GL_RGBA, GL_FLOAT, NULL);
+            }
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -268,6 +672,7 @@ struct FrameBuffer
 
         glDrawBuffers(enums.size(), enums.data());
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return true;
     }
 
     void Clear()
@@ -289,24 +694,179 @@ struct FrameBuffer
             return;
 
         Clear();
-        CreateFBO(4, width, height);
+        CreateFBO(compact ? 2 : 4, width, height, compact);
 
     }
 };
 
+// World space entity bounds stored as structure of arrays so the frustum test
+// can load 4 (SSE) or 8 (AVX) entities per register. Rows match app->entities
+// and the arrays are padded to a multiple of CULLING_BATCH_SIZE.
+#define CULLING_BATCH_SIZE 8
+
+// Planes as (normal, distance), normals pointing inside the frustum
+struct Frustum
+{
+    vec4 planes[6];
+};
+
+struct CullingBounds
+{
+    std::vector<f32> centerX;
+    std::vector<f32> centerY;
+    std::vector<f32> centerZ;
+    std::vector<f32> extentX;
+    std::vector<f32> extentY;
+    std::vector<f32> extentZ;
+    std::vector<u8>  visible;
+    u32 count;
+
+    u32 visibleEntities;
+    u32 culledEntities;
+    u32 culledSubmeshes;
+    u32 culledMeshlets;
+};
+
+struct RenderItem
+{
+    u32 entityIdx;
+    u32 submeshIdx;
+    u32 programIdx;
+    u32 materialIdx;
+    u32 firstRange; // index ranges of the visible meshlets in RenderQueue::rangeCounts/rangeOffsets
+    u32 rangeCount;
+};
+
+struct RenderQueueEntry
+{
+    u64 key;
+    u32 itemIdx;
+};
+
+// Per-frame list of submesh draws. Entries are radix sorted by their 64-bit key
+// (see MakeDrawKey) and submitted in that order.
+struct RenderQueue
+{
+    std::vector<RenderItem> items;
+    std::vector<RenderQueueEntry> entries;
+    std::vector<RenderQueueEntry> scratch;
+
+    // glMultiDrawElements arguments, runs of visible meshlets are merged
+    std::vector<GLsizei> rangeCounts;
+    std::vector<const void*> rangeOffsets;
+
+    u32 drawCount;
+    u32 triangleCount;
+    u32 programChanges;
+    u32 materialChanges;
+    u32 vaoChanges;
+};
+
+#define RENDER_STATE_TEXTURE_UNITS 8
+#define RENDER_STATE_UNIFORM_BUFFERS 8
+
+struct UniformBufferBinding
+{
+    GLuint buffer;
+    GLintptr offset;
+    GLsizeiptr size;
+};
+
+// CPU mirror of the GL state the renderer touches. Values are only trusted
+// within a frame: BeginRenderStateFrame invalidates everything because ImGui
+// and the platform layer change state behind our back.
+struct RenderState
+{
+    GLuint program;
+    GLuint vertexArray;
+    GLuint framebuffer;
+    GLenum activeTexture;
+    GLuint textures2D[RENDER_STATE_TEXTURE_UNITS];
+    GLuint texturesCube[RENDER_STATE_TEXTURE_UNITS];
+    UniformBufferBinding uniformBuffers[RENDER_STATE_UNIFORM_BUFFERS];
+    i8 depthTest;
+    i8 depthWrite;
+    i8 cullFace;
+    GLenum depthFunc;
+
+    u32 issuedCalls;
+    u32 skippedCalls;
+    u32 lastFrameIssuedCalls;
+    u32 lastFrameSkippedCalls;
+};
+
+#define DEPTH_PREPASS_QUERY_FRAMES   4   // frames a timestamp pair stays in flight before it is read
+#define DEPTH_PREPASS_PROBE_FRAMES   32  // measured frames per probe, alternating with and without
+#define DEPTH_PREPASS_PROBE_INTERVAL 600 // frames between probes in auto mode
+#define DEPTH_PREPASS_MIN_GAIN       0.05f // the pre-pass has to save this fraction of the time
+
+enum DepthPrePassMode
+{
+    DepthPrePass_Off,
+    DepthPrePass_On,
+    DepthPrePass_Auto, // measured every DEPTH_PREPASS_PROBE_INTERVAL frames
+};
+
+// GPU timestamps around the opaque geometry of one frame
+struct DepthPrePassQuery
+{
+    GLuint timestamps[2];
+    i8 enabled;     // -1 while the slot holds no frame
+    bool probe;
+};
+
+struct DepthPrePass
+{
+    DepthPrePassMode mode;
+    bool enabled;               // auto mode decision
+    bool frameEnabled;          // drawn this frame
+    u32 drawCount;              // this frame
+
+    DepthPrePassQuery queries[DEPTH_PREPASS_QUERY_FRAMES];
+    u32 frame;
+    u32 nextProbe;              // frames until the next probe
+    u32 probeFrames;            // left to draw in the current probe
+    u32 settleFrames;           // left until the last probe frame is read back
+    f64 probeTime[2];           // summed ms without and with the pre-pass
+    u32 probeSamples[2];
+    f32 lastProbeTime[2];       // averages of the last probe, for the Inspector
+};
+
+#define CUBEMAP_SET_COUNT 3
+
+#define IBL_SH_COEFFICIENTS 9
+#define IBL_SPECULAR_SIZE   128 // faces of the prefiltered chain's level 0
+#define IBL_SPECULAR_MIPS   6   // roughness level / (IBL_SPECULAR_MIPS - 1), down to 4x4 faces
+#define IBL_BRDF_LUT_SIZE   64
+
+// Image based lighting of one environment as computed on the CPU and cached.
+// The irradiance is projected on 9 SH coefficients, convolved with the cosine
+// lobe and divided by PI, so the shader gets the diffuse light for a white
+// albedo. The specular chain holds RGB floats, levels one after the other,
+// six faces each in GL cube face order.
+struct EnvironmentLightingData
+{
+    vec3 irradianceSH[IBL_SH_COEFFICIENTS];
+    std::vector<f32> specular;
+};
+
+struct EnvironmentLighting
+{
+    vec3   irradianceSH[IBL_SH_COEFFICIENTS];
+    GLuint specularTexture;     // cube, IBL_SPECULAR_MIPS levels
+};
+
 struct CubeMap
 {
     std::vector<std::string> faces1;
     std::vector<std::string> faces2;
     std::vector<std::string> faces3;
 
-    std::vector<unsigned char*> faces1Data;
-    std::vector<unsigned char*> faces2Data;
-    std::vector<unsigned char*> faces3Data;
-
-    std::vector<std::pair<int, int>> faces1Sizes;
-    std::vector<std::pair<int, int>> faces2Sizes;
-    std::vector<std::pair<int, int>> faces3Sizes;
+    // One immutable cube texture per set, uploaded once at start up
+    GLuint setTextures[CUBEMAP_SET_COUNT] = {};
+    u32 activeSet = 0;      // 1 based like UpdateCubeMap's cubemapType, 0 before the first switch
+    EnvironmentLighting setLighting[CUBEMAP_SET_COUNT] = {};
+    GLuint brdfLut = 0;     // split sum scale and bias by (NdotV, roughness)
     std::vector<float> cubemapCubeVertices = {
     -1.0f,  1.0f, -1.0f,
     -1.0f, -1.0f, -1.0f,
@@ -331,7 +891,7 @@ struct CubeMap
     GLuint VBO = 0;
     GLuint EBO = 0;
 
-    u32 cubeMapTexture;
+    u32 cubeMapTexture;     // the active set's texture
 };
 
 struct App
@@ -361,8 +921,14 @@ struct App
     u32 geometryProgramIdx;
     u32 forwardProgramIdx;
     u32 reliefMappingIdx;
+    u32 reliefNormalMappingIdx; // same material without the march or the depth write
     u32 environmentMapIdx;
     u32 cubeMapIdx;
+    u32 depthPrePassIdx;
+
+    // Feature permutations, the *Idx above hold their featureless base program
+    ProgramPermutations screenQuadPermutations;
+    ProgramPermutations forwardPermutations;
 
     u32 cubemapTexHandle;
     //Modelo 3D cargado
@@ -386,13 +952,20 @@ struct App
     GLuint vao;
 
     std::vector<std::string> glExtensions;
+    // EXT_texture_compression_s3tc is there, textures are cooked to BC formats
+    bool textureCompression = false;
 
     Camera worldCamera;
     GLint maxUniformBufferSize;
     GLint uniformBlockAlignment;
 
-    Buffer entityUBO;
-    Buffer globalUBO;
+    JobSystem jobs;
+    TextureStreamer textureStreamer;
+    TextureResidency textureResidency;
+
+    RingBuffer entityUBO;
+    RingBuffer globalUBO;
+    u32 globalParamsOffset;
     Buffer localParamsUBO;
 
     std::vector<Entity> entities;
@@ -401,6 +974,21 @@ struct App
 
     FrameBuffer primaryFBO;
 
+    RenderState renderState;
+    RenderQueue renderQueue;
+    DepthPrePass depthPrePass;
+    CullingBounds cullingBounds;
+    LightStorage lightStorage;
+    LightClusters lightClusters;
+    bool frustumCulling = true;
+    bool meshletCulling = true;
+    bool meshletConeCulling = true;
+
+    // Screen size (projected diameter / viewport height) below which each
+    // coarser level is used
+    bool lodEnabled = true;
+    f32 lodScreenSizes[MESH_MAX_LODS] = { 0.5f, 0.25f, 0.12f, 0.06f };
+
     int attachmentIndex;
 
     enum BufferViewMode {
@@ -425,9 +1013,22 @@ struct App
     
     ReliefViewMode reliefViewMode = Relief_VIEW_MAIN;
 
+    enum ReliefMarch {
+        Relief_MARCH_CONE_STEP,
+        Relief_MARCH_LINEAR,    // the 32-64 layer march, kept as the quality reference
+    };
+    ReliefMarch reliefMarch = Relief_MARCH_CONE_STEP;
+
+    // Screen size (projected diameter / viewport height) below which the
+    // relief starts fading, and below which only the normal map is left
+    bool reliefLodEnabled = true;
+    f32 reliefFadeStartSize = 0.2f;
+    f32 reliefFadeEndSize = 0.05f;
+
     CubeMapViewMode cubemapView = CubeMap_Reflection;
 
     bool showDepthOverlay = false;
+    bool compactGBuffer = true;
     float reliefIntensity = 0.05f;
 
     int pgaType;
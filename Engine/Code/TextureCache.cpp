@@ -0,0 +1,303 @@
+#include "TextureCache.h"
+#include "BlockCompression.h"
+#include <stb_image.h>
+#include <string.h>
+
+// EXT_texture_compression_s3tc, not part of the core profile glad was built for
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT  0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+#define DDS_MAGIC                0x20534444u // "DDS "
+#define DDS_FOURCC_DX10          0x30315844u // "DX10"
+#define DDS_PIXELFORMAT_FOURCC   0x4
+#define DDS_HEADER_FLAGS         0x000A1007  // caps, height, width, pixel format, mip count, linear size
+#define DDS_CAPS_TEXTURE_MIPMAP  0x00401008  // complex, texture, mipmap
+#define DDS_DIMENSION_TEXTURE2D  3
+
+// Stored in the header's reserved words, which DDS readers ignore
+#define TEXTURE_CACHE_MAGIC      0x4B4F4F43u // "COOK"
+
+struct DdsPixelFormat
+{
+    u32 size;
+    u32 flags;
+    u32 fourCC;
+    u32 rgbBitCount;
+    u32 masks[4];
+};
+
+struct DdsHeader
+{
+    u32 magic;
+    u32 size;
+    u32 flags;
+    u32 height;
+    u32 width;
+    u32 linearSize;
+    u32 depth;
+    u32 mipCount;
+    u32 cacheMagic;
+    u32 cacheVersion;
+    u32 textureType;
+    u32 sourceTimestamp[2]; // low, high
+    u32 reserved[6];
+    DdsPixelFormat pixelFormat;
+    u32 caps[4];
+    u32 reserved2;
+    // DX10 extension
+    u32 dxgiFormat;
+    u32 dimension;
+    u32 miscFlags;
+    u32 arraySize;
+    u32 miscFlags2;
+};
+static_assert(sizeof(DdsHeader) == 4 + 124 + 20, "DDS header layout");
+
+// DXGI_FORMAT_BC1_UNORM, BC3_UNORM, BC4_UNORM, BC5_UNORM
+static const u32 DxgiFormats[BlockFormat_Count] = { 71, 77, 80, 83 };
+
+BlockFormat GetTextureBlockFormat(TextureType type, bool hasAlpha)
+{
+    switch (type)
+    {
+    case TextureType::Normal: return BlockFormat_BC5;
+    case TextureType::Height: return BlockFormat_BC4;
+    default:                  return hasAlpha ? BlockFormat_BC3 : BlockFormat_BC1;
+    }
+}
+
+GLenum GetBlockFormatGL(BlockFormat format)
+{
+    switch (format)
+    {
+    case BlockFormat_BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    case BlockFormat_BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    case BlockFormat_BC4: return GL_COMPRESSED_RED_RGTC1;
+    case BlockFormat_BC5: return GL_COMPRESSED_RG_RGTC2;
+    default:              return GL_NONE;
+    }
+}
+
+static std::string GetCachePath(const char* filepath)
+{
+    return std::string(filepath) + TEXTURE_CACHE_EXTENSION;
+}
+
+static u32 CountMips(ivec2 size)
+{
+    u32 count = 1;
+    while ((size.x > 1 || size.y > 1) && count < TEXTURE_MAX_MIPS)
+    {
+        size = glm::max(size / 2, ivec2(1));
+        count++;
+    }
+    return count;
+}
+
+// Fills mipOffsets/mipBytes and returns the total size
+static u64 LayoutMips(CookedTexture& cooked)
+{
+    u64 offset = 0;
+    ivec2 size = cooked.size;
+    for (u32 mip = 0; mip < cooked.mipCount; ++mip)
+    {
+        cooked.mipOffsets[mip] = (u32)offset;
+        cooked.mipBytes[mip] = GetCompressedImageBytes(cooked.format, size.x, size.y);
+        offset += cooked.mipBytes[mip];
+        size = glm::max(size / 2, ivec2(1));
+    }
+    return offset;
+}
+
+bool ReadTextureCache(const char* filepath, TextureType type, CookedTexture& cooked)
+{
+    const u64 sourceTimestamp = GetFileLastWriteTimestamp(filepath);
+    if (sourceTimestamp == 0)
+        return false;
+
+    const std::string cachePath = GetCachePath(filepath);
+    MappedFile file = MapFileReadOnly(cachePath.c_str());
+    if (!file.data)
+        return false;
+
+    const DdsHeader* header = (const DdsHeader*)file.data;
+    bool valid = file.size >= sizeof(DdsHeader) &&
+        header->magic == DDS_MAGIC && header->pixelFormat.fourCC == DDS_FOURCC_DX10 &&
+        header->cacheMagic == TEXTURE_CACHE_MAGIC && header->cacheVersion == TEXTURE_CACHE_VERSION &&
+        header->textureType == (u32)type &&
+        header->sourceTimestamp[0] == (u32)sourceTimestamp && header->sourceTimestamp[1] == (u32)(sourceTimestamp >> 32) &&
+        header->width > 0 && header->height > 0 && header->mipCount == CountMips(ivec2(header->width, header->height));
+
+    if (valid)
+    {
+        cooked.format = BlockFormat_Count;
+        for (u32 format = 0; format < BlockFormat_Count; ++format)
+        {
+            if (DxgiFormats[format] == header->dxgiFormat)
+                cooked.format = (BlockFormat)format;
+        }
+        cooked.size = ivec2(header->width, header->height);
+        cooked.mipCount = header->mipCount;
+        valid = cooked.format != BlockFormat_Count &&
+            sizeof(DdsHeader) + LayoutMips(cooked) == file.size;
+    }
+
+    if (!valid)
+    {
+        ILOG("Texture cache %s is stale, cooking %s", cachePath.c_str(), filepath);
+        UnmapFile(file);
+        return false;
+    }
+
+    cooked.file = file;
+    cooked.data = file.data + sizeof(DdsHeader);
+    return true;
+}
+
+static vec3 DecodeNormal(const u8* texel)
+{
+    return vec3(texel[0], texel[1], texel[2]) * (2.0f / 255.0f) - 1.0f;
+}
+
+// 2x2 box filter, the last row/column repeats on odd sizes
+static void DownsampleImage(const u8* source, ivec2 sourceSize, u8* destination, ivec2 size, TextureType type)
+{
+    for (i32 y = 0; y < size.y; ++y)
+    {
+        const i32 y0 = glm::min(y * 2, sourceSize.y - 1);
+        const i32 y1 = glm::min(y * 2 + 1, sourceSize.y - 1);
+        for (i32 x = 0; x < size.x; ++x)
+        {
+            const i32 x0 = glm::min(x * 2, sourceSize.x - 1);
+            const i32 x1 = glm::min(x * 2 + 1, sourceSize.x - 1);
+            const u8* texels[4] = {
+                &source[((size_t)y0 * sourceSize.x + x0) * 4], &source[((size_t)y0 * sourceSize.x + x1) * 4],
+                &source[((size_t)y1 * sourceSize.x + x0) * 4], &source[((size_t)y1 * sourceSize.x + x1) * 4],
+            };
+            u8* out = &destination[((size_t)y * size.x + x) * 4];
+
+            for (u32 c = 0; c < 4; ++c)
+                out[c] = (u8)((texels[0][c] + texels[1][c] + texels[2][c] + texels[3][c] + 2) / 4);
+
+            // Averaged normals get shorter, the shader expects unit length
+            if (type == TextureType::Normal)
+            {
+                const vec3 sum = DecodeNormal(texels[0]) + DecodeNormal(texels[1]) + DecodeNormal(texels[2]) + DecodeNormal(texels[3]);
+                const f32 length = glm::length(sum);
+                const vec3 normal = length > 1e-6f ? sum / length : vec3(0.0f, 0.0f, 1.0f);
+                for (u32 c = 0; c < 3; ++c)
+                    out[c] = (u8)glm::clamp(normal[c] * 127.5f + 127.5f + 0.5f, 0.0f, 255.0f);
+            }
+        }
+    }
+}
+
+static bool WriteTextureCache(const char* filepath, TextureType type, const CookedTexture& cooked, u64 dataBytes)
+{
+    DdsHeader header = {};
+    header.magic = DDS_MAGIC;
+    header.size = 124;
+    header.flags = DDS_HEADER_FLAGS;
+    header.height = cooked.size.y;
+    header.width = cooked.size.x;
+    header.linearSize = cooked.mipBytes[0];
+    header.mipCount = cooked.mipCount;
+    header.cacheMagic = TEXTURE_CACHE_MAGIC;
+    header.cacheVersion = TEXTURE_CACHE_VERSION;
+    header.textureType = (u32)type;
+    const u64 sourceTimestamp = GetFileLastWriteTimestamp(filepath);
+    header.sourceTimestamp[0] = (u32)sourceTimestamp;
+    header.sourceTimestamp[1] = (u32)(sourceTimestamp >> 32);
+    header.pixelFormat.size = sizeof(DdsPixelFormat);
+    header.pixelFormat.flags = DDS_PIXELFORMAT_FOURCC;
+    header.pixelFormat.fourCC = DDS_FOURCC_DX10;
+    header.caps[0] = DDS_CAPS_TEXTURE_MIPMAP;
+    header.dxgiFormat = DxgiFormats[cooked.format];
+    header.dimension = DDS_DIMENSION_TEXTURE2D;
+    header.arraySize = 1;
+
+    const std::string cachePath = GetCachePath(filepath);
+    FILE* file = fopen(cachePath.c_str(), "wb");
+    if (!file)
+    {
+        ELOG("fopen() failed writing texture cache %s", cachePath.c_str());
+        return false;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(cooked.data, 1, (size_t)dataBytes, file);
+
+    const bool failed = ferror(file) != 0;
+    fclose(file);
+    if (failed)
+    {
+        ELOG("Error writing texture cache %s", cachePath.c_str());
+        remove(cachePath.c_str());
+    }
+    return !failed;
+}
+
+bool CookTexture(JobSystem& jobs, const char* filepath, TextureType type, CookedTexture& cooked)
+{
+    ivec2 size;
+    i32 channels = 0;
+    // Per thread, cooks run on the job system next to other decodes
+    stbi_set_flip_vertically_on_load_thread(true);
+    u8* pixels = stbi_load(filepath, &size.x, &size.y, &channels, 4);
+    if (!pixels)
+    {
+        ELOG("Could not open file %s", filepath);
+        return false;
+    }
+
+    bool hasAlpha = false;
+    if (channels == 2 || channels == 4)
+    {
+        for (size_t i = 0; i < (size_t)size.x * size.y && !hasAlpha; ++i)
+            hasAlpha = pixels[i * 4 + 3] < 255;
+    }
+
+    cooked.format = GetTextureBlockFormat(type, hasAlpha);
+    cooked.size = size;
+    cooked.mipCount = CountMips(size);
+    const u64 dataBytes = LayoutMips(cooked);
+    cooked.ownedData.resize((size_t)dataBytes);
+    cooked.data = cooked.ownedData.data();
+
+    // Each level is filtered from the previous one before both are encoded
+    std::vector<u8> level(pixels, pixels + (size_t)size.x * size.y * 4);
+    std::vector<u8> nextLevel;
+    stbi_image_free(pixels);
+
+    ivec2 levelSize = size;
+    for (u32 mip = 0; mip < cooked.mipCount; ++mip)
+    {
+        CompressImage(jobs, cooked.format, level.data(), levelSize.x, levelSize.y, &cooked.ownedData[cooked.mipOffsets[mip]]);
+        if (mip + 1 == cooked.mipCount)
+            break;
+
+        const ivec2 nextSize = glm::max(levelSize / 2, ivec2(1));
+        nextLevel.resize((size_t)nextSize.x * nextSize.y * 4);
+        DownsampleImage(level.data(), levelSize, nextLevel.data(), nextSize, type);
+        level.swap(nextLevel);
+        levelSize = nextSize;
+    }
+
+    const f64 sourceBytes = (f64)size.x * size.y * (channels == 1 ? 1 : channels == 4 ? 4 : 3) * 4.0 / 3.0;
+    ILOG("Cooked %s: %dx%d BC%d, %u mips, %.1f KB (%.1fx smaller than the uncompressed chain)", filepath,
+        size.x, size.y, cooked.format == BlockFormat_BC1 ? 1 : (i32)cooked.format + 2, cooked.mipCount,
+        dataBytes / 1024.0, sourceBytes / (f64)dataBytes);
+
+    WriteTextureCache(filepath, type, cooked, dataBytes);
+    return true;
+}
+
+void ReleaseCookedTexture(CookedTexture& cooked)
+{
+    if (cooked.file.data)
+        UnmapFile(cooked.file);
+    std::vector<u8>().swap(cooked.ownedData);
+    cooked.data = nullptr;
+}
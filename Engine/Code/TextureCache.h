@@ -0,0 +1,28 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "Structs.hpp"
+
+// Bump whenever the file layout or the cooking (mips, encoders) changes
+#define TEXTURE_CACHE_VERSION   1
+#define TEXTURE_CACHE_EXTENSION ".dds"
+
+// Albedo maps cook to BC1, or BC3 when some pixel is not opaque, normal maps to
+// BC5 and height maps to BC4
+BlockFormat GetTextureBlockFormat(TextureType type, bool hasAlpha);
+
+GLenum GetBlockFormatGL(BlockFormat format);
+
+// Maps <source>.dds when it was cooked by this version from a source with the
+// same write time and for the same texture type. The mips point straight into
+// the mapping. Thread safe, does not touch GL.
+bool ReadTextureCache(const char* filepath, TextureType type, CookedTexture& cooked);
+
+// Decodes the source with stb_image, builds the full mip chain (normal maps are
+// renormalized on every level), encodes it on the job system and writes the
+// cache next to the source. Thread safe, does not touch GL.
+bool CookTexture(JobSystem& jobs, const char* filepath, TextureType type, CookedTexture& cooked);
+
+void ReleaseCookedTexture(CookedTexture& cooked);
+
+#endif // TEXTURE_CACHE_H
@@ -0,0 +1,202 @@
+#include "TextureResidency.h"
+#include "TextureStreaming.h"
+#include "TextureCache.h"
+#include "BlockCompression.h"
+#include <algorithm>
+
+void InitTextureResidency(TextureResidency& residency)
+{
+    residency.budget = TEXTURE_RESIDENCY_DEFAULT_BUDGET;
+    residency.mipBias = 0.0f;
+    residency.frame = 0;
+    residency.usedBytes = 0;
+    residency.promotions = 0;
+    residency.evictions = 0;
+    residency.trims = 0;
+}
+
+static u64 GetLevelBytes(GLenum internalFormat, ivec2 size)
+{
+    for (u32 format = 0; format < BlockFormat_Count; ++format)
+    {
+        if (GetBlockFormatGL((BlockFormat)format) == internalFormat)
+            return GetCompressedImageBytes((BlockFormat)format, size.x, size.y);
+    }
+    const u64 bytesPerPixel = internalFormat == GL_R8 ? 1 : internalFormat == GL_RG8 ? 2 : 4;
+    return (u64)size.x * size.y * bytesPerPixel;
+}
+
+u64 GetTextureLevelBytes(GLenum internalFormat, ivec2 size, u32 firstMip, u32 mipCount)
+{
+    u64 bytes = 0;
+    for (u32 mip = firstMip; mip < mipCount; ++mip)
+        bytes += GetLevelBytes(internalFormat, glm::max(size >> (i32)mip, ivec2(1)));
+    return bytes;
+}
+
+u32 GetTailMip(ivec2 size, u32 mipCount)
+{
+    u32 mip = 0;
+    while (mip + 1 < mipCount && glm::max(size.x >> mip, size.y >> mip) > TEXTURE_RESIDENCY_TAIL_SIZE)
+        mip++;
+    return mip;
+}
+
+static void RequestTexture(App* app, u32 textureIdx, f32 screenPixels)
+{
+    TextureResidency& residency = app->textureResidency;
+    Texture& texture = app->textures[textureIdx];
+    texture.lastUsedFrame = residency.frame;
+    if (!texture.resident)
+        return;
+
+    // One texel per pixel across the entity, as if its UVs covered the texture once
+    u32 mip = 0;
+    const f32 largest = (f32)glm::max(texture.size.x, texture.size.y);
+    if (screenPixels < largest)
+    {
+        const f32 level = glm::log2(largest / glm::max(screenPixels, 1.0f)) + residency.mipBias;
+        mip = (u32)glm::clamp(level, 0.0f, (f32)(texture.mipCount - 1));
+    }
+    texture.wantedMip = glm::min(texture.wantedMip, mip);
+}
+
+void RequestMaterialTextures(App* app, const Material& material, f32 screenPixels)
+{
+    // The same textures the render loop binds, index 0 stands for none
+    RequestTexture(app, material.albedoTextureIdx, screenPixels);
+    if (material.normalsTextureIdx != 0)
+        RequestTexture(app, material.normalsTextureIdx, screenPixels);
+    if (material.heighTextureIdx != 0)
+        RequestTexture(app, material.heighTextureIdx, screenPixels);
+    if (material.coneStepTextureIdx != 0)
+        RequestTexture(app, material.coneStepTextureIdx, screenPixels);
+}
+
+u32 ChooseFirstMip(const App* app, GLenum internalFormat, ivec2 size, u32 mipCount)
+{
+    const TextureResidency& residency = app->textureResidency;
+    const u32 tail = GetTailMip(size, mipCount);
+
+    u32 mip = 0;
+    while (mip < tail && residency.usedBytes + GetTextureLevelBytes(internalFormat, size, mip, mipCount) > residency.budget)
+        mip++;
+    return mip;
+}
+
+// Reallocates the chain without its finest level, the rest is copied on the GPU
+static void DropFinestLevel(TextureResidency& residency, Texture& texture)
+{
+    const u32 baseMip = texture.baseMip + 1;
+    const u32 levelCount = texture.mipCount - baseMip;
+    const ivec2 baseSize = glm::max(texture.size >> (i32)baseMip, ivec2(1));
+    const GLuint handle = AllocateTexture(texture.internalFormat, baseSize, levelCount, texture.type);
+
+    for (u32 level = 0; level < levelCount; ++level)
+    {
+        const ivec2 size = glm::max(baseSize >> (i32)level, ivec2(1));
+        glCopyImageSubData(texture.handle, GL_TEXTURE_2D, level + 1, 0, 0, 0,
+                           handle, GL_TEXTURE_2D, level, 0, 0, 0, size.x, size.y, 1);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDeleteTextures(1, &texture.handle);
+
+    const u64 bytes = GetTextureLevelBytes(texture.internalFormat, texture.size, baseMip, texture.mipCount);
+    residency.usedBytes -= texture.bytes - bytes;
+    texture.handle = handle;
+    texture.baseMip = baseMip;
+    texture.bytes = bytes;
+}
+
+static bool CanDropLevel(const Texture& texture)
+{
+    return texture.resident && !texture.streaming && texture.baseMip < GetTailMip(texture.size, texture.mipCount);
+}
+
+// Drops levels of the textures in lru order, skipping those used at or after
+// usedBefore, until usedBytes is at most limit
+static void EvictLevels(App* app, const std::vector<u32>& lru, u64 limit, u32 usedBefore)
+{
+    TextureResidency& residency = app->textureResidency;
+    for (u32 textureIdx : lru)
+    {
+        Texture& texture = app->textures[textureIdx];
+        if (texture.lastUsedFrame >= usedBefore)
+            continue;
+        while (residency.usedBytes > limit && CanDropLevel(texture))
+        {
+            DropFinestLevel(residency, texture);
+            residency.evictions++;
+        }
+        if (residency.usedBytes <= limit)
+            return;
+    }
+}
+
+void UpdateTextureResidency(App* app)
+{
+    TextureResidency& residency = app->textureResidency;
+    const u32 frame = residency.frame;
+
+    // Levels nobody asked for in a while go, one per period
+    std::vector<u32> lru;
+    for (u32 textureIdx = 0; textureIdx < app->textures.size(); ++textureIdx)
+    {
+        Texture& texture = app->textures[textureIdx];
+        if (!texture.resident)
+            continue;
+        if (texture.wantedMip <= texture.baseMip)
+            texture.lastFullUseFrame = frame;
+        if (CanDropLevel(texture) && frame - texture.lastFullUseFrame > TEXTURE_RESIDENCY_TRIM_FRAMES)
+        {
+            DropFinestLevel(residency, texture);
+            texture.lastFullUseFrame = frame;
+            residency.trims++;
+        }
+        if (CanDropLevel(texture))
+            lru.push_back(textureIdx);
+    }
+
+    std::sort(lru.begin(), lru.end(), [app](u32 a, u32 b)
+    {
+        const Texture& textureA = app->textures[a];
+        const Texture& textureB = app->textures[b];
+        if (textureA.lastUsedFrame != textureB.lastUsedFrame)
+            return textureA.lastUsedFrame < textureB.lastUsedFrame;
+        return textureA.bytes > textureB.bytes;
+    });
+
+    if (residency.usedBytes > residency.budget)
+        EvictLevels(app, lru, residency.budget, UINT32_MAX);
+
+    // Finer levels for the textures that asked for them, making room with
+    // textures that were not used this frame. The streamer counts the levels
+    // in flight right away, later requests see the budget they take.
+    for (u32 textureIdx = 0; textureIdx < app->textures.size(); ++textureIdx)
+    {
+        Texture& texture = app->textures[textureIdx];
+        if (!texture.resident || texture.streaming || texture.wantedMip >= texture.baseMip)
+            continue;
+
+        // Plain images are uploaded whole, their mips come from level 0
+        const bool compressed = IsTextureCompressed(app, texture.type);
+        for (u32 mip = compressed ? texture.wantedMip : 0; mip < texture.baseMip; mip = compressed ? mip + 1 : texture.baseMip)
+        {
+            const u64 extraBytes = GetTextureLevelBytes(texture.internalFormat, texture.size, mip, texture.baseMip);
+            if (extraBytes > residency.budget)
+                continue;
+            if (residency.usedBytes + extraBytes > residency.budget)
+                EvictLevels(app, lru, residency.budget - extraBytes, frame);
+            if (residency.usedBytes + extraBytes > residency.budget)
+                continue;
+
+            StreamTexture(app, textureIdx, mip);
+            residency.promotions++;
+            break;
+        }
+    }
+
+    for (Texture& texture : app->textures)
+        texture.wantedMip = TEXTURE_RESIDENCY_NO_REQUEST;
+    residency.frame++;
+}
@@ -0,0 +1,36 @@
+#ifndef TEXTURE_RESIDENCY_H
+#define TEXTURE_RESIDENCY_H
+
+#include "Structs.hpp"
+
+#define TEXTURE_RESIDENCY_DEFAULT_BUDGET (256ull * 1024ull * 1024ull)
+// Levels of this size and below are never dropped, a texture always has something to sample
+#define TEXTURE_RESIDENCY_TAIL_SIZE      64
+// Frames the finest resident level goes unwanted before it is dropped
+#define TEXTURE_RESIDENCY_TRIM_FRAMES    120
+// Marks a texture nobody asked for since the last update
+#define TEXTURE_RESIDENCY_NO_REQUEST     TEXTURE_MAX_MIPS
+
+void InitTextureResidency(TextureResidency& residency);
+
+// VRAM of levels [firstMip, mipCount) of a chain whose level 0 is size.
+// RGB8 counts as 4 bytes per pixel, as drivers store it.
+u64 GetTextureLevelBytes(GLenum internalFormat, ivec2 size, u32 firstMip, u32 mipCount);
+
+// First level at or below TEXTURE_RESIDENCY_TAIL_SIZE
+u32 GetTailMip(ivec2 size, u32 mipCount);
+
+// Render loop: marks the material's textures used this frame and asks for the
+// level whose size matches screenPixels, the entity's projected diameter
+void RequestMaterialTextures(App* app, const Material& material, f32 screenPixels);
+
+// Streamer: finest first level of a new chain that still fits in the budget,
+// never coarser than the tail
+u32 ChooseFirstMip(const App* app, GLenum internalFormat, ivec2 size, u32 mipCount);
+
+// Main thread, once per frame after UpdateTextureStreaming. Drops unwanted
+// levels, evicts least recently used ones while over the budget and streams
+// finer levels in for the textures that asked for them.
+void UpdateTextureResidency(App* app);
+
+#endif // TEXTURE_RESIDENCY_H
@@ -0,0 +1,445 @@
+#include "TextureStreaming.h"
+#include "TextureCache.h"
+#include "TextureResidency.h"
+#include "BlockCompression.h"
+#include "BufferManagement.h"
+#include "JobSystem.h"
+#include "ConeStepMap.h"
+#include <stb_image.h>
+
+// Start of each copy in the pixel unpack buffer
+#define TEXTURE_STREAM_ALIGNMENT 16
+
+// A run of rows copied this frame, uploaded once the region is unmapped
+struct TextureUploadChunk
+{
+    TextureStreamRequest* request;
+    u32 mip;
+    u32 y;
+    u32 height;
+    u32 offset;
+    u32 bytes;
+};
+
+static u32 CountMips(ivec2 size)
+{
+    u32 mips = 1;
+    for (i32 largest = glm::max(size.x, size.y); largest > 1; largest /= 2)
+        mips++;
+    return mips;
+}
+
+static GLuint CreatePlaceholder(const u8 texel[4])
+{
+    GLuint handle;
+    glGenTextures(1, &handle);
+    glBindTexture(GL_TEXTURE_2D, handle);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, texel);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return handle;
+}
+
+void InitTextureStreaming(TextureStreamer& streamer)
+{
+    // White albedo, a flat normal, no relief depth and a flat cone step map
+    static const u8 placeholderTexels[TextureType_Count][4] = {
+        { 255, 255, 255, 255 },
+        { 128, 128, 255, 255 },
+        { 0, 0, 0, 255 },
+        { 0, 255, 0, 255 },
+    };
+    for (u32 type = 0; type < ARRAY_COUNT(streamer.placeholders); ++type)
+        streamer.placeholders[type] = CreatePlaceholder(placeholderTexels[type]);
+
+    streamer.pixelBuffer = CreateRingBuffer(TEXTURE_STREAM_MAX_FRAME_BYTES, GL_PIXEL_UNPACK_BUFFER);
+    streamer.frameBudget = TEXTURE_STREAM_DEFAULT_FRAME_BYTES;
+    streamer.frameBytes = 0;
+    streamer.decoding = 0;
+    streamer.completed = 0;
+    streamer.totalBytes = 0;
+}
+
+static void ReleaseRequest(TextureStreamRequest* request)
+{
+    ReleaseCookedTexture(request->cooked);
+    if (request->image.pixels && request->type != TextureType::ConeStep)
+        stbi_image_free(request->image.pixels);
+    delete request;
+}
+
+void ShutdownTextureStreaming(TextureStreamer& streamer)
+{
+    for (TextureStreamRequest* request : streamer.decoded)
+        streamer.uploads.push_back(request);
+    streamer.decoded.clear();
+
+    for (TextureStreamRequest* request : streamer.uploads)
+    {
+        if (request->handle)
+            glDeleteTextures(1, &request->handle);
+        ReleaseRequest(request);
+    }
+    streamer.uploads.clear();
+
+    glDeleteTextures(ARRAY_COUNT(streamer.placeholders), streamer.placeholders);
+    DestroyRingBuffer(streamer.pixelBuffer);
+}
+
+GLuint GetPlaceholderTexture(const TextureStreamer& streamer, TextureType type)
+{
+    return streamer.placeholders[type];
+}
+
+bool IsTextureCompressed(const App* app, TextureType type)
+{
+    return app->textureCompression && type != TextureType::ConeStep;
+}
+
+// Worker side: the texture cache or a cook when there is S3TC, otherwise the
+// source as stb_image decodes it, mip 0 only. Cone step maps come from their
+// own cache or are built from the height map, also mip 0 only.
+static void DecodeTexture(JobSystem& jobs, TextureStreamRequest& request)
+{
+    const char* filepath = request.filepath.c_str();
+    if (request.type == TextureType::ConeStep)
+    {
+        ConeStepMap& map = request.coneStep;
+        request.decoded = ReadConeStepCache(filepath, map) || BuildConeStepMap(jobs, filepath, map);
+        if (request.decoded)
+        {
+            request.image.pixels = map.texels.data();
+            request.image.size = map.size;
+            request.image.nchannels = 2;
+            request.image.stride = map.size.x * 2;
+        }
+        return;
+    }
+
+    if (request.compressed)
+    {
+        request.decoded = ReadTextureCache(filepath, request.type, request.cooked) ||
+                          CookTexture(jobs, filepath, request.type, request.cooked);
+        return;
+    }
+
+    Image& image = request.image;
+    stbi_set_flip_vertically_on_load_thread(true);
+    image.pixels = stbi_load(filepath, &image.size.x, &image.size.y, &image.nchannels, 0);
+    if (!image.pixels)
+    {
+        ELOG("Could not open file %s", filepath);
+        return;
+    }
+    if (image.nchannels == 2)
+    {
+        ELOG("Unsupported number of channels in %s", filepath);
+        stbi_image_free(image.pixels);
+        image.pixels = NULL;
+        return;
+    }
+    image.stride = image.size.x * image.nchannels;
+    request.decoded = true;
+}
+
+void StreamTexture(App* app, u32 textureIdx, u32 firstMip)
+{
+    TextureStreamer& streamer = app->textureStreamer;
+    Texture& texture = app->textures[textureIdx];
+    texture.streaming = true;
+
+    TextureStreamRequest* request = new TextureStreamRequest();
+    request->textureIdx = textureIdx;
+    request->filepath = texture.filepath;
+    request->type = texture.type;
+    request->compressed = IsTextureCompressed(app, texture.type);
+    request->firstMip = request->compressed ? firstMip : 0;
+    streamer.decoding++;
+
+    // The levels in flight count against the budget from now on
+    if (texture.resident && request->firstMip < texture.baseMip)
+    {
+        request->reservedBytes = GetTextureLevelBytes(texture.internalFormat, texture.size, request->firstMip, texture.baseMip);
+        app->textureResidency.usedBytes += request->reservedBytes;
+    }
+
+    JobSystem* jobs = &app->jobs;
+    TextureStreamer* target = &streamer;
+    SubmitJob(app->jobs, [jobs, target, request]()
+    {
+        DecodeTexture(*jobs, *request);
+
+        std::lock_guard<std::mutex> lock(target->mutex);
+        target->decoded.push_back(request);
+    });
+}
+
+GLuint AllocateTexture(GLenum internalFormat, ivec2 size, u32 levelCount, TextureType type)
+{
+    GLuint handle;
+    glGenTextures(1, &handle);
+    glBindTexture(GL_TEXTURE_2D, handle);
+    glTexStorage2D(GL_TEXTURE_2D, levelCount, internalFormat, size.x, size.y);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    const GLint wrap = type == TextureType::Albedo ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
+    return handle;
+}
+
+// Format and full chain of the decoded source
+static void GetRequestChain(const TextureStreamRequest& request, GLenum& internalFormat, ivec2& size, u32& mipCount)
+{
+    if (request.compressed)
+    {
+        internalFormat = GetBlockFormatGL(request.cooked.format);
+        size = request.cooked.size;
+        mipCount = request.cooked.mipCount;
+    }
+    else
+    {
+        const i32 channels = request.image.nchannels;
+        internalFormat = channels == 1 ? GL_R8 : channels == 2 ? GL_RG8 : channels == 3 ? GL_RGB8 : GL_RGBA8;
+        size = request.image.size;
+        mipCount = CountMips(request.image.size);
+    }
+}
+
+static void CreateStreamedTexture(App* app, TextureStreamRequest& request)
+{
+    GLenum internalFormat;
+    ivec2 size;
+    u32 mipCount;
+    GetRequestChain(request, internalFormat, size, mipCount);
+
+    // Plain images only have level 0 on the CPU, the rest is generated from it
+    if (!request.compressed)
+        request.firstMip = 0;
+    else if (!app->textures[request.textureIdx].resident)
+        request.firstMip = ChooseFirstMip(app, internalFormat, size, mipCount);
+    request.firstMip = glm::min(request.firstMip, mipCount - 1);
+    request.mip = request.firstMip;
+
+    const ivec2 baseSize = glm::max(size >> (i32)request.firstMip, ivec2(1));
+    request.handle = AllocateTexture(internalFormat, baseSize, mipCount - request.firstMip, request.type);
+}
+
+// Rows of the request's current level: rows of 4x4 blocks when compressed
+static void GetLevelRows(const TextureStreamRequest& request, u32& rowCount, u32& rowBytes, const u8*& data)
+{
+    if (request.compressed)
+    {
+        const CookedTexture& cooked = request.cooked;
+        const ivec2 size = glm::max(cooked.size >> (i32)request.mip, ivec2(1));
+        rowCount = (size.y + 3) / 4;
+        rowBytes = GetCompressedImageBytes(cooked.format, size.x, 4);
+        data = cooked.data + cooked.mipOffsets[request.mip];
+    }
+    else
+    {
+        rowCount = request.image.size.y;
+        rowBytes = request.image.stride;
+        data = (const u8*)request.image.pixels;
+    }
+}
+
+static u32 GetLevelCount(const TextureStreamRequest& request)
+{
+    return request.compressed ? request.cooked.mipCount : 1;
+}
+
+// Copies as many rows of the request as fit in the budget. Returns true when
+// its last row is in the buffer.
+static bool CopyRequestRows(TextureStreamer& streamer, TextureStreamRequest& request, u32& budget,
+                            std::vector<TextureUploadChunk>& chunks)
+{
+    RingBuffer& buffer = streamer.pixelBuffer;
+    while (request.mip < GetLevelCount(request))
+    {
+        u32 rowCount, rowBytes;
+        const u8* data;
+        GetLevelRows(request, rowCount, rowBytes, data);
+
+        AlignHead(buffer, TEXTURE_STREAM_ALIGNMENT);
+        const u32 space = glm::min(budget, buffer.regionSize - buffer.head);
+        const u32 rows = glm::min(rowCount - request.row, space / rowBytes);
+        if (rows == 0)
+            return false;
+
+        TextureUploadChunk chunk = {};
+        chunk.request = &request;
+        chunk.mip = request.mip;
+        chunk.y = request.row;
+        chunk.height = rows;
+        chunk.offset = GetRingBufferOffset(buffer);
+        chunk.bytes = rows * rowBytes;
+        PushAlignedData(buffer, data + (size_t)request.row * rowBytes, chunk.bytes, TEXTURE_STREAM_ALIGNMENT);
+        chunks.push_back(chunk);
+
+        budget -= chunk.bytes;
+        streamer.frameBytes += chunk.bytes;
+        request.row += rows;
+        if (request.row == rowCount)
+        {
+            request.row = 0;
+            request.mip++;
+        }
+    }
+    return true;
+}
+
+static void UploadChunk(const TextureUploadChunk& chunk)
+{
+    const TextureStreamRequest& request = *chunk.request;
+    glBindTexture(GL_TEXTURE_2D, request.handle);
+
+    const void* offset = (const void*)(uintptr_t)chunk.offset;
+    if (request.compressed)
+    {
+        // Block rows, the last one may be shorter than 4 pixels
+        const CookedTexture& cooked = request.cooked;
+        const ivec2 size = glm::max(cooked.size >> (i32)chunk.mip, ivec2(1));
+        const i32 y = chunk.y * 4;
+        const i32 height = glm::min((i32)chunk.height * 4, size.y - y);
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, chunk.mip - request.firstMip, 0, y, size.x, height,
+            GetBlockFormatGL(cooked.format), chunk.bytes, offset);
+    }
+    else
+    {
+        const Image& image = request.image;
+        const GLenum dataFormat = image.nchannels == 1 ? GL_RED : image.nchannels == 2 ? GL_RG : image.nchannels == 3 ? GL_RGB : GL_RGBA;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, chunk.y, image.size.x, chunk.height, dataFormat, GL_UNSIGNED_BYTE, offset);
+    }
+}
+
+static void CompleteRequest(App* app, TextureStreamRequest* request)
+{
+    TextureStreamer& streamer = app->textureStreamer;
+    if (!request->compressed)
+    {
+        glBindTexture(GL_TEXTURE_2D, request->handle);
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
+
+    // Finer levels replace the chain the texture had until now
+    Texture& texture = app->textures[request->textureIdx];
+    const u64 previousBytes = texture.resident ? texture.bytes : 0;
+    if (texture.resident)
+        glDeleteTextures(1, &texture.handle);
+
+    texture.handle = request->handle;
+    texture.resident = true;
+    texture.streaming = false;
+    GetRequestChain(*request, texture.internalFormat, texture.size, texture.mipCount);
+    texture.baseMip = request->firstMip;
+    texture.bytes = GetTextureLevelBytes(texture.internalFormat, texture.size, texture.baseMip, texture.mipCount);
+    texture.lastFullUseFrame = app->textureResidency.frame;
+    app->textureResidency.usedBytes += texture.bytes - previousBytes - request->reservedBytes;
+
+    for (u32 mip = request->firstMip; mip < GetLevelCount(*request); ++mip)
+    {
+        request->mip = mip;
+        u32 rowCount, rowBytes;
+        const u8* data;
+        GetLevelRows(*request, rowCount, rowBytes, data);
+        streamer.totalBytes += (u64)rowCount * rowBytes;
+    }
+    streamer.completed++;
+    ReleaseRequest(request);
+}
+
+static void CollectDecodedTextures(App* app)
+{
+    TextureStreamer& streamer = app->textureStreamer;
+    std::lock_guard<std::mutex> lock(streamer.mutex);
+    for (TextureStreamRequest* request : streamer.decoded)
+    {
+        if (request->decoded)
+        {
+            streamer.uploads.push_back(request);
+        }
+        else
+        {
+            // The texture keeps what it has, for good the first time
+            app->textures[request->textureIdx].streaming = false;
+            app->textureResidency.usedBytes -= request->reservedBytes;
+            ReleaseRequest(request);
+        }
+        streamer.decoding--;
+    }
+    streamer.decoded.clear();
+}
+
+static void UploadTextures(App* app, u32 budget)
+{
+    TextureStreamer& streamer = app->textureStreamer;
+    if (streamer.uploads.empty())
+        return;
+
+    // Copy first: without persistent mapping the region has to be unmapped
+    // before GL may read it
+    RingBuffer& buffer = streamer.pixelBuffer;
+    MapRingBufferFrame(buffer);
+
+    std::vector<TextureUploadChunk> chunks;
+    u32 completedCount = 0;
+    for (TextureStreamRequest* request : streamer.uploads)
+    {
+        if (!request->handle)
+            CreateStreamedTexture(app, *request);
+        if (!CopyRequestRows(streamer, *request, budget, chunks))
+            break;
+        completedCount++;
+    }
+
+    UnmapRingBufferFrame(buffer);
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.handle);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (const TextureUploadChunk& chunk : chunks)
+        UploadChunk(chunk);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    FenceRingBufferFrame(buffer);
+
+    for (u32 i = 0; i < completedCount; ++i)
+    {
+        CompleteRequest(app, streamer.uploads.front());
+        streamer.uploads.pop_front();
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void UpdateTextureStreaming(App* app)
+{
+    TextureStreamer& streamer = app->textureStreamer;
+    streamer.frameBytes = 0;
+
+    CollectDecodedTextures(app);
+    UploadTextures(app, glm::min(streamer.frameBudget, streamer.pixelBuffer.regionSize));
+}
+
+void FinishTextureStreaming(App* app)
+{
+    TextureStreamer& streamer = app->textureStreamer;
+    while (GetPendingTextureCount(streamer) > 0)
+    {
+        CollectDecodedTextures(app);
+        if (streamer.uploads.empty())
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        UploadTextures(app, streamer.pixelBuffer.regionSize);
+    }
+    streamer.frameBytes = 0;
+}
+
+u32 GetPendingTextureCount(const TextureStreamer& streamer)
+{
+    return streamer.decoding + (u32)streamer.uploads.size();
+}
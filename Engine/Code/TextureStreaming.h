@@ -0,0 +1,40 @@
+#ifndef TEXTURE_STREAMING_H
+#define TEXTURE_STREAMING_H
+
+#include "Structs.hpp"
+
+// Default bytes copied into the pixel unpack buffer per frame
+#define TEXTURE_STREAM_DEFAULT_FRAME_BYTES (2u * 1024u * 1024u)
+
+// Creates the placeholders and the pixel unpack ring buffer, needs GL
+void InitTextureStreaming(TextureStreamer& streamer);
+// Call after ShutdownJobSystem, no worker may still hold a request
+void ShutdownTextureStreaming(TextureStreamer& streamer);
+
+GLuint GetPlaceholderTexture(const TextureStreamer& streamer, TextureType type);
+
+// Whether the type streams block compressed mips from the texture cache. Cone
+// step maps never do, their ratios would not survive the encoding.
+bool IsTextureCompressed(const App* app, TextureType type);
+
+// Immutable storage for levels [0, levelCount) at size, with the sampling of the type
+GLuint AllocateTexture(GLenum internalFormat, ivec2 size, u32 levelCount, TextureType type);
+
+// Queues app->textures[textureIdx] for decoding on the job system. The texture
+// keeps its current handle, the placeholder the first time, until
+// UpdateTextureStreaming has uploaded levels [firstMip, mipCount). The first
+// load picks firstMip itself from the residency budget.
+void StreamTexture(App* app, u32 textureIdx, u32 firstMip = 0);
+
+// Main thread, once per frame before rendering. Uploads through the pixel
+// unpack buffer until the frame budget is spent, finished textures replace
+// their placeholders.
+void UpdateTextureStreaming(App* app);
+
+// Uploads everything that is queued, without a budget. For the headless
+// benchmark, so it never measures placeholders.
+void FinishTextureStreaming(App* app);
+
+u32 GetPendingTextureCount(const TextureStreamer& streamer);
+
+#endif // TEXTURE_STREAMING_H
@@ -0,0 +1,160 @@
+#include "VertexPacking.h"
+#include <glm/gtc/quaternion.hpp>
+#include <string.h>
+
+#define PACKED_NORMAL_BYTES        4
+#define PACKED_TEXCOORD_BYTES      4
+#define PACKED_TANGENT_FRAME_BYTES 8
+
+static u16 QuantizeUnorm16(f32 value)
+{
+    return (u16)(glm::clamp(value, 0.0f, 1.0f) * 65535.0f + 0.5f);
+}
+
+static i16 QuantizeSnorm16(f32 value)
+{
+    return (i16)glm::round(glm::clamp(value, -1.0f, 1.0f) * 32767.0f);
+}
+
+// Same mapping as OctEncode in RENDER_GEOMETRY.glsl
+static vec2 OctEncode(vec3 n)
+{
+    n /= glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z);
+    if (n.z >= 0.0f)
+        return vec2(n.x, n.y);
+    return vec2((1.0f - glm::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+                (1.0f - glm::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+}
+
+static vec3 SafeNormalize(const vec3& v, const vec3& fallback)
+{
+    const f32 lengthSq = glm::dot(v, v);
+    return lengthSq > 1e-12f ? v / sqrtf(lengthSq) : fallback;
+}
+
+static glm::quat EncodeTangentFrame(vec3 normal, vec3 tangent, const vec3& bitangent)
+{
+    normal = SafeNormalize(normal, vec3(0.0f, 0.0f, 1.0f));
+
+    // The frame has to be orthonormal to be a rotation
+    tangent = tangent - normal * glm::dot(normal, tangent);
+    const vec3 axis = glm::abs(normal.x) < 0.9f ? vec3(1.0f, 0.0f, 0.0f) : vec3(0.0f, 1.0f, 0.0f);
+    tangent = SafeNormalize(tangent, glm::normalize(glm::cross(axis, normal)));
+
+    const vec3 rightHanded = glm::cross(normal, tangent);
+    const bool mirrored = glm::dot(rightHanded, bitangent) < 0.0f;
+
+    glm::quat q = glm::normalize(glm::quat_cast(glm::mat3(tangent, rightHanded, normal)));
+    if (q.w < 0.0f)
+        q = -q;
+
+    // w must not quantize to zero or the handedness sign would be lost
+    const f32 bias = 1.0f / 32767.0f;
+    if (q.w < bias)
+    {
+        const f32 xyzScale = sqrtf(1.0f - bias * bias) / glm::length(vec3(q.x, q.y, q.z));
+        q = glm::quat(bias, q.x * xyzScale, q.y * xyzScale, q.z * xyzScale);
+    }
+
+    return mirrored ? -q : q;
+}
+
+static void PackSubmeshVertices(Submesh& submesh, const vec3& positionScale, const vec3& positionOffset)
+{
+    // Float offsets of each attribute in the imported layout
+    i32 floatOffsets[5] = { -1, -1, -1, -1, -1 };
+    for (const VertexBufferAttribute& attribute : submesh.vertexBufferLayout.attributes)
+    {
+        if (attribute.location < 5)
+            floatOffsets[attribute.location] = attribute.offset / sizeof(float);
+    }
+    const u32 floatStride = submesh.vertexBufferLayout.stride / sizeof(float);
+    const u32 vertexCount = floatStride > 0 ? (u32)submesh.vertices.size() / floatStride : 0;
+
+    const bool hasTexCoords = floatOffsets[2] >= 0;
+    const bool hasTangentFrame = floatOffsets[3] >= 0 && floatOffsets[4] >= 0;
+
+    VertexBufferLayout layout = {};
+    layout.attributes.push_back(VertexBufferAttribute{ 0, 3, 0, GL_UNSIGNED_SHORT, true });
+    layout.attributes.push_back(VertexBufferAttribute{ 1, 2, PACKED_POSITION_BYTES, GL_SHORT, true });
+    layout.stride = PACKED_POSITION_BYTES + PACKED_NORMAL_BYTES;
+    if (hasTexCoords)
+    {
+        layout.attributes.push_back(VertexBufferAttribute{ 2, 2, layout.stride, GL_HALF_FLOAT, false });
+        layout.stride += PACKED_TEXCOORD_BYTES;
+    }
+    if (hasTangentFrame)
+    {
+        layout.attributes.push_back(VertexBufferAttribute{ 3, 4, layout.stride, GL_SHORT, true });
+        layout.stride += PACKED_TANGENT_FRAME_BYTES;
+    }
+
+    // Flat meshes have a zero extent on some axis, it all quantizes to 0
+    const vec3 inverseScale(positionScale.x > 0.0f ? 1.0f / positionScale.x : 0.0f,
+                            positionScale.y > 0.0f ? 1.0f / positionScale.y : 0.0f,
+                            positionScale.z > 0.0f ? 1.0f / positionScale.z : 0.0f);
+
+    std::vector<u8> vertexData((size_t)vertexCount * layout.stride);
+    for (u32 i = 0; i < vertexCount; ++i)
+    {
+        const float* v = &submesh.vertices[(size_t)i * floatStride];
+        u8* out = &vertexData[(size_t)i * layout.stride];
+
+        const vec3 position = (vec3(v[0], v[1], v[2]) - positionOffset) * inverseScale;
+        const u16 packedPosition[4] = { QuantizeUnorm16(position.x), QuantizeUnorm16(position.y), QuantizeUnorm16(position.z), 0 };
+        memcpy(out, packedPosition, sizeof(packedPosition));
+        out += PACKED_POSITION_BYTES;
+
+        const float* n = v + floatOffsets[1];
+        const vec3 normal = SafeNormalize(vec3(n[0], n[1], n[2]), vec3(0.0f, 0.0f, 1.0f));
+        const vec2 octNormal = OctEncode(normal);
+        const i16 packedNormal[2] = { QuantizeSnorm16(octNormal.x), QuantizeSnorm16(octNormal.y) };
+        memcpy(out, packedNormal, sizeof(packedNormal));
+        out += PACKED_NORMAL_BYTES;
+
+        if (hasTexCoords)
+        {
+            const float* uv = v + floatOffsets[2];
+            const u32 packedTexCoord = glm::packHalf2x16(vec2(uv[0], uv[1]));
+            memcpy(out, &packedTexCoord, sizeof(packedTexCoord));
+            out += PACKED_TEXCOORD_BYTES;
+        }
+
+        if (hasTangentFrame)
+        {
+            const float* t = v + floatOffsets[3];
+            const float* b = v + floatOffsets[4];
+            const glm::quat q = EncodeTangentFrame(normal, vec3(t[0], t[1], t[2]), vec3(b[0], b[1], b[2]));
+            const i16 packedFrame[4] = { QuantizeSnorm16(q.x), QuantizeSnorm16(q.y), QuantizeSnorm16(q.z), QuantizeSnorm16(q.w) };
+            memcpy(out, packedFrame, sizeof(packedFrame));
+        }
+    }
+
+    submesh.vertexBufferLayout = layout;
+    submesh.vertexData.swap(vertexData);
+    std::vector<float>().swap(submesh.vertices);
+}
+
+void PackMeshVertices(Mesh& mesh)
+{
+    mesh.positionOffset = mesh.aabb.min;
+    mesh.positionScale = mesh.aabb.max - mesh.aabb.min;
+
+    for (Submesh& submesh : mesh.submeshes)
+    {
+        PackSubmeshVertices(submesh, mesh.positionScale, mesh.positionOffset);
+    }
+}
+
+void AppendPackedPositions(const VertexBufferLayout& layout, const u8* vertices, u64 vertexBytes, std::vector<u8>& positions)
+{
+    const u32 vertexCount = layout.stride > 0 ? (u32)(vertexBytes / layout.stride) : 0;
+    size_t out = positions.size();
+    positions.resize(out + (size_t)vertexCount * PACKED_POSITION_BYTES);
+
+    // The position is the first attribute of every packed vertex
+    for (u32 i = 0; i < vertexCount; ++i, out += PACKED_POSITION_BYTES)
+    {
+        memcpy(&positions[out], vertices + (size_t)i * layout.stride, PACKED_POSITION_BYTES);
+    }
+}
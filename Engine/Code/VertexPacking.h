@@ -0,0 +1,26 @@
+#ifndef VERTEX_PACKING_H
+#define VERTEX_PACKING_H
+
+#include "Structs.hpp"
+
+// Quantized vertex format of every imported mesh, decoded in the vertex shaders:
+//   location 0  position       3 x unorm16 over the mesh bounds (8 bytes, w is padding)
+//   location 1  normal         2 x snorm16 octahedral           (4 bytes)
+//   location 2  texCoord       2 x half float                   (4 bytes)
+//   location 3  tangent frame  4 x snorm16 quaternion           (8 bytes)
+// The quaternion rotates (1,0,0), (0,0,1) to the tangent and normal, the sign
+// of w is the bitangent handedness. Location 4 (bitangent) is not stored.
+// A full vertex is 24 bytes instead of 56 as floats.
+#define PACKED_POSITION_BYTES 8
+
+// Replaces the float vertices and layout of every submesh with the packed ones
+// in Submesh::vertexData and sets the mesh dequantization. Needs the float
+// layout written by the loaders and the mesh bounds. Thread safe.
+void PackMeshVertices(Mesh& mesh);
+
+// Appends the packed positions of a submesh's vertices (vertexBytes of them
+// laid out as described by layout) to a stream of positions alone, for the
+// position only VAOs of the depth pre-pass.
+void AppendPackedPositions(const VertexBufferLayout& layout, const u8* vertices, u64 vertexBytes, std::vector<u8>& positions);
+
+#endif // VERTEX_PACKING_H
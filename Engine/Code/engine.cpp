@@ -14,23 +14,22 @@
 #include <stb_image_write.h>
 
 #include <iostream>
+#include <float.h>
 
 void CreateEntity(App* app, const u32 aModelIndx, const glm::mat4& aVP, const glm::mat4& aPosition, std::string name, EntityType type)
 {
     Entity entity;
-    AlignHead(app->entityUBO, app->uniformBlockAlignment);
-    entity.entityBufferOffset = app->entityUBO.head;
-
     entity.worldMatrix = aPosition;
     entity.modelIndex = aModelIndx;
     entity.name = name;
     entity.type = type;
-    glm::mat4 normalMatrix = glm::transpose(glm::inverse(aPosition));
-    PushMat4(app->entityUBO, entity.worldMatrix);
-    PushMat4(app->entityUBO, normalMatrix);
-    PushMat4(app->entityUBO, aVP * entity.worldMatrix);
+    entity.pass = name == "SkyBox" ? RenderPass_Background : RenderPass_Opaque;
+    entity.lod = 0;
+    entity.reliefFade = 1.0f;
 
-    entity.entityBufferSize = app->entityUBO.size - entity.entityBufferOffset;
+    // The matrices are written every frame by Update into the entity ring buffer
+    entity.entityBufferOffset = 0;
+    entity.entityBufferSize = 3 * sizeof(glm::mat4);
 
     app->entities.push_back(entity);
 }
@@ -40,7 +39,7 @@ void CreateLight(App* app, LightType light, vec3 color, vec3 position, float int
 
     if (light == LightType::Light_Directional)
     {
-        app->lights.push_back({ light, color, position, position, intensity , mode});
+        AddLight(app, { light, color, position, position, intensity , mode});
     }
     else
     {
@@ -50,12 +49,30 @@ void CreateLight(App* app, LightType light, vec3 color, vec3 position, float int
         //Comentat ja que no me crea mes d'una esfera jiji
         //CreateEntity(app, app->sphereIdx, VP, sphereWorld);
 
-        app->lights.push_back({ light, color, vec3(0), position, intensity, mode });
+        AddLight(app, { light, color, vec3(0), position, intensity, mode });
     }
 }
 
 
-GLuint CreateProgramFromSource(String programSource, const char* shaderName)
+// One #define per ShaderFeature bit, plus DEBUG_VIEW_n when a debug view is set
+static void WriteFeatureDefines(u32 features, char* buffer, size_t bufferSize)
+{
+    static const char* featureNames[] = { "NORMAL_MAP", "HEIGHT_MAP", "ENVIRONMENT", "SHOW_DEPTH" };
+
+    int length = 0;
+    buffer[0] = '\0';
+    for (u32 i = 0; i < ARRAY_COUNT(featureNames); ++i)
+    {
+        if (features & (1u << i))
+            length += snprintf(buffer + length, bufferSize - length, "#define %s\n", featureNames[i]);
+    }
+
+    const u32 debugView = (features & SHADER_FEATURE_DEBUG_VIEW_MASK) >> SHADER_FEATURE_DEBUG_VIEW_SHIFT;
+    if (debugView != 0)
+        snprintf(buffer + length, bufferSize - length, "#define DEBUG_VIEW_%u\n", debugView);
+}
+
+GLuint CreateProgramFromSource(String programSource, const char* shaderName, u32 features)
 {
     GLchar  infoLogBuffer[1024] = {};
     GLsizei infoLogBufferSize = sizeof(infoLogBuffer);
@@ -65,30 +82,36 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
     char versionString[] = "#version 430\n";
     char shaderNameDefine[128];
     sprintf(shaderNameDefine, "#define %s\n", shaderName);
+    char featureDefines[256];
+    WriteFeatureDefines(features, featureDefines, sizeof(featureDefines));
     char vertexShaderDefine[] = "#define VERTEX\n";
     char fragmentShaderDefine[] = "#define FRAGMENT\n";
 
     const GLchar* vertexShaderSource[] = {
         versionString,
         shaderNameDefine,
+        featureDefines,
         vertexShaderDefine,
         programSource.str
     };
     const GLint vertexShaderLengths[] = {
         (GLint)strlen(versionString),
         (GLint)strlen(shaderNameDefine),
+        (GLint)strlen(featureDefines),
         (GLint)strlen(vertexShaderDefine),
         (GLint)programSource.len
     };
     const GLchar* fragmentShaderSource[] = {
         versionString,
         shaderNameDefine,
+        featureDefines,
         fragmentShaderDefine,
         programSource.str
     };
     const GLint fragmentShaderLengths[] = {
         (GLint)strlen(versionString),
         (GLint)strlen(shaderNameDefine),
+        (GLint)strlen(featureDefines),
         (GLint)strlen(fragmentShaderDefine),
         (GLint)programSource.len
     };
@@ -100,7 +123,7 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
     if (!success)
     {
         glGetShaderInfoLog(vshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
-        ELOG("glCompileShader() failed with vertex shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+        ELOG("glCompileShader() failed with vertex shader %s (features 0x%x)\nReported message:\n%s\n", shaderName, features, infoLogBuffer);
     }
 
     GLuint fshader = glCreateShader(GL_FRAGMENT_SHADER);
@@ -110,7 +133,7 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
     if (!success)
     {
         glGetShaderInfoLog(fshader, infoLogBufferSize, &infoLogSize, infoLogBuffer);
-        ELOG("glCompileShader() failed with fragment shader %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+        ELOG("glCompileShader() failed with fragment shader %s (features 0x%x)\nReported message:\n%s\n", shaderName, features, infoLogBuffer);
     }
 
     GLuint programHandle = glCreateProgram();
@@ -121,10 +144,11 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
     if (!success)
     {
         glGetProgramInfoLog(programHandle, infoLogBufferSize, &infoLogSize, infoLogBuffer);
-        ELOG("glLinkProgram() failed with program %s\nReported message:\n%s\n", shaderName, infoLogBuffer);
+        ELOG("glLinkProgram() failed with program %s (features 0x%x)\nReported message:\n%s\n", shaderName, features, infoLogBuffer);
     }
 
-    glUseProgram(0);
+    // No glUseProgram(0) here, permutations are compiled in the middle of a
+    // frame and RenderState would miss the unbind
 
     glDetachShader(programHandle, vshader);
     glDetachShader(programHandle, fshader);
@@ -134,30 +158,20 @@ GLuint CreateProgramFromSource(String programSource, const char* shaderName)
     return programHandle;
 }
 
-u32 LoadProgram(App* app, const char* filepath, const char* programName)
+u32 LoadProgram(App* app, const char* filepath, const char* programName, u32 features = 0)
 {
     String programSource = ReadTextFile(filepath);
 
     Program program = {};
-    program.handle = CreateProgramFromSource(programSource, programName);
+    program.handle = CreateProgramFromSource(programSource, programName, features);
     program.filepath = filepath;
     program.programName = programName;
     program.lastWriteTimestamp = GetFileLastWriteTimestamp(filepath);
+    program.features = features;
 
     if (program.handle != 0)
     {
-        GLint AttributeCount = 0UL;
-        glGetProgramiv(program.handle, GL_ACTIVE_ATTRIBUTES, &AttributeCount);
-        for (size_t i = 0; i < AttributeCount; ++i)
-        {
-            GLchar Name[248];
-            GLsizei realNameSize = 0UL;
-            GLsizei attribSize = 0UL;
-            GLenum attribType;
-            glGetActiveAttrib(program.handle, i, ARRAY_COUNT(Name), &realNameSize, &attribSize, &attribType, Name);
-            GLuint attribLocation = glGetAttribLocation(program.handle, Name);
-            program.vertexInputLayout.attributes.push_back({ static_cast<u8>(attribLocation), static_cast<u8>(attribSize) });
-        }
+        ReflectProgram(program);
     }
 
     app->programs.push_back(program);
@@ -165,145 +179,91 @@ u32 LoadProgram(App* app, const char* filepath, const char* programName)
     return app->programs.size() - 1;
 }
 
-Image LoadImage(const char* filename)
+void InitProgramPermutations(ProgramPermutations& permutations, const char* filepath, const char* programName)
 {
-    Image img = {};
-    stbi_set_flip_vertically_on_load(true);
-    img.pixels = stbi_load(filename, &img.size.x, &img.size.y, &img.nchannels, 0);
-    if (img.pixels)
-    {
-        img.stride = img.size.x * img.nchannels;
-    }
-    else
-    {
-        ELOG("Could not open file %s", filename);
-    }
-    return img;
+    permutations.filepath = filepath;
+    permutations.programName = programName;
+    permutations.programs.clear();
 }
 
-
-GLuint CreateTexture2DFromImage(Image image, TextureType type) {
-    GLenum internalFormat = GL_RGB8;
-    GLenum dataFormat = GL_RGB;
-    GLenum dataType = GL_UNSIGNED_BYTE;
-
-    switch (image.nchannels) {
-    case 1:
-        dataFormat = GL_RED;
-        internalFormat = GL_R8;
-        break;
-    case 3:
-        dataFormat = GL_RGB;
-        internalFormat = GL_RGB8;
-        break;
-    case 4:
-        dataFormat = GL_RGBA;
-        internalFormat = GL_RGBA8;
-        break;
-    default:
-        ELOG("LoadTexture2D() - Unsupported number of channels");
-    }
-
-    GLuint texHandle;
-    glGenTextures(1, &texHandle);
-    glBindTexture(GL_TEXTURE_2D, texHandle);
-    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, image.size.x, image.size.y, 0, dataFormat, dataType, image.pixels);
-
-    // Texture parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glGenerateMipmap(GL_TEXTURE_2D);
-
-    if (type == TextureType::Normal) {
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    }
-    else if (type == TextureType::Height) {
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    }
-
-    glBindTexture(GL_TEXTURE_2D, 0);
-    return texHandle;
-}
-void FreeImage(Image image)
+// Compiles the permutation the first time a mask is asked for. It is added to
+// App::programs like any other program, so hot reload rebuilds every live one.
+u32 GetProgramPermutation(App* app, ProgramPermutations& permutations, u32 features)
 {
-    stbi_image_free(image.pixels);
+    auto it = permutations.programs.find(features);
+    if (it != permutations.programs.end())
+        return it->second;
+
+    const u32 programIdx = LoadProgram(app, permutations.filepath.c_str(), permutations.programName.c_str(), features);
+    permutations.programs[features] = programIdx;
+    ILOG("Compiled %s permutation 0x%x", permutations.programName.c_str(), features);
+    return programIdx;
 }
 
 u32 LoadTexture2D(App* app, const char* filepath, TextureType type)
 {
+    // A height map is loaded twice, as itself and as its cone step map
     for (u32 texIdx = 0; texIdx < app->textures.size(); ++texIdx)
-        if (app->textures[texIdx].filepath == filepath)
+        if (app->textures[texIdx].filepath == filepath && app->textures[texIdx].type == type)
             return texIdx;
 
-    Image image = LoadImage(filepath);
-
-    if (image.pixels)
-    {
-        Texture tex = {};
-        tex.handle = CreateTexture2DFromImage(image, type);
-        tex.filepath = filepath;
-        tex.type = type;
-
-        u32 texIdx = app->textures.size();
-        app->textures.push_back(tex);
-
-        FreeImage(image);
-        return texIdx;
-    }
-    else
-    {
-        return UINT32_MAX;
-    }
+    // Returns at once, materials sample the placeholder until the streamer
+    // has decoded and uploaded the texture
+    Texture tex = {};
+    tex.handle = GetPlaceholderTexture(app->textureStreamer, type);
+    tex.filepath = filepath;
+    tex.type = type;
+    tex.resident = false;
+    tex.wantedMip = TEXTURE_RESIDENCY_NO_REQUEST;
+
+    u32 texIdx = app->textures.size();
+    app->textures.push_back(tex);
+    StreamTexture(app, texIdx);
+    return texIdx;
 }
 
 void RenderScreenFillQuad(App* app, const FrameBuffer& aFBO)
 {
+    RenderState& state = app->renderState;
+
     // Setup framebuffer and viewport
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    SetFramebuffer(state, 0);
     glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glViewport(0, 0, app->displaySize.x, app->displaySize.y);
 
-    // Bind shader and geometry
-    Program& program = app->programs[app->texturedGeometryProgramIdx];
-    glUseProgram(program.handle);
-    glBindVertexArray(app->vao);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->embeddedElements);
+    // The buffer view and the depth overlay are compiled in, not branched on
+    u32 features = (u32)app->bufferViewMode << SHADER_FEATURE_DEBUG_VIEW_SHIFT;
+    if (app->showDepthOverlay && app->bufferViewMode == App::BUFFER_VIEW_MAIN)
+        features |= ShaderFeature_ShowDepth;
+
+    // Bind shader and geometry (the element buffer is part of the VAO state)
+    Program& program = app->programs[GetProgramPermutation(app, app->screenQuadPermutations, features)];
+    SetProgram(state, program.handle);
+    SetVertexArray(state, app->vao);
 
     // Bind UBO
-    glBindBufferRange(GL_UNIFORM_BUFFER, 0, app->globalUBO.handle, 0, app->globalUBO.size);
+    SetUniformBufferRange(state, 0, app->globalUBO.handle, app->globalParamsOffset, sizeof(vec4));
 
-    // Bind textures
-    const char* textureNames[] = { "uColor", "uNormals", "uPosition", "uViewDir", "uDepth" };
+    // Bind textures. The compact layout has no position/view direction attachments.
+    const UniformId textureUniforms[] = { Uniform_Color, Uniform_Normals, Uniform_Position, Uniform_ViewDir, Uniform_Depth };
+    const int colorAttachments = aFBO.compact ? 2 : 4;
     for (int i = 0; i < 5; ++i) {
-        glActiveTexture(GL_TEXTURE0 + i);
-        GLuint texHandle = (i < 4) ? aFBO.attachments[i].second : aFBO.depthHandle;
-        glBindTexture(GL_TEXTURE_2D, texHandle);
-        glUniform1i(glGetUniformLocation(program.handle, textureNames[i]), i);
+        GLuint texHandle = (i < colorAttachments) ? aFBO.attachments[i].second : (i == 4 ? aFBO.depthHandle : 0);
+        SetTexture(state, i, GL_TEXTURE_2D, texHandle);
+        SetUniformInt(program, textureUniforms[i], i);
     }
+    SetUniformInt(program, Uniform_CompactGBuffer, aFBO.compact ? 1 : 0);
+    SetUniformMat4(program, Uniform_InverseViewProjection,
+        glm::inverse(app->worldCamera.projectionMatrix * app->worldCamera.viewMatrix));
 
     // Set rendering parameters
-    glUniform1f(glGetUniformLocation(program.handle, "uNear"), 0.1f);
-    glUniform1f(glGetUniformLocation(program.handle, "uFar"), 1000.0f);
-    glUniform1i(glGetUniformLocation(program.handle, "uViewMode"), static_cast<int>(app->bufferViewMode));
-    glUniform1i(glGetUniformLocation(program.handle, "uShowDepth"), app->showDepthOverlay ? 1 : 0);
-    glUniform1f(glGetUniformLocation(program.handle, "uHeightScale"), app->reliefIntensity);
+    SetUniformFloat(program, Uniform_Near, 0.1f);
+    SetUniformFloat(program, Uniform_Far, 1000.0f);
+    SetUniformFloat(program, Uniform_HeightScale, app->reliefIntensity);
 
     // Render quad
     glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, 0);
-
-    glBindVertexArray(0);
-    glUseProgram(0);
-    for (int i = 0; i < 5; ++i) {
-        glActiveTexture(GL_TEXTURE0 + i);
-        glBindTexture(GL_TEXTURE_2D, 0);
-    }
-    glActiveTexture(GL_TEXTURE0);
-    UpdateLights(app);
 }
 void SetUpCamera(App* app) {
     app->worldCamera.position = glm::vec3(12.5f, 200.0f, 160.0f);
@@ -345,7 +305,7 @@ void InitMeshBuffers(App* app)
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(VertexV3V2), (void*)12);
     glEnableVertexAttribArray(1);
-    glBindBuffer(GL_ARRAY_BUFFER, app->embeddedElements);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, app->embeddedElements);
     glBindVertexArray(0);
 }
 
@@ -358,6 +318,10 @@ void ExtensionsOpenGL(App* app)
     {
         const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
         app->glExtensions.emplace_back(extension);
+
+        // BC4/BC5 are core, BC1/BC3 still come from the S3TC extension
+        if (strcmp(extension, "GL_EXT_texture_compression_s3tc") == 0)
+            app->textureCompression = true;
     }
 }
 
@@ -401,120 +365,122 @@ void SetUpCubeMap(App* app) {
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
 
     glBindVertexArray(0);
-
-    glGenTextures(1, &app->cubeMap.cubeMapTexture);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMap.cubeMapTexture);
-    
-    for (unsigned int i = 0; i < 6; i++)
-    {
-        int width, height, nrChannels;
-
-        unsigned char* data = stbi_load(app->cubeMap.faces1[i].c_str(), &width, &height, &nrChannels, 0);
-        if (data)
-        {
-            stbi_set_flip_vertically_on_load(false);
-            glTexImage2D(
-                GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-                0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data
-            );
-            stbi_image_free(data);
-        }
-        else
-        {
-            std::cout << "Failed Loading Image" << app->cubeMap.faces1[i].c_str() << std::endl;
-            stbi_image_free(data);
-        }
-    }
-
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
-    glGenerateMipmap(GL_TEXTURE_CUBE_MAP); // Generate mipmaps
 }
 
-
+// Decodes the faces of every set in parallel and uploads each set once into
+// an immutable cube texture, with its SH irradiance and prefiltered specular
+// chain read from the cache or baked from the faces. The decoded faces are
+// freed right after, a switch only changes which textures get bound.
 void InitCubeMaps(App* app)
 {
-    app->cubeMap.faces1 = {
+    CubeMap& cubeMap = app->cubeMap;
+    cubeMap.faces1 = {
         "CubeMap/px.png", "CubeMap/nx.png",
         "CubeMap/py.png", "CubeMap/ny.png",
         "CubeMap/pz.png", "CubeMap/nz.png"
     };
 
-    app->cubeMap.faces2 = {
+    cubeMap.faces2 = {
         "CubeMap/px_.png", "CubeMap/nx_.png",
         "CubeMap/py_.png", "CubeMap/ny_.png",
         "CubeMap/pz_.png", "CubeMap/nz_.png"
     };
 
-    app->cubeMap.faces3 = {
+    cubeMap.faces3 = {
         "CubeMap/_px.png", "CubeMap/_nx.png",
         "CubeMap/_py.png", "CubeMap/_ny.png",
         "CubeMap/_pz.png", "CubeMap/_nz.png"
     };
 
-    stbi_set_flip_vertically_on_load(false);
+    const std::vector<std::string>* sets[CUBEMAP_SET_COUNT] = { &cubeMap.faces1, &cubeMap.faces2, &cubeMap.faces3 };
+    Image faces[CUBEMAP_SET_COUNT * 6] = {};
+    ParallelFor(app->jobs, CUBEMAP_SET_COUNT * 6, [&](u32 i)
+    {
+        Image& face = faces[i];
+        stbi_set_flip_vertically_on_load_thread(false);
+        face.pixels = stbi_load((*sets[i / 6])[i % 6].c_str(), &face.size.x, &face.size.y, &face.nchannels, 3);
+    });
 
-    // Load faces1
-    for (int i = 0; i < 6; ++i) {
-        int w, h, nc;
-        unsigned char* data = stbi_load(app->cubeMap.faces1[i].c_str(), &w, &h, &nc, 0);
-        app->cubeMap.faces1Data.push_back(data);
-        app->cubeMap.faces1Sizes.emplace_back(w, h);
-    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (u32 set = 0; set < CUBEMAP_SET_COUNT; ++set)
+    {
+        // Every face has to match the first one that loaded
+        ivec2 size(0);
+        for (u32 face = 0; face < 6; ++face)
+        {
+            const Image& image = faces[set * 6 + face];
+            if (image.pixels && size.x == 0)
+                size = image.size;
+        }
 
-    // Load faces2
-    for (int i = 0; i < 6; ++i) {
-        int w, h, nc;
-        unsigned char* data = stbi_load(app->cubeMap.faces2[i].c_str(), &w, &h, &nc, 0);
-        app->cubeMap.faces2Data.push_back(data);
-        app->cubeMap.faces2Sizes.emplace_back(w, h);
-    }
-    for (int i = 0; i < 6; ++i) {
-        int w, h, nc;
-        unsigned char* data = stbi_load(app->cubeMap.faces3[i].c_str(), &w, &h, &nc, 0);
-        app->cubeMap.faces3Data.push_back(data);
-        app->cubeMap.faces3Sizes.emplace_back(w, h);
+        cubeMap.setTextures[set] = 0;
+        if (size.x == 0 || size.x != size.y)
+        {
+            ELOG("Cube map set %u has no usable faces", set + 1);
+        }
+        else
+        {
+            glGenTextures(1, &cubeMap.setTextures[set]);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, cubeMap.setTextures[set]);
+            glTexStorage2D(GL_TEXTURE_CUBE_MAP, 1, GL_RGB8, size.x, size.y);
+            for (u32 face = 0; face < 6; ++face)
+            {
+                const Image& image = faces[set * 6 + face];
+                if (image.pixels && image.size == size)
+                {
+                    glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, 0, 0, size.x, size.y,
+                        GL_RGB, GL_UNSIGNED_BYTE, image.pixels);
+                }
+                else
+                {
+                    ELOG("Failed loading cube map face %s", (*sets[set])[face].c_str());
+                }
+            }
+
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+            EnvironmentLightingData lighting;
+            if (!ReadEnvironmentLightingCache(*sets[set], lighting))
+            {
+                // Faces of another size were not uploaded either, they bake as black
+                Image images[6] = {};
+                for (u32 face = 0; face < 6; ++face)
+                {
+                    if (faces[set * 6 + face].size == size)
+                        images[face] = faces[set * 6 + face];
+                }
+                BakeEnvironmentLighting(app->jobs, *sets[set], images, lighting);
+            }
+            UploadEnvironmentLighting(lighting, cubeMap.setLighting[set]);
+        }
+
+        for (u32 face = 0; face < 6; ++face)
+            stbi_image_free(faces[set * 6 + face].pixels);
     }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+    cubeMap.brdfLut = LoadBrdfLut(app->jobs);
+    // Rough levels are a few texels wide, filtering across faces hides their seams
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
 }
 
 
 void UpdateCubeMap(App* app, int cubemapType) {
-    std::vector<unsigned char*>* dataVec;
-    std::vector<std::pair<int, int>>* sizeVec;
-
-    switch (cubemapType) {
-    case 1:
-        dataVec = &app->cubeMap.faces1Data;
-        sizeVec = &app->cubeMap.faces1Sizes;
-        break;
-    case 2:
-        dataVec = &app->cubeMap.faces2Data;
-        sizeVec = &app->cubeMap.faces2Sizes;
-        break;
-    case 3:
-        dataVec = &app->cubeMap.faces3Data;
-        sizeVec = &app->cubeMap.faces3Sizes;
-        break;
-    default:
+    if (cubemapType < 1 || cubemapType > CUBEMAP_SET_COUNT) {
         std::cerr << "Invalid cubemapType: " << cubemapType << std::endl;
         return;
     }
 
-    glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMap.cubeMapTexture);
-    for (unsigned int i = 0; i < 6; ++i) {
-        if ((*dataVec)[i]) {
-            int width = (*sizeVec)[i].first;
-            int height = (*sizeVec)[i].second;
-
-            glTexImage2D(
-                GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-                0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, (*dataVec)[i]
-            );
-        }
+    // Sets that failed to load keep the current one
+    const GLuint texture = app->cubeMap.setTextures[cubemapType - 1];
+    if (texture != 0) {
+        app->cubeMap.cubeMapTexture = texture;
+        app->cubeMap.activeSet = (u32)cubemapType;
     }
 }
 
@@ -524,15 +490,22 @@ void Init(App* app)
 
     ExtensionsOpenGL(app);
 
+    InitJobSystem(app->jobs);
+    InitTextureStreaming(app->textureStreamer);
+    InitTextureResidency(app->textureResidency);
+    InitDepthPrePass(app->depthPrePass);
+
     SetUpCamera(app);
 
     InitMeshBuffers(app);
 
-    app->texturedGeometryProgramIdx = LoadProgram(app, "Render_Quad.glsl", "Render_Quad");
+    InitProgramPermutations(app->screenQuadPermutations, "Render_Quad.glsl", "Render_Quad");
+    app->texturedGeometryProgramIdx = GetProgramPermutation(app, app->screenQuadPermutations, 0);
 
     app->reliefMappingIdx = LoadProgram(app, "Relief_Mapping.glsl", "RELIEF_MAPPING");
+    app->reliefNormalMappingIdx = LoadProgram(app, "Relief_Mapping.glsl", "RELIEF_NORMAL_MAPPING");
 
-    app->programUniformTexture = glGetUniformLocation(app->programs[app->texturedGeometryProgramIdx].handle, "uTexture");
+    app->programUniformTexture = app->programs[app->texturedGeometryProgramIdx].uniformLocations[Uniform_Texture];
 
     app->cubeMapIdx = LoadProgram(app, "CubeMap.glsl", "CUBEMAP");
     //Reflective Shader
@@ -541,38 +514,59 @@ void Init(App* app)
     InitCubeMaps(app);
 
     SetUpCubeMap(app);
+    UpdateCubeMap(app, 1);
+
+
+
+    // Imported in parallel, uploaded in this order so the indices never change
+    const char* modelFiles[] = {
+        "Cube/Cube.obj",
+        "Cube2/Cube.obj",
+        "Cube3/Cube.obj",
+        "Pikachu/Pikachu.obj",
+        "Plane/Plane.obj",
+        "Cone/Cone.obj",
+        "Torus/Torus.obj",
+        "SkyBox/SkyBox.obj",
+        "Sphere/Sphere.obj",
+        "Monkey/Monkey.obj",
+        "Car/Car.obj",
+        "Test/Entity_test.obj",
+    };
+    u32 modelIndices[ARRAY_COUNT(modelFiles)];
+    LoadModels(app, modelFiles, ARRAY_COUNT(modelFiles), modelIndices);
 
+    u32 cube = modelIndices[0];
 
+    u32 cube2 = modelIndices[1];
 
-    u32 cube = LoadModel(app, "Cube/Cube.obj");
-
-    u32 cube2 = LoadModel(app, "Cube2/Cube.obj");
-
-    u32 cube3 = LoadModel(app, "Cube3/Cube.obj");
+    u32 cube3 = modelIndices[2];
 
-    app->pikachu = LoadModel(app, "Pikachu/Pikachu.obj");
+    app->pikachu = modelIndices[3];
 
-    u32 planeIdx = LoadModel(app, "Plane/Plane.obj");
+    u32 planeIdx = modelIndices[4];
 
-    u32 cone = LoadModel(app, "Cone/Cone.obj");
+    u32 cone = modelIndices[5];
 
-    u32 torus = LoadModel(app, "Torus/Torus.obj");
+    u32 torus = modelIndices[6];
 
-    u32 skyBox = LoadModel(app, "SkyBox/SkyBox.obj");
+    u32 skyBox = modelIndices[7];
 
-    u32 sphere = LoadModel(app, "Sphere/Sphere.obj");
+    u32 sphere = modelIndices[8];
 
-    u32 monkey = LoadModel(app, "Monkey/Monkey.obj");
+    u32 monkey = modelIndices[9];
      
-    u32 car = LoadModel(app, "Car/Car.obj");
+    u32 car = modelIndices[10];
 
     //Comentat ja que no me crea mes d'una esfera jiji
     //app->sphereIdx = LoadModel(app, "Sphere/Sphere_Light.obj");
 
-    u32 test_1 = LoadModel(app, "Test/Entity_test.obj");
-    app->forwardProgramIdx = LoadProgram(app, "FORWARD.glsl", "FORWARD");
+    u32 test_1 = modelIndices[11];
+    InitProgramPermutations(app->forwardPermutations, "FORWARD.glsl", "FORWARD");
+    app->forwardProgramIdx = GetProgramPermutation(app, app->forwardPermutations, 0);
     app->geometryProgramIdx = LoadProgram(app, "RENDER_GEOMETRY.glsl", "RENDER_GEOMETRY");
-    app->patrickTextureUniform = glGetUniformLocation(app->programs[app->geometryProgramIdx].handle, "uTexture");
+    app->depthPrePassIdx = LoadProgram(app, "DEPTH_PREPASS.glsl", "DEPTH_PREPASS");
+    app->patrickTextureUniform = app->programs[app->geometryProgramIdx].uniformLocations[Uniform_Texture];
 
     float aspectRatio = (float)app->displaySize.x / (float)app->displaySize.y;
     float near = 0.1f;
@@ -584,10 +578,11 @@ void Init(App* app)
     glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &app->maxUniformBufferSize);
     glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &app->uniformBlockAlignment);
 
-    // Con esto (tamaño dinámico):
-    const u32 lightDataSize = app->lights.size() * (sizeof(int) + 3 * sizeof(vec4));
-    app->globalUBO = CreateConstantBuffer(lightDataSize + sizeof(vec4) + sizeof(int));
-    app->entityUBO = CreateConstantBuffer(app->maxUniformBufferSize);
+    // Lights live in their own storage buffer, the global params only hold the camera
+    app->globalUBO = CreateConstantRingBuffer(sizeof(vec4));
+    app->entityUBO = CreateConstantRingBuffer(app->maxUniformBufferSize);
+    InitLightStorage(app->lightStorage);
+    InitLightClusters(app->lightClusters);
 
     //TestParaMiquel(app);  //Crea 1000 llums a l'escena
     CreateLight(app, LightType::Light_Directional, vec3(1.0), vec3(1, 0, 0), 2, 1);
@@ -595,8 +590,6 @@ void Init(App* app)
     CreateLight(app, LightType::Light_Directional, vec3(1.0), vec3(0, 0, 1), 2, 2);
     CreateLight(app, LightType::Light_Directional, vec3(1.0), vec3(1, 0, 0), 7, 3);
 
-    Buffer& entityUBO = app->entityUBO;
-    MapBuffer(entityUBO, GL_WRITE_ONLY);
     glm::mat4 VP = app->worldCamera.projectionMatrix * app->worldCamera.viewMatrix;
 
     CreateEntity(app, cube, VP, glm::translate(glm::vec3(70, 0, 0)), "Cube", EntityType::Relief_Mapping);
@@ -623,13 +616,10 @@ void Init(App* app)
 
     CreateEntity(app, app->pikachu, VP, glm::translate(glm::vec3(0, 0, 0)), "Pikachu", EntityType::Deferred_Rendering);
 
-    UnmapBuffer(entityUBO);
-
     app->mode = Mode_Deferred_Geometry;
     app->useForwardRendering = false;
 
-    app->primaryFBO.CreateFBO(4, app->displaySize.x, app->displaySize.y);
-    UpdateLights(app);
+    app->primaryFBO.CreateFBO(app->compactGBuffer ? 2 : 4, app->displaySize.x, app->displaySize.y, app->compactGBuffer);
 }
 
 // Helper function for the toggle button
@@ -711,9 +701,13 @@ void Gui(App* app)
             case App::BUFFER_VIEW_NORMALS:
                 textureID = app->primaryFBO.attachments[1].second; break;
             case App::BUFFER_VIEW_POSITION:
-                textureID = app->primaryFBO.attachments[2].second; break;
             case App::BUFFER_VIEW_VIEWDIR:
-                textureID = app->primaryFBO.attachments[3].second; break;
+                // Rebuilt from depth in the compact layout
+                if (app->primaryFBO.compact)
+                    textureID = app->primaryFBO.depthHandle;
+                else
+                    textureID = app->primaryFBO.attachments[app->bufferViewMode == App::BUFFER_VIEW_POSITION ? 2 : 3].second;
+                break;
             case App::BUFFER_VIEW_DEPTH:
                 textureID = app->primaryFBO.depthHandle; break;
             default:
@@ -756,6 +750,11 @@ void Gui(App* app)
             }
 
             ImGui::PopStyleVar();
+
+            if (ImGui::Checkbox("Compact G-buffer", &app->compactGBuffer)) {
+                app->primaryFBO.Clear();
+                app->primaryFBO.CreateFBO(app->compactGBuffer ? 2 : 4, app->displaySize.x, app->displaySize.y, app->compactGBuffer);
+            }
         }
         ImGui::End();
     }
@@ -818,9 +817,6 @@ void Gui(App* app)
     ImGui::Begin("Inspector");
     {
         if (ImGui::CollapsingHeader("Entities", ImGuiTreeNodeFlags_DefaultOpen)) {
-            bool entityChanged = false;
-            glm::mat4 VP = app->worldCamera.projectionMatrix * app->worldCamera.viewMatrix;
-
             for (size_t i = 0; i < app->entities.size(); ++i) {
                 ImGui::PushID(static_cast<int>(i));
                 app->entities[6].active == false;
@@ -835,7 +831,6 @@ void Gui(App* app)
                         std::string label = "Geometry: " + app->entities[i].name;
                         if (ImGui::DragFloat3(label.c_str(), &entityPosition[0], 0.1f)) {
                             app->entities[i].worldMatrix = glm::translate(glm::mat4(1.0f), entityPosition);
-                            entityChanged = true;
                         }
                     }
                     else if (app->entities[i].type == EntityType::Relief_Mapping && app->pgaType == 2)
@@ -843,7 +838,6 @@ void Gui(App* app)
                         std::string label = "Geometry: " + app->entities[i].name;
                         if (ImGui::DragFloat3(label.c_str(), &entityPosition[0], 0.1f)) {
                             app->entities[i].worldMatrix = glm::translate(glm::mat4(1.0f), entityPosition);
-                            entityChanged = true;
                         }
                     }
                     else if (app->entities[i].type == EntityType::Enviroment_Map && app->pgaType == 3)
@@ -851,23 +845,12 @@ void Gui(App* app)
                         std::string label = "Geometry: " + app->entities[i].name;
                         if (ImGui::DragFloat3(label.c_str(), &entityPosition[0], 0.1f)) {
                             app->entities[i].worldMatrix = glm::translate(glm::mat4(1.0f), entityPosition);
-                            entityChanged = true;
                         }
                     }
                 }
 
                 ImGui::PopID();
             }
-
-            if (entityChanged) {
-                MapBuffer(app->entityUBO, GL_WRITE_ONLY);
-                for (auto& entity : app->entities) {
-                    glm::mat4 newVPMatrix = VP * entity.worldMatrix;
-                    memcpy((char*)app->entityUBO.data + entity.entityBufferOffset, &entity.worldMatrix, sizeof(glm::mat4));
-                    memcpy((char*)app->entityUBO.data + entity.entityBufferOffset + sizeof(glm::mat4), &newVPMatrix, sizeof(glm::mat4));
-                }
-                UnmapBuffer(app->entityUBO);
-            }
         }
 
         if (app->pgaType == 2)
@@ -875,6 +858,11 @@ void Gui(App* app)
             ImGui::Begin("Relief Intensity");
             {
                 ImGui::SliderFloat("Relief Intensity", &app->reliefIntensity, 0.0f, 0.2f, "%.3f");
+                const char* marches[] = { "Cone step", "Linear (reference)" };
+                int march = app->reliefMarch;
+                if (ImGui::Combo("Ray March", &march, marches, IM_ARRAYSIZE(marches))) {
+                    app->reliefMarch = static_cast<App::ReliefMarch>(march);
+                }
                 ToggleButton("Rotation", &app->isRotating);
             }
             ImGui::End();
@@ -882,6 +870,32 @@ void Gui(App* app)
 
         if (ImGui::CollapsingHeader("Important Info", ImGuiTreeNodeFlags_DefaultOpen)) {
             ImGui::Text("FPS: %.1f", 1.0f / app->deltaTime);
+            ImGui::Text("GL state calls: %u issued, %u redundant skipped",
+                app->renderState.lastFrameIssuedCalls, app->renderState.lastFrameSkippedCalls);
+            ImGui::Text("Draws: %u (program changes %u, material changes %u, VAO changes %u)",
+                app->renderQueue.drawCount, app->renderQueue.programChanges,
+                app->renderQueue.materialChanges, app->renderQueue.vaoChanges);
+            ImGui::Checkbox("Frustum culling", &app->frustumCulling);
+            ImGui::SameLine();
+            ImGui::Checkbox("Meshlets", &app->meshletCulling);
+            ImGui::SameLine();
+            ImGui::Checkbox("Backface cones", &app->meshletConeCulling);
+            ImGui::Text("Entities: %u visible, %u culled (%u submeshes, %u meshlets culled)",
+                app->cullingBounds.visibleEntities, app->cullingBounds.culledEntities,
+                app->cullingBounds.culledSubmeshes, app->cullingBounds.culledMeshlets);
+            ImGui::Text("Light clusters: %u point lights, %u indices, max %u per cluster",
+                app->lightClusters.pointLights, (u32)app->lightClusters.lightIndices.size(),
+                app->lightClusters.maxLightsPerCluster);
+            ImGui::Text("Light uploads: %u lights in %u ranges",
+                app->lightStorage.lastUploadLights, app->lightStorage.lastUploadRanges);
+            ImGui::Text("Uniform ring stalls: %u", app->entityUBO.stalls + app->globalUBO.stalls);
+            ImGui::Text("Triangles: %u", app->renderQueue.triangleCount);
+            ImGui::Text("Texture streaming: %u pending, %u resident, %.1f KB this frame",
+                GetPendingTextureCount(app->textureStreamer), app->textureStreamer.completed,
+                app->textureStreamer.frameBytes / 1024.0f);
+            i32 budgetKB = (i32)(app->textureStreamer.frameBudget / 1024);
+            if (ImGui::SliderInt("Upload budget (KB/frame)", &budgetKB, 64, TEXTURE_STREAM_MAX_FRAME_BYTES / 1024))
+                app->textureStreamer.frameBudget = (u32)budgetKB * 1024;
 
             if (app->pgaType == 3) {
                 ImGui::Begin("CubeMap");
@@ -910,6 +924,62 @@ void Gui(App* app)
         }
         ImGui::Separator();
 
+        if (ImGui::CollapsingHeader("Level of detail")) {
+            ImGui::Checkbox("Enabled", &app->lodEnabled);
+            for (u32 i = 0; i < MESH_MAX_LODS; ++i) {
+                // Each level starts below the previous one
+                const f32 maxSize = i > 0 ? app->lodScreenSizes[i - 1] : 2.0f;
+                app->lodScreenSizes[i] = glm::min(app->lodScreenSizes[i], maxSize);
+                char label[32];
+                snprintf(label, sizeof(label), "LOD %u below", i + 1);
+                ImGui::SliderFloat(label, &app->lodScreenSizes[i], 0.0f, maxSize, "%.3f");
+            }
+
+            u32 entitiesPerLod[MESH_MAX_LODS + 1] = {};
+            for (u32 i = 0; i < app->entities.size(); ++i) {
+                if (i < app->cullingBounds.visible.size() && app->cullingBounds.visible[i])
+                    entitiesPerLod[glm::min(app->entities[i].lod, (u32)MESH_MAX_LODS)]++;
+            }
+            ImGui::Text("Visible entities per level: %u / %u / %u / %u / %u",
+                entitiesPerLod[0], entitiesPerLod[1], entitiesPerLod[2], entitiesPerLod[3], entitiesPerLod[4]);
+        }
+        ImGui::Separator();
+
+        if (ImGui::CollapsingHeader("Relief detail")) {
+            ImGui::Checkbox("Enabled##relief", &app->reliefLodEnabled);
+            ImGui::SliderFloat("Fade starts below", &app->reliefFadeStartSize, 0.0f, 1.0f, "%.3f");
+            // Normal mapping only takes over below the start of the fade
+            app->reliefFadeEndSize = glm::min(app->reliefFadeEndSize, app->reliefFadeStartSize);
+            ImGui::SliderFloat("Normal mapping below", &app->reliefFadeEndSize, 0.0f, app->reliefFadeStartSize, "%.3f");
+
+            u32 full = 0, fading = 0, normalMapped = 0;
+            for (u32 i = 0; i < app->entities.size(); ++i) {
+                const Entity& entity = app->entities[i];
+                if (entity.type != EntityType::Relief_Mapping || i >= app->cullingBounds.visible.size() || !app->cullingBounds.visible[i])
+                    continue;
+                if (entity.reliefFade >= 1.0f) full++;
+                else if (entity.reliefFade > 0.0f) fading++;
+                else normalMapped++;
+            }
+            ImGui::Text("Visible relief entities: %u full / %u fading / %u normal mapped", full, fading, normalMapped);
+        }
+        ImGui::Separator();
+
+        if (ImGui::CollapsingHeader("Depth pre-pass")) {
+            DepthPrePass& prePass = app->depthPrePass;
+            const char* modes[] = { "Off", "On", "Auto (measured)" };
+            int mode = prePass.mode;
+            if (ImGui::Combo("Mode##prepass", &mode, modes, IM_ARRAYSIZE(modes))) {
+                prePass.mode = static_cast<DepthPrePassMode>(mode);
+                prePass.nextProbe = 0;
+            }
+            ImGui::Text("Drawn this frame: %s (%u draws)", prePass.frameEnabled ? "yes" : "no", prePass.drawCount);
+            if (prePass.mode == DepthPrePass_Auto && prePass.lastProbeTime[0] > 0.0f) {
+                ImGui::Text("Last probe: %.3f ms with, %.3f ms without", prePass.lastProbeTime[1], prePass.lastProbeTime[0]);
+            }
+        }
+        ImGui::Separator();
+
         if (ImGui::CollapsingHeader("Camera", ImGuiTreeNodeFlags_DefaultOpen)) {
             ImGui::DragFloat3("Position", &app->worldCamera.position[0], 0.1f);
 
@@ -944,12 +1014,10 @@ void Gui(App* app)
             if (ImGui::CollapsingHeader("Lights", ImGuiTreeNodeFlags_DefaultOpen)) {
                 if (ImGui::Button("Add Directional Light")) {
                     CreateLight(app, LightType::Light_Directional, vec3(1), vec3(1), 1.f, app->pgaType);
-                    UpdateLights(app);
                 }
 
                 if (ImGui::Button("Add Point Light")) {
                     CreateLight(app, LightType::Light_Point, vec3(1), vec3(0), 1.f, app->pgaType);
-                    UpdateLights(app);
                 }
                 if (app->pgaType == 1)
                 {
@@ -963,27 +1031,25 @@ void Gui(App* app)
                                 CreateLight(app, LightType::Light_Point, color, glm::vec3(x * 50, 0.0f, z * 50), 1, app->pgaType);
                             }
                         }
-                        UpdateLights(app);
                     }
 
                     if (ImGui::Button("Delete Last 400 lights"))
                     {
                         if (!app->lights.empty()) {
-                            size_t lightsToRemove = glm::min(app->lights.size(), (size_t)401);
-                            app->lights.erase(app->lights.end() - lightsToRemove, app->lights.end());
-                            UpdateLights(app);
+                            u32 lightsToRemove = glm::min((u32)app->lights.size(), 401u);
+                            RemoveLights(app, (u32)app->lights.size() - lightsToRemove, lightsToRemove);
                         }
                     }
                 }
 
                 for (size_t i = 0; i < app->lights.size(); ++i)
                 {
-                    ImGui::PushID(static_cast<int>(i));
                     Light& light = app->lights[i];
                     if (light.mode != app->pgaType)
                     {
                         continue;
                     }
+                    ImGui::PushID(static_cast<int>(i));
                     bool lightChanged = false;
 
                     ImGui::Separator();
@@ -1033,15 +1099,14 @@ void Gui(App* app)
 
                     if (ImGui::Button("Delete"))
                     {
-                        app->lights.erase(app->lights.begin() + i);
-                        UpdateLights(app);
+                        RemoveLights(app, (u32)i, 1);
                         ImGui::PopID();
                         continue;
                     }
 
                     if (lightChanged)
                     {
-                        UpdateLights(app);
+                        MarkLightDirty(app, (u32)i);
                     }
 
                     ImGui::PopID();
@@ -1062,6 +1127,55 @@ void Gui(App* app)
         }
         ImGui::End();
 
+        ImGui::Begin("Texture Residency");
+        {
+            TextureResidency& residency = app->textureResidency;
+            const f32 megabyte = 1024.0f * 1024.0f;
+
+            i32 budgetMB = (i32)(residency.budget / (1024 * 1024));
+            if (ImGui::SliderInt("Budget (MB)", &budgetMB, 8, 4096))
+                residency.budget = (u64)budgetMB * 1024 * 1024;
+            ImGui::SliderFloat("Mip bias", &residency.mipBias, -2.0f, 4.0f, "%.1f");
+
+            char overlay[64];
+            snprintf(overlay, sizeof(overlay), "%.1f / %.1f MB", residency.usedBytes / megabyte, residency.budget / megabyte);
+            ImGui::ProgressBar(residency.budget > 0 ? (f32)residency.usedBytes / (f32)residency.budget : 0.0f, ImVec2(-1.0f, 0.0f), overlay);
+            ImGui::Text("Levels streamed in %u, evicted %u, trimmed %u",
+                residency.promotions, residency.evictions, residency.trims);
+
+            if (ImGui::BeginTable("Textures", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_ScrollY)) {
+                ImGui::TableSetupColumn("Texture");
+                ImGui::TableSetupColumn("Resident");
+                ImGui::TableSetupColumn("Levels");
+                ImGui::TableSetupColumn("MB");
+                ImGui::TableSetupColumn("Unused (frames)");
+                ImGui::TableHeadersRow();
+                for (const Texture& texture : app->textures) {
+                    ImGui::TableNextRow();
+                    ImGui::TableNextColumn();
+                    const size_t slash = texture.filepath.find_last_of("/\\");
+                    ImGui::Text("%s%s", texture.filepath.c_str() + (slash == std::string::npos ? 0 : slash + 1),
+                        texture.type == TextureType::ConeStep ? " (cones)" : "");
+                    if (!texture.resident) {
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%s", texture.streaming ? "loading" : "missing");
+                        continue;
+                    }
+                    const ivec2 size = glm::max(texture.size >> (i32)texture.baseMip, ivec2(1));
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%dx%d%s", size.x, size.y, texture.streaming ? " +" : "");
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%u-%u", texture.baseMip, texture.mipCount - 1);
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%.2f", texture.bytes / megabyte);
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%u", residency.frame - texture.lastUsedFrame);
+                }
+                ImGui::EndTable();
+            }
+        }
+        ImGui::End();
+
         if (ImGui::CollapsingHeader("Camera", ImGuiTreeNodeFlags_DefaultOpen)) {
             ImGui::DragFloat3("Position", &app->worldCamera.position[0], 0.1f);
 
@@ -1143,7 +1257,7 @@ void CheckAndReloadShaders(App* app)
         if (currentTimestamp != program.lastWriteTimestamp)
         {
             String programSource = ReadTextFile(program.filepath.c_str());
-            GLuint newHandle = CreateProgramFromSource(programSource, program.programName.c_str());
+            GLuint newHandle = CreateProgramFromSource(programSource, program.programName.c_str(), program.features);
 
             if (newHandle != 0)
             {
@@ -1152,20 +1266,7 @@ void CheckAndReloadShaders(App* app)
                 program.handle = newHandle;
                 program.lastWriteTimestamp = currentTimestamp;
 
-
-                program.vertexInputLayout.attributes.clear();
-                GLint attributeCount = 0;
-                glGetProgramiv(program.handle, GL_ACTIVE_ATTRIBUTES, &attributeCount);
-                for (size_t i = 0; i < attributeCount; ++i)
-                {
-                    GLchar name[248];
-                    GLsizei realNameSize = 0;
-                    GLsizei attribSize = 0;
-                    GLenum attribType;
-                    glGetActiveAttrib(program.handle, i, ARRAY_COUNT(name), &realNameSize, &attribSize, &attribType, name);
-                    GLuint attribLocation = glGetAttribLocation(program.handle, name);
-                    program.vertexInputLayout.attributes.push_back({ static_cast<u8>(attribLocation), static_cast<u8>(attribSize) });
-                }
+                ReflectProgram(program);
 
                 ELOG("Reloaded shader: %s", program.filepath.c_str());
             }
@@ -1214,6 +1315,9 @@ void Update(App* app) {
 
     CheckAndReloadShaders(app);
 
+    UpdateTextureStreaming(app);
+    UpdateTextureResidency(app);
+
     if (app->input.mouseButtons[LEFT] == BUTTON_PRESS) {
         app->worldCamera.isRotating = true;
     }
@@ -1271,7 +1375,8 @@ void Update(App* app) {
 
     glm::mat4 VP = app->worldCamera.projectionMatrix * app->worldCamera.viewMatrix;
 
-    MapBuffer(app->entityUBO, GL_WRITE_ONLY);
+    // Entity blocks go to this frame's region of the ring, their offsets change every frame
+    MapRingBufferFrame(app->entityUBO);
     static float animationTime = 0.0f;
     animationTime += app->deltaTime;
 
@@ -1302,11 +1407,11 @@ void Update(App* app) {
         glm::mat4 vpMatrix = VP * entity.worldMatrix;
         glm::mat4 normalMatrix = glm::transpose(glm::inverse(entity.worldMatrix));
 
-        memcpy((char*)app->entityUBO.data + entity.entityBufferOffset, &entity.worldMatrix, sizeof(glm::mat4));
-
-        memcpy((char*)app->entityUBO.data + entity.entityBufferOffset + sizeof(glm::mat4), &vpMatrix, sizeof(glm::mat4));
-
-        memcpy((char*)app->entityUBO.data + entity.entityBufferOffset + 2 * sizeof(glm::mat4), &normalMatrix, sizeof(glm::mat4));
+        AlignHead(app->entityUBO, app->uniformBlockAlignment);
+        entity.entityBufferOffset = GetRingBufferOffset(app->entityUBO);
+        PushMat4(app->entityUBO, entity.worldMatrix);
+        PushMat4(app->entityUBO, vpMatrix);
+        PushMat4(app->entityUBO, normalMatrix);
     }
 
     if (app->input.keys[K_F] == BUTTON_PRESSED) {
@@ -1335,50 +1440,17 @@ void Update(App* app) {
         isPanning = false;
     }
 
-    UnmapBuffer(app->entityUBO);
-    UpdateLights(app);
+    UnmapRingBufferFrame(app->entityUBO);
+    UpdateGlobalParams(app);
+    UploadDirtyLights(app);
 }
 
-void UpdateLights(App* app) {
-    // Contar solo las luces activas del modo actual
-    u32 activeLightCount = 0;
-    for (const auto& light : app->lights) {
-        if (light.mode == app->pgaType) {
-            ++activeLightCount;
-        }
-    }
-
-    const u32 sizePerLight = sizeof(int) + 3 * sizeof(vec4); // type + color + dir + pos
-    const u32 otherDataSize = sizeof(glm::vec3) + sizeof(int); // cam pos + light count
-    const u32 requiredSize = otherDataSize + activeLightCount * sizePerLight;
-
-    // Redimensionar si hace falta
-    if (requiredSize > app->maxUniformBufferSize || app->globalUBO.size < requiredSize) {
-        UnmapBuffer(app->globalUBO);
-        app->globalUBO = CreateConstantBuffer(requiredSize);
-    }
-
-    MapBuffer(app->globalUBO, GL_WRITE_ONLY);
-    //BindBuffer(app->globalUBO);
-
-    // Subir posición de cámara y número de luces activas
+void UpdateGlobalParams(App* app)
+{
+    MapRingBufferFrame(app->globalUBO);
+    app->globalParamsOffset = GetRingBufferOffset(app->globalUBO);
     PushVec3(app->globalUBO, app->worldCamera.position);
-    PushUInt(app->globalUBO, activeLightCount);
-
-    for (auto& light : app->lights) {
-        if (light.mode != app->pgaType) continue;
-
-        AlignHead(app->globalUBO, 16);
-        PushUInt(app->globalUBO, static_cast<int>(light.type));
-        PushVec3(app->globalUBO, light.color * light.intensity);
-        AlignHead(app->globalUBO, 16);
-        PushVec3(app->globalUBO, light.direction);
-        AlignHead(app->globalUBO, 16);
-        PushVec3(app->globalUBO, light.position);
-        PushFloat(app->globalUBO, light.intensity);
-    }
-
-    UnmapBuffer(app->globalUBO);
+    UnmapRingBufferFrame(app->globalUBO);
 }
 
 void RenderCubeMap(App* app) {
@@ -1388,285 +1460,487 @@ void RenderCubeMap(App* app) {
         return;
     }
 
-    // Guardar estado actual
-    GLint lastProgram;
-    GLboolean depthMaskEnabled;
-    GLint depthFunc;
-    glGetIntegerv(GL_CURRENT_PROGRAM, &lastProgram);
-    glGetBooleanv(GL_DEPTH_WRITEMASK, &depthMaskEnabled);
-    glGetIntegerv(GL_DEPTH_FUNC, &depthFunc);
-    GLint cullFace = glIsEnabled(GL_CULL_FACE);
+    // Guardar estado actual (from the state cache, querying GL would stall)
+    RenderState& state = app->renderState;
+    const i8 depthWriteEnabled = state.depthWrite;
+    const GLenum depthFunc = state.depthFunc;
+    const i8 cullFaceEnabled = state.cullFace;
 
     // Configurar estado para skybox
-    glDepthFunc(GL_LEQUAL);
-    glDepthMask(GL_FALSE);  // No escribir en depth buffer
-    glDisable(GL_CULL_FACE);
+    SetDepthFunc(state, GL_LEQUAL);
+    SetDepthWrite(state, false);  // No escribir en depth buffer
+    SetCullFace(state, false);
 
     Program& cubeMapProgram = app->programs[app->cubeMapIdx];
-    glUseProgram(cubeMapProgram.handle);
+    SetProgram(state, cubeMapProgram.handle);
 
     // Eliminar componente de traslación
     glm::mat4 view = glm::mat4(glm::mat3(app->worldCamera.viewMatrix));
 
-    glUniformMatrix4fv(glGetUniformLocation(cubeMapProgram.handle, "uView"), 1, GL_FALSE, &view[0][0]);
-    glUniformMatrix4fv(glGetUniformLocation(cubeMapProgram.handle, "uProj"), 1, GL_FALSE, &app->worldCamera.projectionMatrix[0][0]);
+    SetUniformMat4(cubeMapProgram, Uniform_View, view);
+    SetUniformMat4(cubeMapProgram, Uniform_Proj, app->worldCamera.projectionMatrix);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMap.cubeMapTexture);
-    glUniform1i(glGetUniformLocation(cubeMapProgram.handle, "skybox"), 0);
+    SetTexture(state, 0, GL_TEXTURE_CUBE_MAP, app->cubeMap.cubeMapTexture);
+    SetUniformInt(cubeMapProgram, Uniform_Skybox, 0);
 
-    glBindVertexArray(app->cubeMap.VAO);
+    SetVertexArray(state, app->cubeMap.VAO);
     glDrawElements(GL_TRIANGLES,
         static_cast<GLsizei>(app->cubeMap.cubemapCubeIndices.size()),
         GL_UNSIGNED_INT,
         nullptr);
 
     // Restaurar estado
-    glUseProgram(lastProgram);
-    glDepthMask(depthMaskEnabled);
-    glDepthFunc(depthFunc);
-    if (cullFace) glEnable(GL_CULL_FACE);
-    else glDisable(GL_CULL_FACE);
+    if (depthWriteEnabled >= 0) SetDepthWrite(state, depthWriteEnabled != 0);
+    if (depthFunc != GL_NONE)   SetDepthFunc(state, depthFunc);
+    if (cullFaceEnabled >= 0)   SetCullFace(state, cullFaceEnabled != 0);
+}
+
+// Lighting of the active cube map set: SH irradiance as uniforms, the
+// prefiltered specular cube on unit 4 and the BRDF lut on unit 5
+static void BindEnvironmentLighting(App* app, const Program& program)
+{
+    RenderState& state = app->renderState;
+    const CubeMap& cubeMap = app->cubeMap;
+    const EnvironmentLighting& lighting = cubeMap.setLighting[cubeMap.activeSet > 0 ? cubeMap.activeSet - 1 : 0];
+
+    SetUniformVec3Array(program, Uniform_IrradianceSH, lighting.irradianceSH, IBL_SH_COEFFICIENTS);
+    SetTexture(state, 4, GL_TEXTURE_CUBE_MAP, lighting.specularTexture);
+    SetUniformInt(program, Uniform_SpecularEnvironment, 4);
+    SetUniformFloat(program, Uniform_SpecularMaxLod, (f32)(IBL_SPECULAR_MIPS - 1));
+    SetTexture(state, 5, GL_TEXTURE_2D, cubeMap.brdfLut);
+    SetUniformInt(program, Uniform_BrdfLut, 5);
+}
+
+// Materials without a height map get the flat placeholder, which stops the
+// cone march at its first fetch
+static GLuint GetConeStepTexture(const App* app, const Material& material)
+{
+    if (material.coneStepTextureIdx != 0)
+        return app->textures[material.coneStepTextureIdx].handle;
+    return GetPlaceholderTexture(app->textureStreamer, TextureType::ConeStep);
+}
+
+// Cheap programs first so the sort groups by the most common shader
+static u32 GetProgramRank(const App* app, u32 programIdx)
+{
+    if (programIdx == app->environmentMapIdx)      return 1;
+    if (programIdx == app->reliefNormalMappingIdx) return 2;
+    if (programIdx == app->reliefMappingIdx)       return 3;
+    return 0;
+}
+
+// Forward permutation of a submesh. Relief marches along the normal map's
+// tangent frame and drops out once the entity has faded back to flat.
+static u32 GetForwardFeatures(const App* app, const Entity& entity, const Material& material)
+{
+    u32 features = 0;
+    if (material.normalsTextureIdx != 0)
+    {
+        features |= ShaderFeature_NormalMap;
+        if (material.heighTextureIdx != 0 && entity.reliefFade > 0.0f && app->reliefIntensity > 0.0f)
+            features |= ShaderFeature_HeightMap;
+    }
+    if (entity.type == EntityType::Enviroment_Map)
+        features |= ShaderFeature_Environment;
+    return features;
+}
+
+static u32 GetEntityProgram(const App* app, const Entity& entity, bool forward)
+{
+    if (forward)
+        return app->forwardProgramIdx;
+
+    switch (entity.type)
+    {
+    case EntityType::Relief_Mapping:
+        // Without relief the depth write only costs early-Z
+        return entity.reliefFade > 0.0f && app->reliefIntensity > 0.0f ? app->reliefMappingIdx : app->reliefNormalMappingIdx;
+    case EntityType::Enviroment_Map: return app->environmentMapIdx;
+    default:                         return app->geometryProgramIdx;
+    }
+}
+
+// Collects one item per visible submesh and sorts them by draw key. The
+// forward path has no background pass, it draws the skybox via RenderCubeMap.
+// Entities are frustum culled in batch first, then the submeshes of entities
+// that survive are tested one by one against their bounding spheres, and
+// finally their meshlets against the frustum and their backface cones.
+// Each item draws the runs of meshlets that survived.
+void BuildRenderQueue(App* app, bool forward)
+{
+    RenderQueue& queue = app->renderQueue;
+    ClearRenderQueue(queue);
+
+    const Camera& camera = app->worldCamera;
+    const Frustum frustum = ExtractFrustum(camera.projectionMatrix * camera.viewMatrix);
+    CullEntities(app, frustum);
+
+    CullingBounds& bounds = app->cullingBounds;
+    bounds.culledSubmeshes = 0;
+    bounds.culledMeshlets = 0;
+
+    for (u32 entityIdx = 0; entityIdx < app->entities.size(); ++entityIdx)
+    {
+        const Entity& entity = app->entities[entityIdx];
+        if (!bounds.visible[entityIdx])
+            continue;
+        if (forward && entity.pass == RenderPass_Background)
+            continue;
+
+        const Model& model = app->models[entity.modelIndex];
+        const Mesh& mesh = app->meshes[model.meshIdx];
+
+        const vec3 entityPosition = vec3(entity.worldMatrix[3]);
+        const f32 viewDepth = glm::dot(entityPosition - camera.position, camera.front);
+
+        // A single submesh has the entity bounds, the batch test already covered it
+        const bool testSubmeshes = app->frustumCulling && mesh.submeshes.size() > 1 && entity.pass != RenderPass_Background;
+        const f32 maxScale = glm::max(glm::length(vec3(entity.worldMatrix[0])),
+                             glm::max(glm::length(vec3(entity.worldMatrix[1])), glm::length(vec3(entity.worldMatrix[2]))));
+        const f32 minScale = glm::min(glm::length(vec3(entity.worldMatrix[0])),
+                             glm::min(glm::length(vec3(entity.worldMatrix[1])), glm::length(vec3(entity.worldMatrix[2]))));
+
+        // The skybox is seen from inside, and normal cones do not survive a non-uniform scale
+        const bool testMeshlets = app->frustumCulling && app->meshletCulling && entity.pass != RenderPass_Background;
+        const bool testCones = app->meshletConeCulling && minScale >= maxScale * 0.999f;
+
+        // One level for the whole entity so its submeshes never mix detail levels.
+        // The background is seen from inside, it wants full detail.
+        const vec3 center = vec3(entity.worldMatrix * vec4(mesh.sphere.center, 1.0f));
+        const f32 screenSize = entity.pass == RenderPass_Background ? FLT_MAX
+                             : ComputeScreenSize(camera, center, mesh.sphere.radius * maxScale);
+        u32 lod = 0;
+        if (app->lodEnabled && entity.pass != RenderPass_Background)
+        {
+            lod = SelectLod(app->lodScreenSizes, screenSize);
+        }
+        app->entities[entityIdx].lod = lod;
+
+        // Relief fades into plain normal mapping as the entity gets smaller
+        f32 reliefFade = 1.0f;
+        if (app->reliefLodEnabled && entity.pass != RenderPass_Background)
+        {
+            const f32 fadeStart = glm::max(app->reliefFadeStartSize, app->reliefFadeEndSize + 1e-4f);
+            reliefFade = glm::smoothstep(app->reliefFadeEndSize, fadeStart, screenSize);
+        }
+        app->entities[entityIdx].reliefFade = reliefFade;
+
+        const u32 programIdx = GetEntityProgram(app, entity, forward);
+        const u32 programRank = GetProgramRank(app, programIdx);
+        const f32 screenPixels = screenSize * (f32)app->displaySize.y;
+
+        for (u32 i = 0; i < mesh.submeshes.size(); ++i)
+        {
+            if (i >= model.materialIdx.size())
+                continue;
+
+            if (testSubmeshes)
+            {
+                const BoundingSphere& sphere = mesh.submeshes[i].sphere;
+                const vec3 center = vec3(entity.worldMatrix * vec4(sphere.center, 1.0f));
+                if (!IsSphereInFrustum(frustum, center, sphere.radius * maxScale))
+                {
+                    bounds.culledSubmeshes++;
+                    continue;
+                }
+            }
+
+            const Submesh& submesh = mesh.submeshes[i];
+
+            RenderItem item;
+            item.entityIdx = entityIdx;
+            item.submeshIdx = i;
+            item.programIdx = programIdx;
+            item.materialIdx = model.materialIdx[i];
+            item.firstRange = (u32)queue.rangeCounts.size();
+
+            // Forward permutations are picked per material, their mask sorts fewer features first
+            u32 itemProgramRank = programRank;
+            if (forward)
+            {
+                const u32 features = GetForwardFeatures(app, entity, app->materials[item.materialIdx]);
+                item.programIdx = GetProgramPermutation(app, app->forwardPermutations, features);
+                itemProgramRank = features;
+            }
+
+            // Meshlets only cover the full detail level, the coarser ones are drawn whole
+            const u32 level = glm::min(lod, (u32)submesh.lods.size());
+            if (level > 0)
+            {
+                const SubmeshLod& submeshLod = submesh.lods[level - 1];
+                PushRenderRange(queue, submeshLod.indexCount, submesh.indexOffset + submeshLod.firstIndex * sizeof(u32));
+                item.rangeCount = 1;
+            }
+            else if (testMeshlets && submesh.meshlets.size() > 1)
+            {
+                item.rangeCount = PushVisibleMeshletRanges(queue, submesh, entity.worldMatrix, frustum,
+                                                           camera.position, testCones, bounds.culledMeshlets);
+                if (item.rangeCount == 0)
+                    continue;
+            }
+            else
+            {
+                PushRenderRange(queue, submesh.indexCount, submesh.indexOffset);
+                item.rangeCount = 1;
+            }
+
+            u64 key = MakeDrawKey(entity.pass, itemProgramRank, item.materialIdx, model.meshIdx, viewDepth);
+            PushRenderItem(queue, key, item);
+            RequestMaterialTextures(app, app->materials[item.materialIdx], screenPixels);
+        }
+    }
+
+    SortRenderQueue(queue);
 }
 
 void Render(App* app)
 {
+    RenderState& state = app->renderState;
+    BeginRenderStateFrame(state);
+
+    // Known starting point so the cache never has to query GL
+    SetDepthTest(state, true);
+    SetDepthWrite(state, true);
+    SetDepthFunc(state, GL_LESS);
+    SetCullFace(state, false);
+
     switch (app->mode)
     {
     case Mode_Forward_Geometry:
     {
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        SetFramebuffer(state, 0);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glEnable(GL_DEPTH_TEST);
 
         // 1. Render skybox only for environment mapping mode
         if (app->pgaType == 3) {
-            glDepthMask(GL_FALSE);
+            SetDepthWrite(state, false);
             RenderCubeMap(app);
-            glDepthMask(GL_TRUE);
+            SetDepthWrite(state, true);
         }
 
+        // Render all entities (except skybox) in key order: material, then front-to-back
+        RenderQueue& queue = app->renderQueue;
+        BuildRenderQueue(app, true);
+
+        // The skybox above does not write depth, every forward item can go in the pre-pass
+        const bool prePass = BeginDepthPrePassFrame(app->depthPrePass);
+        if (prePass)
+            RenderDepthPrePass(app, queue);
+
         // 2. Renderizar otros objetos normalmente
-        Program& forwardProgram = app->programs[app->forwardProgramIdx];
-        glUseProgram(forwardProgram.handle);
 
         // Bind global UBO
-        glBindBufferBase(GL_UNIFORM_BUFFER, 0, app->globalUBO.handle);
-
-        // Set common matrices and properties
-        glm::mat4 view = app->worldCamera.viewMatrix;
-        glm::mat4 proj = app->worldCamera.projectionMatrix;
-        glUniformMatrix4fv(glGetUniformLocation(forwardProgram.handle, "uView"), 1, GL_FALSE, glm::value_ptr(view));
-        glUniformMatrix4fv(glGetUniformLocation(forwardProgram.handle, "uProj"), 1, GL_FALSE, glm::value_ptr(proj));
-        glUniform3fv(glGetUniformLocation(forwardProgram.handle, "uCameraPosition"), 1, glm::value_ptr(app->worldCamera.position));
-
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMap.cubeMapTexture);
-        glUniform1i(glGetUniformLocation(forwardProgram.handle, "uSkybox"), 3);
-
-        // Reset material flags to defaults
-        glUniform1i(glGetUniformLocation(forwardProgram.handle, "uEnvironmentEnabled"), 0);
-        glUniform1i(glGetUniformLocation(forwardProgram.handle, "uNormalMapAvailable"), 0);
-        glUniform1f(glGetUniformLocation(forwardProgram.handle, "uHeightScale"), 0.0f);
-        glUniform1f(glGetUniformLocation(forwardProgram.handle, "uReflectionIntensity"), 0.0f);
-
-        // Reset ALL texture units before each entity
-        for (int i = 0; i < 4; i++) {
-            glActiveTexture(GL_TEXTURE0 + i);
-            glBindTexture(GL_TEXTURE_2D, 0);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-        }
+        SetUniformBufferRange(state, 0, app->globalUBO.handle, app->globalParamsOffset, sizeof(vec4));
+
+        // The environment cube stays on unit 3 for the whole pass, only ENVIRONMENT permutations sample it
+        SetTexture(state, 3, GL_TEXTURE_CUBE_MAP, app->cubeMap.cubeMapTexture);
 
-        // Render all entities (except skybox)
-        for (auto& entity : app->entities) {
-            if (!entity.active || entity.name == "SkyBox") continue;
+        BuildLightClusters(app);
 
+        u32 lastProgram = UINT32_MAX;
+        u32 lastEntity = UINT32_MAX;
+        u32 lastMaterial = UINT32_MAX;
+        GLuint lastVao = 0;
+        for (const RenderQueueEntry& queueEntry : queue.entries) {
+            const RenderItem& item = queue.items[queueEntry.itemIdx];
+            const Entity& entity = app->entities[item.entityIdx];
+            Program& forwardProgram = app->programs[item.programIdx];
             Model& model = app->models[entity.modelIndex];
             Mesh& mesh = app->meshes[model.meshIdx];
 
-            glUniformMatrix4fv(glGetUniformLocation(forwardProgram.handle, "uModel"), 1, GL_FALSE, glm::value_ptr(entity.worldMatrix));
-
-            for (size_t i = 0; i < mesh.submeshes.size(); ++i) {
-                if (i >= model.materialIdx.size()) continue;
+            // Uniforms that only depend on the permutation are set once per switch
+            if (item.programIdx != lastProgram) {
+                SetProgram(state, forwardProgram.handle);
+
+                SetUniformMat4(forwardProgram, Uniform_View, app->worldCamera.viewMatrix);
+                SetUniformMat4(forwardProgram, Uniform_Proj, app->worldCamera.projectionMatrix);
+                SetUniformVec3(forwardProgram, Uniform_CameraPosition, app->worldCamera.position);
+
+                // Sampler units never change for this program
+                SetUniformInt(forwardProgram, Uniform_AlbedoTexture, 0);
+                SetUniformInt(forwardProgram, Uniform_NormalMap, 1);
+                SetUniformInt(forwardProgram, Uniform_HeightMap, 2);
+                SetUniformInt(forwardProgram, Uniform_ConeStepMap, 6);
+                SetUniformInt(forwardProgram, Uniform_ReliefMarch, app->reliefMarch);
+                SetUniformInt(forwardProgram, Uniform_ReliefAdaptive, app->reliefLodEnabled ? 1 : 0);
+                SetUniformInt(forwardProgram, Uniform_ForwardSkybox, 3);
+                SetUniformFloat(forwardProgram, Uniform_ReflectionIntensity, 0.0f);
+                SetUniformFloat(forwardProgram, Uniform_DiffuseAmbient, app->diffuse);
+                if (forwardProgram.features & ShaderFeature_Environment)
+                    BindEnvironmentLighting(app, forwardProgram);
+
+                queue.programChanges++;
+                lastProgram = item.programIdx;
+                lastEntity = UINT32_MAX;
+                lastMaterial = UINT32_MAX;
+            }
 
-                // Reset all texture units
-                for (int texUnit = 0; texUnit < 4; ++texUnit) {
-                    glActiveTexture(GL_TEXTURE0 + texUnit);
-                    glBindTexture(GL_TEXTURE_2D, 0);
-                    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-                }
+            if (item.entityIdx != lastEntity) {
+                SetUniformMat4(forwardProgram, Uniform_Model, entity.worldMatrix);
+                SetUniformBufferRange(state, 1, app->entityUBO.handle, entity.entityBufferOffset, entity.entityBufferSize);
+                SetUniformVec3(forwardProgram, Uniform_PositionScale, mesh.positionScale);
+                SetUniformVec3(forwardProgram, Uniform_PositionOffset, mesh.positionOffset);
+                SetUniformFloat(forwardProgram, Uniform_ReliefFade, entity.reliefFade);
+                lastEntity = item.entityIdx;
+            }
 
-                u32 matIdx = model.materialIdx[i];
-                Material& mat = app->materials[matIdx];
+            if (item.materialIdx != lastMaterial) {
+                Material& mat = app->materials[item.materialIdx];
 
                 // Albedo
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, app->textures[mat.albedoTextureIdx].handle);
-                glUniform1i(glGetUniformLocation(forwardProgram.handle, "uAlbedoTexture"), 0);
-
-                // Normal map
-                if (mat.normalsTextureIdx != 0) {
-                    glActiveTexture(GL_TEXTURE1);
-                    glBindTexture(GL_TEXTURE_2D, app->textures[mat.normalsTextureIdx].handle);
-                    glUniform1i(glGetUniformLocation(forwardProgram.handle, "uNormalMap"), 1);
-                    glUniform1i(glGetUniformLocation(forwardProgram.handle, "uNormalMapAvailable"), 1);
-                } else {
-                    glActiveTexture(GL_TEXTURE1);
-                    glBindTexture(GL_TEXTURE_2D, 0);
-                    glUniform1i(glGetUniformLocation(forwardProgram.handle, "uNormalMap"), 1);
-                    glUniform1i(glGetUniformLocation(forwardProgram.handle, "uNormalMapAvailable"), 0);
-                }
+                SetTexture(state, 0, GL_TEXTURE_2D, app->textures[mat.albedoTextureIdx].handle);
 
-                // Height map
-                if (mat.heighTextureIdx != 0) {
-                    glActiveTexture(GL_TEXTURE2);
-                    glBindTexture(GL_TEXTURE_2D, app->textures[mat.heighTextureIdx].handle);
-                    glUniform1i(glGetUniformLocation(forwardProgram.handle, "uHeightMap"), 2);
-                    glUniform1f(glGetUniformLocation(forwardProgram.handle, "uHeightScale"), app->reliefIntensity);
-                } else {
-                    glActiveTexture(GL_TEXTURE2);
-                    glBindTexture(GL_TEXTURE_2D, 0);
-                    glUniform1i(glGetUniformLocation(forwardProgram.handle, "uHeightMap"), 2);
-                    glUniform1f(glGetUniformLocation(forwardProgram.handle, "uHeightScale"), 0.0f);
+                // Normal and height maps, only bound for the permutations that sample them
+                if (forwardProgram.features & ShaderFeature_NormalMap) {
+                    SetTexture(state, 1, GL_TEXTURE_2D, app->textures[mat.normalsTextureIdx].handle);
                 }
-
-                // --- Reflection/environment map: only for Enviroment_Map entities --
-                if (entity.type == EntityType::Enviroment_Map) {
-                    glActiveTexture(GL_TEXTURE3);
-                    glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMap.cubeMapTexture);
-                    glUniform1i(glGetUniformLocation(forwardProgram.handle, "uSkybox"), 3);
-                    glUniform1i(glGetUniformLocation(forwardProgram.handle, "uEnvironmentEnabled"), 1);;
- 
-                    glUniform1f(glGetUniformLocation(forwardProgram.handle, "diffus_amb"), app->diffuse);
-                } else {
-                    glActiveTexture(GL_TEXTURE3);
-                    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
-                    glUniform1i(glGetUniformLocation(forwardProgram.handle, "uSkybox"), 3);
-                    glUniform1i(glGetUniformLocation(forwardProgram.handle, "uEnvironmentEnabled"), 0);
-                    glUniform1f(glGetUniformLocation(forwardProgram.handle, "diffus_amb"), app->diffuse);
+                if (forwardProgram.features & ShaderFeature_HeightMap) {
+                    SetTexture(state, 2, GL_TEXTURE_2D, app->textures[mat.heighTextureIdx].handle);
+                    SetTexture(state, 6, GL_TEXTURE_2D, GetConeStepTexture(app, mat));
+                    SetUniformFloat(forwardProgram, Uniform_HeightScale, app->reliefIntensity);
                 }
-
-                // Draw submesh
-                glBindVertexArray(FindVao(mesh, i, forwardProgram));
-                glDrawElements(GL_TRIANGLES, mesh.submeshes[i].indices.size(), GL_UNSIGNED_INT, (void*)(uintptr_t)mesh.submeshes[i].indexOffset);
-                glBindVertexArray(0);
+                queue.materialChanges++;
+                lastMaterial = item.materialIdx;
             }
+
+            // Draw submesh
+            GLuint vao = FindVao(mesh, item.submeshIdx, forwardProgram);
+            if (vao != lastVao) { queue.vaoChanges++; lastVao = vao; }
+            SetVertexArray(state, vao);
+
+            DrawRenderItem(queue, item);
+            queue.drawCount++;
         }
+
+        SetDepthFunc(state, GL_LESS);
+        SetDepthWrite(state, true);
+        EndDepthPrePassFrame(app->depthPrePass);
         break;
     }
         case Mode_Deferred_Geometry:
         {
-            glBindFramebuffer(GL_FRAMEBUFFER, app->primaryFBO.handle);
-
-            // Set up draw buffers
-            std::vector<GLuint> textures;
-            for (auto& it : app->primaryFBO.attachments)
-            {
-                textures.push_back(it.second);
-            }
-            glDrawBuffers(textures.size(), textures.data());
+            // The draw buffers were set on the FBO when it was created
+            SetFramebuffer(state, app->primaryFBO.handle);
 
             // Clear buffers
             glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
             glViewport(0, 0, app->displaySize.x, app->displaySize.y);
 
-            for (const auto& entity : app->entities)
-            {
-                if (entity.active == false)
-                {
-                    continue;
-                }
-                // Determinar which shader se usa
-                Program* program = &app->programs[app->geometryProgramIdx];
-                if (app->programs[app->reliefMappingIdx].programName == "RELIEF_MAPPING" &&
-                    entity.type == EntityType::Relief_Mapping)
-                {
-                    program = &app->programs[app->reliefMappingIdx];
-                }
-                
-                if (app->programs[app->environmentMapIdx].programName == "REFLECTION_ENVIRONMENT" &&
-                    entity.type == EntityType::Enviroment_Map)
-                {
-                    program = &app->programs[app->environmentMapIdx];
-
-                    glActiveTexture(GL_TEXTURE3);
-                    glBindTexture(GL_TEXTURE_CUBE_MAP, app->cubeMap.cubeMapTexture);
-                   
-                }
-                glUseProgram(program->handle);
+            // Opaque entities first, the skybox entity goes last through the background pass
+            RenderQueue& queue = app->renderQueue;
+            BuildRenderQueue(app, false);
 
-                glUniformMatrix4fv(glGetUniformLocation(program->handle, "uModel"), 1, GL_FALSE, glm::value_ptr(entity.worldMatrix));
-                glUniformMatrix4fv(glGetUniformLocation(program->handle, "uView"), 1, GL_FALSE, glm::value_ptr(app->worldCamera.viewMatrix));
-                glUniformMatrix4fv(glGetUniformLocation(program->handle, "uProj"), 1, GL_FALSE, glm::value_ptr(app->worldCamera.projectionMatrix));
-                glUniform3fv(glGetUniformLocation(program->handle, "uCameraPosition"), 1, glm::value_ptr(app->worldCamera.position));
+            SetUniformBufferRange(state, 0, app->globalUBO.handle, app->globalParamsOffset, sizeof(vec4));
 
-                glBindBufferRange(GL_UNIFORM_BUFFER, 0, app->globalUBO.handle, 0, app->globalUBO.size);
-                glBindBufferRange(GL_UNIFORM_BUFFER, 1, app->entityUBO.handle, entity.entityBufferOffset, entity.entityBufferSize);
+            const bool prePass = BeginDepthPrePassFrame(app->depthPrePass);
+            if (prePass)
+                RenderDepthPrePass(app, queue);
 
+            u32 lastProgram = UINT32_MAX;
+            u32 lastEntity = UINT32_MAX;
+            u32 lastMaterial = UINT32_MAX;
+            GLuint lastVao = 0;
+            for (const RenderQueueEntry& queueEntry : queue.entries)
+            {
+                const RenderItem& item = queue.items[queueEntry.itemIdx];
+                const Entity& entity = app->entities[item.entityIdx];
+                Program& program = app->programs[item.programIdx];
+                const bool isRelief = item.programIdx == app->reliefMappingIdx || item.programIdx == app->reliefNormalMappingIdx;
+                const bool isEnvironment = item.programIdx == app->environmentMapIdx;
                 Model& model = app->models[entity.modelIndex];
                 Mesh& mesh = app->meshes[model.meshIdx];
 
-                for (size_t i = 0; i < mesh.submeshes.size(); ++i)
+                // Relief items and the background write their own depth after the pre-pass ones
+                if (prePass)
                 {
-                    GLuint vao = FindVao(mesh, i, *program);
-                    glBindVertexArray(vao);
-
-                    u32 matIdx = model.materialIdx[i];
-                    Material& mat = app->materials[matIdx];
+                    const bool equalDepth = IsInDepthPrePass(app, item);
+                    SetDepthFunc(state, equalDepth ? GL_EQUAL : GL_LESS);
+                    SetDepthWrite(state, !equalDepth);
+                }
 
+                // Uniforms that only depend on the program are set once per program switch
+                if (item.programIdx != lastProgram)
+                {
+                    SetProgram(state, program.handle);
 
-                    glActiveTexture(GL_TEXTURE0);
-                    glBindTexture(GL_TEXTURE_2D, app->textures[mat.albedoTextureIdx].handle);
-                    glUniform1i(glGetUniformLocation(program->handle, "uDiffuse"), 0);
+                    SetUniformMat4(program, Uniform_View, app->worldCamera.viewMatrix);
+                    SetUniformMat4(program, Uniform_Proj, app->worldCamera.projectionMatrix);
+                    SetUniformVec3(program, Uniform_CameraPosition, app->worldCamera.position);
+                    SetUniformInt(program, Uniform_Diffuse, 0);
+                    SetUniformInt(program, Uniform_NormalMap, 1);
+                    SetUniformInt(program, Uniform_CompactGBuffer, app->primaryFBO.compact ? 1 : 0);
 
-                    if (mat.normalsTextureIdx != 0)
+                    if (isRelief)
                     {
-                        glActiveTexture(GL_TEXTURE1);
-                        glBindTexture(GL_TEXTURE_2D, app->textures[mat.normalsTextureIdx].handle);
-                        glUniform1i(glGetUniformLocation(program->handle, "uNormalMap"), 1);
+                        SetUniformInt(program, Uniform_HeightMap, 2);
+                        SetUniformVec3(program, Uniform_ViewPos, app->worldCamera.position);
+                        SetUniformFloat(program, Uniform_HeightScale, app->reliefIntensity);
+                        SetUniformInt(program, Uniform_ViewMode, app->reliefViewMode);
+                        SetUniformInt(program, Uniform_ConeStepMap, 6);
+                        SetUniformInt(program, Uniform_ReliefMarch, app->reliefMarch);
+                        SetUniformInt(program, Uniform_ReliefAdaptive, app->reliefLodEnabled ? 1 : 0);
                     }
-
-                    if (program == &app->programs[app->reliefMappingIdx])
+                    if (isEnvironment)
                     {
-                        glActiveTexture(GL_TEXTURE2);
-                        glBindTexture(GL_TEXTURE_2D, app->textures[mat.heighTextureIdx].handle);
-                        glUniform1i(glGetUniformLocation(program->handle, "uHeightMap"), 2);
+                        SetTexture(state, 3, GL_TEXTURE_CUBE_MAP, app->cubeMap.cubeMapTexture);
+                        SetUniformInt(program, Uniform_Skybox, 3);
+                        SetUniformInt(program, Uniform_CubeMapType, app->cubemapView);
+                        SetUniformInt(program, Uniform_DebugType, 1);
+                        SetUniformFloat(program, Uniform_DiffuseAmbient, app->diffuse);
+                        BindEnvironmentLighting(app, program);
+                    }
+
+                    queue.programChanges++;
+                    lastProgram = item.programIdx;
+                    lastEntity = UINT32_MAX;
+                }
 
-                        glUniform3fv(glGetUniformLocation(program->handle, "uViewPos"), 1, glm::value_ptr(app->worldCamera.position));
-                        glUniform1f(glGetUniformLocation(program->handle, "uHeightScale"), app->reliefIntensity );
-                        glUniform1i(glGetUniformLocation(program->handle, "uViewMode"), app->reliefViewMode);
+                if (item.entityIdx != lastEntity)
+                {
+                    SetUniformMat4(program, Uniform_Model, entity.worldMatrix);
+                    SetUniformBufferRange(state, 1, app->entityUBO.handle, entity.entityBufferOffset, entity.entityBufferSize);
+                    SetUniformVec3(program, Uniform_PositionScale, mesh.positionScale);
+                    SetUniformVec3(program, Uniform_PositionOffset, mesh.positionOffset);
+                    SetUniformFloat(program, Uniform_ReliefFade, entity.reliefFade);
+                    lastEntity = item.entityIdx;
+                }
 
+                if (item.materialIdx != lastMaterial)
+                {
+                    Material& mat = app->materials[item.materialIdx];
 
-                    }
-                    if (program == &app->programs[app->environmentMapIdx])
+                    SetTexture(state, 0, GL_TEXTURE_2D, app->textures[mat.albedoTextureIdx].handle);
+                    if (mat.normalsTextureIdx != 0)
                     {
-                        glUniform1i(glGetUniformLocation(program->handle, "skybox"), 3);
-
-                        glUniform1i(glGetUniformLocation(program->handle, "cubeMapType"), app->cubemapView);
-                        glUniform1i(glGetUniformLocation(program->handle, "uDebugType"), 1);
-                       
-                        glUniform1f(glGetUniformLocation(program->handle, "diffus_amb"), app->diffuse);
+                        SetTexture(state, 1, GL_TEXTURE_2D, app->textures[mat.normalsTextureIdx].handle);
                     }
-                   
-                    Submesh& submesh = mesh.submeshes[i];
-                    glDrawElements(GL_TRIANGLES, submesh.indices.size(), GL_UNSIGNED_INT, (void*)(uintptr_t)submesh.indexOffset);
+                    SetTexture(state, 2, GL_TEXTURE_2D, app->textures[mat.heighTextureIdx].handle);
+                    SetTexture(state, 6, GL_TEXTURE_2D, GetConeStepTexture(app, mat));
 
-                    glBindTexture(GL_TEXTURE_2D, 0);
+                    queue.materialChanges++;
+                    lastMaterial = item.materialIdx;
                 }
 
-                glBindVertexArray(0);
-                glUseProgram(0);
+                GLuint vao = FindVao(mesh, item.submeshIdx, program);
+                if (vao != lastVao) { queue.vaoChanges++; lastVao = vao; }
+                SetVertexArray(state, vao);
+
+                DrawRenderItem(queue, item);
+                queue.drawCount++;
             }
+            SetDepthFunc(state, GL_LESS);
+            SetDepthWrite(state, true);
+            EndDepthPrePassFrame(app->depthPrePass);
+
             if (app->pgaType == 3)
             {
                 RenderCubeMap(app);
                 
             }
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
-            glUseProgram(0);
             if (app->pgaType == 1 || 2)
             {
+                BuildLightClusters(app);
                 RenderScreenFillQuad(app, app->primaryFBO);
             }
             
@@ -1675,15 +1949,24 @@ void Render(App* app)
 
     default:;
     }
+
+    // Every draw reading this frame's uniform regions has been submitted
+    FenceRingBufferFrame(app->entityUBO);
+    FenceRingBufferFrame(app->globalUBO);
 }
 
 void CleanUp(App* app)
 {
     ELOG("Cleaning up engine");
 
+    // Workers may still be decoding textures for the streamer
+    ShutdownJobSystem(app->jobs);
+    ShutdownTextureStreaming(app->textureStreamer);
+
     for (auto& texture : app->textures)
     {
-        glDeleteTextures(1, &texture.handle);
+        if (texture.resident)
+            glDeleteTextures(1, &texture.handle);
     };
 
     for (auto& program : app->programs)
@@ -1708,17 +1991,33 @@ void CleanUp(App* app)
         app->embeddedElements = 0;
     }
 
-    for (auto data : app->cubeMap.faces1Data) {
-        if (data) stbi_image_free(data);
+    for (GLuint& texture : app->cubeMap.setTextures)
+    {
+        if (texture != 0)
+            glDeleteTextures(1, &texture);
+        texture = 0;
+    }
+    for (EnvironmentLighting& lighting : app->cubeMap.setLighting)
+    {
+        if (lighting.specularTexture != 0)
+            glDeleteTextures(1, &lighting.specularTexture);
+        lighting.specularTexture = 0;
     }
-    for (auto data : app->cubeMap.faces2Data) {
-        if (data) stbi_image_free(data);
+    if (app->cubeMap.brdfLut != 0)
+    {
+        glDeleteTextures(1, &app->cubeMap.brdfLut);
+        app->cubeMap.brdfLut = 0;
     }
     if (app->cubeMap.VAO != 0)
     {
         glDeleteVertexArrays(1, &app->cubeMap.VAO);
         app->cubeMap.VAO = 0;
     }
+    DestroyDepthPrePass(app->depthPrePass);
+    DestroyLightClusters(app->lightClusters);
+    DestroyLightStorage(app->lightStorage);
+    DestroyRingBuffer(app->entityUBO);
+    DestroyRingBuffer(app->globalUBO);
     app->primaryFBO.Clear();
 }
 
@@ -1740,10 +2039,11 @@ GLuint FindVao(Mesh& mesh, u32 submeshIndex, const Program& program)
     glBindBuffer(GL_ARRAY_BUFFER, mesh.vertexBufferHandle);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBufferHandle);
 
+    // Inputs the mesh does not store (texture coordinates or tangent frame of
+    // meshes without UVs) stay disabled and read the generic (0,0,0,1), which
+    // for the tangent frame is the identity quaternion
     for (auto& shaderLayout : program.vertexInputLayout.attributes)
     {
-        bool attributeWasLinked = false;
-
         for (auto& meshLayout : submesh.vertexBufferLayout.attributes)
         {
             if (shaderLayout.location == meshLayout.location)
@@ -1752,14 +2052,12 @@ GLuint FindVao(Mesh& mesh, u32 submeshIndex, const Program& program)
                 const u32 ncomp = meshLayout.componentCount;
                 const u32 offset = meshLayout.offset + submesh.vertexOffset;
                 const u32 stride = submesh.vertexBufferLayout.stride;
-                               glVertexAttribPointer(index, ncomp, GL_FLOAT, GL_FALSE, stride, (void*)(u64)offset);
+                const GLboolean normalized = meshLayout.normalized ? GL_TRUE : GL_FALSE;
+                glVertexAttribPointer(index, ncomp, meshLayout.componentType, normalized, stride, (void*)(u64)offset);
                 glEnableVertexAttribArray(index);
-
-                attributeWasLinked = true;
                 break;
             }
         }
-        assert(attributeWasLinked);
     }
 
     glBindVertexArray(0);
@@ -7,6 +7,20 @@
 #include "platform.h"
 #include "AssimpModelLoading.h"
 #include "BufferManagement.h"
+#include "ProgramReflection.h"
+#include "RenderState.h"
+#include "RenderQueue.h"
+#include "Culling.h"
+#include "Meshlets.h"
+#include "MeshLod.h"
+#include "TextureStreaming.h"
+#include "TextureResidency.h"
+#include "ImageBasedLighting.h"
+#include "JobSystem.h"
+#include "MeshCache.h"
+#include "LightClusters.h"
+#include "DepthPrePass.h"
+#include "Lights.h"
 #include <glad/glad.h>
 #include "Structs.hpp"
 
@@ -16,7 +30,9 @@ void Gui(App* app);
 
 void Update(App* app);
 
-void UpdateLights(App* app);
+void UpdateGlobalParams(App* app);
+
+void BuildRenderQueue(App* app, bool forward);
 
 void Render(App* app);
 
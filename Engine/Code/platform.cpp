@@ -13,6 +13,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #endif
 
 #include "engine.h"
@@ -27,15 +31,22 @@
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
+#include <chrono>
 
 #define WINDOW_TITLE  "PGA Engine"
 #define WINDOW_WIDTH  1920
 #define WINDOW_HEIGHT 1080
 
+#define HEADLESS_DEFAULT_FRAMES 300
+#define HEADLESS_GPU_TIMER_COUNT 4
+
 #define GLOBAL_FRAME_ARENA_SIZE MB(16)
 u8* GlobalFrameArenaMemory = NULL;
 u32 GlobalFrameArenaHead = 0;
 
+// Loader glad was initialized with, kept for GetGLProcAddress
+GLADloadproc GlobalGLProcLoader = NULL;
+
 void OnGlfwError(int errorCode, const char *errorMessage)
 {
 	fprintf(stderr, "glfw failed with error %d: %s\n", errorCode, errorMessage);
@@ -126,8 +137,318 @@ void OnGlfwCloseWindow(GLFWwindow* window)
     app->isRunning = false;
 }
 
-int main()
+struct RunOptions
+{
+    bool headless;
+    u32  frameCount;
+    u32  width;
+    u32  height;
+    f32  fixedDeltaTime;
+    std::vector<const char*> meshReportFiles;
+};
+
+RunOptions ParseCommandLine(int argc, char** argv)
+{
+    RunOptions options = {};
+    options.headless = false;
+    options.frameCount = HEADLESS_DEFAULT_FRAMES;
+    options.width = WINDOW_WIDTH;
+    options.height = WINDOW_HEIGHT;
+    options.fixedDeltaTime = 1.0f / 60.0f;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--headless") == 0)        options.headless = true;
+        else if (strcmp(argv[i], "--frames") == 0 && hasValue) options.frameCount = (u32)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--width") == 0 && hasValue)  options.width = (u32)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--height") == 0 && hasValue) options.height = (u32)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--dt") == 0 && hasValue)     options.fixedDeltaTime = (f32)atof(argv[++i]);
+        else if (strcmp(argv[i], "--mesh-report") == 0 && hasValue) options.meshReportFiles.push_back(argv[++i]);
+        else ELOG("Ignoring unknown command line argument %s", argv[i]);
+    }
+
+    if (options.frameCount == 0) options.frameCount = 1;
+    if (options.width == 0)      options.width = WINDOW_WIDTH;
+    if (options.height == 0)     options.height = WINDOW_HEIGHT;
+
+    return options;
+}
+
+// Offscreen GL context used by the headless benchmark. On Linux it is an EGL pbuffer,
+// preferably on Mesa's surfaceless platform so it works without X/Wayland (e.g. llvmpipe
+// on CI machines). On Windows we fall back to a hidden GLFW window.
+struct HeadlessContext
+{
+#ifdef _WIN32
+    GLFWwindow* window;
+#else
+    EGLDisplay display;
+    EGLSurface surface;
+    EGLContext context;
+#endif
+};
+
+#ifdef _WIN32
+void* HeadlessGetProcAddress(const char* name)
+{
+    return (void*)glfwGetProcAddress(name);
+}
+#else
+void* HeadlessGetProcAddress(const char* name)
+{
+    return (void*)eglGetProcAddress(name);
+}
+#endif
+
+bool CreateHeadlessContext(HeadlessContext& ctx, u32 width, u32 height)
+{
+#ifdef _WIN32
+    glfwSetErrorCallback(OnGlfwError);
+    if (!glfwInit())
+    {
+        ELOG("glfwInit() failed\n");
+        return false;
+    }
+
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+    ctx.window = glfwCreateWindow(width, height, WINDOW_TITLE, NULL, NULL);
+    if (!ctx.window)
+    {
+        ELOG("glfwCreateWindow() failed\n");
+        return false;
+    }
+    glfwMakeContextCurrent(ctx.window);
+    return true;
+#else
+    ctx.display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        ctx.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (ctx.display == EGL_NO_DISPLAY)
+        ctx.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (ctx.display == EGL_NO_DISPLAY || !eglInitialize(ctx.display, &major, &minor))
+    {
+        ELOG("eglInitialize() failed\n");
+        return false;
+    }
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(ctx.display, configAttribs, &config, 1, &configCount) || configCount == 0)
+    {
+        ELOG("eglChooseConfig() found no pbuffer capable config\n");
+        return false;
+    }
+
+    const EGLint pbufferAttribs[] = { EGL_WIDTH, (EGLint)width, EGL_HEIGHT, (EGLint)height, EGL_NONE };
+    ctx.surface = eglCreatePbufferSurface(ctx.display, config, pbufferAttribs);
+    if (ctx.surface == EGL_NO_SURFACE)
+    {
+        ELOG("eglCreatePbufferSurface() failed\n");
+        return false;
+    }
+
+    eglBindAPI(EGL_OPENGL_API);
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    ctx.context = eglCreateContext(ctx.display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (ctx.context == EGL_NO_CONTEXT)
+    {
+        ELOG("eglCreateContext() failed\n");
+        return false;
+    }
+
+    return eglMakeCurrent(ctx.display, ctx.surface, ctx.surface, ctx.context) == EGL_TRUE;
+#endif
+}
+
+void DestroyHeadlessContext(HeadlessContext& ctx)
+{
+#ifdef _WIN32
+    if (ctx.window) glfwDestroyWindow(ctx.window);
+    glfwTerminate();
+#else
+    eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (ctx.context != EGL_NO_CONTEXT) eglDestroyContext(ctx.display, ctx.context);
+    if (ctx.surface != EGL_NO_SURFACE) eglDestroySurface(ctx.display, ctx.surface);
+    eglTerminate(ctx.display);
+#endif
+}
+
+// Runs Init/Update/Render for a fixed number of frames with a fixed deltaTime and
+// prints CPU and GPU frame times. No GUI is drawn in this mode.
+int RunHeadless(const RunOptions& options)
+{
+    HeadlessContext ctx = {};
+    if (!CreateHeadlessContext(ctx, options.width, options.height))
+    {
+        return -1;
+    }
+
+    GlobalGLProcLoader = (GLADloadproc)HeadlessGetProcAddress;
+    if (!gladLoadGLLoader(GlobalGLProcLoader))
+    {
+        ELOG("Failed to initialize OpenGL context\n");
+        DestroyHeadlessContext(ctx);
+        return -1;
+    }
+
+    App app = {};
+    app.deltaTime = options.fixedDeltaTime;
+    app.displaySize = ivec2(options.width, options.height);
+    app.isRunning = true;
+
+    strncpy(app.gpuName, (const char*)glGetString(GL_RENDERER), sizeof(app.gpuName) - 1);
+    strncpy(app.openGlVersion, (const char*)glGetString(GL_VERSION), sizeof(app.openGlVersion) - 1);
+    printf("headless: %s | %s | %ux%u | %u frames | dt %.4f\n",
+           app.gpuName, app.openGlVersion, options.width, options.height, options.frameCount, options.fixedDeltaTime);
+
+    GlobalFrameArenaMemory = (u8*)malloc(GLOBAL_FRAME_ARENA_SIZE);
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point initStart = Clock::now();
+    Init(&app);
+    // Frames are measured with the real textures, not the placeholders
+    FinishTextureStreaming(&app);
+    glFinish();
+    f64 initMs = std::chrono::duration<f64, std::milli>(Clock::now() - initStart).count();
+    printf("init: %.3f ms\n", initMs);
+
+    // GPU timings are read back a few frames late so the queries never stall the CPU
+    GLuint gpuTimers[HEADLESS_GPU_TIMER_COUNT];
+    glGenQueries(HEADLESS_GPU_TIMER_COUNT, gpuTimers);
+
+    std::vector<f64> cpuTimes(options.frameCount, 0.0);
+    std::vector<f64> gpuTimes(options.frameCount, 0.0);
+
+    for (u32 frame = 0; frame < options.frameCount; ++frame)
+    {
+        if (frame >= HEADLESS_GPU_TIMER_COUNT)
+        {
+            const u32 pending = frame - HEADLESS_GPU_TIMER_COUNT;
+            GLuint64 elapsedNs = 0;
+            glGetQueryObjectui64v(gpuTimers[pending % HEADLESS_GPU_TIMER_COUNT], GL_QUERY_RESULT, &elapsedNs);
+            gpuTimes[pending] = (f64)elapsedNs / 1.0e6;
+        }
+
+        Clock::time_point frameStart = Clock::now();
+
+        Update(&app);
+
+        glBeginQuery(GL_TIME_ELAPSED, gpuTimers[frame % HEADLESS_GPU_TIMER_COUNT]);
+        Render(&app);
+        glEndQuery(GL_TIME_ELAPSED);
+
+        cpuTimes[frame] = std::chrono::duration<f64, std::milli>(Clock::now() - frameStart).count();
+
+        app.deltaTime = options.fixedDeltaTime;
+        GlobalFrameArenaHead = 0;
+    }
+
+    const u32 firstPending = options.frameCount > HEADLESS_GPU_TIMER_COUNT ? options.frameCount - HEADLESS_GPU_TIMER_COUNT : 0;
+    for (u32 pending = firstPending; pending < options.frameCount; ++pending)
+    {
+        GLuint64 elapsedNs = 0;
+        glGetQueryObjectui64v(gpuTimers[pending % HEADLESS_GPU_TIMER_COUNT], GL_QUERY_RESULT, &elapsedNs);
+        gpuTimes[pending] = (f64)elapsedNs / 1.0e6;
+    }
+    glDeleteQueries(HEADLESS_GPU_TIMER_COUNT, gpuTimers);
+
+    f64 cpuTotal = 0.0, gpuTotal = 0.0;
+    f64 cpuMin = cpuTimes[0], cpuMax = cpuTimes[0];
+    f64 gpuMin = gpuTimes[0], gpuMax = gpuTimes[0];
+    for (u32 frame = 0; frame < options.frameCount; ++frame)
+    {
+        printf("frame %4u  cpu %8.3f ms  gpu %8.3f ms\n", frame, cpuTimes[frame], gpuTimes[frame]);
+        cpuTotal += cpuTimes[frame];
+        gpuTotal += gpuTimes[frame];
+        cpuMin = glm::min(cpuMin, cpuTimes[frame]); cpuMax = glm::max(cpuMax, cpuTimes[frame]);
+        gpuMin = glm::min(gpuMin, gpuTimes[frame]); gpuMax = glm::max(gpuMax, gpuTimes[frame]);
+    }
+
+    const f64 frameCount = (f64)options.frameCount;
+    printf("total cpu %.3f ms (avg %.3f, min %.3f, max %.3f)\n", cpuTotal, cpuTotal / frameCount, cpuMin, cpuMax);
+    printf("total gpu %.3f ms (avg %.3f, min %.3f, max %.3f)\n", gpuTotal, gpuTotal / frameCount, gpuMin, gpuMax);
+    printf("throughput %.2f frames/s (cpu bound)\n", cpuTotal > 0.0 ? 1000.0 * frameCount / cpuTotal : 0.0);
+
+    CleanUp(&app);
+
+    free(GlobalFrameArenaMemory);
+
+    DestroyHeadlessContext(ctx);
+
+    return 0;
+}
+
+// Imports each model bypassing the mesh cache and prints the vertex stage
+// stats of its source and of its optimized order. No window or GL context.
+int RunMeshReport(const RunOptions& options)
+{
+    JobSystem jobs;
+    InitJobSystem(jobs);
+
+    printf("%-40s %10s %10s %17s %17s %17s\n", "model", "triangles", "vertices", "ACMR", "ATVR", "overfetch");
+    int result = 0;
+    for (const char* filename : options.meshReportFiles)
+    {
+        ImportedModel imported;
+        if (!ImportModel(jobs, filename, imported, false))
+        {
+            ELOG("Could not import %s", filename);
+            result = 1;
+            continue;
+        }
+
+        u32 triangleCount = 0;
+        u32 vertexCount = 0;
+        for (const Submesh& submesh : imported.mesh.submeshes)
+        {
+            triangleCount += submesh.indexCount / 3;
+            vertexCount += (u32)(submesh.vertexData.size() / submesh.vertexBufferLayout.stride);
+        }
+
+        const VertexCacheStats& before = imported.sourceStats;
+        const VertexCacheStats& after = imported.optimizedStats;
+        printf("%-40s %10u %10u %7.3f -> %6.3f %7.3f -> %6.3f %7.2f -> %6.2f\n", filename, triangleCount, vertexCount,
+            before.acmr, after.acmr, before.atvr, after.atvr, before.overfetch, after.overfetch);
+    }
+
+    ShutdownJobSystem(jobs);
+    return result;
+}
+
+int main(int argc, char** argv)
 {
+    RunOptions options = ParseCommandLine(argc, argv);
+    if (!options.meshReportFiles.empty())
+    {
+        return RunMeshReport(options);
+    }
+    if (options.headless)
+    {
+        return RunHeadless(options);
+    }
+
     App app = {};
     app.deltaTime = 1.0f / 60.0f;
     app.displaySize = ivec2(WINDOW_WIDTH, WINDOW_HEIGHT);
@@ -167,7 +488,8 @@ int main()
     glfwMakeContextCurrent(window);
 
     // Load all OpenGL functions using the glfw loader function
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+    GlobalGLProcLoader = (GLADloadproc)glfwGetProcAddress;
+    if (!gladLoadGLLoader(GlobalGLProcLoader))
     {
         ELOG("Failed to initialize OpenGL context\n");
         return -1;
@@ -471,6 +793,68 @@ u64 GetFileLastWriteTimestamp(const char* filepath)
     return 0;
 }
 
+MappedFile MapFileReadOnly(const char* filepath)
+{
+    MappedFile mapped = {};
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return mapped;
+
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+    {
+        // The view keeps the mapping alive, both handles can be closed right away
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping)
+        {
+            mapped.data = (const u8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            mapped.size = mapped.data ? (u64)size.QuadPart : 0;
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0)
+        return mapped;
+
+    struct stat attrib;
+    if (fstat(fd, &attrib) == 0 && attrib.st_size > 0)
+    {
+        void* data = mmap(NULL, (size_t)attrib.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            mapped.data = (const u8*)data;
+            mapped.size = (u64)attrib.st_size;
+        }
+    }
+    close(fd);
+#endif
+
+    return mapped;
+}
+
+void UnmapFile(MappedFile& file)
+{
+    if (file.data)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(file.data);
+#else
+        munmap((void*)file.data, (size_t)file.size);
+#endif
+    }
+    file.data = NULL;
+    file.size = 0;
+}
+
+void* GetGLProcAddress(const char* name)
+{
+    return GlobalGLProcLoader ? GlobalGLProcLoader(name) : NULL;
+}
+
 void LogString(const char* str)
 {
 #ifdef _WIN32
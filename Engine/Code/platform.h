@@ -81,6 +81,26 @@ String ReadTextFile(const char *filepath);
  */
 u64 GetFileLastWriteTimestamp(const char *filepath);
 
+struct MappedFile
+{
+    const u8* data;
+    u64       size;
+};
+
+/**
+ * Maps a whole file read-only into memory. data is NULL if the file could not be
+ * opened or is empty. The mapping stays valid until UnmapFile is called.
+ */
+MappedFile MapFileReadOnly(const char *filepath);
+
+void UnmapFile(MappedFile& file);
+
+/**
+ * Returns the address of an OpenGL entry point of the current context. Use it
+ * for functions newer than the GL version loaded by glad.
+ */
+void* GetGLProcAddress(const char* name);
+
 /**
  * It logs a string to whichever outputs are configured in the platform layer.
  * By default, the string is printed in the output console of VisualStudio.
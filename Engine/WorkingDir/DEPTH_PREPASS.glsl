@@ -0,0 +1,39 @@
+#ifdef DEPTH_PREPASS
+
+#if defined(VERTEX) ////////////////////////////////////////
+
+layout(location=0) in vec3 aPosition;
+
+layout(binding = 1, std140) uniform EntityParams
+{
+    mat4 uWorldMatrix;
+    mat4 uWorldViewProjectionMatrix;
+};
+
+uniform vec3 uPositionScale;
+uniform vec3 uPositionOffset;
+
+// The main passes test against this depth with GL_EQUAL, they compute
+// gl_Position with the same expression
+invariant gl_Position;
+
+// Packed vertex decoding, see VertexPacking.h
+vec3 DecodePosition(vec3 quantized)
+{
+    return uPositionOffset + uPositionScale * quantized;
+}
+
+void main()
+{
+    gl_Position = uWorldViewProjectionMatrix * vec4(DecodePosition(aPosition), 1.0);
+}
+
+#elif defined(FRAGMENT) ////////////////////////////////////////
+
+// Depth only, the color writes are masked
+void main()
+{
+}
+
+#endif
+#endif
@@ -3,14 +3,22 @@
 #if defined(VERTEX)
 
 layout(location = 0) in vec3 position;
-layout(location = 1) in vec3 normal;
+layout(location = 1) in vec2 normal;        // octahedral
 layout(location = 2) in vec2 texCoords;
-layout(location = 3) in vec3 tangent;      // NEW
-layout(location = 4) in vec3 bitangent;    // NEW
+layout(location = 3) in vec4 tangentFrame;  // quaternion
 
 uniform mat4 uModel;
-uniform mat4 uView;
-uniform mat4 uProj;
+uniform vec3 uPositionScale;
+uniform vec3 uPositionOffset;
+
+layout(binding = 1, std140) uniform EntityParams
+{
+    mat4 uWorldMatrix;
+    mat4 uWorldViewProjectionMatrix;
+};
+
+// Same expression as DEPTH_PREPASS.glsl, the depth test may be GL_EQUAL
+invariant gl_Position;
 
 out vec3 vPosition;
 out vec3 vNormal;
@@ -18,49 +26,113 @@ out vec2 vTexCoord;
 out vec3 vTangent;    // NEW
 out vec3 vBitangent;  // NEW
 
+// Packed vertex decoding, see VertexPacking.h
+vec3 DecodePosition(vec3 quantized)
+{
+    return uPositionOffset + uPositionScale * quantized;
+}
+
+vec3 OctDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+// Tangent and bitangent of a tangent frame quaternion, w < 0 flips the bitangent
+void DecodeTangentFrame(vec4 q, out vec3 tangent, out vec3 bitangent)
+{
+    q = normalize(q);
+    tangent = vec3(1.0 - 2.0 * (q.y * q.y + q.z * q.z), 2.0 * (q.x * q.y + q.w * q.z), 2.0 * (q.x * q.z - q.w * q.y));
+    vec3 normal = vec3(2.0 * (q.x * q.z + q.w * q.y), 2.0 * (q.y * q.z - q.w * q.x), 1.0 - 2.0 * (q.x * q.x + q.y * q.y));
+    bitangent = cross(normal, tangent) * (q.w < 0.0 ? -1.0 : 1.0);
+}
+
 void main()
 {
-    vec4 worldPosition = uModel * vec4(position, 1.0);
+    vec3 tangent, bitangent;
+    DecodeTangentFrame(tangentFrame, tangent, bitangent);
+
+    vec4 worldPosition = uModel * vec4(DecodePosition(position), 1.0);
     vPosition = worldPosition.xyz;
     vTexCoord = texCoords;
     
     mat3 normalMatrix = transpose(inverse(mat3(uModel)));
-    vNormal = normalize(normalMatrix * normal);
+    vNormal = normalize(normalMatrix * OctDecode(normal));
     vTangent = normalize(normalMatrix * tangent);       // NEW
     vBitangent = normalize(normalMatrix * bitangent);   // NEW
 
-    gl_Position = uProj * uView * worldPosition;
+    gl_Position = uWorldViewProjectionMatrix * vec4(DecodePosition(position), 1.0);
 }
 
 #elif defined(FRAGMENT)
 
 struct Light {
-    unsigned int type;
     vec3 color;
+    uint type;
     vec3 direction;
+    float radius;
     vec3 position;
+    uint mode;
 };
 
 layout(binding = 0, std140) uniform GlobalParams {
     vec3 uCameraPosition;
-    unsigned int uLightCount;
-    Light uLight[16];
 };
 
+// Matches GpuLight, same order as app->lights (see Lights.h)
+layout(std430, binding = 0) readonly buffer Lights {
+    Light uLights[];
+};
+
+layout(std430, binding = 1) readonly buffer ClusterGrid {
+    mat4 uClusterView;
+    uvec4 uClusterDims;     // x, y, z, directional light count
+    vec4 uClusterParams;    // tile width, tile height, slice scale, slice bias
+    uvec2 uClusterRanges[]; // offset and count into uClusterLightIndices
+};
+
+// Directional lights first, then the point lights of every cluster
+layout(std430, binding = 2) readonly buffer ClusterLightIndices {
+    uint uClusterLightIndices[];
+};
+
+uvec2 GetClusterRange(vec3 worldPosition) {
+    float viewDepth = max(-(uClusterView * vec4(worldPosition, 1.0)).z, 1e-4);
+    uvec3 cluster;
+    cluster.xy = min(uvec2(gl_FragCoord.xy / uClusterParams.xy), uClusterDims.xy - 1u);
+    cluster.z = uint(clamp(floor(log(viewDepth) * uClusterParams.z + uClusterParams.w), 0.0, float(uClusterDims.z - 1u)));
+    uint clusterIndex = cluster.x + cluster.y * uClusterDims.x + cluster.z * uClusterDims.x * uClusterDims.y;
+    return uClusterRanges[clusterIndex];
+}
+
 // Material textures
 uniform sampler2D uAlbedoTexture;
 uniform sampler2D uNormalMap;
 uniform sampler2D uHeightMap;
 uniform float uHeightScale;
+uniform sampler2D uConeStepMap;
+uniform int uReliefMarch; // 0 = cone step, 1 = linear reference
+uniform float uReliefFade; // per entity, 1 = full relief, fades to 0 with distance
+uniform int uReliefAdaptive; // 0 = full step counts, 1 = scaled to the screen footprint
 
 // Environment mapping
 uniform samplerCube uSkybox;
 uniform float uReflectionIntensity;
 uniform float uFresnelPower = 5.0;
+uniform float uRoughness = 0.2;
+uniform float uMetallic = 0.8;
+
+// Image based lighting of the active cube map, see ImageBasedLighting.h
+uniform vec3 uIrradianceSH[9];
+uniform samplerCube uSpecularEnvironment;
+uniform float uSpecularMaxLod;
+uniform sampler2D uBrdfLut;
 
-// NEW: Feature enable flags
-uniform int uNormalMapAvailable;  // 0 = off, 1 = on
-uniform int uEnvironmentEnabled;  // 0 = off, 1 = on
+// Features are compiled per permutation (see ShaderFeature): NORMAL_MAP,
+// HEIGHT_MAP (relief, only set together with NORMAL_MAP) and ENVIRONMENT
 
 in vec3 vPosition;
 in vec3 vNormal;
@@ -71,35 +143,133 @@ in vec3 vBitangent;
 out vec4 oColor;
 
 // Relief mapping function
-vec2 ParallaxOcclusionMapping(vec2 texCoords, vec3 viewDirTS) {
+// Normal maps are cooked to two channel BC5, Z is rebuilt from the unit length
+vec3 SampleNormalMap(sampler2D normalMap, vec2 texCoords)
+{
+    vec3 normal;
+    normal.xy = texture(normalMap, texCoords).rg * 2.0 - 1.0;
+    normal.z = sqrt(max(1.0 - dot(normal.xy, normal.xy), 0.0));
+    return normal;
+}
+
+// Reference march: 32-64 fixed layers, refined with a secant between the
+// last two. rayDir is the UV offset per unit of depth. With relief LOD the
+// layer count drops to about one per pixel the ray crosses on screen.
+// Returns the depth at which the view ray hits the height field.
+float LinearReliefMarch(vec2 texCoords, vec3 viewDirTS, vec3 rayDir, float parallaxPixels) {
     const float minLayers = 32.0; 
     const float maxLayers = 64.0;
-    
+    const float lodMinLayers = 4.0;
+
     float ndotv = clamp(dot(vec3(0.0, 0.0, 1.0), normalize(viewDirTS)), 0.0, 1.0);
-    float numLayers = mix(maxLayers, minLayers, ndotv);
-    
+    float numLayers = clamp(parallaxPixels, lodMinLayers, mix(maxLayers, minLayers, ndotv));
+
     float layerDepth = 1.0 / numLayers;
-    vec2 deltaTexCoords = viewDirTS.xy * uHeightScale / (viewDirTS.z * numLayers);
-    
+    vec2 deltaTexCoords = -rayDir.xy / numLayers;
+
     vec2 currentTexCoords = texCoords;
     float currentLayerDepth = 0.0;
     float currentDepthMapValue = texture(uHeightMap, currentTexCoords).r;
-    
+
     for (int i = 0; i < int(numLayers); ++i) {
         if (currentLayerDepth >= currentDepthMapValue)
             break;
-        
+
         currentTexCoords -= deltaTexCoords;
         currentLayerDepth += layerDepth;
         currentDepthMapValue = texture(uHeightMap, currentTexCoords).r;
     }
-    
+
     vec2 prevTexCoords = currentTexCoords + deltaTexCoords;
     float beforeDepth = texture(uHeightMap, prevTexCoords).r - (currentLayerDepth - layerDepth);
     float afterDepth = currentDepthMapValue - currentLayerDepth;
-    
+
     float weight = afterDepth / (afterDepth - beforeDepth);
-    return mix(currentTexCoords, prevTexCoords, weight);
+    return (currentLayerDepth - layerDepth) + weight * layerDepth;
+}
+
+// Relaxed cone stepping over the map built by ConeStepMap.cpp: every fetch
+// advances the ray to 1.5x the edge of the empty cone above the texel, which
+// may overshoot into the surface, so the last step is bisected and closed with
+// a secant. Usually converges in 7-10 fetches, fewer steps and bisections are
+// allowed when the ray only crosses a few pixels.
+float ConeStepReliefMarch(vec2 texCoords, vec3 rayDir, float parallaxPixels) {
+    const float relaxation = 1.5;
+    const float minStep = 1.0 / 256.0;
+    int maxSteps = int(clamp(parallaxPixels * 0.5, 4.0, 16.0));
+    int refineSteps = int(clamp(ceil(log2(max(parallaxPixels, 1.0))), 1.0, 4.0));
+
+    float rayLength = length(rayDir.xy);
+
+    vec3 rayPos = vec3(texCoords, 0.0);
+    vec3 prevPos = rayPos;
+    float prevDepth = 0.0;
+    vec2 cone = textureLod(uConeStepMap, rayPos.xy, 0.0).rg;
+    if (cone.r <= 0.0)
+        return 0.0;
+
+    for (int i = 0; i < maxSteps && rayPos.z < cone.r; ++i) {
+        float ratio = cone.g * cone.g;
+        float advance = relaxation * ratio * (cone.r - rayPos.z) / (rayLength + ratio);
+        prevPos = rayPos;
+        prevDepth = cone.r;
+        rayPos += rayDir * max(advance, minStep);
+        cone = textureLod(uConeStepMap, rayPos.xy, 0.0).rg;
+    }
+    if (rayPos.z < cone.r)
+        return min(rayPos.z, 1.0);
+
+    // prevPos is above the surface and rayPos below, heights are depth minus ray depth
+    float above = prevDepth - prevPos.z;
+    float below = cone.r - rayPos.z;
+    for (int i = 0; i < refineSteps; ++i) {
+        vec3 midPos = (prevPos + rayPos) * 0.5;
+        float height = textureLod(uConeStepMap, midPos.xy, 0.0).r - midPos.z;
+        if (height > 0.0) {
+            prevPos = midPos;
+            above = height;
+        } else {
+            rayPos = midPos;
+            below = height;
+        }
+    }
+    return mix(prevPos.z, rayPos.z, above / max(above - below, 1e-5));
+}
+
+// Depth of the hit below the surface, 0 to 1. uvPerPixel is the screen space
+// footprint of texCoords, taken before any non uniform branch.
+float MarchRelief(vec2 texCoords, vec3 viewDirTS, float heightScale, float uvPerPixel) {
+    vec3 rayDir = vec3(-viewDirTS.xy * heightScale / viewDirTS.z, 1.0);
+    float parallaxPixels = uReliefAdaptive > 0 ? length(rayDir.xy) / max(uvPerPixel, 1e-6) : 1e6;
+    return uReliefMarch == 1 ? LinearReliefMarch(texCoords, viewDirTS, rayDir, parallaxPixels)
+                             : ConeStepReliefMarch(texCoords, rayDir, parallaxPixels);
+}
+
+// Irradiance / PI already convolved with the cosine lobe, no texture fetch
+vec3 EvaluateIrradiance(vec3 n)
+{
+    return max(uIrradianceSH[0] * 0.282095
+        + uIrradianceSH[1] * 0.488603 * n.y
+        + uIrradianceSH[2] * 0.488603 * n.z
+        + uIrradianceSH[3] * 0.488603 * n.x
+        + uIrradianceSH[4] * 1.092548 * n.x * n.y
+        + uIrradianceSH[5] * 1.092548 * n.y * n.z
+        + uIrradianceSH[6] * 0.315392 * (3.0 * n.z * n.z - 1.0)
+        + uIrradianceSH[7] * 1.092548 * n.x * n.z
+        + uIrradianceSH[8] * 0.546274 * (n.x * n.x - n.y * n.y), 0.0);
+}
+
+// Diffuse from SH, specular by split sum: the prefiltered level and the BRDF lut
+vec3 CalcEnvironmentLight(vec3 albedo, vec3 normal, vec3 viewDir)
+{
+    float NdotV = max(dot(normal, viewDir), 1e-4);
+    vec3 F0 = mix(vec3(0.04), albedo, uMetallic);
+    vec3 kS = F0 + (max(vec3(1.0 - uRoughness), F0) - F0) * pow(1.0 - NdotV, uFresnelPower);
+    vec3 diffuse = (1.0 - kS) * (1.0 - uMetallic) * albedo * EvaluateIrradiance(normal);
+
+    vec3 prefiltered = textureLod(uSpecularEnvironment, reflect(-viewDir, normal), uRoughness * uSpecularMaxLod).rgb;
+    vec2 brdf = texture(uBrdfLut, vec2(NdotV, uRoughness)).rg;
+    return diffuse + prefiltered * (F0 * brdf.x + brdf.y);
 }
 
 vec3 CalcDirLight(Light light, vec3 normal, vec3 viewDir)
@@ -147,41 +317,43 @@ void main()
     vec3 viewDirWS = normalize(uCameraPosition - vPosition);
     vec3 viewDirTS = transpose(TBN) * viewDirWS;
     
-    // 3. Apply relief mapping ONLY if height map is available AND heightScale > 0
+    // 3. Apply relief mapping ONLY in the HEIGHT_MAP permutation
     vec2 displacedTexCoords = vTexCoord;
-    if (uNormalMapAvailable > 0 && uHeightScale > 0.0) {
-        displacedTexCoords = ParallaxOcclusionMapping(vTexCoord, viewDirTS);
-    }
+#ifdef HEIGHT_MAP
+    float uvPerPixel = max(length(dFdx(vTexCoord)), length(dFdy(vTexCoord)));
+    float heightScale = uHeightScale * uReliefFade;
+    float depth = MarchRelief(vTexCoord, viewDirTS, heightScale, uvPerPixel);
+    displacedTexCoords -= viewDirTS.xy * heightScale / viewDirTS.z * depth;
+#endif
     
     // 4. Sample textures with new coordinates
     vec3 albedo = texture(uAlbedoTexture, displacedTexCoords).rgb;
     
     // Only sample normal map if available
+#ifdef NORMAL_MAP
+    vec3 normalTS = SampleNormalMap(uNormalMap, displacedTexCoords);
+#else
     vec3 normalTS = vec3(0.0, 0.0, 1.0); // Default flat normal
-    if (uNormalMapAvailable > 0) {
-        normalTS = texture(uNormalMap, displacedTexCoords).rgb * 2.0 - 1.0;
-    }
+#endif
     vec3 normalWS = normalize(TBN * normalTS);
     
         // 5. Lighting calculations
     vec3 lighting = vec3(0.0);
-    for(int i = 0; i < uLightCount; ++i) {
-        if(uLight[i].type == 0) {
-            lighting += CalcDirLight(uLight[i], normalWS, viewDirWS) * albedo;
-        } else {
-            lighting += CalcPointLight(uLight[i], normalWS, vPosition, viewDirWS) * albedo;
-        }
+    for (uint i = 0u; i < uClusterDims.w; ++i) {
+        lighting += CalcDirLight(uLights[uClusterLightIndices[i]], normalWS, viewDirWS) * albedo;
+    }
+
+    uvec2 range = GetClusterRange(vPosition);
+    for (uint i = 0u; i < range.y; ++i) {
+        lighting += CalcPointLight(uLights[uClusterLightIndices[range.x + i]], normalWS, vPosition, viewDirWS) * albedo;
     }
     
     // 6. Environment mapping (solo si est� habilitado)
     vec3 finalColor = lighting;
-    if (uEnvironmentEnabled > 0) {
-        vec3 viewDir = normalize(uCameraPosition - vPosition);
-        vec3 reflectDir = reflect(-viewDir, normalWS);
-        vec3 reflection = texture(uSkybox, reflectDir).rgb;
-
-        finalColor = reflection;
-    }
+#ifdef ENVIRONMENT
+    vec3 viewDir = normalize(uCameraPosition - vPosition);
+    finalColor = lighting + CalcEnvironmentLight(albedo, normalWS, viewDir);
+#endif
     
     oColor = vec4(finalColor, 1.0);
 }
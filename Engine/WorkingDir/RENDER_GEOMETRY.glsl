@@ -3,25 +3,12 @@
 #if defined(VERTEX) ////////////////////////////////////////
 
 layout(location=0) in vec3 aPosition;
-layout(location=1) in vec3 aNormal;
+layout(location=1) in vec2 aNormal;
 layout(location=2) in vec2 aTexCoord;
-layout(location=3) in vec3 aTangent;
-layout(location=4) in vec3 aBitangent;
-
-struct Light
-{
-    int type;
-    vec3 color;
-    vec3 direction;
-    vec3 position;
-
-};
 
 layout(binding = 0, std140) uniform GlobalParams
 {
     vec3 uCameraPosition;
-    int uLightCount;
-    Light uLight[16];
 };
 
 layout(binding = 1, std140) uniform EntityParams
@@ -30,19 +17,40 @@ layout(binding = 1, std140) uniform EntityParams
     mat4 uWorldViewProjectionMatrix;
 };
 
+uniform vec3 uPositionScale;
+uniform vec3 uPositionOffset;
+
+// Same expression as DEPTH_PREPASS.glsl, the depth test may be GL_EQUAL
+invariant gl_Position;
 
 out vec2 vTexCoord;
 out vec3 vPosition;
 out vec3 vNormal;
 out vec3 vViewDir;
 
+// Packed vertex decoding, see VertexPacking.h
+vec3 DecodePosition(vec3 quantized)
+{
+    return uPositionOffset + uPositionScale * quantized;
+}
+
+vec3 OctDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
 void main()
 {
+    vec3 position = DecodePosition(aPosition);
     vTexCoord = aTexCoord;
-    vPosition = vec3(uWorldMatrix * vec4(aPosition,1.0));
-    vNormal = vec3(uWorldMatrix * vec4(aNormal,0.0));
+    vPosition = vec3(uWorldMatrix * vec4(position,1.0));
+    vNormal = vec3(uWorldMatrix * vec4(OctDecode(aNormal),0.0));
     vViewDir = uCameraPosition - vPosition;
-    gl_Position = uWorldViewProjectionMatrix * vec4(aPosition,1.0);
+    gl_Position = uWorldViewProjectionMatrix * vec4(DecodePosition(aPosition), 1.0);
 }
 
 #elif defined(FRAGMENT) ////////////////////////////////////////
@@ -53,19 +61,31 @@ in vec3 vNormal;
 in vec3 vViewDir;
 
 uniform sampler2D uTexture;
+uniform int uCompactGBuffer;
 
 layout(location=0) out vec4 oAlbedo;
 layout(location=1) out vec4 oNormals;
 layout(location=2) out vec4 oPosition;
 layout(location=3) out vec4 oViewDir;
 
+// Octahedral mapping of a unit vector to [-1, 1]^2
+vec2 OctEncode(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 wrapped = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return n.z >= 0.0 ? n.xy : wrapped;
+}
+
 void main()
 {
 
 
     oAlbedo = texture(uTexture, vTexCoord);
 
-    oNormals = vec4(vNormal,1.0);
+    if (uCompactGBuffer == 1)
+        oNormals = vec4(OctEncode(normalize(vNormal)) * 0.5 + 0.5, 0.0, 1.0);
+    else
+        oNormals = vec4(vNormal,1.0);
     
     oPosition = vec4(vPosition,1.0);
     
@@ -1,20 +1,44 @@
 ﻿#ifdef REFLECTION_ENVIRONMENT
 #if defined(VERTEX)
 layout(location = 0) in vec3 aPosition;
-layout(location = 1) in vec3 aNormal;
+layout(location = 1) in vec2 aNormal;
 
 out vec3 vWorldPos;
 out vec3 vNormal;
 
 uniform mat4 uModel;
-uniform mat4 uView;
-uniform mat4 uProj;
+uniform vec3 uPositionScale;
+uniform vec3 uPositionOffset;
+
+layout(binding = 1, std140) uniform EntityParams
+{
+    mat4 uWorldMatrix;
+    mat4 uWorldViewProjectionMatrix;
+};
+
+// Same expression as DEPTH_PREPASS.glsl, the depth test may be GL_EQUAL
+invariant gl_Position;
+
+// Packed vertex decoding, see VertexPacking.h
+vec3 DecodePosition(vec3 quantized)
+{
+    return uPositionOffset + uPositionScale * quantized;
+}
+
+vec3 OctDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
 
 void main() {
-    vec4 worldPos = uModel * vec4(aPosition, 1.0);
+    vec4 worldPos = uModel * vec4(DecodePosition(aPosition), 1.0);
     vWorldPos = worldPos.xyz;
-    vNormal = mat3(transpose(inverse(uModel))) * aNormal;
-    gl_Position = uProj * uView * worldPos;
+    vNormal = mat3(transpose(inverse(uModel))) * OctDecode(aNormal);
+    gl_Position = uWorldViewProjectionMatrix * vec4(DecodePosition(aPosition), 1.0);
 }
 
 #elif defined(FRAGMENT)
@@ -30,6 +54,13 @@ uniform int cubeMapType;
 uniform float roughness = 0.2;
 uniform float metallic = 0.8;
 uniform float diffus_amb;
+uniform vec3 baseColor = vec3(0.9);
+
+// Image based lighting of the active cube map, see ImageBasedLighting.h
+uniform vec3 uIrradianceSH[9];
+uniform samplerCube uSpecularEnvironment;
+uniform float uSpecularMaxLod;
+uniform sampler2D uBrdfLut;
 
 // Parámetros de iluminación
 uniform vec3 lightPositions[4];
@@ -77,6 +108,31 @@ vec3 fresnelSchlick(float cosTheta, vec3 F0) {
     return F0 + (1.0 - F0) * pow(1.0 - cosTheta, 5.0);
 }
 
+// Fresnel for the environment, rough surfaces reflect less at grazing angles
+vec3 fresnelSchlickRoughness(float cosTheta, vec3 F0, float roughness) {
+    return F0 + (max(vec3(1.0 - roughness), F0) - F0) * pow(1.0 - cosTheta, 5.0);
+}
+
+// Irradiance / PI already convolved with the cosine lobe, no texture fetch
+vec3 EvaluateIrradiance(vec3 n) {
+    return max(uIrradianceSH[0] * 0.282095
+        + uIrradianceSH[1] * 0.488603 * n.y
+        + uIrradianceSH[2] * 0.488603 * n.z
+        + uIrradianceSH[3] * 0.488603 * n.x
+        + uIrradianceSH[4] * 1.092548 * n.x * n.y
+        + uIrradianceSH[5] * 1.092548 * n.y * n.z
+        + uIrradianceSH[6] * 0.315392 * (3.0 * n.z * n.z - 1.0)
+        + uIrradianceSH[7] * 1.092548 * n.x * n.z
+        + uIrradianceSH[8] * 0.546274 * (n.x * n.x - n.y * n.y), 0.0);
+}
+
+// Split sum: one fetch of the prefiltered level, one of the BRDF lut
+vec3 EvaluateSpecularIBL(vec3 R, float NdotV, vec3 F0, float roughness) {
+    vec3 prefiltered = textureLod(uSpecularEnvironment, R, roughness * uSpecularMaxLod).rgb;
+    vec2 brdf = texture(uBrdfLut, vec2(NdotV, roughness)).rg;
+    return prefiltered * (F0 * brdf.x + brdf.y);
+}
+
 void main() {
     // Normalizar vectores
     vec3 normal = normalize(vNormal);
@@ -86,32 +142,30 @@ void main() {
 
     // Calcular reflexión base
     vec3 reflectDir = reflect(-viewDir, normal);
-    vec3 reflection = textureLod(skybox, reflectDir, roughness * 10.0).rgb;
+    float NdotV = max(cosTheta, 1e-4);
 
-    // Calcular refracción (solo para modo 1)
+    // Calcular refracción (modos 1 y 2), through the sharp skybox
     vec3 refraction = vec3(0.0);
-    if(cubeMapType == 1) {
+    if(cubeMapType != 0) {
         float ratio = 1.0 / reflectionIntensity;
         vec3 refractDir = refract(-viewDir, normal, ratio);
         if (length(refractDir) > 0.001) {
             refraction = texture(skybox, refractDir).rgb;
         } else {
-            refraction = reflection; // Reflexión interna total
+            refraction = texture(skybox, reflectDir).rgb; // Reflexión interna total
         }
     }
 
     vec3 Lo = vec3(0.0);
-    vec3 ambient = vec3(0.0);
-    vec3 F0 = vec3(0.04);
-    vec3 diffuseEnv = vec3(0.0);
-    vec3 specularEnv = vec3(0.0);
+    vec3 F0 = mix(vec3(0.04), baseColor, metallic);
+    vec3 iblDiffuse = vec3(0.0);
+    vec3 iblSpecular = vec3(0.0);
 
     // Solo calcular componentes PBR para modos que no son refracción
     if(cubeMapType != 1) {
-        diffuseEnv = texture(skybox, normal).rgb;
-        specularEnv = textureLod(skybox, reflectDir, roughness * 10.0).rgb;
-        F0 = mix(F0, specularEnv, metallic);
-        ambient = 0.03 * diffuseEnv;
+        vec3 kS = fresnelSchlickRoughness(NdotV, F0, roughness);
+        iblDiffuse = (1.0 - kS) * (1.0 - metallic) * baseColor * EvaluateIrradiance(normal);
+        iblSpecular = EvaluateSpecularIBL(reflectDir, NdotV, F0, roughness);
 
         // Calcular iluminación PBR
         for(int i = 0; i < numLights; ++i) {
@@ -135,28 +189,21 @@ void main() {
             vec3 kD = (vec3(1.0) - F) * (1.0 - metallic);
             float NdotL = max(dot(normal, lightDir), 0.0);
             
-            Lo += (kD * diffuseEnv / PI + specular) * radiance * NdotL;
+            Lo += (kD * baseColor / PI + specular) * radiance * NdotL;
         }
     }
 
     // Combinar componentes según modo
-    vec3 mainColor;
+    vec3 color;
     if(cubeMapType == 0) {        // Reflexión con PBR
-        mainColor = reflection * fresnel;
+        color = diffus_amb * iblDiffuse + iblSpecular + Lo;
     } else if(cubeMapType == 1) { // Refracción pura
-        mainColor = refraction * (0.55 - fresnel);
+        color = refraction * (0.55 - fresnel) * diffus_amb / 8;
     } else if(cubeMapType == 2) { // Mixto con PBR
-        mainColor = mix(refraction, reflection, fresnel);
-    } else {
-        mainColor = vec3(0.0);
-    }
-
-    // Combinar con iluminación (solo para modos no-refracción)
-    vec3 color;
-    if(cubeMapType == 1) {
-        color = mainColor * diffus_amb / 8; 
+        vec3 prefiltered = textureLod(uSpecularEnvironment, reflectDir, roughness * uSpecularMaxLod).rgb;
+        color = diffus_amb * iblDiffuse + Lo + mix(refraction, prefiltered, fresnel);
     } else {
-        color = (3* diffus_amb * ambient) + Lo + mainColor;
+        color = vec3(0.0);
     }
 
     FragColor = vec4(color, 1.0);
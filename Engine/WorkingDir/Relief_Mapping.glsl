@@ -1,17 +1,28 @@
-﻿#ifdef RELIEF_MAPPING
+﻿// RELIEF_MAPPING marches the height field and writes the depth of the hit.
+// RELIEF_NORMAL_MAPPING is the same material without the march, drawn once
+// the relief has faded out so the depth test can run early.
+#if defined(RELIEF_MAPPING) || defined(RELIEF_NORMAL_MAPPING)
 
 #if defined(VERTEX)
 
 layout(location = 0) in vec3 position;
-layout(location = 1) in vec3 normal;
+layout(location = 1) in vec2 normal;        // octahedral
 layout(location = 2) in vec2 texCoords;
-layout(location = 3) in vec3 tangent;
-layout(location = 4) in vec3 bitangent;
+layout(location = 3) in vec4 tangentFrame;  // quaternion
 
 uniform mat4 uModel;
-uniform mat4 uView;
-uniform mat4 uProj;
 uniform vec3 uViewPos;
+uniform vec3 uPositionScale;
+uniform vec3 uPositionOffset;
+
+layout(binding = 1, std140) uniform EntityParams
+{
+    mat4 uWorldMatrix;
+    mat4 uWorldViewProjectionMatrix;
+};
+
+// Same expression as DEPTH_PREPASS.glsl, the depth test may be GL_EQUAL
+invariant gl_Position;
 
 out Data {
     vec2 texCoords;
@@ -21,15 +32,42 @@ out Data {
     vec3 worldFragPos; 
 } VSOut;
 
+// Packed vertex decoding, see VertexPacking.h
+vec3 DecodePosition(vec3 quantized)
+{
+    return uPositionOffset + uPositionScale * quantized;
+}
+
+vec3 OctDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+// Tangent and bitangent of a tangent frame quaternion, w < 0 flips the bitangent
+void DecodeTangentFrame(vec4 q, out vec3 tangent, out vec3 bitangent)
+{
+    q = normalize(q);
+    tangent = vec3(1.0 - 2.0 * (q.y * q.y + q.z * q.z), 2.0 * (q.x * q.y + q.w * q.z), 2.0 * (q.x * q.z - q.w * q.y));
+    vec3 normal = vec3(2.0 * (q.x * q.z + q.w * q.y), 2.0 * (q.y * q.z - q.w * q.x), 1.0 - 2.0 * (q.x * q.x + q.y * q.y));
+    bitangent = cross(normal, tangent) * (q.w < 0.0 ? -1.0 : 1.0);
+}
+
 void main() {
-    vec3 fragPos = vec3(uModel * vec4(position, 1.0));
+    vec3 tangent, bitangent;
+    DecodeTangentFrame(tangentFrame, tangent, bitangent);
+
+    vec3 fragPos = vec3(uModel * vec4(DecodePosition(position), 1.0));
     VSOut.texCoords = texCoords;
 
     // Corregido: Usar matriz normal para transformaciones
     mat3 normalMatrix = transpose(inverse(mat3(uModel)));
     vec3 T = normalize(normalMatrix * tangent);
     vec3 B = normalize(normalMatrix * bitangent);
-    vec3 N = normalize(normalMatrix * normal);
+    vec3 N = normalize(normalMatrix * OctDecode(normal));
     
     VSOut.TBN = mat3(T, B, N);
     VSOut.TBN = transpose(VSOut.TBN); // Matriz para convertir a espacio tangente
@@ -38,7 +76,7 @@ void main() {
     VSOut.tangentViewPos = VSOut.TBN * uViewPos;
     VSOut.worldFragPos = fragPos;
 
-    gl_Position = uProj * uView * vec4(fragPos, 1.0);
+    gl_Position = uWorldViewProjectionMatrix * vec4(DecodePosition(position), 1.0);
 }
 
 #elif defined(FRAGMENT)
@@ -59,18 +97,42 @@ uniform sampler2D uNormalMap;
 uniform sampler2D uHeightMap;
 uniform float uHeightScale;
 uniform int uViewMode;
+uniform sampler2D uConeStepMap;
+uniform int uReliefMarch; // 0 = cone step, 1 = linear reference
+uniform float uReliefFade; // per entity, 1 = full relief, fades to 0 with distance
+uniform int uReliefAdaptive; // 0 = full step counts, 1 = scaled to the screen footprint
 
 layout(location = 0) out vec4 oColor;
 
-vec2 ParallaxOcclusionMapping(vec2 texCoords, vec3 viewDirTS) {
+#ifdef RELIEF_MAPPING
+// The hit is always below the surface, so the depth test can still reject
+// fragments early against the interpolated depth
+layout(depth_greater) out float gl_FragDepth;
+#endif
+
+// Normal maps are cooked to two channel BC5, Z is rebuilt from the unit length
+vec3 SampleNormalMap(sampler2D normalMap, vec2 texCoords)
+{
+    vec3 normal;
+    normal.xy = texture(normalMap, texCoords).rg * 2.0 - 1.0;
+    normal.z = sqrt(max(1.0 - dot(normal.xy, normal.xy), 0.0));
+    return normal;
+}
+
+// Reference march: 32-64 fixed layers, refined with a secant between the
+// last two. rayDir is the UV offset per unit of depth. With relief LOD the
+// layer count drops to about one per pixel the ray crosses on screen.
+// Returns the depth at which the view ray hits the height field.
+float LinearReliefMarch(vec2 texCoords, vec3 viewDirTS, vec3 rayDir, float parallaxPixels) {
     const float minLayers = 32.0; 
     const float maxLayers = 64.0;
+    const float lodMinLayers = 4.0;
 
     float ndotv = clamp(dot(vec3(0.0, 0.0, 1.0), normalize(viewDirTS)), 0.0, 1.0);
-    float numLayers = mix(maxLayers, minLayers, ndotv);
+    float numLayers = clamp(parallaxPixels, lodMinLayers, mix(maxLayers, minLayers, ndotv));
 
     float layerDepth = 1.0 / numLayers;
-    vec2 deltaTexCoords = viewDirTS.xy * uHeightScale / (viewDirTS.z * numLayers);
+    vec2 deltaTexCoords = -rayDir.xy / numLayers;
 
     vec2 currentTexCoords = texCoords;
     float currentLayerDepth = 0.0;
@@ -90,35 +152,91 @@ vec2 ParallaxOcclusionMapping(vec2 texCoords, vec3 viewDirTS) {
     float afterDepth = currentDepthMapValue - currentLayerDepth;
 
     float weight = afterDepth / (afterDepth - beforeDepth);
-    vec2 finalTexCoords = mix(currentTexCoords, prevTexCoords, weight);
-
-    float totalLayerDepth = (currentLayerDepth - layerDepth) + weight * layerDepth;
-    float t = totalLayerDepth * uHeightScale;
-    
-    vec3 displacementTS = viewDirTS * t; // Usar viewDirTS corregido
-    vec3 displacementWS = FSIn.TBN * displacementTS;
-
-    vec3 newFragPos = FSIn.worldFragPos + displacementWS;
+    return (currentLayerDepth - layerDepth) + weight * layerDepth;
+}
 
-    vec4 viewPos = uView * vec4(newFragPos, 1.0);
-    vec4 clipPos = uProj * viewPos;
-    gl_FragDepth = (clipPos.z / clipPos.w) * 0.5 + 0.5; 
+// Relaxed cone stepping over the map built by ConeStepMap.cpp: every fetch
+// advances the ray to 1.5x the edge of the empty cone above the texel, which
+// may overshoot into the surface, so the last step is bisected and closed with
+// a secant. Usually converges in 7-10 fetches, fewer steps and bisections are
+// allowed when the ray only crosses a few pixels.
+float ConeStepReliefMarch(vec2 texCoords, vec3 rayDir, float parallaxPixels) {
+    const float relaxation = 1.5;
+    const float minStep = 1.0 / 256.0;
+    int maxSteps = int(clamp(parallaxPixels * 0.5, 4.0, 16.0));
+    int refineSteps = int(clamp(ceil(log2(max(parallaxPixels, 1.0))), 1.0, 4.0));
+
+    float rayLength = length(rayDir.xy);
+
+    vec3 rayPos = vec3(texCoords, 0.0);
+    vec3 prevPos = rayPos;
+    float prevDepth = 0.0;
+    vec2 cone = textureLod(uConeStepMap, rayPos.xy, 0.0).rg;
+    if (cone.r <= 0.0)
+        return 0.0;
+
+    for (int i = 0; i < maxSteps && rayPos.z < cone.r; ++i) {
+        float ratio = cone.g * cone.g;
+        float advance = relaxation * ratio * (cone.r - rayPos.z) / (rayLength + ratio);
+        prevPos = rayPos;
+        prevDepth = cone.r;
+        rayPos += rayDir * max(advance, minStep);
+        cone = textureLod(uConeStepMap, rayPos.xy, 0.0).rg;
+    }
+    if (rayPos.z < cone.r)
+        return min(rayPos.z, 1.0);
+
+    // prevPos is above the surface and rayPos below, heights are depth minus ray depth
+    float above = prevDepth - prevPos.z;
+    float below = cone.r - rayPos.z;
+    for (int i = 0; i < refineSteps; ++i) {
+        vec3 midPos = (prevPos + rayPos) * 0.5;
+        float height = textureLod(uConeStepMap, midPos.xy, 0.0).r - midPos.z;
+        if (height > 0.0) {
+            prevPos = midPos;
+            above = height;
+        } else {
+            rayPos = midPos;
+            below = height;
+        }
+    }
+    return mix(prevPos.z, rayPos.z, above / max(above - below, 1e-5));
+}
 
-    return finalTexCoords;
+// Depth of the hit below the surface, 0 to 1. uvPerPixel is the screen space
+// footprint of texCoords, taken before any non uniform branch.
+float MarchRelief(vec2 texCoords, vec3 viewDirTS, float heightScale, float uvPerPixel) {
+    vec3 rayDir = vec3(-viewDirTS.xy * heightScale / viewDirTS.z, 1.0);
+    float parallaxPixels = uReliefAdaptive > 0 ? length(rayDir.xy) / max(uvPerPixel, 1e-6) : 1e6;
+    return uReliefMarch == 1 ? LinearReliefMarch(texCoords, viewDirTS, rayDir, parallaxPixels)
+                             : ConeStepReliefMarch(texCoords, rayDir, parallaxPixels);
 }
 
 void main() {
     vec3 viewDirTS = normalize(FSIn.tangentViewPos - FSIn.tangentFragPos);
+    vec2 displacedTexCoords = FSIn.texCoords;
 
-    vec2 displacedTexCoords = ParallaxOcclusionMapping(FSIn.texCoords, viewDirTS);
+#ifdef RELIEF_MAPPING
+    float uvPerPixel = max(length(dFdx(FSIn.texCoords)), length(dFdy(FSIn.texCoords)));
+    float heightScale = uHeightScale * uReliefFade;
+    float depth = MarchRelief(FSIn.texCoords, viewDirTS, heightScale, uvPerPixel);
+    displacedTexCoords -= viewDirTS.xy * heightScale / viewDirTS.z * depth;
 
     if (displacedTexCoords.x < 0.0 || displacedTexCoords.x > 1.0 ||
         displacedTexCoords.y < 0.0 || displacedTexCoords.y > 1.0)
         discard;
 
-    vec3 normalTS = texture(uNormalMap, displacedTexCoords).rgb * 1.0 - 2.0;
+    // Move the fragment along the view ray down to the hit, TBN goes from
+    // world to tangent space
+    vec3 displacementTS = -viewDirTS * (depth * heightScale / viewDirTS.z);
+    vec3 newFragPos = FSIn.worldFragPos + transpose(FSIn.TBN) * displacementTS;
+    vec4 clipPos = uProj * uView * vec4(newFragPos, 1.0);
+    gl_FragDepth = (clipPos.z / clipPos.w) * 0.5 + 0.5;
+#endif
+
+    vec3 normalTS = SampleNormalMap(uNormalMap, displacedTexCoords);
 
-    vec3 normalWS = normalize(FSIn.TBN * (normalTS * 2.0 - 1.0));
+    vec3 normalWS = normalize(transpose(FSIn.TBN) * normalTS);
 
     vec3 albedo = texture(uDiffuse, displacedTexCoords).rgb;
 
@@ -16,18 +16,44 @@ void main()
 #elif defined(FRAGMENT)
 
 struct Light {
-    int type;
     vec3 color;
+    uint type;
     vec3 direction;
+    float radius;
     vec3 position;
+    uint mode;
 };
 
-layout(binding = 0) uniform GlobalParams {
+layout(binding = 0, std140) uniform GlobalParams {
     vec3 uCameraPosition;
-    int uLightCount;
-    Light uLight[128];
 };
 
+// Matches GpuLight, same order as app->lights (see Lights.h)
+layout(std430, binding = 0) readonly buffer Lights {
+    Light uLights[];
+};
+
+layout(std430, binding = 1) readonly buffer ClusterGrid {
+    mat4 uClusterView;
+    uvec4 uClusterDims;     // x, y, z, directional light count
+    vec4 uClusterParams;    // tile width, tile height, slice scale, slice bias
+    uvec2 uClusterRanges[]; // offset and count into uClusterLightIndices
+};
+
+// Directional lights first, then the point lights of every cluster
+layout(std430, binding = 2) readonly buffer ClusterLightIndices {
+    uint uClusterLightIndices[];
+};
+
+uvec2 GetClusterRange(vec3 worldPosition) {
+    float viewDepth = max(-(uClusterView * vec4(worldPosition, 1.0)).z, 1e-4);
+    uvec3 cluster;
+    cluster.xy = min(uvec2(gl_FragCoord.xy / uClusterParams.xy), uClusterDims.xy - 1u);
+    cluster.z = uint(clamp(floor(log(viewDepth) * uClusterParams.z + uClusterParams.w), 0.0, float(uClusterDims.z - 1u)));
+    uint clusterIndex = cluster.x + cluster.y * uClusterDims.x + cluster.z * uClusterDims.x * uClusterDims.y;
+    return uClusterRanges[clusterIndex];
+}
+
 in vec2 vTexCoord;
 
 uniform sampler2D uColor;
@@ -36,10 +62,14 @@ uniform sampler2D uPosition;
 uniform sampler2D uViewDir;
 uniform sampler2D uDepth;
 
+// Compact layout: octahedral normals in uNormals, position rebuilt from depth
+uniform int uCompactGBuffer;
+uniform mat4 uInverseViewProjection;
+
 uniform float uNear = 0.01;
 uniform float uFar = 5.0;
-uniform int uViewMode; // 0=main, 1=albedo, 2=normals, 3=position, 4=viewdir, 5=depth
-uniform int uShowDepth;
+// Compiled per permutation: DEBUG_VIEW_1=albedo, 2=normals, 3=position, 4=viewdir,
+// 5=depth replace the lighting, SHOW_DEPTH blends depth over it
 uniform float uDepthIntensity = 0.5;
 
 layout(location = 0) out vec4 oColor;
@@ -50,6 +80,20 @@ float LinearizeDepth(float depth) {
     return (2.0 * uNear * uFar) / (uFar + uNear - z * (uFar - uNear));
 }
 
+vec3 OctDecode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+vec3 ReconstructPosition(vec2 uv, float depth) {
+    vec4 clip = vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+    vec4 world = uInverseViewProjection * clip;
+    return world.xyz / world.w;
+}
+
 vec3 CalcPointLight(Light light, vec3 normal, vec3 position, vec3 viewDir) {
     vec3 lightDir = normalize(light.position - position);
     float distance = length(light.position - position);
@@ -77,52 +121,57 @@ vec3 CalcDirLight(Light light, vec3 normal, vec3 viewDir) {
 
 void main() {
     vec3 baseColor = texture(uColor, vTexCoord).rgb;
-    vec3 normal = normalize(texture(uNormals, vTexCoord).rgb * 2.0 - 1.0);
-    vec3 position = texture(uPosition, vTexCoord).rgb;
+    vec3 normal;
+    vec3 position;
+    if (uCompactGBuffer == 1) {
+        normal = OctDecode(texture(uNormals, vTexCoord).rg * 2.0 - 1.0);
+        position = ReconstructPosition(vTexCoord, texture(uDepth, vTexCoord).r);
+    } else {
+        normal = normalize(texture(uNormals, vTexCoord).rgb * 2.0 - 1.0);
+        position = texture(uPosition, vTexCoord).rgb;
+    }
     vec3 viewDir = normalize(uCameraPosition - position);
 
     // Buffer visualization modes
-    if (uViewMode == 1) { // Albedo
-        oColor = texture(uColor, vTexCoord);
-        return;
-    } else if (uViewMode == 2) { // Normals
-        oColor = vec4(normal * 0.5 + 0.5, 1.0);
-        return;
-    } else if (uViewMode == 3) { // Position
-        oColor = texture(uPosition, vTexCoord);
-        return;
-    } else if (uViewMode == 4) { // ViewDir
-        oColor = texture(uViewDir, vTexCoord);
-        return;
-    } else if (uViewMode == 5) { // Depth visualization
-        float depth = texture(uDepth, vTexCoord).r;
-        float linearDepth = LinearizeDepth(depth);
-        linearDepth = 1.0 - pow(linearDepth / uFar, 0.3);
-        linearDepth = clamp(linearDepth, 0.0, 1.0);
-        oColor = vec4(vec3(linearDepth), 1.0);
-        return;
-    }
-
+#if defined(DEBUG_VIEW_1) // Albedo
+    oColor = texture(uColor, vTexCoord);
+#elif defined(DEBUG_VIEW_2) // Normals
+    oColor = vec4(normal * 0.5 + 0.5, 1.0);
+#elif defined(DEBUG_VIEW_3) // Position
+    oColor = uCompactGBuffer == 1 ? vec4(position, 1.0) : texture(uPosition, vTexCoord);
+#elif defined(DEBUG_VIEW_4) // ViewDir
+    oColor = uCompactGBuffer == 1 ? vec4(uCameraPosition - position, 1.0) : texture(uViewDir, vTexCoord);
+#elif defined(DEBUG_VIEW_5) // Depth visualization
+    float depth = texture(uDepth, vTexCoord).r;
+    float linearDepth = LinearizeDepth(depth);
+    linearDepth = 1.0 - pow(linearDepth / uFar, 0.3);
+    linearDepth = clamp(linearDepth, 0.0, 1.0);
+    oColor = vec4(vec3(linearDepth), 1.0);
+#else
     // Lighting calculations
     vec3 finalColor = vec3(0.0);
-    for (int i = 0; i < uLightCount; ++i) {
-        if (uLight[i].type == 0) {
-            finalColor += CalcDirLight(uLight[i], normal, viewDir) * baseColor;
-        } else {
-            finalColor += CalcPointLight(uLight[i], normal, position, viewDir) * baseColor;
-        }
+    for (uint i = 0u; i < uClusterDims.w; ++i) {
+        finalColor += CalcDirLight(uLights[uClusterLightIndices[i]], normal, viewDir) * baseColor;
     }
 
-    // Apply depth visualization on top of the lighting if enabled
-    if (uShowDepth == 1) {
-        float depth = texture(uDepth, vTexCoord).r;
-        float linearDepth = LinearizeDepth(depth);
-        linearDepth = 1.0 - pow(linearDepth / uFar, 2.0);  // Closer is brighter, ^2 for non-linear
-        linearDepth = clamp(linearDepth, 0.0, 1.0);
-        finalColor = mix(finalColor, vec3(linearDepth), uDepthIntensity);
+    // Point lights only from the froxel this pixel falls into
+    uvec2 range = GetClusterRange(position);
+    for (uint i = 0u; i < range.y; ++i) {
+        Light light = uLights[uClusterLightIndices[range.x + i]];
+        finalColor += CalcPointLight(light, normal, position, viewDir) * baseColor;
     }
 
+    // Apply depth visualization on top of the lighting if enabled
+#ifdef SHOW_DEPTH
+    float depth = texture(uDepth, vTexCoord).r;
+    float linearDepth = LinearizeDepth(depth);
+    linearDepth = 1.0 - pow(linearDepth / uFar, 2.0);  // Closer is brighter, ^2 for non-linear
+    linearDepth = clamp(linearDepth, 0.0, 1.0);
+    finalColor = mix(finalColor, vec3(linearDepth), uDepthIntensity);
+#endif
+
     oColor = vec4(finalColor, 1.0);
+#endif
 }
 
 #endif